@@ -284,6 +284,18 @@ namespace Pql.ClientDriver
         /// Protocol support.
         /// </summary>
         public static void WriteBlock(BinaryWriter writer, int toWrite, byte[] data)
+        {
+            WriteBlockHeader(writer, toWrite);
+
+            // writer
+            writer.Write(data, 0, toWrite);
+        }
+
+        /// <summary>
+        /// Protocol support.
+        /// Writes block start marker and size, caller must then write exactly <paramref name="toWrite"/> bytes of block data.
+        /// </summary>
+        public static void WriteBlockHeader(BinaryWriter writer, int toWrite)
         {
             // write block start marker. 
             // do NOT use BinaryWriter's and Stream's methods that write a single byte - write everything as arrays, even a single-element
@@ -292,9 +304,6 @@ namespace Pql.ClientDriver
 
             // write block size
             writer.Write(toWrite);
-
-            // writer
-            writer.Write(data, 0, toWrite);
         }
 
         /// <summary>
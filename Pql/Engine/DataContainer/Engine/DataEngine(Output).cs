@@ -27,6 +27,7 @@ namespace Pql.Engine.DataContainer.Engine
 
             var stream = buffer.Stream;
             var writer = buffer.Writer;
+            var capacity = buffer.Capacity;
             var cts = context.CancellationTokenSource;
 
             buffer.RowsOutput = 0;
@@ -50,8 +51,7 @@ namespace Pql.Engine.DataContainer.Engine
                 try
                 {
                     // no need to apply paging and where clause for pending row: we applied them already
-                    // also expect that a buffer can accomodate at least one row 
-                    // - this requires that rows are never larger than RequestExecutionBuffer.MaxBytesPerBuffer
+                    // buffer stream grows as needed, so it can always accomodate at least one row
                     ProduceOutputRow(context);
                     context.OutputDataBuffer.Write(writer);
 
@@ -65,7 +65,7 @@ namespace Pql.Engine.DataContainer.Engine
             }
 
             // now let's deal with remaining items in the enumerator
-            while (lastValidLength < RequestExecutionBuffer.MaxBytesPerBuffer && !cts.IsCancellationRequested)
+            while (lastValidLength < capacity && !cts.IsCancellationRequested)
             {
                 if (recordsAffected >= pageSize || !sourceEnumerator.MoveNext())
                 {
@@ -98,15 +98,14 @@ namespace Pql.Engine.DataContainer.Engine
                             // produce SELECT (output scheme) from FROM (raw data from storage driver)
                             var estimatedSize = ProduceOutputRow(context);
 
-                            if (lastValidLength + estimatedSize > RequestExecutionBuffer.MaxBytesPerBuffer)
+                            // first row always goes into current buffer, even if it is wider than capacity
+                            if (rowsOutputLocally > 0 && lastValidLength + estimatedSize > capacity)
                             {
                                 // store pending write and return
                                 hasPendingWrite = true;
                                 break;
                             }
 
-                            // MemoryStream will throw NotSupportedException when trying to expand beyond fixed buffer size
-                            // this should never happen (see check above)
                             context.OutputDataBuffer.Write(writer);
 
                             // this counter gets incremented AFTER writing, 
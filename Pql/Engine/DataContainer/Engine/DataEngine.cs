@@ -161,6 +161,7 @@ namespace Pql.Engine.DataContainer.Engine
                     context.AuthContext.UserId, "dummy", context.AuthContext.TenantId, context.AuthContext.ContextId));
 
             var executionPending = true;
+            var lane = QueryLane.Interactive;
             IDriverDataEnumerator sourceEnumerator = null;
             try
             {
@@ -187,6 +188,7 @@ namespace Pql.Engine.DataContainer.Engine
                             // generate response headers and fetch data from Redis
                             // this place fails most often, because of Pql compilation or storage driver connectivity failures
                             StartProduction(context, buffer, out sourceEnumerator);
+                            lane = SelectLane(context.ParsedRequest);
 
                             if (context.Request.ReturnDataset)
                             {
@@ -196,9 +198,21 @@ namespace Pql.Engine.DataContainer.Engine
                             }
                         }
 
-                        // go through retrieved data
-                        havePendingDriverRow = ((DataEngine) context.Engine).WriteItems(
-                            context, buffer, sourceEnumerator, havePendingDriverRow);
+                        // go through retrieved data, one buffer per slot of the shared scheduler,
+                        // so that a long scan lets other requests in between its buffers.
+                        // parallel workers of a scan take their own slots, this thread's slot only covers its own work.
+                        // slot is not held while production starts, because that takes storage locks
+                        // which may have to wait for other producers to complete
+                        QueryScheduler.Shared.Enter(context.AuthContext.TenantId, lane, context.CancellationTokenSource.Token);
+                        try
+                        {
+                            havePendingDriverRow = ((DataEngine) context.Engine).WriteItems(
+                                context, buffer, sourceEnumerator, havePendingDriverRow);
+                        }
+                        finally
+                        {
+                            QueryScheduler.Shared.Exit();
+                        }
 
                         // some consistency checks
                         if (context.Request.ReturnDataset)
@@ -293,6 +307,19 @@ namespace Pql.Engine.DataContainer.Engine
             }
         }
 
+        /// <summary>
+        /// Inserts and requests which address documents by their keys touch few documents and go to interactive lane,
+        /// everything else scans documents of the target entity and goes to batch lane from its first buffer.
+        /// </summary>
+        private static QueryLane SelectLane(ParsedRequest parsedRequest)
+        {
+            return parsedRequest.SpecialCommand.IsSpecialCommand
+                   || parsedRequest.StatementType == StatementType.Insert
+                   || parsedRequest.IsBulk
+                       ? QueryLane.Interactive
+                       : QueryLane.Batch;
+        }
+
         private void StartProduction(
             RequestExecutionContext context, RequestExecutionBuffer buffer, out IDriverDataEnumerator sourceEnumerator)
         {
@@ -0,0 +1,256 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+
+namespace Pql.Engine.DataContainer.Engine
+{
+    /// <summary>
+    /// Priority lane of a unit of query work.
+    /// </summary>
+    internal enum QueryLane
+    {
+        /// <summary>
+        /// Inserts, special commands and requests which address documents by their keys. 
+        /// They touch few documents, so they are served ahead of scans.
+        /// </summary>
+        Interactive,
+
+        /// <summary>
+        /// Requests which scan documents, including morsels scanned by their parallel workers.
+        /// </summary>
+        Batch
+    }
+
+    /// <summary>
+    /// Limits number of requests which produce data at the same time, and decides which of the waiting requests goes next.
+    /// Producers take a slot for every buffer they fill and give it up in between, so a long scan yields to other requests
+    /// after every buffer instead of holding a processor until it completes.
+    /// Parallel workers of a scan take a slot for every morsel, so a parallel scan does not take more processors than it is granted.
+    /// Interactive lane is served ahead of batch lane, but batch lane gets a slot after every few interactive ones, so scans do not starve.
+    /// Within a lane, tenants take turns, so one tenant's requests cannot crowd out others.
+    /// </summary>
+    internal sealed class QueryScheduler
+    {
+        /// <summary>
+        /// Shared by all data engines in the process.
+        /// Producers spend most of their time in computation, so there is no use for more slots than processors.
+        /// </summary>
+        public static readonly QueryScheduler Shared = new QueryScheduler(Math.Max(2, Environment.ProcessorCount));
+
+        /// <summary>
+        /// Number of consecutive grants to interactive lane after which a waiting batch producer gets a slot.
+        /// </summary>
+        private const int InteractiveBurst = 3;
+
+        private readonly object m_lock;
+        private readonly int m_slotCount;
+        private readonly Lane m_interactive;
+        private readonly Lane m_batch;
+        private int m_running;
+        private int m_interactiveInRow;
+
+        public QueryScheduler(int slotCount)
+        {
+            if (slotCount < 1)
+            {
+                throw new ArgumentOutOfRangeException("slotCount", slotCount, "Slot count must be positive");
+            }
+
+            m_lock = new object();
+            m_slotCount = slotCount;
+            m_interactive = new Lane();
+            m_batch = new Lane();
+        }
+
+        /// <summary>
+        /// Number of slots currently taken.
+        /// </summary>
+        public int RunningCount
+        {
+            get
+            {
+                lock (m_lock)
+                {
+                    return m_running;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Number of producers waiting for a slot.
+        /// </summary>
+        public int WaitingCount
+        {
+            get
+            {
+                lock (m_lock)
+                {
+                    return m_interactive.Count + m_batch.Count;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Takes a slot, waiting for it if all slots are taken. Every successful call must be matched by <see cref="Exit"/>.
+        /// Throws <see cref="OperationCanceledException"/> if cancellation is requested while waiting.
+        /// </summary>
+        public void Enter(string tenantId, QueryLane lane, CancellationToken cancellationToken)
+        {
+            Waiter waiter;
+            lock (m_lock)
+            {
+                if (m_running < m_slotCount && m_interactive.Count == 0 && m_batch.Count == 0)
+                {
+                    m_running++;
+                    return;
+                }
+
+                waiter = new Waiter();
+                (lane == QueryLane.Interactive ? m_interactive : m_batch).Enqueue(tenantId ?? string.Empty, waiter);
+            }
+
+            using (cancellationToken.Register(Wake, waiter))
+            {
+                lock (waiter)
+                {
+                    while (!waiter.Granted && !cancellationToken.IsCancellationRequested)
+                    {
+                        Monitor.Wait(waiter);
+                    }
+                }
+            }
+
+            lock (m_lock)
+            {
+                if (waiter.Granted)
+                {
+                    return;
+                }
+
+                // grant will skip this waiter
+                waiter.Cancelled = true;
+            }
+
+            cancellationToken.ThrowIfCancellationRequested();
+        }
+
+        /// <summary>
+        /// Gives up a slot taken by <see cref="Enter"/>, handing it over to the next waiting producer if there is one.
+        /// </summary>
+        public void Exit()
+        {
+            lock (m_lock)
+            {
+                if (m_running <= 0)
+                {
+                    throw new SynchronizationLockException("Slot is not taken");
+                }
+
+                var waiter = TakeNextWaiter();
+                if (waiter == null)
+                {
+                    m_running--;
+                    return;
+                }
+
+                // slot goes to the waiter as it is, so that no newcomer can take it meanwhile
+                lock (waiter)
+                {
+                    waiter.Granted = true;
+                    Monitor.Pulse(waiter);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Picks lane and dequeues next waiter from it. Must be called under <see cref="m_lock"/>.
+        /// </summary>
+        private Waiter TakeNextWaiter()
+        {
+            while (m_interactive.Count > 0 || m_batch.Count > 0)
+            {
+                Waiter waiter;
+                if (m_interactive.Count > 0 && (m_batch.Count == 0 || m_interactiveInRow < InteractiveBurst))
+                {
+                    waiter = m_interactive.Dequeue();
+                    m_interactiveInRow++;
+                }
+                else
+                {
+                    waiter = m_batch.Dequeue();
+                    m_interactiveInRow = 0;
+                }
+
+                if (!waiter.Cancelled)
+                {
+                    return waiter;
+                }
+            }
+
+            return null;
+        }
+
+        private static void Wake(object state)
+        {
+            lock (state)
+            {
+                Monitor.Pulse(state);
+            }
+        }
+
+        private sealed class Waiter
+        {
+            public bool Granted;
+            public bool Cancelled;
+        }
+
+        /// <summary>
+        /// Waiters of one lane, queued per tenant. Tenants with waiters are served round-robin.
+        /// </summary>
+        private sealed class Lane
+        {
+            private readonly Dictionary<string, Queue<Waiter>> m_waitersByTenant;
+            private readonly Queue<string> m_tenants;
+
+            public int Count;
+
+            public Lane()
+            {
+                m_waitersByTenant = new Dictionary<string, Queue<Waiter>>(StringComparer.Ordinal);
+                m_tenants = new Queue<string>();
+            }
+
+            public void Enqueue(string tenantId, Waiter waiter)
+            {
+                if (!m_waitersByTenant.TryGetValue(tenantId, out var waiters))
+                {
+                    waiters = new Queue<Waiter>();
+                    m_waitersByTenant.Add(tenantId, waiters);
+                    m_tenants.Enqueue(tenantId);
+                }
+
+                waiters.Enqueue(waiter);
+                Count++;
+            }
+
+            public Waiter Dequeue()
+            {
+                var tenantId = m_tenants.Dequeue();
+                var waiters = m_waitersByTenant[tenantId];
+                var waiter = waiters.Dequeue();
+                if (waiters.Count > 0)
+                {
+                    // tenant goes to the end of the line
+                    m_tenants.Enqueue(tenantId);
+                }
+                else
+                {
+                    m_waitersByTenant.Remove(tenantId);
+                }
+
+                Count--;
+                return waiter;
+            }
+        }
+    }
+}
\ No newline at end of file
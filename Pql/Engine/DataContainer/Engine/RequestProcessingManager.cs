@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Diagnostics;
 using System.IO;
 using System.Text;
 using Pql.ClientDriver;
@@ -144,9 +145,14 @@ namespace Pql.Engine.DataContainer.Engine
                             break;
                         }
 
-                        // write block
-                        var buffer = stream.GetBuffer();
-                        BufferedReaderStream.WriteBlock(binaryWriter, toWrite, buffer);
+                        // write block, chunk by chunk
+                        var started = Stopwatch.GetTimestamp();
+                        BufferedReaderStream.WriteBlockHeader(binaryWriter, toWrite);
+                        binaryWriter.Flush();
+                        stream.WriteTo(output);
+
+                        // next batch of rows in this buffer will be sized after observed network speed
+                        lastCompletedTask.AdaptCapacity(toWrite, lastCompletedTask.RowsOutput, Stopwatch.GetTimestamp() - started);
 
                         ReportStats(toWrite, lastCompletedTask.RowsOutput);
 
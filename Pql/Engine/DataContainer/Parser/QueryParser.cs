@@ -872,11 +872,6 @@ namespace Pql.Engine.DataContainer.Parser
                     }
                 }
 
-                if (ctx.ParsedRequest.BaseDataset.OrderClauseFields.Count > 0)
-                {
-                    throw new CompilationException("Cannot sort by more than one field at this time", node);
-                }
-
                 if (0 <= ctx.ParsedRequest.BaseDataset.OrderClauseFields.FindIndex(x => x.Item1 == field.FieldId))
                 {
                     throw new CompilationException("Duplicate order field: " + field.Name, node);
@@ -0,0 +1,638 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.InteropServices;
+using System.Text;
+using Newtonsoft.Json;
+using Pql.ExpressionEngine.Interfaces;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Exports columns of a document container as Arrow-layout buffers in a memory-mapped file or a named shared memory section.
+    /// Layout of the mapped region:
+    /// <list type="bullet">
+    /// <item>8 bytes of <see cref="Signature"/>, 4 bytes of <see cref="FormatVersion"/>, 4 bytes of manifest length;</item>
+    /// <item>UTF-8 JSON manifest with row count, and Arrow type and buffer locations of every field;</item>
+    /// <item>buffers, every one starting at a multiple of <see cref="BufferAlignment"/>.</item>
+    /// </list>
+    /// Buffer offsets in the manifest are relative to the first aligned position after the manifest.
+    /// Type names are understood by pyarrow.type_for_alias, so that consumers can wrap buffers with Array.from_buffers.
+    /// First field is always <see cref="ValidDocumentsFieldName"/>, which tells deleted documents apart.
+    /// Rows are not compacted, so that NotNulls and valid documents bitmaps can be copied as is.
+    /// All columns are exported from snapshots taken at the same moment, see <see cref="DocumentDataContainer.ReadFromSnapshots{T}"/>.
+    /// Decimals are exported as invariant culture strings, because their scale varies between values.
+    /// </summary>
+    internal static class ArrowColumnExporter
+    {
+        public const int FormatVersion = 1;
+        public const int BufferAlignment = 64;
+        public const string ValidDocumentsFieldName = "$valid";
+        public static readonly byte[] Signature = Encoding.ASCII.GetBytes("PQLARROW");
+
+        private static readonly long UnixEpochTicks = new DateTime(1970, 1, 1, 0, 0, 0, DateTimeKind.Utc).Ticks;
+
+        /// <summary>
+        /// Writes export into a file, replacing existing one.
+        /// </summary>
+        public static void ExportToFile(DocumentDataContainer container, IReadOnlyList<int> fieldIds, string path)
+        {
+            if (string.IsNullOrEmpty(path))
+            {
+                throw new ArgumentNullException("path");
+            }
+
+            Export(container, fieldIds, size => MemoryMappedFile.CreateFromFile(path, FileMode.Create, null, size)).Dispose();
+        }
+
+        /// <summary>
+        /// Writes export into a named shared memory section.
+        /// Section exists for as long as the returned object or any of the consumers' views is not disposed.
+        /// </summary>
+        public static MemoryMappedFile ExportToSharedMemory(DocumentDataContainer container, IReadOnlyList<int> fieldIds, string mapName)
+        {
+            if (string.IsNullOrEmpty(mapName))
+            {
+                throw new ArgumentNullException("mapName");
+            }
+
+            return Export(container, fieldIds, size => MemoryMappedFile.CreateNew(mapName, size));
+        }
+
+        private static MemoryMappedFile Export(DocumentDataContainer container, IReadOnlyList<int> fieldIds, Func<long, MemoryMappedFile> createMap)
+        {
+            if (container == null)
+            {
+                throw new ArgumentNullException("container");
+            }
+
+            if (fieldIds == null)
+            {
+                throw new ArgumentNullException("fieldIds");
+            }
+
+            // writers are only held up while snapshots are taken, values are exported from snapshots afterwards,
+            // so that every document is exported as of the same moment in all columns
+            return container.ReadFromSnapshots(fieldIds, (count, validDocuments, snapshots) =>
+                {
+                    var columns = new List<ColumnExport> {new ValidDocumentsExport(validDocuments, count)};
+                    for (var i = 0; i < snapshots.Length; i++)
+                    {
+                        var field = container.DataContainerDescriptor.RequireField(fieldIds[i]);
+                        var elementType = container.ColumnStores[container.FieldIdToColumnStore[fieldIds[i]]].ElementType;
+                        columns.Add(ColumnExport.Create(field.Name, elementType, snapshots[i], count));
+                    }
+
+                    return Write(container.DocDesc.Name, columns, count, createMap);
+                });
+        }
+
+        private static MemoryMappedFile Write(string documentType, List<ColumnExport> columns, int count, Func<long, MemoryMappedFile> createMap)
+        {
+            var manifest = new Manifest {DocumentType = documentType, RowCount = count};
+            long dataLength = 0;
+            foreach (var column in columns)
+            {
+                var fieldManifest = new FieldManifest {Name = column.Name, Type = column.ArrowType, Timezone = column.Timezone, Nullable = column.Nullable};
+                foreach (var length in column.GetBufferLengths())
+                {
+                    fieldManifest.Buffers.Add(new BufferManifest {Offset = dataLength, Length = length});
+                    dataLength = Align(dataLength + length);
+                }
+
+                manifest.Fields.Add(fieldManifest);
+            }
+
+            var manifestBytes = Encoding.UTF8.GetBytes(JsonConvert.SerializeObject(manifest));
+            var dataStart = Align(Signature.Length + 8 + manifestBytes.Length);
+
+            var map = createMap(Math.Max(1, dataStart + dataLength));
+            try
+            {
+                using (var accessor = map.CreateViewAccessor(0, dataStart + dataLength))
+                {
+                    accessor.WriteArray(0, Signature, 0, Signature.Length);
+                    accessor.Write(Signature.Length, FormatVersion);
+                    accessor.Write(Signature.Length + 4, manifestBytes.Length);
+                    accessor.WriteArray(Signature.Length + 8, manifestBytes, 0, manifestBytes.Length);
+
+                    var handle = accessor.SafeMemoryMappedViewHandle;
+                    var addedRef = false;
+                    handle.DangerousAddRef(ref addedRef);
+                    try
+                    {
+                        var basePtr = handle.DangerousGetHandle().ToInt64() + accessor.PointerOffset;
+                        for (var i = 0; i < columns.Count; i++)
+                        {
+                            var buffers = manifest.Fields[i].Buffers;
+                            var target = new ExportTarget(accessor, basePtr, dataStart, buffers);
+                            columns[i].Write(target);
+                        }
+                    }
+                    finally
+                    {
+                        if (addedRef)
+                        {
+                            handle.DangerousRelease();
+                        }
+                    }
+
+                    accessor.Flush();
+                }
+            }
+            catch
+            {
+                map.Dispose();
+                throw;
+            }
+
+            return map;
+        }
+
+        private static long Align(long position)
+        {
+            return (position + BufferAlignment - 1) / BufferAlignment * BufferAlignment;
+        }
+
+        private static long ToMicroseconds(long ticks)
+        {
+            return (ticks - UnixEpochTicks) / 10;
+        }
+
+        /// <summary>
+        /// Destination of a single field's buffers.
+        /// </summary>
+        private sealed class ExportTarget
+        {
+            public readonly MemoryMappedViewAccessor Accessor;
+            private readonly long m_basePtr;
+            private readonly long m_dataStart;
+            private readonly List<BufferManifest> m_buffers;
+
+            public ExportTarget(MemoryMappedViewAccessor accessor, long basePtr, long dataStart, List<BufferManifest> buffers)
+            {
+                Accessor = accessor;
+                m_basePtr = basePtr;
+                m_dataStart = dataStart;
+                m_buffers = buffers;
+            }
+
+            /// <summary>
+            /// Position of a buffer within the accessor's view.
+            /// </summary>
+            public long GetPosition(int buffer)
+            {
+                return m_dataStart + m_buffers[buffer].Offset;
+            }
+
+            public IntPtr GetPointer(int buffer, long offset)
+            {
+                return new IntPtr(m_basePtr + GetPosition(buffer) + offset);
+            }
+        }
+
+        private abstract class ColumnExport
+        {
+            public string Name;
+            public string ArrowType;
+            public string Timezone;
+            public bool Nullable;
+            protected int Count;
+
+            public abstract IEnumerable<long> GetBufferLengths();
+
+            public abstract void Write(ExportTarget target);
+
+            public static ColumnExport Create(string name, Type type, ColumnDataSnapshot snapshot, int count)
+            {
+                ColumnExport result;
+
+                if (type == typeof (bool))
+                {
+                    result = new BooleanColumnExport(snapshot, "bool");
+                }
+                else if (type == typeof (string) || type == typeof (SizableArrayOfByte))
+                {
+                    var values = type == typeof (string)
+                                     ? ((ColumnData<string>.VarLengthDataSnapshot) snapshot).Data
+                                     : ((ColumnData<SizableArrayOfByte>.VarLengthDataSnapshot) snapshot).Data;
+                    result = new VarLengthColumnExport(snapshot.NotNulls, values, type == typeof (string) ? "large_string" : "large_binary");
+                }
+                else if (type == typeof (DateTime))
+                {
+                    result = new ConvertedColumnExport<DateTime, long>(snapshot, "timestamp[us]", x => ToMicroseconds(x.Ticks));
+                }
+                else if (type == typeof (DateTimeOffset))
+                {
+                    result = new ConvertedColumnExport<DateTimeOffset, long>(snapshot, "timestamp[us]", x => ToMicroseconds(x.UtcTicks)) {Timezone = "UTC"};
+                }
+                else if (type == typeof (TimeSpan))
+                {
+                    result = new ConvertedColumnExport<TimeSpan, long>(snapshot, "duration[us]", x => x.Ticks / 10);
+                }
+                else if (type == typeof (decimal))
+                {
+                    // decimal's scale varies between values, and Arrow decimals need a fixed one, so exact text is exported
+                    result = new DecimalColumnExport(snapshot, "large_string");
+                }
+                else
+                {
+                    string arrowType;
+                    if (!FixedWidthTypes.TryGetValue(type, out arrowType))
+                    {
+                        throw new NotSupportedException("Arrow export is not supported for this type: " + type.FullName);
+                    }
+
+                    // layout of these types is identical to Arrow's, so values are copied block by block
+                    var exportType = typeof (FixedWidthColumnExport<>).MakeGenericType(type);
+                    result = (ColumnExport) Activator.CreateInstance(exportType, snapshot, arrowType);
+                }
+
+                result.Name = name;
+                result.Nullable = true;
+                result.Count = count;
+                return result;
+            }
+
+            private static readonly Dictionary<Type, string> FixedWidthTypes = new Dictionary<Type, string>
+                {
+                    {typeof (byte), "uint8"},
+                    {typeof (sbyte), "int8"},
+                    {typeof (short), "int16"},
+                    {typeof (ushort), "uint16"},
+                    {typeof (int), "int32"},
+                    {typeof (uint), "uint32"},
+                    {typeof (long), "int64"},
+                    {typeof (ulong), "uint64"},
+                    {typeof (float), "float32"},
+                    {typeof (double), "float64"},
+                    // bytes in the order of Guid.ToByteArray
+                    {typeof (Guid), "fixed_size_binary[16]"},
+                };
+
+            protected long BitmapLength
+            {
+                get { return (Count + 7) / 8; }
+            }
+        }
+
+        private sealed class ValidDocumentsExport : ColumnExport
+        {
+            private readonly BitVectorSnapshot m_validDocuments;
+
+            public ValidDocumentsExport(BitVectorSnapshot validDocuments, int count)
+            {
+                m_validDocuments = validDocuments;
+                Name = ValidDocumentsFieldName;
+                ArrowType = "bool";
+                Count = count;
+            }
+
+            public override IEnumerable<long> GetBufferLengths()
+            {
+                return new[] {BitmapLength};
+            }
+
+            public override void Write(ExportTarget target)
+            {
+                m_validDocuments.CopyTo(target.GetPointer(0, 0), (ulong) Count);
+            }
+        }
+
+        /// <summary>
+        /// Base for columns with a validity bitmap and a single fixed-width values buffer.
+        /// </summary>
+        private abstract class FixedLayoutColumnExport<T> : ColumnExport
+        {
+            protected readonly BitVectorSnapshot NotNulls;
+            protected readonly ExpandableArraySnapshot<T> Data;
+
+            protected FixedLayoutColumnExport(ColumnDataSnapshot snapshot, string arrowType)
+            {
+                NotNulls = snapshot.NotNulls;
+                Data = ((ColumnData<T>.FixedSizeDataSnapshot) snapshot).Data;
+                ArrowType = arrowType;
+            }
+
+            protected abstract long ValuesLength { get; }
+
+            /// <summary>
+            /// Number of leading rows which have values in the snapshot, the rest are exported as zeros.
+            /// </summary>
+            protected int SnapshotCount
+            {
+                get { return (int) Math.Min(Math.Min(Count, Data.Capacity), (long) NotNulls.Capacity); }
+            }
+
+            public override IEnumerable<long> GetBufferLengths()
+            {
+                return new[] {BitmapLength, ValuesLength};
+            }
+
+            public override void Write(ExportTarget target)
+            {
+                NotNulls.CopyTo(target.GetPointer(0, 0), (ulong) Count);
+                WriteValues(target);
+            }
+
+            protected abstract void WriteValues(ExportTarget target);
+        }
+
+        private sealed class FixedWidthColumnExport<T> : FixedLayoutColumnExport<T> where T : struct
+        {
+            public FixedWidthColumnExport(ColumnDataSnapshot snapshot, string arrowType)
+                : base(snapshot, arrowType)
+            {
+            }
+
+            protected override long ValuesLength
+            {
+                get { return (long) Count * Marshal.SizeOf(typeof (T)); }
+            }
+
+            protected override void WriteValues(ExportTarget target)
+            {
+                var position = target.GetPosition(1);
+                var itemSize = Marshal.SizeOf(typeof (T));
+                var count = SnapshotCount;
+
+                for (var start = 0; start < count;)
+                {
+                    var block = Data.GetBlock(start);
+                    var offset = Data.GetLocalIndex(start);
+                    var length = Math.Min(block.Length - offset, count - start);
+                    target.Accessor.WriteArray(position + (long) start * itemSize, block, offset, length);
+                    start += length;
+                }
+            }
+        }
+
+        private sealed class ConvertedColumnExport<T, TOut> : FixedLayoutColumnExport<T> where TOut : struct
+        {
+            private readonly Func<T, TOut> m_converter;
+
+            public ConvertedColumnExport(ColumnDataSnapshot snapshot, string arrowType, Func<T, TOut> converter)
+                : base(snapshot, arrowType)
+            {
+                m_converter = converter;
+            }
+
+            protected override long ValuesLength
+            {
+                get { return (long) Count * Marshal.SizeOf(typeof (TOut)); }
+            }
+
+            protected override void WriteValues(ExportTarget target)
+            {
+                var position = target.GetPosition(1);
+                var itemSize = Marshal.SizeOf(typeof (TOut));
+                var count = SnapshotCount;
+                TOut[] buffer = null;
+
+                for (var start = 0; start < count;)
+                {
+                    var block = Data.GetBlock(start);
+                    var offset = Data.GetLocalIndex(start);
+                    var length = Math.Min(block.Length - offset, count - start);
+                    if (buffer == null)
+                    {
+                        buffer = new TOut[block.Length];
+                    }
+
+                    for (var i = 0; i < length; i++)
+                    {
+                        // values under NULLs are undefined and may be garbage, do not let converters overflow on them
+                        buffer[i] = NotNulls.Get(start + i) ? m_converter(block[offset + i]) : default(TOut);
+                    }
+
+                    target.Accessor.WriteArray(position + (long) start * itemSize, buffer, 0, length);
+                    start += length;
+                }
+            }
+        }
+
+        private sealed class BooleanColumnExport : FixedLayoutColumnExport<bool>
+        {
+            public BooleanColumnExport(ColumnDataSnapshot snapshot, string arrowType)
+                : base(snapshot, arrowType)
+            {
+            }
+
+            protected override long ValuesLength
+            {
+                get { return BitmapLength; }
+            }
+
+            protected override void WriteValues(ExportTarget target)
+            {
+                var buffer = new byte[BitmapLength];
+                var count = SnapshotCount;
+                for (var i = 0; i < count; i++)
+                {
+                    if (Data[i])
+                    {
+                        buffer[i >> 3] |= (byte) (1 << (i & 7));
+                    }
+                }
+
+                target.Accessor.WriteArray(target.GetPosition(1), buffer, 0, buffer.Length);
+            }
+        }
+
+        /// <summary>
+        /// Base for large string or binary layout: validity bitmap, 64-bit offsets and value bytes.
+        /// </summary>
+        private abstract class VarLengthLayoutColumnExport : ColumnExport
+        {
+            private readonly BitVectorSnapshot m_notNulls;
+            private long m_dataLength = -1;
+
+            protected VarLengthLayoutColumnExport(BitVectorSnapshot notNulls, string arrowType)
+            {
+                m_notNulls = notNulls;
+                ArrowType = arrowType;
+            }
+
+            /// <summary>
+            /// Number of leading rows which may have values in the snapshot, the rest are exported as NULLs.
+            /// </summary>
+            protected abstract int SnapshotCount { get; }
+
+            protected abstract int GetValueLength(int docIndex);
+
+            /// <summary>
+            /// Copies bytes of a value, which are exactly as many as returned by <see cref="GetValueLength"/>.
+            /// </summary>
+            protected abstract void CopyValue(int docIndex, IntPtr dest, int length);
+
+            public override IEnumerable<long> GetBufferLengths()
+            {
+                m_dataLength = 0;
+                var count = SnapshotCount;
+                for (var i = 0; i < count; i++)
+                {
+                    if (m_notNulls.Get(i))
+                    {
+                        m_dataLength += GetValueLength(i);
+                    }
+                }
+
+                return new[] {BitmapLength, ((long) Count + 1) * sizeof (long), m_dataLength};
+            }
+
+            public override void Write(ExportTarget target)
+            {
+                m_notNulls.CopyTo(target.GetPointer(0, 0), (ulong) Count);
+
+                var offsets = new long[Math.Min(Count + 1, 65536)];
+                var offsetsPosition = target.GetPosition(1);
+                var count = SnapshotCount;
+                long dataOffset = 0;
+                var chunkStart = 0;
+                var chunkLength = 0;
+
+                for (var i = 0; i < Count; i++)
+                {
+                    offsets[chunkLength++] = dataOffset;
+                    if (chunkLength == offsets.Length)
+                    {
+                        target.Accessor.WriteArray(offsetsPosition + (long) chunkStart * sizeof (long), offsets, 0, chunkLength);
+                        chunkStart += chunkLength;
+                        chunkLength = 0;
+                    }
+
+                    if (i >= count || !m_notNulls.Get(i))
+                    {
+                        continue;
+                    }
+
+                    // snapshot does not change, so values are exactly as long as they were counted
+                    var length = GetValueLength(i);
+                    if (length > m_dataLength - dataOffset)
+                    {
+                        throw new InvalidOperationException("Value at " + i + " does not fit into space counted for it");
+                    }
+
+                    CopyValue(i, target.GetPointer(2, dataOffset), length);
+                    dataOffset += length;
+                }
+
+                offsets[chunkLength++] = dataOffset;
+                target.Accessor.WriteArray(offsetsPosition + (long) chunkStart * sizeof (long), offsets, 0, chunkLength);
+            }
+        }
+
+        /// <summary>
+        /// Strings and binary values, which are copied as stored.
+        /// </summary>
+        private sealed class VarLengthColumnExport : VarLengthLayoutColumnExport
+        {
+            private readonly ExpandableArrayOfValuesSnapshot m_values;
+            private readonly ulong m_capacity;
+
+            public VarLengthColumnExport(BitVectorSnapshot notNulls, ExpandableArrayOfValuesSnapshot values, string arrowType)
+                : base(notNulls, arrowType)
+            {
+                m_values = values;
+                m_capacity = Math.Min(values.Capacity, notNulls.Capacity);
+            }
+
+            protected override int SnapshotCount
+            {
+                get { return (int) Math.Min((ulong) Count, m_capacity); }
+            }
+
+            protected override int GetValueLength(int docIndex)
+            {
+                return m_values.GetLength(docIndex);
+            }
+
+            protected override void CopyValue(int docIndex, IntPtr dest, int length)
+            {
+                m_values.CopyTo(docIndex, dest, length);
+            }
+        }
+
+        /// <summary>
+        /// Decimals as invariant culture strings, which keep every digit and the scale of every value.
+        /// </summary>
+        private sealed class DecimalColumnExport : VarLengthLayoutColumnExport
+        {
+            private readonly ExpandableArraySnapshot<decimal> m_data;
+            private readonly long m_capacity;
+            private readonly byte[] m_buffer = new byte[32];
+
+            public DecimalColumnExport(ColumnDataSnapshot snapshot, string arrowType)
+                : base(snapshot.NotNulls, arrowType)
+            {
+                m_data = ((ColumnData<decimal>.FixedSizeDataSnapshot) snapshot).Data;
+                m_capacity = Math.Min(m_data.Capacity, (long) snapshot.NotNulls.Capacity);
+            }
+
+            protected override int SnapshotCount
+            {
+                get { return (int) Math.Min(Count, m_capacity); }
+            }
+
+            protected override int GetValueLength(int docIndex)
+            {
+                return Format(docIndex).Length;
+            }
+
+            protected override void CopyValue(int docIndex, IntPtr dest, int length)
+            {
+                // formatted decimals only have ASCII characters
+                var text = Format(docIndex);
+                Encoding.ASCII.GetBytes(text, 0, length, m_buffer, 0);
+                Marshal.Copy(m_buffer, 0, dest, length);
+            }
+
+            private string Format(int docIndex)
+            {
+                return m_data[docIndex].ToString(CultureInfo.InvariantCulture);
+            }
+        }
+
+        private sealed class Manifest
+        {
+            [JsonProperty("documentType")]
+            public string DocumentType;
+
+            [JsonProperty("rowCount")]
+            public int RowCount;
+
+            [JsonProperty("fields")]
+            public readonly List<FieldManifest> Fields = new List<FieldManifest>();
+        }
+
+        private sealed class FieldManifest
+        {
+            [JsonProperty("name")]
+            public string Name;
+
+            [JsonProperty("type")]
+            public string Type;
+
+            [JsonProperty("timezone", NullValueHandling = NullValueHandling.Ignore)]
+            public string Timezone;
+
+            [JsonProperty("nullable")]
+            public bool Nullable;
+
+            [JsonProperty("buffers")]
+            public readonly List<BufferManifest> Buffers = new List<BufferManifest>();
+        }
+
+        private sealed class BufferManifest
+        {
+            [JsonProperty("offset")]
+            public long Offset;
+
+            [JsonProperty("length")]
+            public long Length;
+        }
+    }
+}
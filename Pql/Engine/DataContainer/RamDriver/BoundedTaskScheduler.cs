@@ -0,0 +1,77 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Runs tasks on a fixed set of dedicated background threads, in order of submission.
+    /// Used for loading and flushing column files, so that hundreds of columns are processed by a handful of threads
+    /// instead of a thread per file, and tasks which wait on disk do not hold up the shared thread pool.
+    /// </summary>
+    internal sealed class BoundedTaskScheduler : TaskScheduler
+    {
+        /// <summary>
+        /// Shared by all storage drivers in the process.
+        /// Writes are asynchronous (see <see cref="ColumnFile"/>), so threads mostly encode data and do not need to outnumber processors.
+        /// </summary>
+        public static readonly BoundedTaskScheduler Storage = new BoundedTaskScheduler("Pql storage", Math.Max(2, Math.Min(8, Environment.ProcessorCount)));
+
+        [ThreadStatic]
+        private static BoundedTaskScheduler t_current;
+
+        private readonly BlockingCollection<Task> m_tasks;
+        private readonly Thread[] m_threads;
+
+        public BoundedTaskScheduler(string name, int threadCount)
+        {
+            if (threadCount < 1)
+            {
+                throw new ArgumentOutOfRangeException("threadCount", threadCount, "Thread count must be positive");
+            }
+
+            m_tasks = new BlockingCollection<Task>();
+            m_threads = new Thread[threadCount];
+            for (var i = 0; i < threadCount; i++)
+            {
+                m_threads[i] = new Thread(Run) {IsBackground = true, Name = name + " #" + i};
+                m_threads[i].Start();
+            }
+        }
+
+        public override int MaximumConcurrencyLevel
+        {
+            get { return m_threads.Length; }
+        }
+
+        protected override void QueueTask(Task task)
+        {
+            m_tasks.Add(task);
+        }
+
+        /// <summary>
+        /// Only threads of this scheduler may run its tasks inline, e.g. when one of them waits for another task.
+        /// </summary>
+        protected override bool TryExecuteTaskInline(Task task, bool taskWasPreviouslyQueued)
+        {
+            // a queued task which is executed here is skipped by worker which dequeues it
+            return t_current == this && TryExecuteTask(task);
+        }
+
+        protected override IEnumerable<Task> GetScheduledTasks()
+        {
+            return m_tasks.ToArray();
+        }
+
+        private void Run()
+        {
+            t_current = this;
+            foreach (var task in m_tasks.GetConsumingEnumerable())
+            {
+                TryExecuteTask(task);
+            }
+        }
+    }
+}
@@ -0,0 +1,177 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Tracks which blocks of a group of column files changed since they were last written,
+    /// so that checkpoints only have to write changed blocks into delta files.
+    /// One instance covers files which are always written together, e.g. not-null bitmap and values of a column.
+    /// Blocks are marked while holding StructureLock in any mode. Marks are taken away while holding it in write mode,
+    /// together with snapshots of data, so that blocks changed while snapshots are being written go to the next checkpoint.
+    /// </summary>
+    internal sealed class CheckpointState
+    {
+        /// <summary>
+        /// Enough blocks to cover int.MaxValue rows, so that bitmap never has to grow.
+        /// </summary>
+        private const int MaxBlockCount = (int)(((long)int.MaxValue + ColumnFile.RowsPerBlock - 1) / ColumnFile.RowsPerBlock);
+
+        private readonly int[] m_dirtyBlocks = new int[(MaxBlockCount + 31) / 32];
+        private volatile bool m_allDirty = true;
+        private int m_persistedRowCount;
+        private int m_generation;
+
+        /// <summary>
+        /// True when files have to be rewritten completely, e.g. when they were never written or written in legacy format.
+        /// </summary>
+        public bool IsAllDirty
+        {
+            get { return m_allDirty; }
+        }
+
+        /// <summary>
+        /// Highest checkpoint generation found in files of this group. Next checkpoint must use a greater one.
+        /// </summary>
+        public int Generation
+        {
+            get { return m_generation; }
+        }
+
+        public void MarkDirty(int docIndex)
+        {
+            var word = docIndex / ColumnFile.RowsPerBlock / 32;
+            var mask = 1 << ((docIndex / ColumnFile.RowsPerBlock) % 32);
+
+            var current = m_dirtyBlocks[word];
+            while ((current & mask) == 0)
+            {
+                var prev = Interlocked.CompareExchange(ref m_dirtyBlocks[word], current | mask, current);
+                if (prev == current)
+                {
+                    break;
+                }
+
+                current = prev;
+            }
+        }
+
+        public void MarkAllDirty()
+        {
+            m_allDirty = true;
+        }
+
+        /// <summary>
+        /// Returns true when a delta for given current row count cannot be written, and files have to be rewritten.
+        /// Rows can only be appended by a delta, so a trimmed container requires a rewrite.
+        /// </summary>
+        public bool RequiresRewrite(int rowCount)
+        {
+            return m_allDirty || rowCount < m_persistedRowCount;
+        }
+
+        /// <summary>
+        /// Returns ordered indexes of blocks to be written into a delta: blocks with modified rows,
+        /// plus every block from the one which contained last persisted row up to current end of data.
+        /// </summary>
+        public List<int> GetDirtyBlocks(int rowCount)
+        {
+            return GetDirtyBlocks(rowCount, m_dirtyBlocks);
+        }
+
+        /// <summary>
+        /// Same as <see cref="GetDirtyBlocks(int)"/>, for marks previously taken by <see cref="TakeDirtyBlocks"/>.
+        /// </summary>
+        public List<int> GetDirtyBlocks(int rowCount, int[] dirtyBlocks)
+        {
+            if (dirtyBlocks == null)
+            {
+                throw new ArgumentNullException("dirtyBlocks");
+            }
+
+            var result = new List<int>();
+            var blockCount = (rowCount + ColumnFile.RowsPerBlock - 1) / ColumnFile.RowsPerBlock;
+            var firstAppended = rowCount > m_persistedRowCount ? m_persistedRowCount / ColumnFile.RowsPerBlock : blockCount;
+
+            for (var i = 0; i < blockCount; i++)
+            {
+                if (i >= firstAppended || (dirtyBlocks[i / 32] & (1 << (i % 32))) != 0)
+                {
+                    result.Add(i);
+                }
+            }
+
+            return result;
+        }
+
+        /// <summary>
+        /// Returns current marks and clears them. Must be called while holding StructureLock in write mode.
+        /// Marks have to be given back with <see cref="RestoreDirtyBlocks"/> if they do not get persisted.
+        /// </summary>
+        public int[] TakeDirtyBlocks()
+        {
+            var result = (int[]) m_dirtyBlocks.Clone();
+            Array.Clear(m_dirtyBlocks, 0, m_dirtyBlocks.Length);
+            return result;
+        }
+
+        /// <summary>
+        /// Merges marks taken by <see cref="TakeDirtyBlocks"/> back into current ones, e.g. after a failed checkpoint.
+        /// </summary>
+        public void RestoreDirtyBlocks(int[] dirtyBlocks)
+        {
+            if (dirtyBlocks == null)
+            {
+                throw new ArgumentNullException("dirtyBlocks");
+            }
+
+            for (var word = 0; word < dirtyBlocks.Length; word++)
+            {
+                var mask = dirtyBlocks[word];
+                var current = m_dirtyBlocks[word];
+                while ((current & mask) != mask)
+                {
+                    var prev = Interlocked.CompareExchange(ref m_dirtyBlocks[word], current | mask, current);
+                    if (prev == current)
+                    {
+                        break;
+                    }
+
+                    current = prev;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Records that all changes up to now are persisted in files with given row count and generation.
+        /// </summary>
+        public void OnPersisted(int rowCount, int generation)
+        {
+            Array.Clear(m_dirtyBlocks, 0, m_dirtyBlocks.Length);
+            OnSnapshotPersisted(rowCount, generation);
+        }
+
+        /// <summary>
+        /// Records that a snapshot with given row count is persisted in files with given generation.
+        /// Unlike <see cref="OnPersisted"/>, keeps blocks which were marked after marks were taken by <see cref="TakeDirtyBlocks"/>.
+        /// </summary>
+        public void OnSnapshotPersisted(int rowCount, int generation)
+        {
+            m_persistedRowCount = rowCount;
+            m_generation = generation;
+            m_allDirty = false;
+        }
+
+        /// <summary>
+        /// Records that files with given row count and generation were loaded.
+        /// Unlike <see cref="OnPersisted"/>, keeps blocks which were marked while loading was in progress.
+        /// </summary>
+        public void OnLoaded(int rowCount, int generation)
+        {
+            m_persistedRowCount = rowCount;
+            m_generation = generation;
+            m_allDirty = false;
+        }
+    }
+}
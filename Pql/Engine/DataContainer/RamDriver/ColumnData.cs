@@ -1,6 +1,7 @@
 ﻿using System;
 using System.Data;
 using System.IO;
+using System.Linq;
 using System.Linq.Expressions;
 using System.Threading;
 using Pql.Engine.Interfaces.Internal;
@@ -11,34 +12,90 @@ namespace Pql.Engine.DataContainer.RamDriver
 {
     internal sealed class ColumnData<T> : ColumnDataBase
     {
+        /// <summary>
+        /// Order-preserving conversions of values into zone map bounds. 
+        /// At most one of them is not null, both are null for types without zone maps.
+        /// </summary>
+        private static readonly Func<T, long> ToZoneMapInt64 = GenerateZoneMapConverter<long>();
+        private static readonly Func<T, double> ToZoneMapDouble = GenerateZoneMapConverter<double>();
+
         private readonly DbType m_dbType;
+        private readonly Func<int, T> m_getValue;
+        private Action<BinaryWriter, int, int, ExpandableArraySnapshot<T>, BitVectorSnapshot> m_writeSnapshotData;
         
+        /// <summary>
+        /// Values of fixed-size types. Null for strings and binary values, which are kept in <see cref="VarLengthData"/>.
+        /// </summary>
         public readonly ExpandableArray<T> DataArray;
+
+        /// <summary>
+        /// Unmanaged storage of strings (as UTF-8) and binary values. Null for fixed-size types.
+        /// Keeps variable-length values out of managed heap, so that they are not traced by garbage collector.
+        /// </summary>
+        public readonly ExpandableArrayOfValues VarLengthData;
+
         public override DbType DbType { get { return m_dbType; } }
 
         public ColumnData(DbType dbType, IUnmanagedAllocator allocator)
+            : this(dbType, allocator, null)
+        {
+        }
+
+        /// <param name="mappedFilePath">Scratch file to keep string and binary values in, or null to keep them in RAM.
+        /// Ignored for fixed-size types, which live on managed heap.</param>
+        public ColumnData(DbType dbType, IUnmanagedAllocator allocator, string mappedFilePath)
             : base(allocator)
         {
             m_dbType = dbType;
-            DataArray = new ExpandableArray<T>(1, typeof(T).IsValueType ? DriverRowData.GetByteCount(dbType) : IntPtr.Size);
-            
-            AssignFromDriverRow = GenerateAssignFromDriverRowAction();
-            AssignToDriverRow = GenerateAssignToDriverRowAction();
-            WriteData = GenerateWriteDataAction();
-            ReadData = GenerateReadDataAction();
+
+            if (IsVarLength(dbType))
+            {
+                VarLengthData = new ExpandableArrayOfValues(allocator, mappedFilePath);
+                GenerateVarLengthActions();
+            }
+            else
+            {
+                DataArray = new ExpandableArray<T>(1, typeof(T).IsValueType ? DriverRowData.GetByteCount(dbType) : IntPtr.Size);
+
+                AssignFromDriverRow = GenerateAssignFromDriverRowAction();
+                AssignToDriverRow = GenerateAssignToDriverRowAction();
+                WriteData = GenerateWriteDataAction();
+                ReadData = IsBulkReadable(typeof(T)) ? GenerateBulkReadDataAction(GenerateReadDataAction()) : GenerateReadDataAction();
+            }
+
+            m_getValue = GenerateGetValueFunc();
         }
 
         public ColumnData(ColumnDataBase source, IUnmanagedAllocator allocator)
+            : this(source, allocator, null)
+        {
+        }
+
+        public ColumnData(ColumnDataBase source, IUnmanagedAllocator allocator, string mappedFilePath)
             : base(source, allocator)
         {
             var typed = (ColumnData<T>) source;
 
             m_dbType = typed.DbType;
-            DataArray = typed.DataArray;
-            AssignFromDriverRow = typed.AssignFromDriverRow;
-            AssignToDriverRow = typed.AssignToDriverRow;
-            WriteData = typed.WriteData;
-            ReadData = typed.ReadData;
+
+            if (typed.VarLengthData != null)
+            {
+                // may throw due to insufficient memory
+                // copying only takes live values, so this also removes garbage left by updates
+                VarLengthData = new ExpandableArrayOfValues(typed.VarLengthData, allocator, mappedFilePath);
+                GenerateVarLengthActions();
+                m_getValue = GenerateGetValueFunc();
+            }
+            else
+            {
+                DataArray = typed.DataArray;
+                AssignFromDriverRow = typed.AssignFromDriverRow;
+                AssignToDriverRow = typed.AssignToDriverRow;
+                WriteData = typed.WriteData;
+                ReadData = typed.ReadData;
+                m_getValue = typed.m_getValue;
+                m_writeSnapshotData = typed.m_writeSnapshotData;
+            }
         }
 
         public override Type ElementType
@@ -48,11 +105,256 @@ namespace Pql.Engine.DataContainer.RamDriver
 
         public override bool TryEnsureCapacity(int newCapacity, int timeout = 0)
         {
-            var myresult = DataArray.TryEnsureCapacity(newCapacity, timeout);
+            var myresult = VarLengthData != null
+                               ? VarLengthData.TryEnsureCapacity((ulong) newCapacity, timeout)
+                               : DataArray.TryEnsureCapacity(newCapacity, timeout);
             var theirresult = base.TryEnsureCapacity(newCapacity, timeout);
             return myresult && theirresult;
         }
 
+        public override bool IsMapped
+        {
+            get { return VarLengthData != null && VarLengthData.IsMapped; }
+        }
+
+        public override void Prefetch(int firstDocIndex, int count)
+        {
+            if (VarLengthData != null)
+            {
+                VarLengthData.Prefetch(firstDocIndex, count);
+            }
+        }
+
+        public override ColumnZoneMap ComputeZoneMap(int firstDocIndex, int count)
+        {
+            return DataArray == null
+                       ? base.ComputeZoneMap(firstDocIndex, count)
+                       : ComputeZoneMap(firstDocIndex, count, NotNulls.Get, docIndex => DataArray[docIndex]);
+        }
+
+        /// <summary>
+        /// Takes a frozen image of not-null flags and values. Subsequent writes into this column do not affect it.
+        /// Caller must make sure there are no concurrent writers while snapshot is taken.
+        /// </summary>
+        public override ColumnDataSnapshot Snapshot()
+        {
+            var notNulls = NotNulls.Snapshot();
+            try
+            {
+                if (VarLengthData != null)
+                {
+                    return new VarLengthDataSnapshot(notNulls, VarLengthData.Snapshot());
+                }
+
+                if (m_writeSnapshotData == null)
+                {
+                    m_writeSnapshotData = GenerateWriteSnapshotDataAction();
+                }
+
+                return new FixedSizeDataSnapshot(notNulls, DataArray.Snapshot(), m_writeSnapshotData);
+            }
+            catch
+            {
+                notNulls.Dispose();
+                throw;
+            }
+        }
+
+        private static ColumnZoneMap ComputeZoneMap(int firstDocIndex, int count, Func<int, bool> isNotNull, Func<int, T> getValue)
+        {
+            var result = new ColumnZoneMap();
+            for (var docIndex = firstDocIndex; docIndex < firstDocIndex + count; docIndex++)
+            {
+                if (isNotNull(docIndex))
+                {
+                    result.NonNullCount++;
+                }
+            }
+
+            if (result.NonNullCount == 0)
+            {
+                return result;
+            }
+
+            if (ToZoneMapInt64 != null)
+            {
+                long min = long.MaxValue, max = long.MinValue;
+                for (var docIndex = firstDocIndex; docIndex < firstDocIndex + count; docIndex++)
+                {
+                    if (isNotNull(docIndex))
+                    {
+                        var value = ToZoneMapInt64(getValue(docIndex));
+                        min = Math.Min(min, value);
+                        max = Math.Max(max, value);
+                    }
+                }
+
+                result.Kind = ColumnZoneMapKind.Int64;
+                result.Min = min;
+                result.Max = max;
+            }
+            else if (ToZoneMapDouble != null)
+            {
+                double min = double.PositiveInfinity, max = double.NegativeInfinity;
+                var hasNaN = false;
+                for (var docIndex = firstDocIndex; docIndex < firstDocIndex + count; docIndex++)
+                {
+                    if (isNotNull(docIndex))
+                    {
+                        var value = ToZoneMapDouble(getValue(docIndex));
+                        hasNaN |= double.IsNaN(value);
+                        min = Math.Min(min, value);
+                        max = Math.Max(max, value);
+                    }
+                }
+
+                // NaN does not compare to anything, so no bounds can be given
+                if (!hasNaN)
+                {
+                    result.Kind = ColumnZoneMapKind.Double;
+                    result.Min = BitConverter.DoubleToInt64Bits(min);
+                    result.Max = BitConverter.DoubleToInt64Bits(max);
+                }
+            }
+
+            return result;
+        }
+
+        public override void TrimTo(int newCapacity)
+        {
+            if (VarLengthData != null)
+            {
+                VarLengthData.TrimTo((ulong) newCapacity);
+            }
+            else
+            {
+                DataArray.TrimTo(newCapacity);
+            }
+
+            base.TrimTo(newCapacity);
+        }
+
+        /// <summary>
+        /// Reads a single value. Strings and binary values are materialized as new objects.
+        /// </summary>
+        /// <remarks>NOTE: this method assumes that value is NOT NULL. This should be verified by caller.</remarks>
+        public T GetValue(int docIndex)
+        {
+            return m_getValue(docIndex);
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (VarLengthData != null)
+            {
+                VarLengthData.Dispose();
+            }
+
+            base.Dispose(disposing);
+        }
+
+        private static bool IsVarLength(DbType dbType)
+        {
+            var storageType = DriverRowData.DeriveRepresentationType(dbType);
+            return storageType == DriverRowData.DataTypeRepresentation.String
+                   || storageType == DriverRowData.DataTypeRepresentation.ByteArray;
+        }
+
+        private void GenerateVarLengthActions()
+        {
+            // NOTE: assign actions assume that value is NOT NULL
+            // this should be verified by caller
+            var values = VarLengthData;
+
+            if (DriverRowData.DeriveRepresentationType(DbType) == DriverRowData.DataTypeRepresentation.String)
+            {
+                AssignFromDriverRow = (docIndex, rowData, indexInArray) => values.SetString(docIndex, rowData.StringData[indexInArray]);
+                AssignToDriverRow = (docIndex, rowData, indexInArray) => rowData.StringData[indexInArray] = values.GetString(docIndex);
+            }
+            else
+            {
+                AssignFromDriverRow = (docIndex, rowData, indexInArray) =>
+                    {
+                        var source = rowData.BinaryData[indexInArray];
+                        values.SetAt(docIndex, source.Data, source.Length);
+                    };
+
+                // we assume that DriverRowData always has destination byte array initialized
+                AssignToDriverRow = (docIndex, rowData, indexInArray) =>
+                    {
+                        var dest = rowData.BinaryData[indexInArray];
+                        dest.SetLength(values.GetLength(docIndex));
+                        values.CopyTo(docIndex, dest.Data, 0);
+                    };
+            }
+
+            // strings are written by BinaryWriter as UTF-8 with 7-bit encoded length prefix,
+            // and binary values also have 7-bit encoded length prefix, so both formats match native one
+            WriteData = (writer, first, count) => values.Write(writer, (ulong) first, (ulong) count, NotNulls);
+            ReadData = (reader, first, count) =>
+                {
+                    values.EnsureCapacity((ulong) (first + count));
+                    values.Read(reader, (ulong) first, (ulong) count, NotNulls);
+                };
+        }
+
+        private static Func<T, TBound> GenerateZoneMapConverter<TBound>()
+        {
+            var value = Expression.Parameter(typeof (T), "value");
+            var type = typeof (T);
+
+            Expression body = null;
+            if (typeof (TBound) == typeof (long))
+            {
+                // unsigned 64-bit values do not fit, and decimals would be rounded
+                if (type == typeof (sbyte) || type == typeof (byte) || type == typeof (short) || type == typeof (ushort)
+                    || type == typeof (int) || type == typeof (uint) || type == typeof (long))
+                {
+                    body = Expression.Convert(value, typeof (long));
+                }
+                else if (type == typeof (bool))
+                {
+                    body = Expression.Condition(value, Expression.Constant(1L), Expression.Constant(0L));
+                }
+                else if (type == typeof (DateTime) || type == typeof (TimeSpan))
+                {
+                    body = Expression.Property(value, "Ticks");
+                }
+            }
+            else if (typeof (TBound) == typeof (double))
+            {
+                if (type == typeof (float) || type == typeof (double))
+                {
+                    body = Expression.Convert(value, typeof (double));
+                }
+            }
+
+            return body == null ? null : Expression.Lambda<Func<T, TBound>>(body, value).Compile();
+        }
+
+        private Func<int, T> GenerateGetValueFunc()
+        {
+            if (VarLengthData == null)
+            {
+                return docIndex => DataArray[docIndex];
+            }
+
+            var values = VarLengthData;
+            if (typeof (T) == typeof (string))
+            {
+                return (Func<int, T>) (object) new Func<int, string>(values.GetString);
+            }
+
+            return (Func<int, T>) (object) new Func<int, SizableArrayOfByte>(
+                docIndex =>
+                    {
+                        var result = new SizableArrayOfByte();
+                        result.SetLength(values.GetLength(docIndex));
+                        values.CopyTo(docIndex, result.Data, 0);
+                        return result;
+                    });
+        }
+
         private Action<int, DriverRowData, int> GenerateAssignFromDriverRowAction()
         {
             // NOTE: this method assumes that source value is NOT NULL
@@ -63,7 +365,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             var fieldArrayIndex = Expression.Parameter(typeof (int), "indexInArray");
 
             var arrayData = Expression.Field(Expression.Constant(this), "DataArray");
-            var dataBlock = Expression.Call(arrayData, "GetBlock", null, docIndex);
+            var dataBlock = Expression.Call(arrayData, "GetWritableBlock", null, docIndex);
             var localIndex = Expression.Call(arrayData, "GetLocalIndex", null, docIndex);
             Expression source;
             Expression assign;
@@ -173,20 +475,38 @@ namespace Pql.Engine.DataContainer.RamDriver
             return (Action<int, DriverRowData, int>)lambda.Compile();
         }
 
-        private Action<BinaryWriter, int> GenerateWriteDataAction()
+        private Action<BinaryWriter, int, int> GenerateWriteDataAction()
         {
+            var thisref = Expression.Constant(this);
+            var lambda = GenerateWriteDataLambda(Expression.Field(thisref, "DataArray"), Expression.Field(thisref, "NotNulls"));
+            return (Action<BinaryWriter, int, int>) lambda.Compile();
+        }
+
+        private Action<BinaryWriter, int, int, ExpandableArraySnapshot<T>, BitVectorSnapshot> GenerateWriteSnapshotDataAction()
+        {
+            var data = Expression.Parameter(typeof (ExpandableArraySnapshot<T>), "data");
+            var notNulls = Expression.Parameter(typeof (BitVectorSnapshot), "notNulls");
+            var lambda = GenerateWriteDataLambda(data, notNulls, data, notNulls);
+            return (Action<BinaryWriter, int, int, ExpandableArraySnapshot<T>, BitVectorSnapshot>) lambda.Compile();
+        }
+
+        /// <summary>
+        /// Generates a loop which writes non-null values of a range of documents.
+        /// Values and not-null flags are either fields of this column, or snapshots passed in as extra parameters.
+        /// </summary>
+        private LambdaExpression GenerateWriteDataLambda(Expression arrayData, Expression notnulls, params ParameterExpression[] extraParameters)
+        {
+            var first = Expression.Parameter(typeof (int), "first");
             var count = Expression.Parameter(typeof (int), "count");
             var writer = Expression.Parameter(typeof (BinaryWriter), "writer");
             
-            var thisref = Expression.Constant(this);
             var docIndex = Expression.Variable(typeof (int), "docIndex");
-            var arrayData = Expression.Field(Expression.Constant(this), "DataArray");
+            var end = Expression.Variable(typeof (int), "end");
             var blockGet = Expression.Call(arrayData, "GetBlock", null, docIndex);
             var block = Expression.Variable(blockGet.Type, "block");
             var dataElement = Expression.ArrayAccess(block, Expression.Call(arrayData, "GetLocalIndex", null, docIndex));
 
-            var notnulls = Expression.Field(thisref, "NotNulls");
-            var isnotnull = Expression.Call(notnulls, typeof (BitVector).GetMethod("Get", new [] {typeof(int)}), docIndex);
+            var isnotnull = Expression.Call(notnulls, notnulls.Type.GetMethod("Get", new [] {typeof(int)}), docIndex);
 
             var writeItem = Expression.Block(
                 Expression.Assign(block, blockGet),
@@ -196,7 +516,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             var body = Expression.Block(
                 new[] { block },
                 Expression.IfThen(
-                    Expression.GreaterThanOrEqual(docIndex, count), 
+                    Expression.GreaterThanOrEqual(docIndex, end), 
                     Expression.Break(breakLabel)),
                 Expression.IfThen(isnotnull, writeItem),
                 Expression.PreIncrementAssign(docIndex)
@@ -205,25 +525,90 @@ namespace Pql.Engine.DataContainer.RamDriver
                 );
 
             var loop = Expression.Block(
-                new [] {docIndex},
-                Expression.Assign(docIndex, Expression.Constant(0, docIndex.Type)),
+                new [] {docIndex, end},
+                Expression.Assign(docIndex, first),
+                Expression.Assign(end, Expression.Add(first, count)),
                 Expression.Loop(body, breakLabel))
                 ;
 
-            var lambda = Expression.Lambda(
-                Expression.GetActionType(new[] { typeof(BinaryWriter), typeof(int) }),
-                loop, writer, count);
+            var parameters = new[] {writer, first, count}.Concat(extraParameters).ToArray();
+            return Expression.Lambda(
+                Expression.GetActionType(parameters.Select(x => x.Type).ToArray()),
+                loop, parameters);
+        }
 
-            return (Action<BinaryWriter, int>) lambda.Compile();
+        /// <summary>
+        /// True for types whose values are written by <see cref="BinaryWriter"/> in their in-memory representation.
+        /// Decimals, chars and other types are encoded differently.
+        /// </summary>
+        private static bool IsBulkReadable(Type type)
+        {
+            return type.IsPrimitive && type != typeof(char) && type != typeof(IntPtr) && type != typeof(UIntPtr);
         }
 
-        private Action<BinaryReader, int> GenerateReadDataAction()
+        /// <summary>
+        /// When data comes from a <see cref="MemoryViewStream"/>, e.g. a mapped column file,
+        /// every run of non-null values within a block is copied into column storage with a single memcpy.
+        /// Other readers go through per-value reader.
+        /// </summary>
+        private Action<BinaryReader, int, int> GenerateBulkReadDataAction(Action<BinaryReader, int, int> readValueByValue)
         {
+            return (reader, first, count) =>
+                {
+                    var view = reader.BaseStream as MemoryViewStream;
+                    if (view == null)
+                    {
+                        readValueByValue(reader, first, count);
+                        return;
+                    }
+
+                    var end = first + count;
+                    DataArray.EnsureCapacity(end);
+
+                    var docIndex = first;
+                    while (docIndex < end)
+                    {
+                        if (!NotNulls.Get(docIndex))
+                        {
+                            docIndex++;
+                            continue;
+                        }
+
+                        var span = DataArray.GetBlockSpan(docIndex, end - docIndex);
+                        var run = 1;
+                        while (run < span.Count)
+                        {
+                            // whole groups of eight non-nulls are common, skip them at once
+                            var next = docIndex + run;
+                            if ((next & 7) == 0 && run + 8 <= span.Count && NotNulls.GetGroup((ulong) next) == 0xFF)
+                            {
+                                run += 8;
+                            }
+                            else if (NotNulls.Get(next))
+                            {
+                                run++;
+                            }
+                            else
+                            {
+                                break;
+                            }
+                        }
+
+                        view.ReadArray(span.Array, span.Offset, run);
+                        docIndex += run;
+                    }
+                };
+        }
+
+        private Action<BinaryReader, int, int> GenerateReadDataAction()
+        {
+            var first = Expression.Parameter(typeof (int), "first");
             var count = Expression.Parameter(typeof (int), "count");
             var reader = Expression.Parameter(typeof (BinaryReader), "reader");
             
             var thisref = Expression.Constant(this);
             var docIndex = Expression.Variable(typeof (int), "docIndex");
+            var end = Expression.Variable(typeof (int), "end");
             var arrayData = Expression.Field(Expression.Constant(this), "DataArray");
             var blockGet = Expression.Call(arrayData, "GetBlock", null, docIndex);
             var block = Expression.Variable(blockGet.Type, "block");
@@ -240,7 +625,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             var body = Expression.Block(
                 new []{block},
                 Expression.IfThen(
-                    Expression.GreaterThanOrEqual(docIndex, count), 
+                    Expression.GreaterThanOrEqual(docIndex, end), 
                     Expression.Break(breakLabel)),
                 Expression.IfThen(isnotnull, readItem),
                 Expression.PreIncrementAssign(docIndex)
@@ -248,17 +633,22 @@ namespace Pql.Engine.DataContainer.RamDriver
 
             var loop = Expression.Block(
                 new[] {docIndex},
-                Expression.Assign(docIndex, Expression.Constant(0, docIndex.Type)),
+                Expression.Assign(docIndex, first),
                 Expression.Loop(body, breakLabel))
                 ;
 
-            var createDataArray = Expression.Call(arrayData, "EnsureCapacity", null, count);
+            var createDataArray = Expression.Call(arrayData, "EnsureCapacity", null, end);
 
             var lambda = Expression.Lambda(
-                Expression.GetActionType(new[] { typeof(BinaryReader), typeof(int) }),
-                Expression.Block(createDataArray, loop), reader, count);
-
-            return (Action<BinaryReader, int>) lambda.Compile();
+                Expression.GetActionType(new[] { typeof(BinaryReader), typeof(int), typeof(int) }),
+                Expression.Block(
+                    new[] {end},
+                    Expression.Assign(end, Expression.Add(first, count)),
+                    createDataArray,
+                    loop), 
+                reader, first, count);
+
+            return (Action<BinaryReader, int, int>) lambda.Compile();
         }
 
         private Expression GenerateReadItemExpression(Type itemType, Expression dataElement, ParameterExpression reader)
@@ -375,5 +765,67 @@ namespace Pql.Engine.DataContainer.RamDriver
 
             throw new Exception("Unsupported item type: " + itemType.AssemblyQualifiedName);
         }
+
+        internal sealed class FixedSizeDataSnapshot : ColumnDataSnapshot
+        {
+            private readonly ExpandableArraySnapshot<T> m_data;
+            private readonly Action<BinaryWriter, int, int, ExpandableArraySnapshot<T>, BitVectorSnapshot> m_writeData;
+
+            public FixedSizeDataSnapshot(
+                BitVectorSnapshot notNulls, ExpandableArraySnapshot<T> data, Action<BinaryWriter, int, int, ExpandableArraySnapshot<T>, BitVectorSnapshot> writeData)
+                : base(notNulls)
+            {
+                m_data = data;
+                m_writeData = writeData;
+            }
+
+            public ExpandableArraySnapshot<T> Data
+            {
+                get { return m_data; }
+            }
+
+            public override void WriteData(BinaryWriter writer, int first, int count)
+            {
+                m_writeData(writer, first, count, m_data, NotNulls);
+            }
+
+            public override ColumnZoneMap ComputeZoneMap(int firstDocIndex, int count)
+            {
+                return ColumnData<T>.ComputeZoneMap(firstDocIndex, count, NotNulls.Get, docIndex => m_data[docIndex]);
+            }
+
+            public override void Dispose()
+            {
+                m_data.Dispose();
+                base.Dispose();
+            }
+        }
+
+        internal sealed class VarLengthDataSnapshot : ColumnDataSnapshot
+        {
+            private readonly ExpandableArrayOfValuesSnapshot m_data;
+
+            public VarLengthDataSnapshot(BitVectorSnapshot notNulls, ExpandableArrayOfValuesSnapshot data)
+                : base(notNulls)
+            {
+                m_data = data;
+            }
+
+            public ExpandableArrayOfValuesSnapshot Data
+            {
+                get { return m_data; }
+            }
+
+            public override void WriteData(BinaryWriter writer, int first, int count)
+            {
+                m_data.Write(writer, (ulong) first, (ulong) count, NotNulls);
+            }
+
+            public override void Dispose()
+            {
+                m_data.Dispose();
+                base.Dispose();
+            }
+        }
     }
 }
\ No newline at end of file
@@ -12,20 +12,34 @@ namespace Pql.Engine.DataContainer.RamDriver
 {
     internal abstract class ColumnDataBase : IDisposable
     {
+        private const int BlockPending = 0;
+        private const int BlockLoading = 1;
+        private const int BlockLoaded = 2;
+
         private volatile Task[] m_dataLoaderTasks;
+        private volatile LoadProgress m_loadProgress;
+        private volatile int m_loadedPrefix = int.MaxValue;
 
         public BitVector NotNulls;
         private bool m_disposed;
 
+        /// <summary>
+        /// Blocks of not-null flags and values changed since column files were last written or loaded.
+        /// Carried over to copies of this column, as they represent same persistent data.
+        /// </summary>
+        public readonly CheckpointState Checkpoint;
+
         protected ColumnDataBase(IUnmanagedAllocator allocator)
         {
             NotNulls = new BitVector(allocator);
+            Checkpoint = new CheckpointState();
         }
 
         protected ColumnDataBase(ColumnDataBase source, IUnmanagedAllocator allocator)
         {
             // may throw due to insufficient memory
             NotNulls = new BitVector(source.NotNulls, allocator);
+            Checkpoint = source.Checkpoint;
         }
 
         public abstract Type ElementType { get; }
@@ -36,6 +50,30 @@ namespace Pql.Engine.DataContainer.RamDriver
             return NotNulls.TryEnsureCapacity((ulong)newCapacity, timeout);
         }
 
+        /// <summary>
+        /// True when values are kept in a memory-mapped file and may have to be paged in.
+        /// </summary>
+        public virtual bool IsMapped
+        {
+            get { return false; }
+        }
+
+        /// <summary>
+        /// Hints that values of given range of documents are about to be read sequentially.
+        /// Only does something for memory-mapped columns.
+        /// </summary>
+        public virtual void Prefetch(int firstDocIndex, int count)
+        {
+        }
+
+        /// <summary>
+        /// Releases storage beyond first newCapacity values. Caller must have exclusive access to this column.
+        /// </summary>
+        public virtual void TrimTo(int newCapacity)
+        {
+            NotNulls.TrimTo((ulong)newCapacity);
+        }
+
         /// <summary>
         /// Do not remove. Used implicitly from runtime code generator.
         /// </summary>
@@ -67,6 +105,212 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
         }
 
+        /// <summary>
+        /// Number of leading documents whose values and not-null flags can be read.
+        /// Grows while column is being loaded, equals int.MaxValue when column is not being loaded.
+        /// </summary>
+        public int LoadedPrefix
+        {
+            get { return m_loadedPrefix; }
+        }
+
+        /// <summary>
+        /// Starts tracking of loaded ranges, so that readers can start on leading documents before entire column is loaded.
+        /// Must be invoked before loaders are attached.
+        /// </summary>
+        /// <param name="count">Number of documents being loaded</param>
+        /// <param name="loadBlock">Loads a block of <see cref="ColumnFile"/> and publishes it with <see cref="PublishLoadedRange"/>.
+        /// When given, readers which need a block that loader has not got to yet load it themselves, 
+        /// and loader must go through <see cref="EnsureBlockLoaded"/> to skip such blocks. Must be safe to invoke concurrently for different blocks.
+        /// May be null, then readers can only wait for loader.</param>
+        public void BeginRangeTracking(int count, Action<int> loadBlock)
+        {
+            m_loadProgress = new LoadProgress(count, loadBlock);
+            m_loadedPrefix = 0;
+        }
+
+        /// <summary>
+        /// Publishes a range of documents whose values have been loaded.
+        /// Ranges must be aligned with blocks of <see cref="ColumnFile"/>, and can be published in any order.
+        /// </summary>
+        public void PublishLoadedRange(int firstDocIndex, int count)
+        {
+            var progress = m_loadProgress;
+            if (progress == null)
+            {
+                return;
+            }
+
+            lock (progress)
+            {
+                progress.BlockStates[firstDocIndex / ColumnFile.RowsPerBlock] = BlockLoaded;
+
+                var prefix = m_loadedPrefix;
+                while (prefix < progress.Count && progress.BlockStates[prefix / ColumnFile.RowsPerBlock] == BlockLoaded)
+                {
+                    prefix = Math.Min(progress.Count, prefix + ColumnFile.RowsPerBlock);
+                }
+
+                m_loadedPrefix = prefix;
+
+                // waiters for blocks beyond prefix have to be woken up as well
+                Monitor.PulseAll(progress);
+            }
+        }
+
+        /// <summary>
+        /// Loads given block in calling thread, unless it is already loaded or another thread is loading it, 
+        /// in which case waits for that thread. Used by loader to skip blocks which readers loaded on demand.
+        /// </summary>
+        public void EnsureBlockLoaded(int blockIndex)
+        {
+            var progress = m_loadProgress;
+            if (progress != null)
+            {
+                WaitBlockLoaded(progress, blockIndex);
+            }
+        }
+
+        /// <summary>
+        /// Stops tracking of loaded ranges and wakes up all waiters. 
+        /// Waits for blocks which readers are loading on demand, so that loader can release column files afterwards.
+        /// After a failure, waiters find out about it from <see cref="WaitLoadingCompleted"/>.
+        /// </summary>
+        public void EndRangeTracking(bool succeeded)
+        {
+            var progress = m_loadProgress;
+            if (progress == null)
+            {
+                return;
+            }
+
+            lock (progress)
+            {
+                progress.LoadBlock = null;
+                while (Array.IndexOf(progress.BlockStates, BlockLoading) >= 0)
+                {
+                    Monitor.Wait(progress);
+                }
+
+                progress.Completed = true;
+                if (succeeded)
+                {
+                    m_loadedPrefix = int.MaxValue;
+                }
+
+                Monitor.PulseAll(progress);
+            }
+
+            m_loadProgress = null;
+        }
+
+        /// <summary>
+        /// Waits until first endDocIndex documents are loaded. Returns immediately when column is not being loaded.
+        /// Blocks which loader has not got to yet are loaded by calling thread when possible.
+        /// Rethrows loading errors.
+        /// </summary>
+        public void WaitRangeLoaded(int endDocIndex)
+        {
+            if (m_loadedPrefix >= endDocIndex)
+            {
+                return;
+            }
+
+            var progress = m_loadProgress;
+            if (progress != null)
+            {
+                int prefix;
+                while ((prefix = m_loadedPrefix) < endDocIndex && WaitBlockLoaded(progress, prefix / ColumnFile.RowsPerBlock))
+                {
+                }
+            }
+
+            if (m_loadedPrefix < endDocIndex)
+            {
+                WaitLoadingCompleted();
+            }
+        }
+
+        /// <summary>
+        /// Waits until block which contains given document is loaded, loading it in calling thread when possible.
+        /// Lets random reads proceed without waiting for entire column. Returns immediately when column is not being loaded.
+        /// Rethrows loading errors.
+        /// </summary>
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public void WaitRowLoaded(int docIndex)
+        {
+            if (m_loadedPrefix <= docIndex)
+            {
+                WaitBlockOfRowLoaded(docIndex);
+            }
+        }
+
+        private void WaitBlockOfRowLoaded(int docIndex)
+        {
+            var progress = m_loadProgress;
+            if (progress == null || !WaitBlockLoaded(progress, docIndex / ColumnFile.RowsPerBlock))
+            {
+                WaitLoadingCompleted();
+            }
+        }
+
+        /// <summary>
+        /// Returns true when block is loaded, false when loading ended without loading it.
+        /// Claims and loads a pending block when progress allows loading on demand, otherwise waits for another thread.
+        /// </summary>
+        private static bool WaitBlockLoaded(LoadProgress progress, int blockIndex)
+        {
+            Action<int> loadBlock;
+            lock (progress)
+            {
+                while (true)
+                {
+                    // documents beyond loaded count can only be waited for
+                    var state = blockIndex < progress.BlockStates.Length ? progress.BlockStates[blockIndex] : BlockLoading;
+                    if (state == BlockLoaded)
+                    {
+                        return true;
+                    }
+
+                    if (progress.Completed)
+                    {
+                        return false;
+                    }
+
+                    if (state == BlockPending && progress.LoadBlock != null)
+                    {
+                        loadBlock = progress.LoadBlock;
+                        progress.BlockStates[blockIndex] = BlockLoading;
+                        break;
+                    }
+
+                    Monitor.Wait(progress);
+                }
+            }
+
+            try
+            {
+                loadBlock(blockIndex);
+            }
+            catch
+            {
+                // someone else may retry, and loader must not wait for this block forever
+                lock (progress)
+                {
+                    if (progress.BlockStates[blockIndex] == BlockLoading)
+                    {
+                        progress.BlockStates[blockIndex] = BlockPending;
+                    }
+
+                    Monitor.PulseAll(progress);
+                }
+
+                throw;
+            }
+
+            return true;
+        }
+
         /// <summary>
         /// Disassembled method from BinaryReader.
         /// </summary>
@@ -138,14 +382,42 @@ namespace Pql.Engine.DataContainer.RamDriver
         public Action<int, DriverRowData, int> AssignToDriverRow { get; protected set; }
 
         /// <summary>
-        /// Action to write actual data values to a binary stream.
+        /// Action to write actual data values of a range of documents to a binary stream.
+        /// Arguments are the writer, index of first document and number of documents.
+        /// </summary>
+        public Action<BinaryWriter, int, int> WriteData { get; protected set; }
+
+        /// <summary>
+        /// Action to read actual data values of a range of documents from a binary stream.
+        /// Arguments are the reader, index of first document and number of documents.
+        /// Not-null flags of the range must be loaded already.
+        /// Ranges which start at block boundaries of <see cref="ColumnFile"/> can be read concurrently from mapped files.
         /// </summary>
-        public Action<BinaryWriter, int> WriteData { get; protected set; }
+        public Action<BinaryReader, int, int> ReadData { get; protected set; }
 
         /// <summary>
-        /// Action to read actual data values from a binary stream.
+        /// Takes a frozen image of not-null flags and values, which is not affected by subsequent writes.
+        /// Caller must make sure there are no concurrent writers while snapshot is taken,
+        /// and must dispose snapshot before this column is trimmed or disposed. Only one snapshot can be alive at a time.
         /// </summary>
-        public Action<BinaryReader, int> ReadData { get; protected set; }
+        public abstract ColumnDataSnapshot Snapshot();
+
+        /// <summary>
+        /// Computes zone map of a range of documents. Base implementation only counts non-null values.
+        /// </summary>
+        public virtual ColumnZoneMap ComputeZoneMap(int firstDocIndex, int count)
+        {
+            var result = new ColumnZoneMap();
+            for (var docIndex = firstDocIndex; docIndex < firstDocIndex + count; docIndex++)
+            {
+                if (NotNulls.Get(docIndex))
+                {
+                    result.NonNullCount++;
+                }
+            }
+
+            return result;
+        }
 
         public void Dispose()
         {
@@ -174,5 +446,69 @@ namespace Pql.Engine.DataContainer.RamDriver
         {
             Dispose(false);
         }
+
+        private sealed class LoadProgress
+        {
+            public readonly int Count;
+            public readonly int[] BlockStates;
+            public Action<int> LoadBlock;
+            public bool Completed;
+
+            public LoadProgress(int count, Action<int> loadBlock)
+            {
+                Count = count;
+                BlockStates = new int[(count + ColumnFile.RowsPerBlock - 1) / ColumnFile.RowsPerBlock];
+                LoadBlock = loadBlock;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Frozen image of a column, see <see cref="ColumnDataBase.Snapshot"/>.
+    /// Lets column files be written from a consistent state while writers keep modifying the column.
+    /// </summary>
+    internal abstract class ColumnDataSnapshot : IDisposable
+    {
+        public readonly BitVectorSnapshot NotNulls;
+
+        protected ColumnDataSnapshot(BitVectorSnapshot notNulls)
+        {
+            NotNulls = notNulls ?? throw new ArgumentNullException("notNulls");
+        }
+
+        /// <summary>
+        /// Writes not-null flags of a range of documents, in the same format as <see cref="BitVector.Write(BinaryWriter, ulong, ulong)"/>.
+        /// </summary>
+        public void WriteNotNulls(BinaryWriter writer, int first, int count)
+        {
+            NotNulls.Write(writer, (ulong) first, (ulong) count);
+        }
+
+        /// <summary>
+        /// Writes values of a range of documents, in the same format as <see cref="ColumnDataBase.WriteData"/>.
+        /// </summary>
+        public abstract void WriteData(BinaryWriter writer, int first, int count);
+
+        /// <summary>
+        /// Same as <see cref="ColumnDataBase.ComputeZoneMap"/>. Base implementation only counts non-null values.
+        /// </summary>
+        public virtual ColumnZoneMap ComputeZoneMap(int firstDocIndex, int count)
+        {
+            var result = new ColumnZoneMap();
+            for (var docIndex = firstDocIndex; docIndex < firstDocIndex + count; docIndex++)
+            {
+                if (NotNulls.Get(docIndex))
+                {
+                    result.NonNullCount++;
+                }
+            }
+
+            return result;
+        }
+
+        public virtual void Dispose()
+        {
+            NotNulls.Dispose();
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,659 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Text;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Kind of data kept in a column file. Recorded in file header to catch mixed up files.
+    /// </summary>
+    internal enum ColumnFileKind
+    {
+        Bitmap = 1,
+        Keys = 2,
+        Values = 3
+    }
+
+    /// <summary>
+    /// Type of bounds kept in a <see cref="ColumnZoneMap"/>.
+    /// </summary>
+    internal enum ColumnZoneMapKind : byte
+    {
+        None = 0,
+        Int64 = 1,
+        Double = 2
+    }
+
+    /// <summary>
+    /// Summary of values in a block of rows, which lets readers decide whether a block can be skipped without reading it.
+    /// </summary>
+    internal struct ColumnZoneMap
+    {
+        public int NonNullCount;
+        public ColumnZoneMapKind Kind;
+
+        /// <summary>
+        /// Lower bound of non-null values. Holds bits of a double when <see cref="Kind"/> is Double.
+        /// </summary>
+        public long Min;
+
+        /// <summary>
+        /// Upper bound of non-null values. Holds bits of a double when <see cref="Kind"/> is Double.
+        /// </summary>
+        public long Max;
+
+        public double MinDouble
+        {
+            get { return BitConverter.Int64BitsToDouble(Min); }
+        }
+
+        public double MaxDouble
+        {
+            get { return BitConverter.Int64BitsToDouble(Max); }
+        }
+    }
+
+    /// <summary>
+    /// Entry of the block index kept in column file footer.
+    /// </summary>
+    internal struct ColumnFileBlock
+    {
+        public int FirstRow;
+        public int RowCount;
+        public long Offset;
+        public int Length;
+        public uint Crc;
+        public ColumnZoneMap ZoneMap;
+    }
+
+
+    /// <summary>
+    /// Layout of persistent column files (not-null bitmaps, document keys and column values).
+    /// <code>
+    /// header:  magic, format version, kind, db type, rows per block, row count, checkpoint generation, CRC-32C of header
+    /// blocks:  payload of every block of rows, in the same encoding as used by older headerless files
+    /// footer:  index entry of every block (row range, byte range, CRC-32C of payload, zone map)
+    /// trailer: footer offset, block count, CRC-32C of footer, magic
+    /// </code>
+    /// Blocks are aligned with blocks of unmanaged containers, so that every block can be read and verified independently,
+    /// and loaders can process blocks in parallel.
+    /// <para>
+    /// Incremental checkpoints append segments to a delta file next to the base file. Every segment has the same layout
+    /// with its own magic, holds only blocks which changed since previous checkpoint, and replaces them as a whole.
+    /// Offsets in segments are absolute, so segments are found by walking back from the end of delta file.
+    /// Segments whose generation is not greater than generation of base file were merged into it and are ignored.
+    /// </para>
+    /// </summary>
+    internal static class ColumnFile
+    {
+        /// <summary>
+        /// "PQLC" in little-endian order.
+        /// </summary>
+        public const int Magic = 0x434C5150;
+
+        /// <summary>
+        /// "PQLD" in little-endian order.
+        /// </summary>
+        public const int DeltaMagic = 0x444C5150;
+
+        public const int FormatVersion = 1;
+
+        /// <summary>
+        /// Same as number of items per block in <see cref="ExpandableArrayOfKeys"/> and <see cref="ExpandableArrayOfValues"/>,
+        /// and a multiple of number of bits per byte, so that bitmap blocks start at byte boundaries.
+        /// </summary>
+        public const int RowsPerBlock = 65536;
+
+        public const int HeaderSize = 32;
+        public const int IndexEntrySize = 45;
+        public const int TrailerSize = 20;
+
+        /// <summary>
+        /// Suffix appended to path of base file to get path of its delta file.
+        /// </summary>
+        public const string DeltaSuffix = ".delta";
+
+        /// <summary>
+        /// Files are written through <see cref="AsyncFileWriter"/>, which keeps up to this many buffers of
+        /// <see cref="WriteBufferSize"/> bytes in flight while next blocks are being encoded.
+        /// </summary>
+        public const int WriteQueueDepth = 4;
+
+        public const int WriteBufferSize = 1 << 20;
+
+        /// <summary>
+        /// First version of storage driver which writes column files in this format.
+        /// Stores written by older versions have headerless files, which are read as a single stream.
+        /// </summary>
+        public static readonly Version FirstStoreVersion = new Version(1, 0, 0, 0);
+
+        public static int GetBlockCount(int rowCount)
+        {
+            return (int)(((long)rowCount + RowsPerBlock - 1) / RowsPerBlock);
+        }
+
+        /// <summary>
+        /// Writes a complete column file. Payload of every block is produced by writeRange, which receives first row and row count.
+        /// File is written under a temporary name and then replaces existing file, so that a failure leaves previous file intact.
+        /// </summary>
+        /// <param name="path">File to create or overwrite</param>
+        /// <param name="kind">Kind of data</param>
+        /// <param name="dbType">Type of column values, or -1 for bitmaps and keys</param>
+        /// <param name="rowCount">Total number of rows</param>
+        /// <param name="generation">Checkpoint generation, must be greater than generations of all segments in existing delta file</param>
+        /// <param name="writeRange">Writes payload of a range of rows</param>
+        /// <param name="computeZoneMap">Computes zone map of a range of rows, may be null</param>
+        public static void Write(
+            string path, ColumnFileKind kind, int dbType, int rowCount, int generation,
+            Action<BinaryWriter, int, int> writeRange, Func<int, int, ColumnZoneMap> computeZoneMap)
+        {
+            if (rowCount < 0)
+            {
+                throw new ArgumentOutOfRangeException("rowCount", rowCount, "Row count cannot be negative");
+            }
+
+            var tempPath = path + ".tmp";
+            try
+            {
+                using (var file = new AsyncFileWriter(tempPath, false, WriteQueueDepth, WriteBufferSize))
+                {
+                    WriteSegment(file, Magic, kind, dbType, rowCount, generation, Enumerable.Range(0, GetBlockCount(rowCount)).ToList(), writeRange, computeZoneMap);
+                }
+
+                if (File.Exists(path))
+                {
+                    File.Replace(tempPath, path, null);
+                }
+                else
+                {
+                    File.Move(tempPath, path);
+                }
+            }
+            finally
+            {
+                File.Delete(tempPath);
+            }
+        }
+
+        /// <summary>
+        /// Appends a segment with given blocks to a delta file, creating it if necessary.
+        /// A failed append is truncated away, so that delta file stays readable.
+        /// </summary>
+        /// <param name="path">Delta file</param>
+        /// <param name="kind">Kind of data</param>
+        /// <param name="dbType">Type of column values, or -1 for bitmaps and keys</param>
+        /// <param name="rowCount">Total number of rows, cannot be less than row count of preceding segments</param>
+        /// <param name="generation">Checkpoint generation, must be greater than generations of base file and preceding segments</param>
+        /// <param name="blockIndexes">Ordered indexes of blocks to write</param>
+        /// <param name="writeRange">Writes payload of a range of rows</param>
+        /// <param name="computeZoneMap">Computes zone map of a range of rows, may be null</param>
+        public static void AppendDelta(
+            string path, ColumnFileKind kind, int dbType, int rowCount, int generation, IList<int> blockIndexes,
+            Action<BinaryWriter, int, int> writeRange, Func<int, int, ColumnZoneMap> computeZoneMap)
+        {
+            using (var file = new AsyncFileWriter(path, true, WriteQueueDepth, WriteBufferSize))
+            {
+                var start = file.Position;
+                try
+                {
+                    WriteSegment(file, DeltaMagic, kind, dbType, rowCount, generation, blockIndexes, writeRange, computeZoneMap);
+                }
+                catch
+                {
+                    file.Truncate(start);
+                    throw;
+                }
+            }
+        }
+
+        private static void WriteSegment(
+            AsyncFileWriter file, int magic, ColumnFileKind kind, int dbType, int rowCount, int generation, IList<int> blockIndexes,
+            Action<BinaryWriter, int, int> writeRange, Func<int, int, ColumnZoneMap> computeZoneMap)
+        {
+            if (writeRange == null)
+            {
+                throw new ArgumentNullException("writeRange");
+            }
+
+            if (blockIndexes == null)
+            {
+                throw new ArgumentNullException("blockIndexes");
+            }
+
+            var blocks = new ColumnFileBlock[blockIndexes.Count];
+
+            using (var buffer = new MemoryStream())
+            using (var writer = new BinaryWriter(buffer, Encoding.UTF8, true))
+            {
+                writer.Write(magic);
+                writer.Write(FormatVersion);
+                writer.Write((int)kind);
+                writer.Write(dbType);
+                writer.Write(RowsPerBlock);
+                writer.Write(rowCount);
+                writer.Write(generation);
+                writer.Flush();
+                writer.Write(Crc32C.Compute(0, buffer.GetBuffer(), 0, (int)buffer.Length));
+                WriteBuffer(buffer, writer, file);
+
+                for (var i = 0; i < blocks.Length; i++)
+                {
+                    var first = blockIndexes[i] * RowsPerBlock;
+                    if (first < 0 || first >= rowCount || (i > 0 && blockIndexes[i] <= blockIndexes[i - 1]))
+                    {
+                        throw new ArgumentException("Block indexes must be ordered and within row count", "blockIndexes");
+                    }
+
+                    var count = Math.Min(RowsPerBlock, rowCount - first);
+
+                    writeRange(writer, first, count);
+                    writer.Flush();
+
+                    blocks[i].FirstRow = first;
+                    blocks[i].RowCount = count;
+                    blocks[i].Offset = file.Position;
+                    blocks[i].Length = (int)buffer.Length;
+                    blocks[i].Crc = Crc32C.Compute(0, buffer.GetBuffer(), 0, (int)buffer.Length);
+                    if (computeZoneMap != null)
+                    {
+                        blocks[i].ZoneMap = computeZoneMap(first, count);
+                    }
+
+                    WriteBuffer(buffer, writer, file);
+                }
+
+                var footerOffset = file.Position;
+                foreach (var block in blocks)
+                {
+                    writer.Write(block.FirstRow);
+                    writer.Write(block.RowCount);
+                    writer.Write(block.Offset);
+                    writer.Write(block.Length);
+                    writer.Write(block.Crc);
+                    writer.Write(block.ZoneMap.NonNullCount);
+                    writer.Write((byte)block.ZoneMap.Kind);
+                    writer.Write(block.ZoneMap.Min);
+                    writer.Write(block.ZoneMap.Max);
+                }
+
+                writer.Flush();
+                var footerCrc = Crc32C.Compute(0, buffer.GetBuffer(), 0, (int)buffer.Length);
+
+                writer.Write(footerOffset);
+                writer.Write(blocks.Length);
+                writer.Write(footerCrc);
+                writer.Write(magic);
+                WriteBuffer(buffer, writer, file);
+
+                file.Flush(true);
+            }
+        }
+
+        private static void WriteBuffer(MemoryStream buffer, BinaryWriter writer, Stream file)
+        {
+            writer.Flush();
+            file.Write(buffer.GetBuffer(), 0, (int)buffer.Length);
+            buffer.SetLength(0);
+        }
+    }
+
+    /// <summary>
+    /// Reads a column file written by <see cref="ColumnFile.Write"/>, together with segments appended to its delta file.
+    /// Header and block index are verified on open, payload of every block is verified when block is opened.
+    /// </summary>
+    internal sealed class ColumnFileReader : IDisposable
+    {
+        private readonly Source m_base;
+        private readonly Source m_delta;
+        private readonly Source[] m_blockSources;
+
+        /// <summary>
+        /// Block index, ordered by row. Every block comes either from base file or from latest delta segment which has it.
+        /// </summary>
+        public readonly ColumnFileBlock[] Blocks;
+
+        public readonly int RowCount;
+
+        /// <summary>
+        /// Highest checkpoint generation found in base file and its delta file.
+        /// </summary>
+        public readonly int Generation;
+
+        /// <summary>
+        /// Takes ownership of the stream.
+        /// </summary>
+        /// <exception cref="InvalidDataException">File is damaged or does not match expected kind, type or row count</exception>
+        public ColumnFileReader(string path, Stream stream, ColumnFileKind kind, int dbType, int rowCount)
+            : this(path, stream, null, kind, dbType, rowCount)
+        {
+        }
+
+        /// <summary>
+        /// Takes ownership of both streams.
+        /// </summary>
+        /// <param name="path">Base file</param>
+        /// <param name="stream">Contents of base file</param>
+        /// <param name="deltaStream">Contents of delta file, or null when there is none</param>
+        /// <param name="kind">Expected kind of data</param>
+        /// <param name="dbType">Expected type of column values, or -1 for bitmaps and keys</param>
+        /// <param name="rowCount">Expected number of rows, after delta is applied</param>
+        /// <exception cref="InvalidDataException">Files are damaged or do not match expected kind, type or row count</exception>
+        public ColumnFileReader(string path, Stream stream, Stream deltaStream, ColumnFileKind kind, int dbType, int rowCount)
+        {
+            if (stream == null)
+            {
+                if (deltaStream != null)
+                {
+                    deltaStream.Dispose();
+                }
+
+                throw new ArgumentNullException("stream");
+            }
+
+            m_base = new Source(path, stream);
+            m_delta = deltaStream == null ? null : new Source(path + ColumnFile.DeltaSuffix, deltaStream);
+
+            try
+            {
+                var baseSegment = ReadSegment(m_base, m_base.Stream.Length, ColumnFile.Magic, kind, dbType);
+                if (baseSegment.Start != 0)
+                {
+                    throw m_base.Damaged("header magic not found");
+                }
+
+                if (baseSegment.Blocks.Length != ColumnFile.GetBlockCount(baseSegment.RowCount))
+                {
+                    throw m_base.Damaged("block index does not cover all rows");
+                }
+
+                var segments = new List<Segment> {baseSegment};
+                Generation = baseSegment.Generation;
+
+                if (m_delta != null)
+                {
+                    var deltas = new List<Segment>();
+                    for (var end = m_delta.Stream.Length; end > 0;)
+                    {
+                        var segment = ReadSegment(m_delta, end, ColumnFile.DeltaMagic, kind, dbType);
+                        deltas.Add(segment);
+                        Generation = Math.Max(Generation, segment.Generation);
+                        end = segment.Start;
+                    }
+
+                    // segments written before last rewrite of base file are already merged into it
+                    deltas.Reverse();
+                    foreach (var segment in deltas.Where(x => x.Generation > baseSegment.Generation))
+                    {
+                        if (segment.RowCount < segments[segments.Count - 1].RowCount)
+                        {
+                            throw m_delta.Damaged("segment at offset " + segment.Start + " has less rows than preceding data");
+                        }
+
+                        segments.Add(segment);
+                    }
+                }
+
+                RowCount = segments[segments.Count - 1].RowCount;
+                if (RowCount != rowCount)
+                {
+                    throw (m_delta ?? m_base).Damaged(string.Format("expected {0} rows, found {1}", rowCount, RowCount));
+                }
+
+                Blocks = new ColumnFileBlock[ColumnFile.GetBlockCount(RowCount)];
+                m_blockSources = new Source[Blocks.Length];
+                foreach (var segment in segments)
+                {
+                    foreach (var block in segment.Blocks)
+                    {
+                        Blocks[block.FirstRow / ColumnFile.RowsPerBlock] = block;
+                        m_blockSources[block.FirstRow / ColumnFile.RowsPerBlock] = segment.Source;
+                    }
+                }
+
+                // a block which was partial in base file must have been replaced when rows were appended to it
+                for (var i = 0; i < Blocks.Length; i++)
+                {
+                    if (m_blockSources[i] == null || Blocks[i].RowCount != Math.Min(ColumnFile.RowsPerBlock, RowCount - Blocks[i].FirstRow))
+                    {
+                        throw (m_delta ?? m_base).Damaged("rows of block " + i + " are missing");
+                    }
+                }
+            }
+            catch
+            {
+                Dispose();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// True when files are mapped into memory, so that blocks can be opened and read concurrently.
+        /// </summary>
+        public bool IsMapped
+        {
+            get { return m_base.View != null && (m_delta == null || m_delta.View != null); }
+        }
+
+        /// <summary>
+        /// Verifies checksum of block payload and returns a reader positioned at its start.
+        /// For mapped files, payload is read straight from mapped memory, and this reader must outlive returned one.
+        /// </summary>
+        /// <exception cref="InvalidDataException">Block checksum does not match</exception>
+        public BinaryReader OpenBlock(int index)
+        {
+            var block = Blocks[index];
+            var source = m_blockSources[index];
+
+            Stream payload;
+            uint crc;
+            if (source.View != null)
+            {
+                payload = source.View.Slice(block.Offset, block.Length);
+                crc = source.View.ComputeCrc32C(block.Offset, block.Length);
+            }
+            else
+            {
+                var data = source.ReadBytes(block.Offset, block.Length);
+                payload = new MemoryStream(data, false);
+                crc = Crc32C.Compute(0, data, 0, data.Length);
+            }
+
+            if (crc != block.Crc)
+            {
+                payload.Dispose();
+                throw source.Damaged(string.Format("checksum mismatch in block {0}, rows {1} to {2}", index, block.FirstRow, block.FirstRow + block.RowCount - 1));
+            }
+
+            return new BinaryReader(payload);
+        }
+
+        /// <summary>
+        /// Reads and verifies header and block index of a segment which ends at given offset.
+        /// </summary>
+        private static Segment ReadSegment(Source source, long end, int magic, ColumnFileKind kind, int dbType)
+        {
+            if (end < ColumnFile.HeaderSize + ColumnFile.TrailerSize)
+            {
+                throw source.Damaged("file is too short");
+            }
+
+            var trailerOffset = end - ColumnFile.TrailerSize;
+            long footerOffset;
+            int blockCount;
+            uint footerCrc;
+            using (var reader = new BinaryReader(new MemoryStream(source.ReadBytes(trailerOffset, ColumnFile.TrailerSize))))
+            {
+                footerOffset = reader.ReadInt64();
+                blockCount = reader.ReadInt32();
+                footerCrc = reader.ReadUInt32();
+                if (reader.ReadInt32() != magic)
+                {
+                    throw source.Damaged("trailer magic not found, file may be truncated");
+                }
+            }
+
+            if (blockCount < 0 || footerOffset < ColumnFile.HeaderSize
+                || footerOffset + (long)blockCount * ColumnFile.IndexEntrySize != trailerOffset)
+            {
+                throw source.Damaged("invalid footer location");
+            }
+
+            var footer = source.ReadBytes(footerOffset, blockCount * ColumnFile.IndexEntrySize);
+            if (footerCrc != Crc32C.Compute(0, footer, 0, footer.Length))
+            {
+                throw source.Damaged("footer checksum mismatch");
+            }
+
+            var blocks = new ColumnFileBlock[blockCount];
+            using (var reader = new BinaryReader(new MemoryStream(footer)))
+            {
+                for (var i = 0; i < blockCount; i++)
+                {
+                    blocks[i].FirstRow = reader.ReadInt32();
+                    blocks[i].RowCount = reader.ReadInt32();
+                    blocks[i].Offset = reader.ReadInt64();
+                    blocks[i].Length = reader.ReadInt32();
+                    blocks[i].Crc = reader.ReadUInt32();
+                    blocks[i].ZoneMap.NonNullCount = reader.ReadInt32();
+                    blocks[i].ZoneMap.Kind = (ColumnZoneMapKind)reader.ReadByte();
+                    blocks[i].ZoneMap.Min = reader.ReadInt64();
+                    blocks[i].ZoneMap.Max = reader.ReadInt64();
+                }
+            }
+
+            // payload of first block immediately follows the header
+            var start = (blockCount > 0 ? blocks[0].Offset : footerOffset) - ColumnFile.HeaderSize;
+            if (start < 0 || start > footerOffset - ColumnFile.HeaderSize)
+            {
+                throw source.Damaged("invalid index entry for block 0");
+            }
+
+            var segment = new Segment {Source = source, Start = start, Blocks = blocks};
+
+            var header = source.ReadBytes(start, ColumnFile.HeaderSize);
+            using (var reader = new BinaryReader(new MemoryStream(header)))
+            {
+                if (reader.ReadInt32() != magic)
+                {
+                    throw source.Damaged("header magic not found");
+                }
+
+                var version = reader.ReadInt32();
+                var fileKind = reader.ReadInt32();
+                var fileDbType = reader.ReadInt32();
+                var rowsPerBlock = reader.ReadInt32();
+                segment.RowCount = reader.ReadInt32();
+                segment.Generation = reader.ReadInt32();
+
+                if (reader.ReadUInt32() != Crc32C.Compute(0, header, 0, ColumnFile.HeaderSize - sizeof(uint)))
+                {
+                    throw source.Damaged("header checksum mismatch");
+                }
+
+                if (version > ColumnFile.FormatVersion)
+                {
+                    throw source.Damaged("format version " + version + " is not supported");
+                }
+
+                if (fileKind != (int)kind || fileDbType != dbType)
+                {
+                    throw source.Damaged(string.Format("expected {0} of type {1}, found {2} of type {3}", kind, dbType, (ColumnFileKind)fileKind, fileDbType));
+                }
+
+                if (rowsPerBlock != ColumnFile.RowsPerBlock)
+                {
+                    throw source.Damaged("rows per block must be " + ColumnFile.RowsPerBlock + ", found " + rowsPerBlock);
+                }
+
+                if (segment.RowCount < 0)
+                {
+                    throw source.Damaged("invalid row count " + segment.RowCount);
+                }
+            }
+
+            // loaders rely on blocks being ordered and aligned with boundaries of container blocks
+            var nextOffset = start + ColumnFile.HeaderSize;
+            for (var i = 0; i < blockCount; i++)
+            {
+                if (blocks[i].FirstRow < 0 || blocks[i].FirstRow % ColumnFile.RowsPerBlock != 0 || blocks[i].FirstRow >= segment.RowCount
+                    || (i > 0 && blocks[i].FirstRow <= blocks[i - 1].FirstRow)
+                    || blocks[i].RowCount != Math.Min(ColumnFile.RowsPerBlock, segment.RowCount - blocks[i].FirstRow)
+                    || blocks[i].Offset != nextOffset || blocks[i].Length < 0)
+                {
+                    throw source.Damaged("invalid index entry for block " + i);
+                }
+
+                nextOffset += blocks[i].Length;
+            }
+
+            if (nextOffset != footerOffset)
+            {
+                throw source.Damaged("block index does not match payload");
+            }
+
+            return segment;
+        }
+
+        public void Dispose()
+        {
+            m_base.Stream.Dispose();
+            if (m_delta != null)
+            {
+                m_delta.Stream.Dispose();
+            }
+        }
+
+        private sealed class Segment
+        {
+            public Source Source;
+            public long Start;
+            public int RowCount;
+            public int Generation;
+            public ColumnFileBlock[] Blocks;
+        }
+
+        private sealed class Source
+        {
+            public readonly string Path;
+            public readonly Stream Stream;
+            public readonly MemoryViewStream View;
+
+            public Source(string path, Stream stream)
+            {
+                Path = path;
+                Stream = stream;
+                View = stream as MemoryViewStream;
+            }
+
+            public byte[] ReadBytes(long offset, int count)
+            {
+                var result = new byte[count];
+                lock (Stream)
+                {
+                    Stream.Position = offset;
+                    var read = 0;
+                    while (read < count)
+                    {
+                        var chunk = Stream.Read(result, read, count - read);
+                        if (chunk <= 0)
+                        {
+                            throw Damaged("unexpected end of file");
+                        }
+
+                        read += chunk;
+                    }
+                }
+
+                return result;
+            }
+
+            public InvalidDataException Damaged(string reason)
+            {
+                return new InvalidDataException(string.Format("Column file {0} is damaged or invalid: {1}", Path, reason));
+            }
+        }
+    }
+}
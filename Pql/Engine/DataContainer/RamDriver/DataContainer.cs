@@ -17,15 +17,17 @@ namespace Pql.Engine.DataContainer.RamDriver
         private volatile IUnmanagedAllocator m_memoryPool;
         private readonly DataContainerDescriptor m_dataContainerDescriptor;
         private readonly string m_storageRoot;
+        private readonly RamDriverSettings m_settings;
         private readonly Dictionary<int, DocumentDataContainer> m_documentDataContainers;
         private readonly Dictionary<int, object> m_documentDataContainerLocks;
         private bool m_disposed;
 
-        public DataContainer(ITracer tracer, DataContainerDescriptor dataContainerDescriptor, string storageRoot)
+        public DataContainer(ITracer tracer, DataContainerDescriptor dataContainerDescriptor, RamDriverSettings settings)
         {
+            m_settings = settings ?? throw new ArgumentNullException("settings");
 
             // intentionally allowed to be null - in case if we don't want to use any persistence
-            m_storageRoot = storageRoot;
+            m_storageRoot = settings.StorageRoot;
             m_tracer = tracer ?? throw new ArgumentNullException("tracer");
             m_memoryPool = new DynamicMemoryPool();
 
@@ -55,11 +57,16 @@ namespace Pql.Engine.DataContainer.RamDriver
                         m_dataContainerDescriptor, 
                         m_dataContainerDescriptor.RequireDocumentType(docType),
                         m_memoryPool,
+                        m_settings,
                         m_tracer);
                     if (!string.IsNullOrEmpty(m_storageRoot))
                     {
-                        var stats = ReadStatsFromStore(m_storageRoot);
-                        docStore.ReadDataFromStore(GetDocRootPath(m_storageRoot, m_dataContainerDescriptor.RequireDocumentType(docType)), stats.TryGetDocumentCount(docType));
+                        Version storeVersion;
+                        var stats = ReadStatsFromStore(m_storageRoot, out storeVersion);
+                        docStore.ReadDataFromStore(
+                            GetDocRootPath(m_storageRoot, m_dataContainerDescriptor.RequireDocumentType(docType)), 
+                            stats.TryGetDocumentCount(docType),
+                            storeVersion);
                     }
                     
                     m_documentDataContainers.Add(docType, docStore);
@@ -106,7 +113,8 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
 
             // read stats to verify that file exists
-            ReadStatsFromStore(m_storageRoot);
+            Version storeVersion;
+            ReadStatsFromStore(m_storageRoot, out storeVersion);
         }
 
         public void WriteStatsToStore()
@@ -184,11 +192,14 @@ namespace Pql.Engine.DataContainer.RamDriver
             return Path.Combine(storageRoot, GetFolderName(docTypeDesc));
         }
 
-        private static DataContainerStats ReadStatsFromStore(string storageRoot)
+        /// <param name="storageRoot">Folder with stats file</param>
+        /// <param name="storeVersion">Version of storage driver which wrote the stats, and files of the store along with them</param>
+        private static DataContainerStats ReadStatsFromStore(string storageRoot, out Version storeVersion)
         {
             var path = Path.Combine(storageRoot, "stats.json");
             if (!File.Exists(path))
             {
+                storeVersion = RamDriverFactory.CurrentStoreVersion();
                 return new DataContainerStats();
             }
 
@@ -216,6 +227,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                     throw new Exception("Stats file is empty");
                 }
 
+                storeVersion = storedVersion;
                 return file.DataContainerStats;
             }
         }
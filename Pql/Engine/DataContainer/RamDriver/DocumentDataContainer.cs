@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Data;
 using System.Diagnostics;
@@ -7,6 +8,7 @@ using System.Linq;
 using System.Runtime.CompilerServices;
 using System.Threading;
 using System.Threading.Tasks;
+using Pql.Engine.DataContainer.Engine;
 using Pql.Engine.Interfaces;
 using Pql.Engine.Interfaces.Internal;
 using Pql.Engine.Interfaces.Services;
@@ -24,11 +26,34 @@ namespace Pql.Engine.DataContainer.RamDriver
 
         public const int GrowthIncrement = 10000; 
 
+        /// <summary>
+        /// Number of document indexes an insert partition reserves at once.
+        /// Ranges are aligned to it, so that partitions never set bits in the same byte of <see cref="ValidDocumentsBitmap"/>
+        /// or of null bitmaps of columns, and fixed-size values of different partitions only meet at range boundaries.
+        /// </summary>
+        private const int InsertPartitionRange = 64;
+
+        /// <summary>
+        /// Value of an insert partition slot while one of the inserts reserves a new range for it.
+        /// </summary>
+        private const long RefillingInsertPartition = -1;
+
+        /// <summary>
+        /// Distance between states of insert partitions, in elements. Keeps every partition on its own cache line.
+        /// </summary>
+        private const int InsertPartitionStride = 8;
+
         public readonly DocumentTypeDescriptor DocDesc;
         public readonly DataContainerDescriptor DataContainerDescriptor;
+        public readonly RamDriverSettings Settings;
         public ConcurrentHashmapOfKeys DocumentIdToIndex;
         public readonly SortIndexManager SortIndexManager;
-        public readonly ReaderWriterLockSlim StructureLock;
+        public readonly ScalableReaderWriterLock StructureLock;
+
+        /// <summary>
+        /// Versions of documents, so that readers see every document as of their start while writers change it.
+        /// </summary>
+        public readonly RowVersionStore Versions;
         
         /// <summary>
         /// All keys of documents, unordered. 
@@ -57,14 +82,56 @@ namespace Pql.Engine.DataContainer.RamDriver
         /// Identifier of the field that is the primary key on this document.
         /// </summary>
         public readonly int PrimaryKeyFieldId;
+
+        /// <summary>
+        /// Indexes and types of all column stores, in order. Used to save entire documents before they are deleted.
+        /// </summary>
+        private readonly int[] m_allColumnIndexes;
+        private readonly DbType[] m_allColumnTypes;
+
+        /// <summary>
+        /// Column list for writes which only change validity of deleted documents, so no values have to be saved.
+        /// </summary>
+        private static readonly int[] NoColumnIndexes = new int[0];
+        private static readonly DbType[] NoColumnTypes = new DbType[0];
+
+        /// <summary>
+        /// Ranges of document indexes reserved by insert partitions, null when inserts are not partitioned.
+        /// Every partition takes a slot, which packs next free index into lower and end of range into upper 32 bits.
+        /// See <see cref="RamDriverSettings.InsertPartitionCount"/>.
+        /// </summary>
+        private readonly long[] m_insertPartitions;
         
         private string m_docRootPath;
         private bool m_disposed;
 
+        /// <summary>
+        /// True when files under <see cref="m_docRootPath"/> were written before <see cref="ColumnFile"/> format was introduced.
+        /// </summary>
+        private bool m_legacyStoreFormat;
+
+        /// <summary>
+        /// Blocks of document keys and of valid documents bitmap changed since their files were last written or loaded.
+        /// </summary>
+        private readonly CheckpointState m_structureCheckpoint = new CheckpointState();
+
+        /// <summary>
+        /// Serializes flushes with each other and with operations which trim or replace structures, 
+        /// since flush writes from snapshots after it releases <see cref="StructureLock"/>.
+        /// </summary>
+        private readonly object m_flushLock = new object();
+
+        /// <summary>
+        /// Row buffer reused by <see cref="PublishRowImage"/>.
+        /// </summary>
+        [ThreadStatic]
+        private static DriverRowData t_imageValues;
+
         public DocumentDataContainer(
             DataContainerDescriptor dataContainerDescriptor, 
             DocumentTypeDescriptor documentTypeDescriptor,
             IUnmanagedAllocator allocator,
+            RamDriverSettings settings,
             ITracer tracer)
         {
             m_logger = tracer ?? throw new ArgumentNullException("tracer");
@@ -72,8 +139,11 @@ namespace Pql.Engine.DataContainer.RamDriver
             m_allocator = allocator ?? throw new ArgumentNullException("allocator");
             DocDesc = documentTypeDescriptor ?? throw new ArgumentNullException("documentTypeDescriptor");
             DataContainerDescriptor = dataContainerDescriptor ?? throw new ArgumentNullException("dataContainerDescriptor");
+            Settings = settings ?? throw new ArgumentNullException("settings");
 
             ColumnStores = new ColumnDataBase[DocDesc.Fields.Length];
+            m_allColumnIndexes = new int[ColumnStores.Length];
+            m_allColumnTypes = new DbType[ColumnStores.Length];
             DocumentKeys = new ExpandableArrayOfKeys(m_allocator);
             FieldIdToColumnStore = new Dictionary<int, int>(ColumnStores.Length * 2);
             PrimaryKeyFieldId = dataContainerDescriptor.RequireField(documentTypeDescriptor.DocumentType, documentTypeDescriptor.PrimaryKeyFieldName).FieldId;
@@ -81,24 +151,45 @@ namespace Pql.Engine.DataContainer.RamDriver
             for (var i = 0; i < DocDesc.Fields.Length; i++)
             {
                 var field = dataContainerDescriptor.RequireField(DocDesc.Fields[i]);
-                ColumnStores[i] = CreateColumnStore(field.DbType, m_allocator, null);
+                ColumnStores[i] = CreateColumnStore(field, m_allocator, null);
                 FieldIdToColumnStore.Add(field.FieldId, i);
+                m_allColumnIndexes[i] = i;
+                m_allColumnTypes[i] = field.DbType;
             }
 
             DocumentIdToIndex = new ConcurrentHashmapOfKeys(m_allocator);
             ValidDocumentsBitmap = new BitVector(m_allocator);
             SortIndexManager = new SortIndexManager(this);
-            StructureLock = new ReaderWriterLockSlim(LockRecursionPolicy.SupportsRecursion);
+            StructureLock = new ScalableReaderWriterLock();
+            Versions = new RowVersionStore(m_allocator);
+
+            if (settings.InsertPartitionCount > 1)
+            {
+                m_insertPartitions = new long[settings.InsertPartitionCount * InsertPartitionStride];
+            }
         }
 
-        private static ColumnDataBase CreateColumnStore(DbType dbType, IUnmanagedAllocator allocator, ColumnDataBase migrated)
+        private ColumnDataBase CreateColumnStore(FieldMetadata field, IUnmanagedAllocator allocator, ColumnDataBase migrated)
         {
-            var dataType = DriverRowData.DeriveSystemType(dbType);
+            var dataType = DriverRowData.DeriveSystemType(field.DbType);
             var columnStoreType = typeof(ColumnData<>).MakeGenericType(dataType);
+            var mappedFilePath = field.MemoryMapped ? GenerateMappedFilePath(field) : null;
 
             return migrated == null
-                       ? (ColumnDataBase) Activator.CreateInstance(columnStoreType, dbType, allocator)
-                       : (ColumnDataBase) Activator.CreateInstance(columnStoreType, migrated, allocator);
+                       ? (ColumnDataBase) Activator.CreateInstance(columnStoreType, field.DbType, allocator, mappedFilePath)
+                       : (ColumnDataBase) Activator.CreateInstance(columnStoreType, migrated, allocator, mappedFilePath);
+        }
+
+        /// <summary>
+        /// Every column store gets its own scratch file, which is deleted when the store is disposed.
+        /// </summary>
+        private string GenerateMappedFilePath(FieldMetadata field)
+        {
+            var root = Settings.MappedColumnsRoot
+                       ?? Path.Combine(string.IsNullOrEmpty(Settings.StorageRoot) ? Path.GetTempPath() : Settings.StorageRoot, "mapped");
+
+            Directory.CreateDirectory(root);
+            return Path.Combine(root, string.Format("{0}-{1}-{2:N}.col", DocDesc.DocumentType, field.FieldId, Guid.NewGuid()));
         }
 
         public IDriverDataEnumerator GetUnorderedEnumerator(
@@ -114,7 +205,24 @@ namespace Pql.Engine.DataContainer.RamDriver
         }
 
         public IDriverDataEnumerator GetOrderedEnumerator(
-            IReadOnlyList<FieldMetadata> fields, int countOfMainFields, DriverRowData driverRow, int orderFieldId, bool descending)
+            IReadOnlyList<FieldMetadata> fields, int countOfMainFields, DriverRowData driverRow, IReadOnlyList<Tuple<int, bool>> orderFields)
+        {
+            if (m_untrimmedDocumentCount == 0)
+            {
+                return null;
+            }
+
+            // index may be built in background and cover more documents than we saw before requesting it,
+            // so untrimmed count must be taken after the index
+            var index = SortIndexManager.GetIndex(orderFields, out var descending);
+            var untrimmedCount = m_untrimmedDocumentCount;
+            return new DocumentDataContainerEnumerator_IndexScan(untrimmedCount, driverRow, this, fields, countOfMainFields, index, descending);
+        }
+
+        public IDriverDataEnumerator GetTopKEnumerator(
+            IReadOnlyList<FieldMetadata> fields, int countOfMainFields, DriverRowData driverRow, IReadOnlyList<Tuple<int, bool>> orderFields, 
+            int limit, Func<ClauseEvaluationContext, bool> whereClause, ClauseEvaluationContext evaluationContext, 
+            QueryScheduler scheduler, string tenantId, CancellationToken cancellationToken)
         {
             var untrimmedCount = m_untrimmedDocumentCount;
             if (untrimmedCount == 0)
@@ -122,8 +230,25 @@ namespace Pql.Engine.DataContainer.RamDriver
                 return null;
             }
 
-            var index = SortIndexManager.GetIndex(orderFieldId, m_untrimmedDocumentCount);
-            return new DocumentDataContainerEnumerator_IndexScan(untrimmedCount, driverRow, this, fields, countOfMainFields, index, descending);
+            return new DocumentDataContainerEnumerator_TopK(
+                untrimmedCount, driverRow, this, fields, countOfMainFields, orderFields, limit, whereClause, evaluationContext, 
+                scheduler, tenantId, cancellationToken);
+        }
+
+        public IDriverDataEnumerator GetParallelScanEnumerator(
+            IReadOnlyList<FieldMetadata> fields, int countOfMainFields, DriverRowData driverRow, 
+            Func<ClauseEvaluationContext, bool> whereClause, ClauseEvaluationContext evaluationContext, bool ordered, 
+            QueryScheduler scheduler, string tenantId, CancellationToken cancellationToken)
+        {
+            var untrimmedCount = m_untrimmedDocumentCount;
+            if (untrimmedCount == 0)
+            {
+                return null;
+            }
+
+            return new DocumentDataContainerEnumerator_ParallelScan(
+                untrimmedCount, driverRow, this, fields, countOfMainFields, whereClause, evaluationContext, ordered, 
+                scheduler, tenantId, cancellationToken);
         }
 
         public IDriverDataEnumerator GetBulkUpdateEnumerator(List<FieldMetadata> fields, DriverRowData driverRow, IDriverDataEnumerator inputDataEnumerator)
@@ -139,51 +264,208 @@ namespace Pql.Engine.DataContainer.RamDriver
 
         /// <summary>
         /// Will try to add a new document key and expand all column containers to make sure they can fit a new value.
-        /// Returns false for duplicate keys or insufficient resources.
+        /// Document is added with all fields NULL, use <see cref="BeginAddDocument"/> to assign its values in the same row version.
         /// </summary>
         public void TryAddDocument(byte[] key, out int index)
+        {
+            var version = BeginAddDocument(key, NoColumnIndexes, NoColumnTypes, out index);
+            Versions.EndRowWrite(index, version);
+        }
+
+        /// <summary>
+        /// Adds a new document key, or brings back a deleted document with the same key, and starts a versioned write of the document.
+        /// Document becomes valid within this write, so caller assigns its values and completes with <see cref="RowVersionStore.EndRowWrite"/>;
+        /// readers see either no document or the document with all of its values.
+        /// If another thread has just added the same key, the write goes to its document, and given columns are saved for older snapshots.
+        /// </summary>
+        public long BeginAddDocument(byte[] key, int[] columnIndexes, DbType[] columnTypes, out int index)
         {
             index = 0;
             if (DocumentIdToIndex.TryGetValueInt32(key, ref index))
             {
-                OnUpdateValueDocumentsKeyIndex(index);
-                return;
+                return BeginReviveDocument(index);
             }
             
             // make a copy of the key (so that we don't introduce dependency on caller's local variables) 
             // and reserve a new index value
-            var newCount = Interlocked.Increment(ref m_untrimmedDocumentCount);
-            if (newCount == int.MinValue)
+            index = m_insertPartitions == null ? ReserveDocumentIndexes(1) : TakePartitionDocumentIndex(key);
+            m_structureCheckpoint.MarkDirty(index);
+
+            // now set values at the reserved index
+            if (!DocumentKeys.TrySetAt(index, key))
+            {
+                throw new Exception("Failed to store new key value at " + index);
+            }
+
+            // write starts before the key is published, so nobody else can change the document in between
+            // readers which started before still have the new index in range, and must not see the document
+            var version = BeginRowWrite(index, NoColumnIndexes, NoColumnTypes);
+            try
+            {
+                if (DocumentIdToIndex.TryAdd(DocumentKeys.GetIntPtrAt(index), index))
+                {
+                    // mark document as valid, caller assigns its fields before the write completes
+                    ValidDocumentsBitmap.SafeSet(index);
+                    return version;
+                }
+
+                // seems like somebody slipped in and inserted the same value
+                // mark our own generated index value as invalid
+                ValidDocumentsBitmap.SafeClear(index);
+            }
+            catch
+            {
+                Versions.EndRowWrite(index, version);
+                throw;
+            }
+
+            Versions.EndRowWrite(index, version);
+
+            // now get "their" index and proceed to updating same record
+            // some user data race is possible here, but container state won't be broken
+            index = DocumentIdToIndex.GetInt32At(key);
+            return BeginRowWrite(index, columnIndexes, columnTypes);
+        }
+
+        /// <summary>
+        /// Appends a range of document indexes to the registry and returns the first one.
+        /// Documents in the range are not valid until they are assigned keys.
+        /// </summary>
+        private int ReserveDocumentIndexes(int count)
+        {
+            var newCount = Interlocked.Add(ref m_untrimmedDocumentCount, count);
+            if (newCount < count)
             {
                 // if we overflowed over max integer value, put max value back and throw
                 Interlocked.CompareExchange(ref m_untrimmedDocumentCount, int.MaxValue, newCount);
                 throw new Exception("Cannot expand storage any more");
             }
 
-            index = newCount - 1;
-
             ExpandStorage(newCount);
+            return newCount - count;
+        }
 
-            // now set values at the reserved index
-            if (!DocumentKeys.TrySetAt(index, key))
+        /// <summary>
+        /// Takes next document index from the insert partition of a key.
+        /// Inserts of different partitions do not contend on the registry count, 
+        /// and write into different words of bitmaps and different cache lines of columns.
+        /// </summary>
+        private int TakePartitionDocumentIndex(byte[] key)
+        {
+            var slot = (int)(GetKeyHash(key) % (uint)(m_insertPartitions.Length / InsertPartitionStride)) * InsertPartitionStride;
+            var spinner = new SpinWait();
+            while (true)
             {
-                throw new Exception("Failed to store new key value at " + index);
+                var range = Volatile.Read(ref m_insertPartitions[slot]);
+                if (range == RefillingInsertPartition)
+                {
+                    spinner.SpinOnce();
+                    continue;
+                }
+
+                var next = (int)range;
+                var end = (int)(range >> 32);
+                if (next < end)
+                {
+                    if (Interlocked.CompareExchange(ref m_insertPartitions[slot], ((long)end << 32) | (uint)(next + 1), range) == range)
+                    {
+                        return next;
+                    }
+
+                    continue;
+                }
+
+                // only one insert reserves a new range for the partition, others wait for it instead of reserving their own
+                if (Interlocked.CompareExchange(ref m_insertPartitions[slot], RefillingInsertPartition, range) != range)
+                {
+                    continue;
+                }
+
+                long newRange;
+                try
+                {
+                    newRange = ReserveInsertPartitionRange();
+                }
+                catch
+                {
+                    Volatile.Write(ref m_insertPartitions[slot], range);
+                    throw;
+                }
+
+                // first index of the new range is ours
+                Volatile.Write(ref m_insertPartitions[slot], newRange + 1);
+                return (int)newRange;
+            }
+        }
+
+        /// <summary>
+        /// Appends document indexes up to the next multiple of <see cref="InsertPartitionRange"/> to the registry,
+        /// and returns them packed as a slot of an insert partition.
+        /// Only insert partitions append to the registry when inserts are partitioned, so all ranges but the first one are full and aligned.
+        /// </summary>
+        private long ReserveInsertPartitionRange()
+        {
+            while (true)
+            {
+                var count = Volatile.Read(ref m_untrimmedDocumentCount);
+                var end = (count | (InsertPartitionRange - 1)) + 1;
+                if (end <= count)
+                {
+                    throw new Exception("Cannot expand storage any more");
+                }
+
+                if (Interlocked.CompareExchange(ref m_untrimmedDocumentCount, end, count) == count)
+                {
+                    ExpandStorage(end);
+                    return ((long)end << 32) | (uint)count;
+                }
             }
+        }
 
-            if (DocumentIdToIndex.TryAdd(DocumentKeys.GetIntPtrAt(index), index))
+        /// <summary>
+        /// FNV-1a hash of a key, whose first byte is its length.
+        /// </summary>
+        internal static uint GetKeyHash(byte[] key)
+        {
+            var hash = 2166136261;
+            for (var i = 1; i <= key[0]; i++)
             {
-                // mark document as valid, but don't touch any of its fields
-                ValidDocumentsBitmap.SafeSet(index);
+                hash = (hash ^ key[i]) * 16777619;
             }
-            else
+
+            return hash;
+        }
+
+        /// <summary>
+        /// Forgets ranges reserved by insert partitions, when the registry is loaded anew. 
+        /// Must be called while holding StructureLock in write mode.
+        /// </summary>
+        private void ResetInsertPartitions()
+        {
+            if (m_insertPartitions != null)
             {
-                // seems like somebody slipped in and inserted the same value
-                // mark our own generated index value as invalid
-                ValidDocumentsBitmap.SafeClear(index);
+                Array.Clear(m_insertPartitions, 0, m_insertPartitions.Length);
+            }
+        }
+
+        /// <summary>
+        /// Cuts ranges reserved by insert partitions at given registry count, 
+        /// unused indexes below it are kept for next inserts of their partitions.
+        /// Must be called while holding StructureLock in write mode, when registry is trimmed.
+        /// </summary>
+        private void TrimInsertPartitions(int count)
+        {
+            if (m_insertPartitions == null)
+            {
+                return;
+            }
 
-                // now get "their" index and proceed to updating same record
-                // some user data race is possible here, but container state won't be broken
-                index = DocumentIdToIndex.GetInt32At(key);
+            for (var slot = 0; slot < m_insertPartitions.Length; slot += InsertPartitionStride)
+            {
+                var range = m_insertPartitions[slot];
+                var next = (int)range;
+                var end = Math.Min((int)(range >> 32), count);
+                m_insertPartitions[slot] = next < end ? ((long)end << 32) | (uint)next : 0;
             }
         }
 
@@ -201,7 +483,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             var currentCapacity = m_capacity;
             if (currentCapacity < newCount)
             {
-                if (!StructureLock.IsReadLockHeld && !StructureLock.IsWriteLockHeld && !StructureLock.IsUpgradeableReadLockHeld)
+                if (!StructureLock.IsReadLockHeld && !StructureLock.IsWriteLockHeld)
                 {
                     throw new InvalidOperationException("StructureLock must be held in any mode in order to start expansion");
                 }
@@ -252,19 +534,99 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
         }
 
-        private void OnUpdateValueDocumentsKeyIndex(int index)
+        private long BeginReviveDocument(int index)
+        {
+            // document was deleted, so its values are not visible to any snapshot and need not be saved
+            var version = BeginRowWrite(index, NoColumnIndexes, NoColumnTypes);
+            try
+            {
+                // does it point to a non-deleted entry?
+                if (ValidDocumentsBitmap.SafeGetAndSet(index))
+                {
+                    throw new Exception("Duplicate primary key for location " + index);
+                }
+
+                m_structureCheckpoint.MarkDirty(index);
+
+                // make sure all fields are NULL,
+                foreach (var store in ColumnStores)
+                {
+                    store.Checkpoint.MarkDirty(index);
+                    store.NotNulls.SafeClear(index);
+                }
+            }
+            catch
+            {
+                Versions.EndRowWrite(index, version);
+                throw;
+            }
+
+            return version;
+        }
+
+        /// <summary>
+        /// Starts a versioned write of a document, see <see cref="RowVersionStore"/>.
+        /// If some active snapshot predates the write, current values of given columns are saved first.
+        /// Must be completed with <see cref="RowVersionStore.EndRowWrite"/>.
+        /// </summary>
+        public long BeginRowWrite(int docIndex, int[] columnIndexes, DbType[] columnTypes)
+        {
+            var version = Versions.BeginRowWrite(docIndex, out var keepImage);
+            try
+            {
+                if (keepImage)
+                {
+                    PublishRowImage(docIndex, version, columnIndexes, columnTypes);
+                }
+                else
+                {
+                    Versions.PublishRowWrite(docIndex, version);
+                }
+            }
+            catch
+            {
+                // nothing is changed yet, readers must not wait for this write
+                Versions.EndRowWrite(docIndex, version);
+                throw;
+            }
+
+            return version;
+        }
+
+        /// <summary>
+        /// Saves current values of given columns into a row image.
+        /// Values pass through a row buffer reused by this thread for the same column types.
+        /// </summary>
+        private void PublishRowImage(int docIndex, long version, int[] columnIndexes, DbType[] columnTypes)
         {
-            // does it point to a non-deleted entry?
-            if (ValidDocumentsBitmap.SafeGetAndSet(index))
+            var wasValid = ValidDocumentsBitmap.SafeGet(docIndex);
+            if (!wasValid || columnIndexes.Length == 0)
+            {
+                Versions.PublishRowWrite(docIndex, version, wasValid, columnIndexes, null);
+                return;
+            }
+
+            var values = t_imageValues;
+            if (values == null || !ReferenceEquals(values.FieldTypes, columnTypes))
             {
-                throw new Exception("Duplicate primary key for location " + index);
+                t_imageValues = values = new DriverRowData(columnTypes);
             }
 
-            // make sure all fields are NULL,
-            foreach (var store in ColumnStores)
+            for (var ordinal = 0; ordinal < columnIndexes.Length; ordinal++)
             {
-                store.NotNulls.SafeClear(index);
+                var colStore = ColumnStores[columnIndexes[ordinal]];
+                if (colStore.NotNulls.SafeGet(docIndex))
+                {
+                    ClientDriver.Protocol.BitVector.Set(values.NotNulls, ordinal);
+                    colStore.AssignToDriverRow(docIndex, values, values.FieldArrayIndexes[ordinal]);
+                }
+                else
+                {
+                    ClientDriver.Protocol.BitVector.Clear(values.NotNulls, ordinal);
+                }
             }
+
+            Versions.PublishRowWrite(docIndex, version, true, columnIndexes, values);
         }
 
         /// <summary>
@@ -292,16 +654,28 @@ namespace Pql.Engine.DataContainer.RamDriver
             int index = 0;
             if (DocumentIdToIndex.TryGetValueInt32(internalEntityId, ref index))
             {
-                // mark document as deleted, if it is not yet marked as such
-                if (ValidDocumentsBitmap.SafeGetAndClear(index))
+                // older snapshots still see the document with all of its values
+                var version = BeginRowWrite(index, m_allColumnIndexes, m_allColumnTypes);
+                try
                 {
-                    // mark all values as null so that they don't get read or written to disk
-                    foreach (var colStore in ColumnStores)
+                    // mark document as deleted, if it is not yet marked as such
+                    if (ValidDocumentsBitmap.SafeGetAndClear(index))
                     {
-                        colStore.NotNulls.SafeClear(index);
-                    }
+                        m_structureCheckpoint.MarkDirty(index);
 
-                    return true;
+                        // mark all values as null so that they don't get read or written to disk
+                        foreach (var colStore in ColumnStores)
+                        {
+                            colStore.Checkpoint.MarkDirty(index);
+                            colStore.NotNulls.SafeClear(index);
+                        }
+
+                        return true;
+                    }
+                }
+                finally
+                {
+                    Versions.EndRowWrite(index, version);
                 }
             }
 
@@ -317,110 +691,297 @@ namespace Pql.Engine.DataContainer.RamDriver
                 throw new ArgumentException("Storage root is invalid: " + docRootPath);
             }
 
-            StructureLock.EnterWriteLock();
-            try
+            lock (m_flushLock)
             {
-                var tasks = new Task[2 + FieldIdToColumnStore.Count * 2];
-                var count = 0;
-
-                tasks[count] = new Task(
-                    () =>
+                var snapshots = new List<IDisposable>(1 + FieldIdToColumnStore.Count);
+                try
+                {
+                    // checkpoint state only describes files under the root this container was loaded from
+                    var sameRoot = string.Equals(docRootPath, m_docRootPath, StringComparison.OrdinalIgnoreCase);
+                    var groups = new List<CheckpointGroup>(1 + FieldIdToColumnStore.Count);
+                    int rowCount;
+
+                    // writers are only held up while snapshots are taken, files are written from snapshots afterwards
+                    StructureLock.EnterWriteLock();
+                    try
+                    {
+                        rowCount = m_untrimmedDocumentCount;
+
+                        var validDocuments = ValidDocumentsBitmap.Snapshot();
+                        snapshots.Add(validDocuments);
+
+                        // keys are assigned once and never change below snapshot row count, so they are written from live array
+                        var keys = DocumentKeys;
+                        groups.Add(new CheckpointGroup(
+                            m_structureCheckpoint,
+                            new CheckpointFile(
+                                Path.Combine(docRootPath, "_keysvalid.dat"), ColumnFileKind.Bitmap, -1,
+                                (writer, first, n) => validDocuments.Write(writer, (ulong)first, (ulong)n), null),
+                            new CheckpointFile(
+                                Path.Combine(docRootPath, "_keys.dat"), ColumnFileKind.Keys, -1,
+                                (writer, first, n) => keys.Write(writer, (ulong)first, (ulong)n, validDocuments), null)));
+
+                        foreach (var pair in FieldIdToColumnStore)
                         {
-                            using (var writer = new BinaryWriter(
-                                new FileStream(
-                                    Path.Combine(docRootPath, "_keysvalid.dat"),
-                                    FileMode.Create, FileAccess.ReadWrite, FileShare.None, 1 << 22, FileOptions.None)))
-                            {
-                                //WriteBitVectorToStore(writer, ValidDocumentsBitmap, m_untrimmedDocumentCount);
-                                ValidDocumentsBitmap.Write(writer, (ulong)m_untrimmedDocumentCount);
-                            }
-                        }, TaskCreationOptions.LongRunning);
+                            var field = DataContainerDescriptor.RequireField(pair.Key);
+                            var colStore = ColumnStores[pair.Value];
+
+                            var snapshot = colStore.Snapshot();
+                            snapshots.Add(snapshot);
+
+                            groups.Add(new CheckpointGroup(
+                                colStore.Checkpoint,
+                                new CheckpointFile(
+                                    Path.Combine(docRootPath, GetColumnNotNullsFileName(field)), ColumnFileKind.Bitmap, (int)field.DbType,
+                                    snapshot.WriteNotNulls, null),
+                                new CheckpointFile(
+                                    Path.Combine(docRootPath, GetColumnDataFileName(field)), ColumnFileKind.Values, (int)field.DbType,
+                                    snapshot.WriteData, snapshot.ComputeZoneMap)));
+                        }
 
-                count++;
-                tasks[count] = tasks[count-1].ContinueWith(
-                    prev =>
+                        // only taken when all snapshots succeeded, and only when they can be persisted
+                        if (sameRoot)
                         {
-                            using (var writer = new BinaryWriter(
-                                new FileStream(
-                                    Path.Combine(docRootPath, "_keys.dat"),
-                                    FileMode.Create, FileAccess.ReadWrite, FileShare.None, 1 << 22, FileOptions.None)))
+                            foreach (var group in groups)
                             {
-                                DocumentKeys.Write(writer, (ulong)m_untrimmedDocumentCount, ValidDocumentsBitmap);
+                                group.DirtyBlocks = group.State.TakeDirtyBlocks();
                             }
-                        }, CancellationToken.None, TaskContinuationOptions.LongRunning, TaskScheduler.Default);
-
-                count++;
-                tasks[count - 2].Start();
-
-                foreach (var pair in FieldIdToColumnStore)
-                {
-                    var field = DataContainerDescriptor.RequireField(pair.Key);
-                    var colStore = ColumnStores[FieldIdToColumnStore[pair.Key]];
-
-                    var colDataPath = Path.Combine(docRootPath, GetColumnDataFileName(field));
-                    var colNotNullsPath = Path.Combine(docRootPath, GetColumnNotNullsFileName(field));
-
-                    tasks[count] = new Task(
-                        () =>
-                            {
-                                using (
-                                    var writer = new BinaryWriter(new FileStream(
-                                        colNotNullsPath, FileMode.Create, FileAccess.ReadWrite, FileShare.None, 1 << 22, FileOptions.None))
-                                    )
-                                {
-                                    colStore.NotNulls.Write(writer, (ulong)m_untrimmedDocumentCount);
-                                    writer.Flush();
-                                }
-                            }, TaskCreationOptions.LongRunning);
+                        }
+                    }
+                    finally
+                    {
+                        StructureLock.ExitWriteLock();
+                    }
 
-                    count++;
-                    tasks[count] = tasks[count - 1].ContinueWith(
-                        prev =>
-                            {
+                    var tasks = groups.Select(
+                        group => Task.Factory.StartNew(
+                            () => Checkpoint(group, sameRoot, rowCount),
+                            CancellationToken.None, TaskCreationOptions.None, BoundedTaskScheduler.Storage));
 
-                                using (
-                                    var writer = new BinaryWriter(new FileStream(
-                                        colDataPath, FileMode.Create, FileAccess.ReadWrite, FileShare.None, 1 << 22, FileOptions.None))
-                                    )
-                                {
-                                    colStore.WriteData(writer, m_untrimmedDocumentCount);
-                                    writer.Flush();
-                                }
-                            }, CancellationToken.None, TaskContinuationOptions.LongRunning, TaskScheduler.Default);
+                    Task.WaitAll(tasks.ToArray());
 
-                    count++;
-                    tasks[count - 2].Start();
+                    if (sameRoot)
+                    {
+                        m_legacyStoreFormat = false;
+                    }
+                }
+                finally
+                {
+                    foreach (var snapshot in snapshots)
+                    {
+                        snapshot.Dispose();
+                    }
                 }
-
-                Task.WaitAll(tasks);
-            }
-            finally
-            {
-                StructureLock.ExitWriteLock();
             }
         }
 
-        private string GetColumnDataFileName(FieldMetadata field)
-        {
-            return string.Format("{0}-{1}-{2}.fdata", field.Name, field.FieldId, field.DbType);
-        }
-
-        private string GetColumnNotNullsFileName(FieldMetadata field)
-        {
-            return string.Format("{0}-{1}-{2}.fnn", field.Name, field.FieldId, field.DbType);
-        }
-
-        public void ReadDataFromStore(string docRootPath, int count)
+        /// <summary>
+        /// Takes frozen images of valid documents bitmap and of columns of given fields, and passes them to a reader with row count.
+        /// Same as with flush, all images are taken at the same moment, and writers are only held up while they are taken.
+        /// Flushes, trims and migrations wait until reader completes.
+        /// </summary>
+        public T ReadFromSnapshots<T>(IReadOnlyList<int> fieldIds, Func<int, BitVectorSnapshot, ColumnDataSnapshot[], T> reader)
         {
             CheckState();
 
-            if (count > 0 && (docRootPath == null || !Directory.Exists(docRootPath)))
+            if (fieldIds == null)
             {
-                throw new ArgumentException("Count is non-zero, but storage root is invalid: " + docRootPath);
+                throw new ArgumentNullException("fieldIds");
             }
 
-            m_docRootPath = docRootPath;
-
+            if (reader == null)
+            {
+                throw new ArgumentNullException("reader");
+            }
+
+            // column stores may be not loaded yet, make sure they are loaded before taking locks
+            foreach (var fieldId in fieldIds)
+            {
+                RequireColumnStore(fieldId);
+            }
+
+            lock (m_flushLock)
+            {
+                // a column can only have one snapshot at a time, so fields listed more than once share it
+                var snapshots = new Dictionary<int, ColumnDataSnapshot>(fieldIds.Count);
+                BitVectorSnapshot validDocuments = null;
+                try
+                {
+                    var columns = new ColumnDataSnapshot[fieldIds.Count];
+                    int rowCount;
+
+                    StructureLock.EnterWriteLock();
+                    try
+                    {
+                        rowCount = m_untrimmedDocumentCount;
+                        validDocuments = ValidDocumentsBitmap.Snapshot();
+
+                        for (var i = 0; i < columns.Length; i++)
+                        {
+                            var columnStoreIndex = FieldIdToColumnStore[fieldIds[i]];
+                            if (!snapshots.TryGetValue(columnStoreIndex, out columns[i]))
+                            {
+                                columns[i] = ColumnStores[columnStoreIndex].Snapshot();
+                                snapshots.Add(columnStoreIndex, columns[i]);
+                            }
+                        }
+                    }
+                    finally
+                    {
+                        StructureLock.ExitWriteLock();
+                    }
+
+                    return reader(rowCount, validDocuments, columns);
+                }
+                finally
+                {
+                    foreach (var snapshot in snapshots.Values)
+                    {
+                        snapshot.Dispose();
+                    }
+
+                    if (validDocuments != null)
+                    {
+                        validDocuments.Dispose();
+                    }
+                }
+            }
+        }
+
+        /// <summary>
+        /// Writes a group of files which share checkpoint state.
+        /// Only blocks changed since previous checkpoint are appended to delta files, so that cost of a checkpoint
+        /// depends on volume of changes rather than on size of data. Files are rewritten and their deltas dropped
+        /// when they have never been written in current format, when rows were trimmed, or when deltas grew too large.
+        /// Marks taken from checkpoint state are given back if files could not be written.
+        /// </summary>
+        private void Checkpoint(CheckpointGroup group, bool sameRoot, int rowCount)
+        {
+            try
+            {
+                Checkpoint(group.State, group.DirtyBlocks, sameRoot, rowCount, group.Files);
+            }
+            catch
+            {
+                if (group.DirtyBlocks != null)
+                {
+                    group.State.RestoreDirtyBlocks(group.DirtyBlocks);
+                }
+
+                throw;
+            }
+        }
+
+        private void Checkpoint(CheckpointState state, int[] dirtyBlocks, bool sameRoot, int rowCount, CheckpointFile[] files)
+        {
+            var generation = state.Generation + 1;
+
+            if (!sameRoot || state.RequiresRewrite(rowCount) || files.Any(RequiresMerge))
+            {
+                foreach (var file in files)
+                {
+                    ColumnFile.Write(file.Path, file.Kind, file.DbType, rowCount, generation, file.WriteRange, file.ComputeZoneMap);
+                }
+
+                // segments of delta files are superseded by rewritten files even if they cannot be deleted
+                foreach (var file in files)
+                {
+                    File.Delete(file.Path + ColumnFile.DeltaSuffix);
+                }
+            }
+            else
+            {
+                var blocks = state.GetDirtyBlocks(rowCount, dirtyBlocks);
+                if (blocks.Count == 0)
+                {
+                    return;
+                }
+
+                foreach (var file in files)
+                {
+                    ColumnFile.AppendDelta(
+                        file.Path + ColumnFile.DeltaSuffix, file.Kind, file.DbType, rowCount, generation, blocks, file.WriteRange, file.ComputeZoneMap);
+                }
+            }
+
+            if (sameRoot)
+            {
+                state.OnSnapshotPersisted(rowCount, generation);
+            }
+        }
+
+        private bool RequiresMerge(CheckpointFile file)
+        {
+            var baseFile = new FileInfo(file.Path);
+            if (!baseFile.Exists)
+            {
+                return true;
+            }
+
+            var deltaFile = new FileInfo(file.Path + ColumnFile.DeltaSuffix);
+            return Settings.DeltaMergeRatio <= 0 || (deltaFile.Exists && deltaFile.Length > baseFile.Length * Settings.DeltaMergeRatio);
+        }
+
+        /// <summary>
+        /// Files which share checkpoint state, with marks taken from that state at the moment of snapshot.
+        /// </summary>
+        private sealed class CheckpointGroup
+        {
+            public readonly CheckpointState State;
+            public readonly CheckpointFile[] Files;
+            public int[] DirtyBlocks;
+
+            public CheckpointGroup(CheckpointState state, params CheckpointFile[] files)
+            {
+                State = state;
+                Files = files;
+            }
+        }
+
+        private sealed class CheckpointFile
+        {
+            public readonly string Path;
+            public readonly ColumnFileKind Kind;
+            public readonly int DbType;
+            public readonly Action<BinaryWriter, int, int> WriteRange;
+            public readonly Func<int, int, ColumnZoneMap> ComputeZoneMap;
+
+            public CheckpointFile(
+                string path, ColumnFileKind kind, int dbType, Action<BinaryWriter, int, int> writeRange, Func<int, int, ColumnZoneMap> computeZoneMap)
+            {
+                Path = path;
+                Kind = kind;
+                DbType = dbType;
+                WriteRange = writeRange;
+                ComputeZoneMap = computeZoneMap;
+            }
+        }
+
+        private string GetColumnDataFileName(FieldMetadata field)
+        {
+            return string.Format("{0}-{1}-{2}.fdata", field.Name, field.FieldId, field.DbType);
+        }
+
+        private string GetColumnNotNullsFileName(FieldMetadata field)
+        {
+            return string.Format("{0}-{1}-{2}.fnn", field.Name, field.FieldId, field.DbType);
+        }
+
+        /// <param name="docRootPath">Folder with files of this document type</param>
+        /// <param name="count">Number of documents, including deleted ones</param>
+        /// <param name="storeVersion">Version of storage driver which wrote the files</param>
+        public void ReadDataFromStore(string docRootPath, int count, Version storeVersion)
+        {
+            CheckState();
+
+            if (count > 0 && (docRootPath == null || !Directory.Exists(docRootPath)))
+            {
+                throw new ArgumentException("Count is non-zero, but storage root is invalid: " + docRootPath);
+            }
+
+            m_docRootPath = docRootPath;
+            m_legacyStoreFormat = storeVersion == null || storeVersion < ColumnFile.FirstStoreVersion;
+
             if (count < 0)
             {
                 throw new ArgumentOutOfRangeException("count", count, "Count cannot be negative");
@@ -428,6 +989,7 @@ namespace Pql.Engine.DataContainer.RamDriver
 
             m_untrimmedDocumentCount = count;
             m_capacity = count;
+            ResetInsertPartitions();
 
             DocumentIdToIndex.Clear();
 
@@ -438,24 +1000,48 @@ namespace Pql.Engine.DataContainer.RamDriver
 
             var timer = Stopwatch.StartNew();
 
-            using (var reader = new BinaryReader(new FileStream(Path.Combine(docRootPath, "_keysvalid.dat"),
-                FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 22, FileOptions.SequentialScan)))
+            if (m_legacyStoreFormat)
             {
-                //ReadBitVectorFromStore(reader, ValidDocumentsBitmap, m_untrimmedDocumentCount);
-                ValidDocumentsBitmap.Read(reader, (ulong)m_untrimmedDocumentCount);
-            }
+                using (var reader = new BinaryReader(new FileStream(Path.Combine(docRootPath, "_keysvalid.dat"),
+                    FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 22, FileOptions.SequentialScan)))
+                {
+                    //ReadBitVectorFromStore(reader, ValidDocumentsBitmap, m_untrimmedDocumentCount);
+                    ValidDocumentsBitmap.Read(reader, (ulong)m_untrimmedDocumentCount);
+                }
 
-            using (var reader = new BinaryReader(new FileStream(Path.Combine(docRootPath, "_keys.dat"),
-                FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 22, FileOptions.SequentialScan)))
+                using (var reader = new BinaryReader(new FileStream(Path.Combine(docRootPath, "_keys.dat"),
+                    FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 22, FileOptions.SequentialScan)))
+                {
+                    DocumentKeys.Read(reader, (ulong)m_untrimmedDocumentCount, ValidDocumentsBitmap);
+                }
+            }
+            else
             {
-                DocumentKeys.Read(reader, (ulong)m_untrimmedDocumentCount, ValidDocumentsBitmap);
+                var generation = 0;
 
-                for (var i = 0; i < m_untrimmedDocumentCount; i++)
+                ValidDocumentsBitmap.EnsureCapacity((ulong)m_untrimmedDocumentCount);
+                using (var file = OpenColumnFileReader(Path.Combine(docRootPath, "_keysvalid.dat"), ColumnFileKind.Bitmap, -1))
                 {
-                    if (!DocumentIdToIndex.TryAdd(DocumentKeys.GetIntPtrAt(i), i))
-                    {
-                        throw new Exception("Failed to add the key at offset " + i + " to map");
-                    }
+                    ReadBlocks(file, (reader, first, n) => ValidDocumentsBitmap.Read(reader, (ulong)first, (ulong)n), true);
+                    generation = Math.Max(generation, file.Generation);
+                }
+
+                // keys are allocated from a shared pool, so they are read one block at a time
+                DocumentKeys.EnsureCapacity((ulong)m_untrimmedDocumentCount);
+                using (var file = OpenColumnFileReader(Path.Combine(docRootPath, "_keys.dat"), ColumnFileKind.Keys, -1))
+                {
+                    ReadBlocks(file, (reader, first, n) => DocumentKeys.Read(reader, (ulong)first, (ulong)n, ValidDocumentsBitmap), false);
+                    generation = Math.Max(generation, file.Generation);
+                }
+
+                m_structureCheckpoint.OnLoaded(m_untrimmedDocumentCount, generation);
+            }
+
+            for (var i = 0; i < m_untrimmedDocumentCount; i++)
+            {
+                if (!DocumentIdToIndex.TryAdd(DocumentKeys.GetIntPtrAt(i), i))
+                {
+                    throw new Exception("Failed to add the key at offset " + i + " to map");
                 }
             }
 
@@ -504,47 +1090,281 @@ namespace Pql.Engine.DataContainer.RamDriver
                     return;
                 }
 
-                var tasks = new Task[2];
-
                 var field = DataContainerDescriptor.RequireField(fieldId);
                 var colDataPath = Path.Combine(m_docRootPath, GetColumnDataFileName(field));
                 var colNotNullsPath = Path.Combine(m_docRootPath, GetColumnNotNullsFileName(field));
+                var rowCount = m_untrimmedDocumentCount;
 
-                var readNotNulls = new Task(
-                    () =>
-                        {
-                            using (var reader = new BinaryReader(
-                                new FileStream(
-                                    colNotNullsPath, FileMode.Open, FileAccess.Read, FileShare.Read, 8 * 1024 * 1024, FileOptions.SequentialScan)))
+                Task[] tasks;
+                Action<int> loadBlock = null;
+                if (m_legacyStoreFormat)
+                {
+                    var readNotNulls = new Task(
+                        () =>
                             {
-                                colStore.NotNulls.Read(reader, (ulong)m_untrimmedDocumentCount);
-                            }
-                        }, TaskCreationOptions.LongRunning);
+                                using (var reader = new BinaryReader(OpenColumnFile(colNotNullsPath)))
+                                {
+                                    colStore.NotNulls.Read(reader, (ulong)rowCount);
+                                }
+                            });
 
-                var readData = readNotNulls.ContinueWith(
-                    x =>
-                        {
-                            using (var reader = new BinaryReader(
-                                new FileStream(
-                                    colDataPath, FileMode.Open, FileAccess.Read, FileShare.Read, 8 * 1024 * 1024, FileOptions.SequentialScan)))
+                    var readData = readNotNulls.ContinueWith(
+                        x =>
                             {
-                                colStore.ReadData(reader, m_untrimmedDocumentCount);
-                            }
-                        }, CancellationToken.None, TaskContinuationOptions.OnlyOnRanToCompletion | TaskContinuationOptions.LongRunning, TaskScheduler.Default);
+                                using (var reader = new BinaryReader(OpenColumnFile(colDataPath)))
+                                {
+                                    colStore.ReadData(reader, 0, rowCount);
+                                }
+                            }, CancellationToken.None, TaskContinuationOptions.OnlyOnRanToCompletion, BoundedTaskScheduler.Storage);
+
+                    // headerless files have no blocks, so readers can only start when entire column is loaded
+                    var publish = readData.ContinueWith(
+                        x => colStore.EndRangeTracking(x.Status == TaskStatus.RanToCompletion),
+                        CancellationToken.None, TaskContinuationOptions.ExecuteSynchronously, TaskScheduler.Default);
 
-                tasks[0] = readNotNulls;
-                tasks[1] = readData;
+                    tasks = new[] {readNotNulls, readData, publish};
+                }
+                else
+                {
+                    // files are opened by whoever needs a block first: the loader, or a reader which loads a block on demand
+                    var files = new Lazy<LoadingColumnFiles>(() => OpenLoadingColumnFiles(colStore, field, colNotNullsPath, colDataPath, rowCount));
+                    loadBlock = i => LoadColumnBlock(colStore, files.Value, i);
+                    tasks = new[]
+                        {
+                            new Task(() => LoadColumnStore(colStore, files, rowCount))
+                        };
+                }
+
+                colStore.BeginRangeTracking(rowCount, loadBlock);
 
                 if (colStore.AttachLoaders(tasks))
                 {
-                    readNotNulls.Start();
+                    tasks[0].Start(BoundedTaskScheduler.Storage);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Loads not-null flags and values of a column block by block into storage which is sized up front.
+        /// Works as a prefetcher: blocks which readers have already loaded on demand are skipped.
+        /// Blocks of mapped files are decoded concurrently and handed out to workers in order of rows,
+        /// and every block is published to readers as soon as both its parts are loaded.
+        /// </summary>
+        private void LoadColumnStore(ColumnDataBase colStore, Lazy<LoadingColumnFiles> files, int rowCount)
+        {
+            var succeeded = false;
+            try
+            {
+                var blockCount = files.Value.Data.Blocks.Length;
+                if (files.Value.IsMapped && blockCount > 1)
+                {
+                    // decoding fans out to the shared thread pool, not to the few storage threads this loader runs on
+                    Parallel.ForEach(
+                        Partitioner.Create(0, blockCount, 1),
+                        new ParallelOptions {TaskScheduler = TaskScheduler.Default},
+                        range =>
+                            {
+                                for (var i = range.Item1; i < range.Item2; i++)
+                                {
+                                    colStore.EnsureBlockLoaded(i);
+                                }
+                            });
+                }
+                else
+                {
+                    for (var i = 0; i < blockCount; i++)
+                    {
+                        colStore.EnsureBlockLoaded(i);
+                    }
+                }
+
+                colStore.Checkpoint.OnLoaded(rowCount, Math.Max(files.Value.NotNulls.Generation, files.Value.Data.Generation));
+                succeeded = true;
+            }
+            finally
+            {
+                // also waits for readers which are still loading blocks from these files
+                colStore.EndRangeTracking(succeeded);
+
+                if (files.IsValueCreated)
+                {
+                    files.Value.Dispose();
+                }
+            }
+        }
+
+        private LoadingColumnFiles OpenLoadingColumnFiles(ColumnDataBase colStore, FieldMetadata field, string notNullsPath, string dataPath, int rowCount)
+        {
+            colStore.EnsureCapacity(rowCount);
+
+            var notNulls = OpenColumnFileReader(notNullsPath, ColumnFileKind.Bitmap, (int)field.DbType);
+            ColumnFileReader data;
+            try
+            {
+                data = OpenColumnFileReader(dataPath, ColumnFileKind.Values, (int)field.DbType);
+            }
+            catch
+            {
+                notNulls.Dispose();
+                throw;
+            }
+
+            var result = new LoadingColumnFiles(notNulls, data);
+            for (var i = 0; i < data.Blocks.Length; i++)
+            {
+                if (i >= notNulls.Blocks.Length
+                    || notNulls.Blocks[i].FirstRow != data.Blocks[i].FirstRow
+                    || notNulls.Blocks[i].RowCount != data.Blocks[i].RowCount)
+                {
+                    result.Dispose();
+                    throw new InvalidDataException(string.Format(
+                        "Blocks of column files {0} and {1} do not match", notNullsPath, dataPath));
+                }
+            }
+
+            return result;
+        }
+
+        private static void LoadColumnBlock(ColumnDataBase colStore, LoadingColumnFiles files, int index)
+        {
+            if (files.IsMapped)
+            {
+                ReadColumnBlock(colStore, files, index);
+            }
+            else
+            {
+                // buffered streams cannot be read concurrently
+                lock (files)
+                {
+                    ReadColumnBlock(colStore, files, index);
+                }
+            }
+
+            colStore.PublishLoadedRange(files.Data.Blocks[index].FirstRow, files.Data.Blocks[index].RowCount);
+        }
+
+        private static void ReadColumnBlock(ColumnDataBase colStore, LoadingColumnFiles files, int index)
+        {
+            ReadBlock(files.NotNulls, index, (reader, first, n) => colStore.NotNulls.Read(reader, (ulong)first, (ulong)n));
+            ReadBlock(files.Data, index, colStore.ReadData);
+        }
+
+        /// <summary>
+        /// Column files of a column which is being loaded. Shared by loader and readers which load blocks on demand.
+        /// </summary>
+        private sealed class LoadingColumnFiles : IDisposable
+        {
+            public readonly ColumnFileReader NotNulls;
+            public readonly ColumnFileReader Data;
+
+            public LoadingColumnFiles(ColumnFileReader notNulls, ColumnFileReader data)
+            {
+                NotNulls = notNulls;
+                Data = data;
+            }
+
+            public bool IsMapped
+            {
+                get { return NotNulls.IsMapped && Data.IsMapped; }
+            }
+
+            public void Dispose()
+            {
+                NotNulls.Dispose();
+                Data.Dispose();
+            }
+        }
+
+        /// <summary>
+        /// Opens column file as a read-only mapped view, so that column loaders can copy data straight from mapped pages.
+        /// Falls back to buffered sequential reads when file cannot be mapped, e.g. for lack of address space.
+        /// </summary>
+        private Stream OpenColumnFile(string path)
+        {
+            try
+            {
+                return MemoryViewStream.OpenMappedFile(path);
+            }
+            catch (IOException e)
+            {
+                if (!File.Exists(path))
+                {
+                    throw new FileNotFoundException("Column file not found", path, e);
+                }
+
+                if (m_logger.IsInfoEnabled)
+                {
+                    m_logger.InfoFormat("Failed to map column file {0}, falling back to buffered reads: {1}", path, e.Message);
+                }
+
+                return new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.Read, 8 * 1024 * 1024, FileOptions.SequentialScan);
+            }
+        }
+
+        /// <summary>
+        /// Opens column file together with its delta file, if there is one.
+        /// </summary>
+        private ColumnFileReader OpenColumnFileReader(string path, ColumnFileKind kind, int dbType)
+        {
+            var deltaPath = path + ColumnFile.DeltaSuffix;
+            var stream = OpenColumnFile(path);
+
+            Stream deltaStream;
+            try
+            {
+                deltaStream = File.Exists(deltaPath) ? OpenColumnFile(deltaPath) : null;
+            }
+            catch
+            {
+                stream.Dispose();
+                throw;
+            }
+
+            return new ColumnFileReader(path, stream, deltaStream, kind, dbType, m_untrimmedDocumentCount);
+        }
+
+        /// <summary>
+        /// Reads all blocks of a column file, every block is verified against its checksum before it is read.
+        /// Blocks of mapped files are read in parallel when allowed by caller, 
+        /// which requires capacity of target containers to be already ensured.
+        /// </summary>
+        private static void ReadBlocks(ColumnFileReader file, Action<BinaryReader, int, int> readRange, bool allowParallel)
+        {
+            if (allowParallel && file.IsMapped && file.Blocks.Length > 1)
+            {
+                Parallel.For(0, file.Blocks.Length, i => ReadBlock(file, i, readRange));
+            }
+            else
+            {
+                for (var i = 0; i < file.Blocks.Length; i++)
+                {
+                    ReadBlock(file, i, readRange);
+                }
+            }
+        }
+
+        private static void ReadBlock(ColumnFileReader file, int index, Action<BinaryReader, int, int> readRange)
+        {
+            var block = file.Blocks[index];
+            using (var reader = file.OpenBlock(index))
+            {
+                readRange(reader, block.FirstRow, block.RowCount);
+
+                if (reader.BaseStream.Position != reader.BaseStream.Length)
+                {
+                    throw new InvalidDataException(string.Format(
+                        "Block {0} of column file has {1} unread bytes", index, reader.BaseStream.Length - reader.BaseStream.Position));
                 }
             }
         }
 
         public void Dispose()
         {
-            Dispose(true);
+            // a flush in progress is still writing from snapshots of structures
+            lock (m_flushLock)
+            {
+                Dispose(true);
+            }
         }
 
         private void Dispose(bool disposing)
@@ -556,6 +1376,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                 if (disposing)
                 {
                     GC.SuppressFinalize(this);
+                    StructureLock.Dispose();
                 }
 
                 foreach (var col in ColumnStores)
@@ -563,6 +1384,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                     col.Dispose();
                 }
 
+                Versions.Dispose();
                 ValidDocumentsBitmap.Dispose();
                 DocumentIdToIndex.Dispose();
                 DocumentKeys.Dispose();
@@ -593,63 +1415,123 @@ namespace Pql.Engine.DataContainer.RamDriver
             var diti = DocumentIdToIndex;
             var colstores = ColumnStores.ToArray();
 
-            StructureLock.EnterWriteLock();
-            try
+            // flush may still be writing from snapshots of structures which are about to be trimmed and disposed
+            lock (m_flushLock)
             {
-                // generate a new copy of the data
-                var tasks = new List<Task>();
-
-                tasks.Add(new Task<BitVector>(() => new BitVector(ValidDocumentsBitmap, newpool)));
-                tasks.Add(new Task<ExpandableArrayOfKeys>(() => new ExpandableArrayOfKeys(DocumentKeys, newpool)));
-
-                foreach (var c in ColumnStores)
+                StructureLock.EnterWriteLock();
+                try
                 {
-                    tasks.Add(new Task<ColumnDataBase>(o => CreateColumnStore(((ColumnDataBase)o).DbType, newpool, (ColumnDataBase)o), c));
-                }
+                    // copies will only be as large as trimmed originals
+                    TrimTrailingDeletedDocuments();
 
-                foreach (var t in tasks)
-                {
-                    t.Start();
-                }
+                    // generate a new copy of the data
+                    var tasks = new List<Task>();
 
-                Task.WaitAll(tasks.ToArray());
+                    tasks.Add(new Task<BitVector>(() => new BitVector(ValidDocumentsBitmap, newpool)));
+                    tasks.Add(new Task<ExpandableArrayOfKeys>(() => new ExpandableArrayOfKeys(DocumentKeys, newpool)));
 
-                var newvdb = ((Task<BitVector>) tasks[0]).Result;
-                var newdk = ((Task<ExpandableArrayOfKeys>) tasks[1]).Result;
-                var newditi = new ConcurrentHashmapOfKeys(DocumentIdToIndex, newdk, newpool);
-                
-                // now, since no exception was thrown, let's consume results and dispose of old structures
-                try
-                {
-                    ValidDocumentsBitmap = newvdb;
-                    DocumentKeys = newdk;
-                    DocumentIdToIndex = newditi;
+                    for (var i = 0; i < ColumnStores.Length; i++)
+                    {
+                        var field = DataContainerDescriptor.RequireField(DocDesc.Fields[i]);
+                        var source = ColumnStores[i];
+                        tasks.Add(new Task<ColumnDataBase>(() => CreateColumnStore(field, newpool, source)));
+                    }
 
-                    for (var i = 2; i < tasks.Count; i++)
+                    foreach (var t in tasks)
                     {
-                        ColumnStores[i-2] = ((Task<ColumnDataBase>)tasks[i]).Result;
+                        t.Start();
                     }
+
+                    Task.WaitAll(tasks.ToArray());
+
+                    var newvdb = ((Task<BitVector>) tasks[0]).Result;
+                    var newdk = ((Task<ExpandableArrayOfKeys>) tasks[1]).Result;
+                    var newditi = new ConcurrentHashmapOfKeys(DocumentIdToIndex, newdk, newpool);
+                
+                    // now, since no exception was thrown, let's consume results and dispose of old structures
+                    try
+                    {
+                        ValidDocumentsBitmap = newvdb;
+                        DocumentKeys = newdk;
+                        DocumentIdToIndex = newditi;
+
+                        for (var i = 2; i < tasks.Count; i++)
+                        {
+                            ColumnStores[i-2] = ((Task<ColumnDataBase>)tasks[i]).Result;
+                        }
                     
-                    vdb.Dispose();
-                    dk.Dispose();
-                    diti.Dispose();
+                        vdb.Dispose();
+                        dk.Dispose();
+                        diti.Dispose();
 
-                    foreach (var c in colstores)
+                        foreach (var c in colstores)
+                        {
+                            c.Dispose();
+                        }
+                    }
+                    catch
                     {
-                        c.Dispose();
+                        m_stateBroken = true;
+                        throw;
                     }
+
+                    // no snapshots are active under write lock, so all row images can go
+                    Versions.MigrateRAM(newpool);
+                    m_allocator = newpool;
                 }
-                catch
+                finally
                 {
-                    m_stateBroken = true;
-                    throw;
+                    StructureLock.ExitWriteLock();
                 }
+            }
+        }
 
-                m_allocator = newpool;
+        /// <summary>
+        /// Drops deleted documents at the tail of the registry and releases storage beyond the last valid document.
+        /// Must be called while holding StructureLock in write mode.
+        /// Keys of dropped documents stay in <see cref="DocumentIdToIndex"/>, so caller has to rebuild it from trimmed keys.
+        /// </summary>
+        private void TrimTrailingDeletedDocuments()
+        {
+            var untrimmedCount = m_untrimmedDocumentCount;
+            var count = untrimmedCount;
+            while (count > 0 && !ValidDocumentsBitmap.SafeGet(count - 1))
+            {
+                count--;
             }
-            finally
+
+            if (count == m_capacity)
+            {
+                return;
+            }
+
+            // column stores which are not loaded yet will read untrimmed count of values from disk
+            foreach (var colStore in ColumnStores)
+            {
+                if (colStore.IsLoadingInProgress || (untrimmedCount > 0 && colStore.NotNulls.Capacity == 0))
+                {
+                    return;
+                }
+            }
+
+            m_untrimmedDocumentCount = count;
+            m_capacity = count;
+            TrimInsertPartitions(count);
+
+            // existing orderings may point past the new end of the table
+            SortIndexManager.DropAllIndexes();
+
+            ValidDocumentsBitmap.TrimTo((ulong)count);
+            DocumentKeys.TrimTo((ulong)count);
+            foreach (var colStore in ColumnStores)
+            {
+                colStore.TrimTo(count);
+            }
+
+            if (m_logger.IsInfoEnabled)
             {
-                StructureLock.ExitWriteLock();
+                m_logger.InfoFormat("Trimmed document {0}/{1} from {2} to {3} rows.", 
+                    DocDesc.DocumentType, DocDesc.Name, untrimmedCount, count);
             }
         }
 
@@ -17,8 +17,18 @@ namespace Pql.Engine.DataContainer.RamDriver
         protected readonly IReadOnlyList<FieldMetadata> Fields;
         protected readonly int CountOfMainFields;
 
-        public void Dispose()
+        /// <summary>
+        /// Version of documents this enumerator sees, taken together with the read lock.
+        /// </summary>
+        private RowVersionSnapshot m_snapshot;
+
+        public virtual void Dispose()
         {
+            if (m_snapshot != null)
+            {
+                m_snapshot.Dispose();
+            }
+
             DataContainer.StructureLock.ExitReadLock();
         }
 
@@ -29,39 +39,90 @@ namespace Pql.Engine.DataContainer.RamDriver
             // get internal entity id
             DataContainer.DocumentKeys.GetAt(Position, RowData.InternalEntityId);
 
-            // get other columns
-            for (var ordinal = CountOfMainFields; ordinal < RowDataOrdinalToColumnStoreIndex.Length; ordinal++)
+            // get other columns, as of the same snapshot as main fields
+            ReadFields(Position, RowData, CountOfMainFields, RowDataOrdinalToColumnStoreIndex.Length);
+        }
+
+        /// <summary>
+        /// True if a document exists in this enumerator's snapshot, regardless of deletes and inserts made after it was taken.
+        /// </summary>
+        protected bool IsVisible(int position)
+        {
+            while (true)
             {
-                var columnStore = DataContainer.ColumnStores[RowDataOrdinalToColumnStoreIndex[ordinal]];
-                if (columnStore.NotNulls.SafeGet(Position))
+                var stamp = m_snapshot.BeginRowRead(position);
+                var isValid = DataContainer.ValidDocumentsBitmap.SafeGet(position);
+                if (m_snapshot.EndRowRead(position, stamp))
                 {
-                    BitVector.Set(RowData.NotNulls, ordinal);
-                    var indexInArray = RowData.FieldArrayIndexes[ordinal];
-                    columnStore.AssignToDriverRow(Position, RowData, indexInArray);
-                }
-                else
-                {
-                    BitVector.Clear(RowData.NotNulls, ordinal);
+                    return m_snapshot.WasValid(position, stamp, isValid);
                 }
             }
         }
 
+        /// <summary>
+        /// Waits until a document is loaded in all columns of this enumerator, loading missing blocks on demand.
+        /// Needed by enumerators which read documents in random order and did not wait for entire columns to be loaded.
+        /// </summary>
+        protected void WaitRowLoaded(int position)
+        {
+            for (var ordinal = 0; ordinal < RowDataOrdinalToColumnStoreIndex.Length; ordinal++)
+            {
+                DataContainer.ColumnStores[RowDataOrdinalToColumnStoreIndex[ordinal]].WaitRowLoaded(position);
+            }
+        }
+
         protected void ReadRow()
+        {
+            ReadMainFields(Position, RowData);
+        }
+
+        /// <summary>
+        /// Reads primary fields of a document into a row buffer that has same layout as <see cref="RowData"/>.
+        /// </summary>
+        protected void ReadMainFields(int position, DriverRowData rowData)
         {
             // by default, fetch subset of primary fields only
             // everything else is fetched by FetchAdditionalFields
-            for (var ordinal = 0; ordinal < CountOfMainFields; ordinal++)
+            ReadFields(position, rowData, 0, CountOfMainFields);
+        }
+
+        /// <summary>
+        /// Reads a range of fields of a document as of this enumerator's snapshot.
+        /// Fields are read in place, then values changed after the snapshot are replaced from row images,
+        /// and everything is read again if the document was written meanwhile.
+        /// </summary>
+        private void ReadFields(int position, DriverRowData rowData, int firstOrdinal, int endOrdinal)
+        {
+            while (true)
             {
-                var columnStore = DataContainer.ColumnStores[RowDataOrdinalToColumnStoreIndex[ordinal]];
-                if (columnStore.NotNulls.SafeGet(Position))
+                var stamp = m_snapshot.BeginRowRead(position);
+
+                for (var ordinal = firstOrdinal; ordinal < endOrdinal; ordinal++)
+                {
+                    var columnStore = DataContainer.ColumnStores[RowDataOrdinalToColumnStoreIndex[ordinal]];
+                    if (columnStore.NotNulls.SafeGet(position))
+                    {
+                        BitVector.Set(rowData.NotNulls, ordinal);
+                        var indexInArray = rowData.FieldArrayIndexes[ordinal];
+                        columnStore.AssignToDriverRow(position, rowData, indexInArray);
+                    }
+                    else
+                    {
+                        BitVector.Clear(rowData.NotNulls, ordinal);
+                    }
+                }
+
+                if (m_snapshot.IsNewer(stamp))
                 {
-                    BitVector.Set(RowData.NotNulls, ordinal);
-                    var indexInArray = RowData.FieldArrayIndexes[ordinal];
-                    columnStore.AssignToDriverRow(Position, RowData, indexInArray);
+                    for (var ordinal = firstOrdinal; ordinal < endOrdinal; ordinal++)
+                    {
+                        m_snapshot.ReadColumnImage(position, RowDataOrdinalToColumnStoreIndex[ordinal], rowData, ordinal);
+                    }
                 }
-                else
+
+                if (m_snapshot.EndRowRead(position, stamp))
                 {
-                    BitVector.Clear(RowData.NotNulls, ordinal);
+                    return;
                 }
             }
         }
@@ -112,15 +173,31 @@ namespace Pql.Engine.DataContainer.RamDriver
         /// Must be invoked from constructor of ancestors when all other checks are complete.
         /// </summary>
         protected void ReadStructureAndTakeLocks()
+        {
+            ReadStructureAndTakeLocks(true);
+        }
+
+        /// <summary>
+        /// Must be invoked from constructor of ancestors when all other checks are complete.
+        /// </summary>
+        /// <param name="waitForLoading">False for sequential scans, which wait for every range of documents 
+        /// with <see cref="ColumnDataBase.WaitRangeLoaded"/> before reading it, and for random reads,
+        /// which wait for every document with <see cref="WaitRowLoaded"/></param>
+        protected void ReadStructureAndTakeLocks(bool waitForLoading)
         {
             for (var ordinal = 0; ordinal < RowDataOrdinalToColumnStoreIndex.Length; ordinal++)
             {
                 var colStoreIndex = RequireColumnStoreIndex(Fields[ordinal].FieldId);
-                DataContainer.ColumnStores[colStoreIndex].WaitLoadingCompleted();
+                if (waitForLoading)
+                {
+                    DataContainer.ColumnStores[colStoreIndex].WaitLoadingCompleted();
+                }
+
                 RowDataOrdinalToColumnStoreIndex[ordinal] = colStoreIndex;
             }
 
             DataContainer.StructureLock.EnterReadLock();
+            m_snapshot = DataContainer.Versions.BeginRead();
         }
 
         private int RequireColumnStoreIndex(int fieldId)
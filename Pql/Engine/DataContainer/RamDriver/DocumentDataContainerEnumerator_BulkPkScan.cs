@@ -45,7 +45,8 @@ namespace Pql.Engine.DataContainer.RamDriver
         {
             m_inputEnumerator = inputDataEnumerator ?? throw new ArgumentNullException("inputDataEnumerator");
             
-            ReadStructureAndTakeLocks();
+            // only keys and valid documents bitmap are read, and they are loaded with container structure
+            ReadStructureAndTakeLocks(false);
         }
     }
 }
\ No newline at end of file
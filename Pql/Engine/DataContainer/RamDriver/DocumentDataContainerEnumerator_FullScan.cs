@@ -1,10 +1,26 @@
-﻿using System.Collections.Generic;
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
 using Pql.Engine.Interfaces.Internal;
 
 namespace Pql.Engine.DataContainer.RamDriver
 {
     internal sealed class DocumentDataContainerEnumerator_FullScan : DocumentDataContainerEnumeratorBase
     {
+        /// <summary>
+        /// Number of documents to keep read ahead of current position for memory-mapped columns.
+        /// </summary>
+        private const int PrefetchWindow = 4096;
+
+        private readonly ColumnDataBase[] m_mappedColumns;
+        private int m_prefetchedUpTo;
+
+        /// <summary>
+        /// Columns which were still being loaded when scan started, and number of leading documents known to be loaded in all of them.
+        /// </summary>
+        private readonly ColumnDataBase[] m_loadingColumns;
+        private int m_loadedUpTo;
+
         public override bool MoveNext()
         {
             if (Position >= UntrimmedCount)
@@ -12,8 +28,6 @@ namespace Pql.Engine.DataContainer.RamDriver
                 return false;
             }
 
-            var bmpList = DataContainer.ValidDocumentsBitmap;
-
             do
             {
                 // move at least one position forward,
@@ -24,16 +38,51 @@ namespace Pql.Engine.DataContainer.RamDriver
                 {
                     break;
                 }
-            } while (!bmpList.SafeGet(Position));
+            } while (!IsVisible(Position));
 
             HaveData = Position < UntrimmedCount;
             if (HaveData)
             {
+                if (Position >= m_loadedUpTo)
+                {
+                    WaitForLoadedDocuments();
+                }
+
+                PrefetchMappedColumns();
                 ReadRow();
             }
             return HaveData;
         }
 
+        private void WaitForLoadedDocuments()
+        {
+            var loadedUpTo = int.MaxValue;
+            foreach (var columnStore in m_loadingColumns)
+            {
+                columnStore.WaitRangeLoaded(Position + 1);
+                loadedUpTo = Math.Min(loadedUpTo, columnStore.LoadedPrefix);
+            }
+
+            m_loadedUpTo = loadedUpTo;
+        }
+
+        private void PrefetchMappedColumns()
+        {
+            if (m_mappedColumns == null || Position + PrefetchWindow <= m_prefetchedUpTo)
+            {
+                return;
+            }
+
+            var first = Math.Max(Position, m_prefetchedUpTo);
+            var end = Math.Min(UntrimmedCount, Position + 2 * PrefetchWindow);
+            foreach (var columnStore in m_mappedColumns)
+            {
+                columnStore.Prefetch(first, end - first);
+            }
+
+            m_prefetchedUpTo = end;
+        }
+
         public DocumentDataContainerEnumerator_FullScan(
             int untrimmedCount, 
             DriverRowData rowData, 
@@ -42,7 +91,19 @@ namespace Pql.Engine.DataContainer.RamDriver
             int countOfMainFields)
             : base(untrimmedCount, rowData, dataContainer, fields, countOfMainFields)
         {
-            ReadStructureAndTakeLocks();
+            // documents are read in order, so scan can start as soon as leading blocks of columns are loaded
+            ReadStructureAndTakeLocks(false);
+
+            var columns = RowDataOrdinalToColumnStoreIndex
+                .Distinct()
+                .Select(x => DataContainer.ColumnStores[x])
+                .ToArray();
+
+            var mapped = columns.Where(x => x.IsMapped).ToArray();
+            m_mappedColumns = mapped.Length > 0 ? mapped : null;
+
+            m_loadingColumns = columns.Where(x => x.LoadedPrefix < UntrimmedCount).ToArray();
+            m_loadedUpTo = m_loadingColumns.Length > 0 ? 0 : int.MaxValue;
         }
     }
 }
\ No newline at end of file
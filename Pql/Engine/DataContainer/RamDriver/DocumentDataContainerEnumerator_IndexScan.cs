@@ -6,7 +6,7 @@ namespace Pql.Engine.DataContainer.RamDriver
 {
     internal sealed class DocumentDataContainerEnumerator_IndexScan : DocumentDataContainerEnumeratorBase
     {
-        private readonly SortIndex m_sortIndex;
+        private readonly SortIndex.Snapshot m_sortIndex;
         private readonly bool m_descending;
 
         public int PositionInIndex;
@@ -15,7 +15,6 @@ namespace Pql.Engine.DataContainer.RamDriver
         {
             var orderData = m_sortIndex.OrderData;
             var validCount = m_sortIndex.ValidDocCount;
-            var bmpList = DataContainer.ValidDocumentsBitmap;
 
             if (validCount > UntrimmedCount)
             {
@@ -35,7 +34,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                 }
 
                 Position = orderData[PositionInIndex];
-            } while (!bmpList.SafeGet(Position));
+            } while (!IsVisible(Position));
 
             if (PositionInIndex >= validCount || PositionInIndex < 0)
             {
@@ -44,6 +43,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             else
             {
                 HaveData = true;
+                WaitRowLoaded(Position);
                 ReadRow();
             }
             return HaveData;
@@ -55,7 +55,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             DocumentDataContainer dataContainer,
             IReadOnlyList<FieldMetadata> fields,
             int countOfMainFields, 
-            SortIndex sortIndex, 
+            SortIndex.Snapshot sortIndex, 
             bool descending)
             : base(untrimmedCount, rowData, dataContainer, fields, countOfMainFields)
         {
@@ -64,9 +64,9 @@ namespace Pql.Engine.DataContainer.RamDriver
                 throw new ArgumentNullException("sortIndex");
             }
 
-            // note that we ignore value of sortIndex.IsValid here
+            // note that index version is immutable and may be stale here
             // that's because invalidation of index only happens when the data is stale
-            // we only check state of an index and optionally update it in the beginning of processing pipeline
+            // we only check state of an index and optionally wait for a rebuild in the beginning of processing pipeline
             if (sortIndex.OrderData == null || sortIndex.OrderData.Length > untrimmedCount)
             {
                 throw new ArgumentException("Index on column is in invalid state", "sortIndex");
@@ -76,7 +76,8 @@ namespace Pql.Engine.DataContainer.RamDriver
             m_descending = descending;
             PositionInIndex = descending ? m_sortIndex.ValidDocCount : -1;
 
-            ReadStructureAndTakeLocks();
+            // queries with a limit often read only a few documents, so only their blocks have to be loaded
+            ReadStructureAndTakeLocks(false);
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,330 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
+using Pql.Engine.DataContainer.Engine;
+using Pql.Engine.Interfaces.Internal;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Full scan which filters documents in parallel.
+    /// Documents are split into morsels, workers take morsels one by one and evaluate WHERE clause on their own row buffers,
+    /// and consumer reads matching documents either in order of completion or in order of document indexes.
+    /// Workers only run a bounded number of morsels ahead of consumer, so a slow client holds up the scan instead of buffering it.
+    /// Every morsel of a worker is scanned under a batch slot of the query scheduler, so parallel scans share processors with other requests.
+    /// Consumer runs under its request's own slot and scans morsels itself rather than wait for workers which cannot get slots.
+    /// Engine still re-applies WHERE clause and paging to the produced rows.
+    /// </summary>
+    internal sealed class DocumentDataContainerEnumerator_ParallelScan : DocumentDataContainerEnumeratorBase
+    {
+        /// <summary>
+        /// Documents per morsel. Small enough to balance load between workers and to stream results early,
+        /// large enough to amortize synchronization with consumer.
+        /// </summary>
+        public const int MorselSize = 16384;
+
+        /// <summary>
+        /// Number of morsels every worker may run ahead of consumer.
+        /// </summary>
+        private const int MorselsAheadPerWorker = 4;
+
+        private readonly Func<ClauseEvaluationContext, bool> m_whereClause;
+        private readonly ClauseEvaluationContext m_evaluationContext;
+        private readonly CancellationToken m_cancellationToken;
+        private readonly bool m_ordered;
+        private readonly QueryScheduler m_scheduler;
+        private readonly string m_tenantId;
+
+        /// <summary>
+        /// Cancelled on request cancellation and on dispose, releases workers which wait for a slot.
+        /// </summary>
+        private readonly CancellationTokenSource m_stopSource;
+
+        private readonly object m_lock;
+        private readonly int m_morselCount;
+        private readonly int m_workerCount;
+        private readonly int[][] m_results;
+        private readonly Queue<int> m_completedMorsels;
+        private int m_nextMorsel;
+        private int m_consumedMorsels;
+        private int m_activeWorkers;
+        private Exception m_failure;
+        private bool m_stopped;
+
+        private int[] m_currentMorsel;
+        private int m_positionInMorsel;
+        private ClauseEvaluationContext m_consumerContext;
+        private List<int> m_consumerMatches;
+
+        public override bool MoveNext()
+        {
+            while (true)
+            {
+                if (m_currentMorsel != null && ++m_positionInMorsel < m_currentMorsel.Length)
+                {
+                    Position = m_currentMorsel[m_positionInMorsel];
+                    HaveData = true;
+                    ReadRow();
+                    return true;
+                }
+
+                if (!TakeNextMorsel())
+                {
+                    HaveData = false;
+                    return false;
+                }
+            }
+        }
+
+        public override void Dispose()
+        {
+            // workers read column stores, so they must be gone before read lock is released
+            lock (m_lock)
+            {
+                m_stopped = true;
+            }
+
+            m_stopSource.Cancel();
+
+            lock (m_lock)
+            {
+                while (m_activeWorkers > 0)
+                {
+                    Monitor.Wait(m_lock);
+                }
+            }
+
+            m_stopSource.Dispose();
+            base.Dispose();
+        }
+
+        public DocumentDataContainerEnumerator_ParallelScan(
+            int untrimmedCount,
+            DriverRowData rowData,
+            DocumentDataContainer dataContainer,
+            IReadOnlyList<FieldMetadata> fields,
+            int countOfMainFields,
+            Func<ClauseEvaluationContext, bool> whereClause,
+            ClauseEvaluationContext evaluationContext,
+            bool ordered,
+            QueryScheduler scheduler,
+            string tenantId,
+            CancellationToken cancellationToken)
+            : base(untrimmedCount, rowData, dataContainer, fields, countOfMainFields)
+        {
+            m_whereClause = whereClause ?? throw new ArgumentNullException("whereClause");
+            m_evaluationContext = evaluationContext ?? throw new ArgumentNullException("evaluationContext");
+            m_scheduler = scheduler ?? throw new ArgumentNullException("scheduler");
+            m_tenantId = tenantId;
+            m_ordered = ordered;
+            m_cancellationToken = cancellationToken;
+            m_stopSource = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+
+            m_lock = new object();
+            m_morselCount = (UntrimmedCount + MorselSize - 1) / MorselSize;
+            m_workerCount = Math.Max(1, Math.Min(Environment.ProcessorCount, m_morselCount));
+            m_results = new int[m_morselCount][];
+            m_completedMorsels = new Queue<int>();
+            m_positionInMorsel = -1;
+
+            // morsels are taken in any order, so columns must be loaded entirely
+            ReadStructureAndTakeLocks();
+
+            lock (m_lock)
+            {
+                StartWorkers();
+            }
+        }
+
+        /// <summary>
+        /// Makes next completed morsel current, scanning morsels or waiting for workers if necessary. 
+        /// Returns false when all morsels are consumed.
+        /// </summary>
+        private bool TakeNextMorsel()
+        {
+            while (true)
+            {
+                lock (m_lock)
+                {
+                    if (m_failure != null)
+                    {
+                        // workers quit on cancellation, report it the same way as a sequential scan would
+                        m_cancellationToken.ThrowIfCancellationRequested();
+                        throw new AggregateException(m_failure);
+                    }
+
+                    if (m_consumedMorsels == m_morselCount)
+                    {
+                        m_currentMorsel = null;
+                        return false;
+                    }
+
+                    var morsel = m_ordered ? m_consumedMorsels : (m_completedMorsels.Count > 0 ? m_completedMorsels.Dequeue() : -1);
+                    if (morsel >= 0 && m_results[morsel] != null)
+                    {
+                        m_currentMorsel = m_results[morsel];
+                        m_results[morsel] = null;
+                        m_positionInMorsel = -1;
+                        m_consumedMorsels++;
+
+                        // consumer has moved the window, let workers proceed
+                        StartWorkers();
+                        return true;
+                    }
+
+                    // morsels taken by workers are scanned under their slots and will complete
+                    if (!CanTakeMorsel())
+                    {
+                        Monitor.Wait(m_lock);
+                        continue;
+                    }
+                }
+
+                // workers may be waiting for slots, while this thread already runs under a slot of its request
+                if (m_consumerContext == null)
+                {
+                    m_consumerContext = CreateScanContext();
+                    m_consumerMatches = new List<int>();
+                }
+
+                TryScanNextMorsel(m_consumerContext, m_consumerMatches);
+            }
+        }
+
+        /// <summary>
+        /// Starts workers until there are enough of them for morsels which may be scanned ahead of consumer.
+        /// Must be called under <see cref="m_lock"/>.
+        /// </summary>
+        private void StartWorkers()
+        {
+            while (m_activeWorkers < m_workerCount && CanTakeMorsel())
+            {
+                m_activeWorkers++;
+                Task.Factory.StartNew(RunWorker, CancellationToken.None, TaskCreationOptions.None, TaskScheduler.Default);
+            }
+        }
+
+        private bool CanTakeMorsel()
+        {
+            return !m_stopped
+                   && m_failure == null
+                   && m_nextMorsel < m_morselCount
+                   && m_nextMorsel < m_consumedMorsels + m_workerCount * MorselsAheadPerWorker;
+        }
+
+        /// <summary>
+        /// Scans morsels while consumer is not too far behind, then quits. Consumer starts workers again as it catches up,
+        /// so that no thread is blocked waiting for a slow client.
+        /// Slot is taken before the morsel, so that every taken morsel is sure to complete.
+        /// </summary>
+        private void RunWorker()
+        {
+            try
+            {
+                var context = CreateScanContext();
+                var matches = new List<int>();
+                while (true)
+                {
+                    lock (m_lock)
+                    {
+                        if (!CanTakeMorsel())
+                        {
+                            break;
+                        }
+                    }
+
+                    m_scheduler.Enter(m_tenantId, QueryLane.Batch, m_stopSource.Token);
+                    try
+                    {
+                        if (!TryScanNextMorsel(context, matches))
+                        {
+                            break;
+                        }
+                    }
+                    finally
+                    {
+                        m_scheduler.Exit();
+                    }
+                }
+            }
+            catch (OperationCanceledException) when (!m_cancellationToken.IsCancellationRequested)
+            {
+                // enumerator is disposed while this worker waits for a slot
+            }
+            catch (Exception e)
+            {
+                lock (m_lock)
+                {
+                    if (m_failure == null)
+                    {
+                        m_failure = e;
+                    }
+                }
+            }
+            finally
+            {
+                lock (m_lock)
+                {
+                    m_activeWorkers--;
+                    Monitor.PulseAll(m_lock);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Takes next morsel and publishes documents of it which satisfy WHERE clause. Returns false when no morsel can be taken.
+        /// </summary>
+        private bool TryScanNextMorsel(ClauseEvaluationContext context, List<int> matches)
+        {
+            int morsel;
+            lock (m_lock)
+            {
+                if (!CanTakeMorsel())
+                {
+                    return false;
+                }
+
+                morsel = m_nextMorsel++;
+            }
+
+            m_cancellationToken.ThrowIfCancellationRequested();
+
+            matches.Clear();
+            var end = Math.Min(UntrimmedCount, (morsel + 1) * MorselSize);
+            for (var position = morsel * MorselSize; position < end; position++)
+            {
+                if (IsVisible(position))
+                {
+                    ReadMainFields(position, context.InputRow);
+                    if (m_whereClause(context))
+                    {
+                        matches.Add(position);
+                    }
+                }
+            }
+
+            lock (m_lock)
+            {
+                m_results[morsel] = matches.ToArray();
+                m_completedMorsels.Enqueue(morsel);
+                Monitor.PulseAll(m_lock);
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Evaluation context with a private row buffer, so that scanning threads do not overwrite each other's rows.
+        /// </summary>
+        private ClauseEvaluationContext CreateScanContext()
+        {
+            return new ClauseEvaluationContext
+                {
+                    InputRow = new DriverRowData(RowData.FieldTypes),
+                    InputParametersRow = m_evaluationContext.InputParametersRow,
+                    InputParametersCollections = m_evaluationContext.InputParametersCollections
+                };
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,267 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
+using Pql.Engine.DataContainer.Engine;
+using Pql.Engine.Interfaces.Internal;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Produces first K documents of an ordering without building a sort index.
+    /// Documents are filtered and pushed into bounded heaps by a parallel scan, heaps are then merged and sorted.
+    /// Consumer scans partitions under its request's own slot, helpers take a batch slot of the query scheduler for every partition.
+    /// Engine still re-applies WHERE clause and paging to the produced rows.
+    /// </summary>
+    internal sealed class DocumentDataContainerEnumerator_TopK : DocumentDataContainerEnumeratorBase
+    {
+        /// <summary>
+        /// Documents per scan partition. Small enough to balance load between workers,
+        /// large enough to amortize per-partition setup.
+        /// </summary>
+        private const int PartitionSize = 65536;
+
+        private readonly IReadOnlyList<Tuple<int, bool>> m_orderFields;
+        private readonly int m_limit;
+        private readonly Func<ClauseEvaluationContext, bool> m_whereClause;
+        private readonly ClauseEvaluationContext m_evaluationContext;
+        private readonly CancellationToken m_cancellationToken;
+        private readonly QueryScheduler m_scheduler;
+        private readonly string m_tenantId;
+        private int[] m_orderData;
+        private int m_partitionCount;
+        private int m_nextPartition;
+
+        public int PositionInOrder;
+
+        public override bool MoveNext()
+        {
+            if (m_orderData == null)
+            {
+                m_orderData = CollectTopDocuments();
+            }
+
+            do
+            {
+                PositionInOrder++;
+
+                if (PositionInOrder >= m_orderData.Length)
+                {
+                    break;
+                }
+
+                Position = m_orderData[PositionInOrder];
+            } while (!IsVisible(Position));
+
+            HaveData = PositionInOrder < m_orderData.Length;
+            if (HaveData)
+            {
+                ReadRow();
+            }
+            return HaveData;
+        }
+
+        public DocumentDataContainerEnumerator_TopK(
+            int untrimmedCount,
+            DriverRowData rowData,
+            DocumentDataContainer dataContainer,
+            IReadOnlyList<FieldMetadata> fields,
+            int countOfMainFields,
+            IReadOnlyList<Tuple<int, bool>> orderFields,
+            int limit,
+            Func<ClauseEvaluationContext, bool> whereClause,
+            ClauseEvaluationContext evaluationContext,
+            QueryScheduler scheduler,
+            string tenantId,
+            CancellationToken cancellationToken)
+            : base(untrimmedCount, rowData, dataContainer, fields, countOfMainFields)
+        {
+            if (orderFields == null || orderFields.Count == 0)
+            {
+                throw new ArgumentNullException("orderFields");
+            }
+
+            if (limit <= 0)
+            {
+                throw new ArgumentOutOfRangeException("limit", limit, "Limit must be positive");
+            }
+
+            m_orderFields = orderFields;
+            m_limit = limit;
+            m_whereClause = whereClause;
+            m_evaluationContext = evaluationContext ?? throw new ArgumentNullException("evaluationContext");
+            m_scheduler = scheduler ?? throw new ArgumentNullException("scheduler");
+            m_tenantId = tenantId;
+            m_cancellationToken = cancellationToken;
+            PositionInOrder = -1;
+
+            // order fields are not necessarily among fetched fields, make sure they are loaded before taking locks
+            foreach (var field in orderFields)
+            {
+                DataContainer.RequireColumnStore(field.Item1);
+            }
+
+            ReadStructureAndTakeLocks();
+        }
+
+        private int[] CollectTopDocuments()
+        {
+            // column stores may only be replaced under write lock, and we hold read lock for our lifetime
+            var writers = new SortKeyFieldWriter[m_orderFields.Count];
+            for (var i = 0; i < writers.Length; i++)
+            {
+                var columnStore = DataContainer.ColumnStores[DataContainer.FieldIdToColumnStore[m_orderFields[i].Item1]];
+                writers[i] = SortKeyFieldWriter.Create(columnStore, m_orderFields[i].Item2);
+            }
+
+            m_partitionCount = (UntrimmedCount + PartitionSize - 1) / PartitionSize;
+            var result = new TopKHeap(m_limit);
+
+            using (var stopSource = CancellationTokenSource.CreateLinkedTokenSource(m_cancellationToken))
+            {
+                var helpers = new Task[Math.Max(0, Math.Min(Environment.ProcessorCount, m_partitionCount) - 1)];
+                for (var i = 0; i < helpers.Length; i++)
+                {
+                    helpers[i] = Task.Factory.StartNew(
+                        () => RunHelper(writers, result, stopSource.Token), CancellationToken.None, TaskCreationOptions.None, TaskScheduler.Default);
+                }
+
+                var completed = false;
+                try
+                {
+                    // this thread already runs under a slot of its request, so it never waits for helpers which cannot get slots
+                    var state = new ScanState(this);
+                    int partition;
+                    while ((partition = Interlocked.Increment(ref m_nextPartition) - 1) < m_partitionCount)
+                    {
+                        m_cancellationToken.ThrowIfCancellationRequested();
+                        ScanPartition(partition, writers, state);
+                    }
+
+                    lock (result)
+                    {
+                        result.MergeFrom(state.Heap);
+                    }
+
+                    completed = true;
+                }
+                finally
+                {
+                    // helpers still waiting for a slot have nothing left to scan, 
+                    // and helpers read column stores, so they must be gone before read lock is released
+                    stopSource.Cancel();
+                    try
+                    {
+                        Task.WaitAll(helpers);
+                    }
+                    catch (AggregateException)
+                    {
+                        if (completed)
+                        {
+                            throw;
+                        }
+                    }
+                }
+            }
+
+            return result.DrainSorted();
+        }
+
+        /// <summary>
+        /// Scans partitions, each under its own slot, until there are none left, then merges its heap into result.
+        /// Slot is taken before the partition, so that every taken partition is sure to complete.
+        /// </summary>
+        private void RunHelper(SortKeyFieldWriter[] writers, TopKHeap result, CancellationToken stopToken)
+        {
+            var state = new ScanState(this);
+            try
+            {
+                while (Volatile.Read(ref m_nextPartition) < m_partitionCount)
+                {
+                    m_scheduler.Enter(m_tenantId, QueryLane.Batch, stopToken);
+                    try
+                    {
+                        var partition = Interlocked.Increment(ref m_nextPartition) - 1;
+                        if (partition >= m_partitionCount)
+                        {
+                            break;
+                        }
+
+                        ScanPartition(partition, writers, state);
+                    }
+                    finally
+                    {
+                        m_scheduler.Exit();
+                    }
+                }
+            }
+            catch (OperationCanceledException) when (!m_cancellationToken.IsCancellationRequested)
+            {
+                // consumer has taken all partitions while this helper waited for a slot
+            }
+
+            lock (result)
+            {
+                result.MergeFrom(state.Heap);
+            }
+        }
+
+        private void ScanPartition(int partition, SortKeyFieldWriter[] writers, ScanState state)
+        {
+            var end = Math.Min(UntrimmedCount, (partition + 1) * PartitionSize);
+            for (var position = partition * PartitionSize; position < end; position++)
+            {
+                ScanDocument(position, writers, state);
+            }
+        }
+
+        private void ScanDocument(int position, SortKeyFieldWriter[] writers, ScanState state)
+        {
+            if (!IsVisible(position))
+            {
+                return;
+            }
+
+            if (m_whereClause != null)
+            {
+                ReadMainFields(position, state.Context.InputRow);
+                if (!m_whereClause(state.Context))
+                {
+                    return;
+                }
+            }
+
+            var keys = state.Keys;
+            keys.Length = 0;
+            foreach (var writer in writers)
+            {
+                writer.Write(position, keys);
+            }
+
+            state.Heap.Offer(keys.Data, keys.Length, position);
+        }
+
+        /// <summary>
+        /// Private buffers of a single scan worker.
+        /// </summary>
+        private sealed class ScanState
+        {
+            public readonly ClauseEvaluationContext Context;
+            public readonly SortKeyBuffer Keys;
+            public readonly TopKHeap Heap;
+
+            public ScanState(DocumentDataContainerEnumerator_TopK owner)
+            {
+                Context = new ClauseEvaluationContext
+                    {
+                        InputRow = new DriverRowData(owner.RowData.FieldTypes),
+                        InputParametersRow = owner.m_evaluationContext.InputParametersRow,
+                        InputParametersCollections = owner.m_evaluationContext.InputParametersCollections
+                    };
+
+                Keys = new SortKeyBuffer(64);
+                Heap = new TopKHeap(owner.m_limit);
+            }
+        }
+    }
+}
@@ -15,11 +15,21 @@ namespace Pql.Engine.DataContainer.RamDriver
         public const int LargestObjectSizeOnNormalHeap = 85000 - 1 - 12;
 
         private readonly object m_thisLock;
-        private readonly int m_itemsPerBlock;
+        private readonly int m_blockMask;
         private volatile int m_blockCount;
         private volatile T[][] m_list;
+
+        /// <summary>
+        /// Blocks referenced by the live snapshot, or null. 
+        /// Writers which go through <see cref="GetWritableBlock"/> replace any of these blocks with a copy before writing.
+        /// </summary>
+        private volatile T[][] m_pinnedBlocks;
        
+        /// <summary>
+        /// Always a power of two, so that element lookup is a shift and a mask.
+        /// </summary>
         public readonly int ElementsPerBlock;
+        public readonly int BlockShift;
         public int BlockCountIncrement { get { return 100; } }
         
         public ExpandableArray(int elementsPerItem, int itemByteSize)
@@ -29,18 +39,34 @@ namespace Pql.Engine.DataContainer.RamDriver
                 throw new ArgumentOutOfRangeException("elementsPerItem", elementsPerItem, "Elements per item must be positive");
             }
 
+            if ((elementsPerItem & (elementsPerItem - 1)) != 0)
+            {
+                throw new ArgumentOutOfRangeException("elementsPerItem", elementsPerItem, "Elements per item must be a power of two");
+            }
+
             m_thisLock = new object();
             m_list = null;
-            m_itemsPerBlock = ComputeItemsPerBlock(itemByteSize);
-            ElementsPerBlock = m_itemsPerBlock * elementsPerItem;
+            ElementsPerBlock = ComputeItemsPerBlock(itemByteSize) * elementsPerItem;
+            m_blockMask = ElementsPerBlock - 1;
+            while ((1 << BlockShift) < ElementsPerBlock)
+            {
+                BlockShift++;
+            }
         }
 
         public static int ComputeItemsPerBlock(int itemByteSize)
         {
-            // Number of elements per block must be product of 32 for compatibility with bitvector, because 32 = 8 * sizeof(int).
+            // Number of elements per block must be a power of two, to replace divisions with shifts on every access.
+            // Being at least 32, it is also a product of 32 for compatibility with bitvector, because 32 = 8 * sizeof(int).
             // In addition to this, it should be small enough to prevent a block from going into large object heap.
-            var result = ((LargestObjectSizeOnNormalHeap / itemByteSize) >> 5) << 5;
-            return result > 0 ? result : 32;
+            var limit = LargestObjectSizeOnNormalHeap / itemByteSize;
+            var result = 32;
+            while (result * 2 <= limit)
+            {
+                result *= 2;
+            }
+
+            return result;
         }
 
         [MethodImpl(MethodImplOptions.AggressiveInlining)]
@@ -53,27 +79,117 @@ namespace Pql.Engine.DataContainer.RamDriver
         [MethodImpl(MethodImplOptions.AggressiveInlining)]
         public int GetLocalIndex(int elementIndex)
         {
-            return elementIndex % ElementsPerBlock;
+            return elementIndex & m_blockMask;
         }
 
         public T this[int elementIndex]
         {
             [MethodImpl(MethodImplOptions.AggressiveInlining)]
-            get { return m_list[elementIndex / ElementsPerBlock][elementIndex % ElementsPerBlock]; }
+            get { return m_list[elementIndex >> BlockShift][elementIndex & m_blockMask]; }
             [MethodImpl(MethodImplOptions.AggressiveInlining)]
-            set { m_list[elementIndex / ElementsPerBlock][elementIndex % ElementsPerBlock] = value; }
+            set { GetWritableBlock(elementIndex)[elementIndex & m_blockMask] = value; }
         }
 
         [MethodImpl(MethodImplOptions.AggressiveInlining)]
         public T[] GetBlock(int elementIndex)
         {
-            return m_list[elementIndex / ElementsPerBlock];
+            return m_list[elementIndex >> BlockShift];
+        }
+
+        /// <summary>
+        /// Returns block containing given element for writing. 
+        /// When block is pinned by a snapshot, it is first replaced with a copy, so that snapshot keeps seeing old values.
+        /// Without a live snapshot this costs one extra read.
+        /// Do not remove. Used implicitly from runtime code generator.
+        /// </summary>
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public T[] GetWritableBlock(int elementIndex)
+        {
+            var blockIndex = elementIndex >> BlockShift;
+            var block = m_list[blockIndex];
+
+            var pinned = m_pinnedBlocks;
+            if (pinned != null && blockIndex < pinned.Length && ReferenceEquals(pinned[blockIndex], block))
+            {
+                return CopyPinnedBlock(blockIndex);
+            }
+
+            return block;
+        }
+
+        /// <summary>
+        /// Takes a frozen image of this array, which is not affected by writes through <see cref="GetWritableBlock"/>.
+        /// Caller must make sure there are no concurrent writers while snapshot is taken, and must dispose it when done.
+        /// Only one snapshot can be alive at a time.
+        /// </summary>
+        public ExpandableArraySnapshot<T> Snapshot()
+        {
+            lock (m_thisLock)
+            {
+                if (m_pinnedBlocks != null)
+                {
+                    throw new InvalidOperationException("Another snapshot of this array is still alive");
+                }
+
+                var list = m_list;
+                var blocks = new T[list == null ? 0 : m_blockCount][];
+                if (blocks.Length > 0)
+                {
+                    Array.Copy(list, blocks, blocks.Length);
+                }
+
+                m_pinnedBlocks = blocks;
+                return new ExpandableArraySnapshot<T>(this, blocks);
+            }
+        }
+
+        internal void ReleaseSnapshot(T[][] blocks)
+        {
+            lock (m_thisLock)
+            {
+                if (ReferenceEquals(m_pinnedBlocks, blocks))
+                {
+                    m_pinnedBlocks = null;
+                }
+            }
+        }
+
+        private T[] CopyPinnedBlock(int blockIndex)
+        {
+            // list may have been replaced by a concurrent expansion, which also takes this lock
+            lock (m_thisLock)
+            {
+                var list = m_list;
+                var block = list[blockIndex];
+
+                var pinned = m_pinnedBlocks;
+                if (pinned != null && blockIndex < pinned.Length && ReferenceEquals(pinned[blockIndex], block))
+                {
+                    block = (T[]) block.Clone();
+                    Thread.MemoryBarrier();
+                    list[blockIndex] = block;
+                }
+
+                return block;
+            }
+        }
+
+        /// <summary>
+        /// Returns contiguous run of elements starting at given index, 
+        /// bounded by maxCount and by the end of containing block.
+        /// Lets scans iterate whole blocks instead of looking up every element.
+        /// </summary>
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public ArraySegment<T> GetBlockSpan(int elementIndex, int maxCount)
+        {
+            var offset = elementIndex & m_blockMask;
+            return new ArraySegment<T>(m_list[elementIndex >> BlockShift], offset, Math.Min(maxCount, ElementsPerBlock - offset));
         }
 
         public int Capacity
         {
             [MethodImpl(MethodImplOptions.AggressiveInlining)]
-            get { return m_blockCount * ElementsPerBlock; }
+            get { return m_blockCount << BlockShift; }
         }
 
         /// <summary>
@@ -109,7 +225,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                 if (Capacity < capacity)
                 {
                     var list = m_list;
-                    var newBlockCount = 1 + capacity / ElementsPerBlock;
+                    var newBlockCount = 1 + (capacity >> BlockShift);
 
                     // do we have to reallocate list of blocks?
                     if (list == null || newBlockCount > list.Length)
@@ -134,7 +250,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                         // only allocate blocks for explicitly required capacity
                         for (var i = existing; i < newBlockCount; i++)
                         {
-                            newList[i] = new T[m_itemsPerBlock];
+                            newList[i] = new T[ElementsPerBlock];
                         }
 
                         Thread.MemoryBarrier();
@@ -149,7 +265,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                         // only allocate blocks for explicitly required capacity
                         for (var i = existing; i < newBlockCount; i++)
                         {
-                            list[i] = new T[m_itemsPerBlock];
+                            list[i] = new T[ElementsPerBlock];
                         }
 
                         Thread.MemoryBarrier();
@@ -166,6 +282,37 @@ namespace Pql.Engine.DataContainer.RamDriver
             return true;
         }
 
+        /// <summary>
+        /// Drops blocks which are not needed to hold first capacity elements.
+        /// Caller must have exclusive access to this array. Dropped blocks are reclaimed by garbage collector
+        /// once no stale readers hold them.
+        /// </summary>
+        public void TrimTo(int capacity)
+        {
+            if (capacity < 0)
+            {
+                throw new ArgumentOutOfRangeException("capacity", capacity, "New capacity value must be non-negative");
+            }
+
+            lock (m_thisLock)
+            {
+                var list = m_list;
+                var newBlockCount = (capacity + m_blockMask) >> BlockShift;
+                if (list == null || newBlockCount >= m_blockCount)
+                {
+                    return;
+                }
+
+                var newList = new T[BlockCountIncrement + newBlockCount][];
+                Array.Copy(list, newList, newBlockCount);
+
+                Thread.MemoryBarrier();
+
+                m_blockCount = newBlockCount;
+                m_list = newList;
+            }
+        }
+
         public void Clear()
         {
             lock (m_thisLock)
@@ -174,4 +321,51 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
        }
     }
+
+    /// <summary>
+    /// Frozen image of an <see cref="ExpandableArray{T}"/>, see <see cref="ExpandableArray{T}.Snapshot"/>.
+    /// Exposes same element lookup methods as the array, so that generated readers work on either of them.
+    /// </summary>
+    internal sealed class ExpandableArraySnapshot<T> : IDisposable
+    {
+        private readonly ExpandableArray<T> m_owner;
+        private readonly T[][] m_blocks;
+
+        public ExpandableArraySnapshot(ExpandableArray<T> owner, T[][] blocks)
+        {
+            m_owner = owner ?? throw new ArgumentNullException("owner");
+            m_blocks = blocks ?? throw new ArgumentNullException("blocks");
+        }
+
+        public int Capacity
+        {
+            get { return m_blocks.Length << m_owner.BlockShift; }
+        }
+
+        public T this[int elementIndex]
+        {
+            [MethodImpl(MethodImplOptions.AggressiveInlining)]
+            get { return m_blocks[elementIndex >> m_owner.BlockShift][m_owner.GetLocalIndex(elementIndex)]; }
+        }
+
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public T[] GetBlock(int elementIndex)
+        {
+            return m_blocks[elementIndex >> m_owner.BlockShift];
+        }
+
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public int GetLocalIndex(int elementIndex)
+        {
+            return m_owner.GetLocalIndex(elementIndex);
+        }
+
+        /// <summary>
+        /// Unpins blocks of the array. Disposing more than once does no harm.
+        /// </summary>
+        public void Dispose()
+        {
+            m_owner.ReleaseSnapshot(m_blocks);
+        }
+    }
 }
\ No newline at end of file
@@ -1,11 +1,16 @@
 ﻿using System;
 using System.Collections.Concurrent;
+using System.Collections.Generic;
 using System.Data;
+using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
 using System.Linq;
 using System.Threading;
+using Irony.Parsing;
 using Newtonsoft.Json;
 using Pql.ClientDriver.Protocol;
+using Pql.Engine.DataContainer.Engine;
 using Pql.Engine.Interfaces;
 using Pql.Engine.Interfaces.Internal;
 using Pql.Engine.Interfaces.Services;
@@ -51,7 +56,7 @@ namespace Pql.Engine.DataContainer.RamDriver
         /// </summary>
         public static Version CurrentStoreVersion()
         {
-            return new Version(0, 0, 0, 0);
+            return ColumnFile.FirstStoreVersion;
         }
 
         /// <summary>
@@ -81,6 +86,37 @@ namespace Pql.Engine.DataContainer.RamDriver
         /// Container descriptor.
         /// </summary>
         public DataContainerDescriptor Descriptor;
+        /// <summary>
+        /// When true, queries ordered by a column whose sort index is being rebuilt will use 
+        /// the previous version of that index instead of waiting for the rebuild to complete.
+        /// Documents modified since the previous version was built may then appear out of order.
+        /// </summary>
+        public bool AllowStaleSortIndexReads;
+        /// <summary>
+        /// Directory for scratch files of columns marked with <see cref="FieldMetadata.MemoryMapped"/>.
+        /// Defaults to "mapped" subdirectory of <see cref="StorageRoot"/>, or of temporary files directory.
+        /// </summary>
+        public string MappedColumnsRoot;
+        /// <summary>
+        /// Flushes append changed blocks of column files to delta files, and rewrite a column file together with its delta
+        /// once delta grows beyond this fraction of column file size. Zero makes every flush rewrite all files.
+        /// </summary>
+        public double DeltaMergeRatio = 0.25;
+        /// <summary>
+        /// When true, every applied changeset is written into a write-ahead log in <see cref="StorageRoot"/>
+        /// before Apply returns, so that changes survive a crash without a flush.
+        /// Logged changes are replayed and flushed when driver is initialized, regardless of this setting.
+        /// </summary>
+        public bool UseWriteAheadLog;
+        /// <summary>
+        /// When greater than one, inserts of every document type are spread over this many partitions by hash of primary key.
+        /// Partitions only batch reservation of document indexes: each of them appends documents into its own aligned ranges 
+        /// of 64 document indexes, so that concurrent inserts do not contend on the shared document count and on neighbouring bits and values.
+        /// Keys, columns and structure lock are still shared by all partitions of a document type, so this is not sharding:
+        /// inserts still contend on the key map and on the read side of structure lock.
+        /// Every partition may hold up to 63 unused indexes, which are treated as deleted documents.
+        /// </summary>
+        public int InsertPartitionCount;
 
         /// <summary>
         /// Ctr.
@@ -98,6 +134,11 @@ namespace Pql.Engine.DataContainer.RamDriver
                 InitializationCommand = settings.InitializationCommand;
                 StorageRoot = settings.StorageRoot;
                 Descriptor = settings.Descriptor;
+                AllowStaleSortIndexReads = settings.AllowStaleSortIndexReads;
+                MappedColumnsRoot = settings.MappedColumnsRoot;
+                DeltaMergeRatio = settings.DeltaMergeRatio;
+                UseWriteAheadLog = settings.UseWriteAheadLog;
+                InsertPartitionCount = settings.InsertPartitionCount;
             }
         }
     }
@@ -108,11 +149,38 @@ namespace Pql.Engine.DataContainer.RamDriver
     /// </summary>
     public class RamDriver : IStorageDriver
     {
+        /// <summary>
+        /// Largest number of rows (offset plus page size) that may be produced by a top-K heap scan.
+        /// </summary>
+        private const int TopKMaxRows = 10000;
+
+        /// <summary>
+        /// Only a fraction of scanned documents makes it into the heap, so insertion cost is discounted.
+        /// </summary>
+        private const double TopKHeapInsertRatio = 8;
+
+        /// <summary>
+        /// Smallest number of documents for which a filtered scan is split between workers.
+        /// </summary>
+        private const int ParallelScanMinDocuments = 4 * DocumentDataContainerEnumerator_ParallelScan.MorselSize;
+
+        /// <summary>
+        /// Index scan visits documents in random order, which is more expensive than a sequential scan.
+        /// </summary>
+        private const double IndexScanRandomAccessPenalty = 4;
+
+        /// <summary>
+        /// Number of locks which keep logged changes of the same document in order of their application, see <see cref="AddChange"/>.
+        /// </summary>
+        private const int ChangeLogLockCount = 256;
+
         private ITracer m_tracer;
         private volatile bool m_initialized;
         private volatile DataContainerDescriptor m_descriptor;
         private DataContainer m_dataContainer;
+        private WriteAheadLog m_log;
         private readonly object m_thisLock;
+        private readonly object[] m_changeLogLocks;
         private ConcurrentDictionary<long, RamDriverChangeset> m_changesets;
         private long m_lastChangesetHandle;
         private RamDriverSettings m_settings;
@@ -123,6 +191,12 @@ namespace Pql.Engine.DataContainer.RamDriver
         public RamDriver()
         {
             m_thisLock = new object();
+
+            m_changeLogLocks = new object[ChangeLogLockCount];
+            for (var i = 0; i < m_changeLogLocks.Length; i++)
+            {
+                m_changeLogLocks[i] = new object();
+            }
         }
 
         /// <summary>
@@ -133,6 +207,12 @@ namespace Pql.Engine.DataContainer.RamDriver
         {
             m_initialized = false;
 
+            if (m_log != null)
+            {
+                m_log.Dispose();
+                m_log = null;
+            }
+
             if (m_dataContainer != null)
             {
                 m_dataContainer.Dispose();
@@ -241,6 +321,15 @@ namespace Pql.Engine.DataContainer.RamDriver
             return stats;
         }
 
+        /// <summary>
+        /// Returns in-memory container of a document type.
+        /// </summary>
+        internal DocumentDataContainer RequireDocumentContainer(int docType)
+        {
+            CheckInitialized();
+            return m_dataContainer.RequireDocumentContainer(docType);
+        }
+
         public void BeginPrepareColumnData(int fieldId)
         {
             var docType = m_descriptor.RequireField(fieldId).OwnerDocumentType;
@@ -267,9 +356,15 @@ namespace Pql.Engine.DataContainer.RamDriver
         /// Schedules asynchronous loading of all columns and then waits for them to complete.
         /// </summary>
         public void PrepareAllEntitiesAndWait()
+        {
+            CheckInitialized();
+            LoadAllColumns();
+        }
+
+        private void LoadAllColumns()
         {
             // schedule loading of all columns
-            foreach (var docDesc in GetDescriptor().EnumerateDocumentTypes())
+            foreach (var docDesc in m_descriptor.EnumerateDocumentTypes())
             {
                 var docStore = m_dataContainer.RequireDocumentContainer(docDesc.DocumentType);
 
@@ -280,7 +375,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
 
             // wait until all columns are loaded
-            foreach (var docDesc in GetDescriptor().EnumerateDocumentTypes())
+            foreach (var docDesc in m_descriptor.EnumerateDocumentTypes())
             {
                 var docStore = m_dataContainer.RequireDocumentContainer(docDesc.DocumentType);
 
@@ -313,23 +408,190 @@ namespace Pql.Engine.DataContainer.RamDriver
 
             if (context.ParsedRequest.BaseDataset.OrderClauseFields.Count == 0)
             {
+                if (ShouldUseParallelScan(context, data, out var ordered))
+                {
+                    return data.GetParallelScanEnumerator(
+                        context.ParsedRequest.BaseDataset.BaseFields,
+                        context.ParsedRequest.BaseDataset.BaseFieldsMainCount,
+                        context.DriverOutputBuffer,
+                        context.ParsedRequest.BaseDataset.WhereClauseProcessor,
+                        context.ClauseEvaluationContext,
+                        ordered,
+                        QueryScheduler.Shared,
+                        context.AuthContext.TenantId,
+                        context.CancellationTokenSource.Token);
+                }
+
                 return data.GetUnorderedEnumerator(
                     context.ParsedRequest.BaseDataset.BaseFields, 
                     context.ParsedRequest.BaseDataset.BaseFieldsMainCount, 
                     context.DriverOutputBuffer);
             }
 
-            if (context.ParsedRequest.BaseDataset.OrderClauseFields.Count > 1)
+            if (ShouldUseTopK(context, data, out var limit))
             {
-                throw new InvalidOperationException("Sorting by more than one field is not supported yet");
+                return data.GetTopKEnumerator(
+                    context.ParsedRequest.BaseDataset.BaseFields,
+                    context.ParsedRequest.BaseDataset.BaseFieldsMainCount,
+                    context.DriverOutputBuffer,
+                    context.ParsedRequest.BaseDataset.OrderClauseFields,
+                    limit,
+                    context.ParsedRequest.BaseDataset.WhereClauseProcessor,
+                    context.ClauseEvaluationContext,
+                    QueryScheduler.Shared,
+                    context.AuthContext.TenantId,
+                    context.CancellationTokenSource.Token);
             }
 
             return data.GetOrderedEnumerator(
                 context.ParsedRequest.BaseDataset.BaseFields,
                 context.ParsedRequest.BaseDataset.BaseFieldsMainCount,
                 context.DriverOutputBuffer,
-                context.ParsedRequest.BaseDataset.OrderClauseFields[0].Item1,
-                context.ParsedRequest.BaseDataset.OrderClauseFields[0].Item2);
+                context.ParsedRequest.BaseDataset.OrderClauseFields);
+        }
+
+        /// <summary>
+        /// Compares estimated costs of a top-K heap scan and a sort index scan for an ordered query.
+        /// Costs are measured in "document visits", sorting is estimated as N*log2(N) visits.
+        /// </summary>
+        private static bool ShouldUseTopK(RequestExecutionContext context, DocumentDataContainer data, out int limit)
+        {
+            limit = 0;
+
+            var baseDataset = context.ParsedRequest.BaseDataset;
+            var func = baseDataset.Paging.Offset;
+            var offset = ReferenceEquals(func, null) ? 0 : func(context.ParsedRequest.Params.InputValues);
+            func = baseDataset.Paging.PageSize;
+            var pageSize = ReferenceEquals(func, null) ? Int32.MaxValue : func(context.ParsedRequest.Params.InputValues);
+
+            var rowsNeeded = (long) Math.Max(offset, 0) + pageSize;
+            if (pageSize <= 0 || rowsNeeded > TopKMaxRows)
+            {
+                return false;
+            }
+
+            // heap drops documents which do not make it into the page, and output row numbers in WHERE count rows in sorted order
+            if (ReferencesDriverRowNumbers(context.ParsedRequest)
+                || (baseDataset.WhereClauseRoot != null && ReferencesFunction(baseDataset.WhereClauseRoot, "rownumoutput")))
+            {
+                return false;
+            }
+
+            double count = data.UntrimmedCount;
+            if (count <= rowsNeeded)
+            {
+                return false;
+            }
+
+            // top-K always visits every document once, in parallel, and pays log2(K) per heap insertion
+            var topKCost = count * (1 + Math.Log(rowsNeeded, 2) / TopKHeapInsertRatio) / Environment.ProcessorCount;
+
+            // index scan pays for rebuild of a stale index, then visits documents in index order until page fills up;
+            // with a WHERE clause we do not know selectivity, so assume that half of the ordering has to be walked
+            var indexCost = data.SortIndexManager.IsIndexReady(baseDataset.OrderClauseFields) ? 0 : count * Math.Log(count, 2);
+            indexCost += baseDataset.WhereClauseProcessor == null ? rowsNeeded : count / 2 * IndexScanRandomAccessPenalty;
+
+            if (topKCost >= indexCost)
+            {
+                return false;
+            }
+
+            limit = (int) rowsNeeded;
+            return true;
+        }
+
+        /// <summary>
+        /// Decides whether an unordered query is filtered by parallel workers before the engine sees documents.
+        /// Documents are then produced in index order only when paging or output row numbers depend on it.
+        /// </summary>
+        private static bool ShouldUseParallelScan(RequestExecutionContext context, DocumentDataContainer data, out bool ordered)
+        {
+            ordered = false;
+
+            var parsedRequest = context.ParsedRequest;
+            var baseDataset = parsedRequest.BaseDataset;
+            if (baseDataset.WhereClauseProcessor == null 
+                || Environment.ProcessorCount < 2 
+                || data.UntrimmedCount < ParallelScanMinDocuments)
+            {
+                return false;
+            }
+
+            if (ReferencesDriverRowNumbers(parsedRequest))
+            {
+                return false;
+            }
+
+            // paging and rownumoutput() have to see matching documents in the same order as a sequential scan
+            var func = baseDataset.Paging.Offset;
+            ordered = !ReferenceEquals(func, null) && func(parsedRequest.Params.InputValues) > 0;
+            func = baseDataset.Paging.PageSize;
+            ordered |= !ReferenceEquals(func, null) && func(parsedRequest.Params.InputValues) < Int32.MaxValue;
+            foreach (var clause in GetRowClauses(parsedRequest))
+            {
+                ordered |= ReferencesFunction(clause, "rownumoutput");
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// True when rownum() appears in WHERE, SELECT or SET clauses.
+        /// rownum() counts every document that comes from storage driver, so such requests must not filter or drop documents early.
+        /// </summary>
+        private static bool ReferencesDriverRowNumbers(ParsedRequest parsedRequest)
+        {
+            foreach (var clause in GetRowClauses(parsedRequest))
+            {
+                if (ReferencesFunction(clause, "rownum"))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        /// <summary>
+        /// Enumerates clauses which are evaluated for every row: WHERE, SELECT and SET.
+        /// </summary>
+        private static IEnumerable<ParseTreeNode> GetRowClauses(ParsedRequest parsedRequest)
+        {
+            var clauses = new List<ParseTreeNode>();
+            if (parsedRequest.BaseDataset.WhereClauseRoot != null)
+            {
+                clauses.Add(parsedRequest.BaseDataset.WhereClauseRoot);
+            }
+
+            if (parsedRequest.Select.SelectClauses != null)
+            {
+                clauses.AddRange(parsedRequest.Select.SelectClauses.Where(x => x != null));
+            }
+
+            if (parsedRequest.Modify.InsertUpdateSetClauses != null)
+            {
+                clauses.AddRange(parsedRequest.Modify.InsertUpdateSetClauses.Where(x => x != null));
+            }
+
+            return clauses;
+        }
+
+        private static bool ReferencesFunction(ParseTreeNode node, string name)
+        {
+            if (node.Token != null && 0 == StringComparer.OrdinalIgnoreCase.Compare(name, node.Token.ValueString))
+            {
+                return true;
+            }
+
+            foreach (var child in node.ChildNodes)
+            {
+                if (ReferencesFunction(child, name))
+                {
+                    return true;
+                }
+            }
+
+            return false;
         }
 
         public long CreateChangeset(DriverChangeBuffer changeBuffer, bool isBulk)
@@ -355,7 +617,7 @@ namespace Pql.Engine.DataContainer.RamDriver
                 }
             }
 
-            var changesetRec = new RamDriverChangeset(this, changeBuffer, isBulk, documentContainer, columnStores);
+            var changesetRec = new RamDriverChangeset(this, changeBuffer, isBulk, documentContainer, columnStores, m_log != null);
             
             documentContainer.StructureLock.EnterReadLock();
             try
@@ -380,27 +642,62 @@ namespace Pql.Engine.DataContainer.RamDriver
             var changesetRec = m_changesets[changeset];
             bool success;
 
+            if (changesetRec.LogWriter == null)
+            {
+                success = ApplyChange(changesetRec);
+            }
+            else
+            {
+                // concurrent changesets may change the same document, so it is changed in memory and logged in one critical section,
+                // otherwise replay could apply changes in a different order than they were made
+                var key = changesetRec.ChangeBuffer.InternalEntityId;
+                lock (m_changeLogLocks[DocumentDataContainer.GetKeyHash(key) % (uint)m_changeLogLocks.Length])
+                {
+                    success = ApplyChange(changesetRec);
+                    if (success)
+                    {
+                        LogChange(changesetRec);
+                    }
+                }
+            }
+
+            if (success)
+            {
+                // TODO: interlocked?
+				changesetRec.ChangeCount++;
+            }
+        }
+
+        private bool ApplyChange(RamDriverChangeset changesetRec)
+        {
             switch (changesetRec.ChangeBuffer.ChangeType)
             {
                 case DriverChangeType.Insert:
                     InsertOne(changesetRec);
-                    success = true;
-                    break;
+                    return true;
                 case DriverChangeType.Update:
-                    success = UpdateOne(changesetRec);
-                    break;
+                    return UpdateOne(changesetRec);
                 case DriverChangeType.Delete:
-                    success = DeleteOne(changesetRec);
-                    break;
+                    return DeleteOne(changesetRec);
                 default:
                     throw new ArgumentOutOfRangeException("changeset", changesetRec.ChangeBuffer.ChangeType, "Change type has invalid value");
             }
+        }
 
-            if (success)
-            {
-                // TODO: interlocked?
-				changesetRec.ChangeCount++;
-            }
+        /// <summary>
+        /// Appends current change of a changeset to the log as a record of its own.
+        /// Change is logged after it is made in memory, so that a flush which starts a new log file
+        /// either includes changes logged into previous file, or leaves them to be logged into the new one.
+        /// </summary>
+        private void LogChange(RamDriverChangeset changesetRec)
+        {
+            // record keeps changeset header, and gets current change in place of the previous one
+            changesetRec.LogRecord.SetLength(changesetRec.LogHeaderLength);
+            changesetRec.LogRecord.Position = changesetRec.LogHeaderLength;
+            WriteAheadLog.WriteChange(changesetRec.LogWriter, changesetRec.ChangeBuffer);
+            changesetRec.LogWriter.Flush();
+
+            changesetRec.LastLogSequence = m_log.Append(changesetRec.LogRecord);
         }
 
         private static void InvalidateIndexes(RamDriverChangeset changesetRec)
@@ -438,8 +735,20 @@ namespace Pql.Engine.DataContainer.RamDriver
 
         private void InsertOne(RamDriverChangeset changesetRec)
         {
-            changesetRec.DocumentContainer.TryAddDocument(changesetRec.ChangeBuffer.InternalEntityId, out var docIndex);
-            UpdateAtPosition(changesetRec, changesetRec.ChangeBuffer, docIndex);
+            var change = changesetRec.ChangeBuffer;
+            var documentContainer = changesetRec.DocumentContainer;
+
+            // new document becomes valid together with its values
+            var version = documentContainer.BeginAddDocument(
+                change.InternalEntityId, changesetRec.ColumnStoreIndexes, change.Data.FieldTypes, out var docIndex);
+            try
+            {
+                AssignValues(changesetRec, change, docIndex);
+            }
+            finally
+            {
+                documentContainer.Versions.EndRowWrite(docIndex, version);
+            }
         }
 
         public void AllocateCapacityForDocumentType(int documentType, int additionalCapacity)
@@ -459,11 +768,32 @@ namespace Pql.Engine.DataContainer.RamDriver
         }
 
         private void UpdateAtPosition(RamDriverChangeset changesetRec, DriverChangeBuffer change, int docIndex)
+        {
+            var changeData = change.Data;
+            var documentContainer = changesetRec.DocumentContainer;
+
+            // readers which started earlier keep seeing previous values of changed fields
+            var version = documentContainer.BeginRowWrite(docIndex, changesetRec.ColumnStoreIndexes, changeData.FieldTypes);
+            try
+            {
+                AssignValues(changesetRec, change, docIndex);
+            }
+            finally
+            {
+                documentContainer.Versions.EndRowWrite(docIndex, version);
+            }
+        }
+
+        /// <summary>
+        /// Copies changed fields into column stores. Caller must hold a row write on the document.
+        /// </summary>
+        private static void AssignValues(RamDriverChangeset changesetRec, DriverChangeBuffer change, int docIndex)
         {
             var changeData = change.Data;
             for (var ordinal = 0; ordinal < change.Fields.Length; ordinal++)
             {
                 var colStore = changesetRec.ColumnStores[ordinal];
+                colStore.Checkpoint.MarkDirty(docIndex);
 
                 if (BitVector.Get(changeData.NotNulls, ordinal))
                 {
@@ -496,6 +826,12 @@ namespace Pql.Engine.DataContainer.RamDriver
                 changesetRec.DocumentContainer.StructureLock.ExitReadLock();
             }
 
+            // changes are already logged, commit waits for the last of them together with concurrent changesets
+            if (changesetRec.LastLogSequence > 0)
+            {
+                m_log.WaitDurable(changesetRec.LastLogSequence);
+            }
+
             if (changesetRec.ChangeCount > 0)
             {
                 if (m_tracer.IsDebugEnabled)
@@ -521,6 +857,7 @@ namespace Pql.Engine.DataContainer.RamDriver
             CheckInitialized();
 
 
+            // changes of discarded changesets stay in memory, so they are logged as well, but nobody waits for them
             if (m_changesets.TryRemove(changeset, out var changesetRec))
             {
                 try
@@ -545,9 +882,49 @@ namespace Pql.Engine.DataContainer.RamDriver
             CheckInitialized();
 
             PrepareAllEntitiesAndWait();
+
+            // changes logged before this point are already made in memory, and will be written by this flush
+            var lastLogFile = m_log != null ? m_log.Rotate() : 0;
+
             m_dataContainer.WriteDescriptorToStore();
             m_dataContainer.WriteStatsToStore();
             m_dataContainer.FlushDataToStore();
+
+            if (m_log != null)
+            {
+                WriteAheadLog.DeleteFiles(m_settings.StorageRoot, lastLogFile);
+            }
+        }
+
+        /// <summary>
+        /// Exports columns of a document type into a file as Arrow-layout buffers.
+        /// </summary>
+        /// <param name="docType">Document type</param>
+        /// <param name="fieldIds">Fields to export, or null to export all fields of the document type</param>
+        /// <param name="path">Target file, will be overwritten</param>
+        /// <seealso cref="ArrowColumnExporter"/>
+        public void ExportColumnsToFile(int docType, IReadOnlyList<int> fieldIds, string path)
+        {
+            CheckInitialized();
+
+            var docStore = m_dataContainer.RequireDocumentContainer(docType);
+            ArrowColumnExporter.ExportToFile(docStore, fieldIds ?? docStore.DocDesc.Fields, path);
+        }
+
+        /// <summary>
+        /// Exports columns of a document type into a named shared memory section as Arrow-layout buffers.
+        /// </summary>
+        /// <param name="docType">Document type</param>
+        /// <param name="fieldIds">Fields to export, or null to export all fields of the document type</param>
+        /// <param name="mapName">Name of the new shared memory section</param>
+        /// <returns>Shared memory section, caller must dispose of it once consumers have opened their views</returns>
+        /// <seealso cref="ArrowColumnExporter"/>
+        public MemoryMappedFile ExportColumnsToSharedMemory(int docType, IReadOnlyList<int> fieldIds, string mapName)
+        {
+            CheckInitialized();
+
+            var docStore = m_dataContainer.RequireDocumentContainer(docType);
+            return ArrowColumnExporter.ExportToSharedMemory(docStore, fieldIds ?? docStore.DocDesc.Fields, mapName);
         }
 
         public bool CanUpdateField(int fieldId)
@@ -635,12 +1012,135 @@ namespace Pql.Engine.DataContainer.RamDriver
 
                 if (m_descriptor != null)
                 {
-                    m_dataContainer = new DataContainer(m_tracer, m_descriptor, m_settings.StorageRoot);
+                    m_dataContainer = new DataContainer(m_tracer, m_descriptor, m_settings);
+
+                    if (!string.IsNullOrEmpty(m_settings.StorageRoot))
+                    {
+                        ReplayWriteAheadLog();
+
+                        if (m_settings.UseWriteAheadLog)
+                        {
+                            m_log = new WriteAheadLog(m_settings.StorageRoot);
+                        }
+                    }
+
                     m_initialized = true;
                 }
             }
         }
 
+        /// <summary>
+        /// Applies changes found in write-ahead log files left by previous instance, then flushes them to store
+        /// and deletes replayed files. Some of logged changes may already be in store, 
+        /// so replayed inserts of existing documents become updates.
+        /// </summary>
+        private void ReplayWriteAheadLog()
+        {
+            var storageRoot = m_settings.StorageRoot;
+            if (!Directory.Exists(storageRoot))
+            {
+                return;
+            }
+
+            var files = WriteAheadLog.GetFileNumbers(storageRoot);
+            if (files.Count == 0)
+            {
+                return;
+            }
+
+            var timer = Stopwatch.StartNew();
+            var changeCount = 0;
+
+            foreach (var file in files)
+            {
+                foreach (var record in WriteAheadLog.ReadRecords(storageRoot, file, m_tracer))
+                {
+                    using (var reader = new BinaryReader(new MemoryStream(record, false)))
+                    {
+                        var documentContainer = m_dataContainer.RequireDocumentContainer(reader.ReadInt32());
+                        var fields = new FieldMetadata[reader.ReadInt32()];
+                        var columnStores = fields.Length > 0 ? new ColumnDataBase[fields.Length] : null;
+                        for (var i = 0; i < fields.Length; i++)
+                        {
+                            fields[i] = m_descriptor.RequireField(reader.ReadInt32());
+                            documentContainer.BeginLoadColumnStore(fields[i].FieldId);
+                            columnStores[i] = documentContainer.RequireColumnStore(fields[i].FieldId);
+                        }
+
+                        var changeBuffer = fields.Length > 0
+                            ? new DriverChangeBuffer(
+                                documentContainer.DocDesc.DocumentType, 
+                                Array.FindIndex(fields, x => x.FieldId == documentContainer.PrimaryKeyFieldId), 
+                                fields)
+                            : new DriverChangeBuffer(documentContainer.DocDesc.DocumentType);
+                        changeBuffer.InternalEntityId = new byte[byte.MaxValue + 1];
+
+                        var changesetRec = new RamDriverChangeset(this, changeBuffer, false, documentContainer, columnStores, false);
+
+                        documentContainer.StructureLock.EnterReadLock();
+                        try
+                        {
+                            while (reader.BaseStream.Position < reader.BaseStream.Length)
+                            {
+                                WriteAheadLog.ReadChange(reader, changeBuffer);
+                                ReplayChange(changesetRec);
+                                changeCount++;
+                            }
+
+                            InvalidateIndexes(changesetRec);
+                        }
+                        finally
+                        {
+                            documentContainer.StructureLock.ExitReadLock();
+                        }
+                    }
+                }
+            }
+
+            if (changeCount > 0)
+            {
+                LoadAllColumns();
+                m_dataContainer.WriteStatsToStore();
+                m_dataContainer.FlushDataToStore();
+            }
+
+            WriteAheadLog.DeleteFiles(storageRoot, files[files.Count - 1]);
+
+            if (m_tracer.IsInfoEnabled)
+            {
+                m_tracer.InfoFormat("Replayed {0} changes from {1} write-ahead log files in {2} milliseconds", 
+                    changeCount, files.Count, timer.ElapsedMilliseconds);
+            }
+        }
+
+        private void ReplayChange(RamDriverChangeset changesetRec)
+        {
+            switch (changesetRec.ChangeBuffer.ChangeType)
+            {
+                case DriverChangeType.Insert:
+                    var docIndex = 0;
+                    var documentContainer = changesetRec.DocumentContainer;
+                    if (documentContainer.DocumentIdToIndex.TryGetValueInt32(changesetRec.ChangeBuffer.InternalEntityId, ref docIndex)
+                        && documentContainer.ValidDocumentsBitmap.SafeGet(docIndex))
+                    {
+                        UpdateAtPosition(changesetRec, changesetRec.ChangeBuffer, docIndex);
+                    }
+                    else
+                    {
+                        InsertOne(changesetRec);
+                    }
+                    break;
+                case DriverChangeType.Update:
+                    UpdateOne(changesetRec);
+                    break;
+                case DriverChangeType.Delete:
+                    DeleteOne(changesetRec);
+                    break;
+                default:
+                    throw new InvalidDataException("Invalid change type in write-ahead log: " + changesetRec.ChangeBuffer.ChangeType);
+            }
+        }
+
         private void CheckHaveDescriptor()
         {
             if (m_descriptor == null)
@@ -657,18 +1157,52 @@ namespace Pql.Engine.DataContainer.RamDriver
         public readonly bool IsBulk;
         public readonly ColumnDataBase[] ColumnStores;
         public readonly DocumentDataContainer DocumentContainer;
+
+        /// <summary>
+        /// Indexes of <see cref="ColumnStores"/> in the document container, in order of changed fields.
+        /// </summary>
+        public readonly int[] ColumnStoreIndexes;
         public int ChangeCount;
 
+        /// <summary>
+        /// Record of current change of this changeset for <see cref="WriteAheadLog"/>, null when changes are not logged.
+        /// Every change is logged as a separate record, which starts with changeset header of <see cref="LogHeaderLength"/> bytes.
+        /// </summary>
+        public readonly MemoryStream LogRecord;
+        public readonly BinaryWriter LogWriter;
+        public readonly int LogHeaderLength;
+
+        /// <summary>
+        /// Log sequence number of the last logged change, zero when nothing is logged.
+        /// </summary>
+        public long LastLogSequence;
+
         /// <summary>
         /// Ctr.
         /// </summary>
-        public RamDriverChangeset(RamDriver driver, DriverChangeBuffer changeBuffer, bool isBulk, DocumentDataContainer documentContainer, ColumnDataBase[] columnStores)
+        public RamDriverChangeset(
+            RamDriver driver, DriverChangeBuffer changeBuffer, bool isBulk, DocumentDataContainer documentContainer, ColumnDataBase[] columnStores, bool logChanges)
         {
             Driver = driver ?? throw new ArgumentNullException("driver");
             ChangeBuffer = changeBuffer ?? throw new ArgumentNullException("changeBuffer");
             IsBulk = isBulk;
             ColumnStores = columnStores;
             DocumentContainer = documentContainer ?? throw new ArgumentNullException("documentContainer");
+
+            ColumnStoreIndexes = new int[changeBuffer.Fields == null ? 0 : changeBuffer.Fields.Length];
+            for (var i = 0; i < ColumnStoreIndexes.Length; i++)
+            {
+                ColumnStoreIndexes[i] = documentContainer.FieldIdToColumnStore[changeBuffer.Fields[i].FieldId];
+            }
+
+            if (logChanges)
+            {
+                LogRecord = new MemoryStream();
+                LogWriter = new BinaryWriter(LogRecord);
+                WriteAheadLog.WriteChangesetHeader(LogWriter, changeBuffer.TargetEntity, changeBuffer.Fields);
+                LogWriter.Flush();
+                LogHeaderLength = (int)LogRecord.Length;
+            }
         }
     }
 }
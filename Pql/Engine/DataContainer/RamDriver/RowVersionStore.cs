@@ -0,0 +1,652 @@
+﻿using System;
+using System.Runtime.InteropServices;
+using System.Threading;
+using Pql.Engine.Interfaces.Internal;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Gives readers of a document container a consistent snapshot of every document, while writers keep changing documents in place.
+    /// Every write of a document takes a version from a global counter and stamps the document with it,
+    /// and every reader takes the current version as its snapshot when it starts.
+    /// When some reader's snapshot predates a write, writer first saves previous values of columns it is about to change
+    /// into a row image, and such readers take values from images instead of column stores.
+    /// Images live in the container's memory pool. Images of a document are chained from newest to oldest,
+    /// and are freed as soon as no active snapshot predates them.
+    /// While a write is in progress, document's stamp is flagged, so that readers which have to see the write wait for it,
+    /// and readers which overlap it notice the change and read the document again.
+    /// Writes of the same document do not overlap, so that images of a document are chained in order of their versions.
+    /// </summary>
+    internal sealed class RowVersionStore : IDisposable
+    {
+        /// <summary>
+        /// Flag of a document stamp, set while the write with stamp's version changes document's columns.
+        /// </summary>
+        internal const long WriteInProgress = 1L << 62;
+
+        /// <summary>
+        /// Version part of a flagged stamp, while the write has not yet taken its version.
+        /// </summary>
+        internal const long UnassignedVersion = WriteInProgress - 1;
+
+        /// <summary>
+        /// Value of <see cref="m_oldestSnapshot"/> while a reader is taking its version.
+        /// Such reader is older than any write.
+        /// </summary>
+        private const long PendingSnapshot = -1;
+
+        // layout of an image in the memory pool: header, then column index and value offset for every saved column, then values
+        private const int VersionOffset = 0;
+        private const int OlderOffset = 8;
+        private const int OlderVersionOffset = 16;
+        private const int RetiredNextOffset = 24;
+        private const int ColumnCountOffset = 32;
+        private const int WasValidOffset = 36;
+        private const int HeaderSize = 40;
+        private const int ColumnEntrySize = 8;
+
+        /// <summary>
+        /// Reused to copy strings into images.
+        /// </summary>
+        [ThreadStatic]
+        private static char[] t_chars;
+
+        private readonly ExpandableArray<long> m_stamps;
+        private readonly ExpandableArray<long> m_images;
+        private readonly ExpandableArray<long> m_imageVersions;
+        private readonly object m_snapshotLock;
+        private readonly object m_retiredLock;
+        private long[] m_snapshots;
+        private long m_oldestSnapshot;
+        private IUnmanagedAllocator m_allocator;
+        private IntPtr m_retiredHead;
+        private IntPtr m_retiredTail;
+        private int m_imageCount;
+        private long m_version;
+
+        public RowVersionStore(IUnmanagedAllocator allocator)
+        {
+            m_allocator = allocator ?? throw new ArgumentNullException("allocator");
+            m_stamps = new ExpandableArray<long>(1, sizeof(long));
+            m_images = new ExpandableArray<long>(1, sizeof(long));
+            m_imageVersions = new ExpandableArray<long>(1, sizeof(long));
+            m_snapshots = new long[Math.Max(16, 4 * Environment.ProcessorCount)];
+            m_snapshotLock = new object();
+            m_retiredLock = new object();
+
+            // zero stamp of a document which was never written is older than any snapshot, zero slot is free
+            m_version = 1;
+            m_oldestSnapshot = long.MaxValue;
+        }
+
+        /// <summary>
+        /// Number of row images which are not yet reclaimed.
+        /// </summary>
+        public int ImageCount
+        {
+            get { return Volatile.Read(ref m_imageCount); }
+        }
+
+        /// <summary>
+        /// Registers a reader and returns its snapshot. Readers only share a short lock, and the slot table grows when all slots are taken.
+        /// Snapshot must be disposed when reader completes, until then writers keep images of documents they change.
+        /// </summary>
+        public RowVersionSnapshot BeginRead()
+        {
+            lock (m_snapshotLock)
+            {
+                var slot = ClaimSnapshotSlot();
+                var oldest = m_oldestSnapshot;
+
+                // pending value is published with a full fence, so writers which took their versions after the read below
+                // either see it and keep images for us, or see the final oldest version which is older than theirs
+                Interlocked.Exchange(ref m_oldestSnapshot, PendingSnapshot);
+                var version = Interlocked.Read(ref m_version);
+                m_snapshots[slot] = version;
+                Volatile.Write(ref m_oldestSnapshot, Math.Min(oldest, version));
+                return new RowVersionSnapshot(this, slot, version);
+            }
+        }
+
+        internal void EndRead(int slot)
+        {
+            lock (m_snapshotLock)
+            {
+                m_snapshots[slot] = 0;
+                Volatile.Write(ref m_oldestSnapshot, GetOldestSnapshot());
+            }
+
+            Reclaim();
+        }
+
+        /// <summary>
+        /// Flags document as being written, after another write of the same document completes, and takes version for the write.
+        /// Flag is set before the version is taken, so that every snapshot which has to see the write finds the document flagged.
+        /// Sets keepImage when some active snapshot predates the write, in which case writer must save document's current state
+        /// with <see cref="PublishRowWrite(int,long,bool,int[],DriverRowData)"/>.
+        /// </summary>
+        public long BeginRowWrite(int docIndex, out bool keepImage)
+        {
+            if (docIndex >= m_stamps.Capacity)
+            {
+                m_stamps.EnsureCapacity(docIndex + 1);
+            }
+
+            var block = m_stamps.GetBlock(docIndex);
+            var localIndex = m_stamps.GetLocalIndex(docIndex);
+            var spinner = new SpinWait();
+            while (true)
+            {
+                var stamp = Volatile.Read(ref block[localIndex]);
+                if ((stamp & WriteInProgress) == 0
+                    && Interlocked.CompareExchange(ref block[localIndex], WriteInProgress | UnassignedVersion, stamp) == stamp)
+                {
+                    break;
+                }
+
+                spinner.SpinOnce();
+            }
+
+            // flag is set with a full fence, so a snapshot which reads this version or a newer one also sees the flag
+            var version = Interlocked.Increment(ref m_version);
+            keepImage = Volatile.Read(ref m_oldestSnapshot) < version;
+            return version;
+        }
+
+        /// <summary>
+        /// Publishes version of the write started by <see cref="BeginRowWrite"/>, when no image has to be kept.
+        /// Caller then changes document's columns and completes with <see cref="EndRowWrite"/>.
+        /// </summary>
+        public void PublishRowWrite(int docIndex, long version)
+        {
+            // full fence: version is published before any column changes
+            Interlocked.Exchange(ref m_stamps.GetBlock(docIndex)[m_stamps.GetLocalIndex(docIndex)], version | WriteInProgress);
+        }
+
+        /// <summary>
+        /// Saves image of document's state before the write into the memory pool, chains it ahead of document's older images,
+        /// and publishes version of the write started by <see cref="BeginRowWrite"/>.
+        /// Values hold saved columns in order of columnIndexes, and are null when document was not valid.
+        /// Caller then changes document's columns and completes with <see cref="EndRowWrite"/>.
+        /// </summary>
+        public void PublishRowWrite(int docIndex, long version, bool wasValid, int[] columnIndexes, DriverRowData values)
+        {
+            if (columnIndexes == null)
+            {
+                throw new ArgumentNullException("columnIndexes");
+            }
+
+            if (docIndex >= m_images.Capacity)
+            {
+                m_images.EnsureCapacity(docIndex + 1);
+            }
+
+            if (docIndex >= m_imageVersions.Capacity)
+            {
+                m_imageVersions.EnsureCapacity(docIndex + 1);
+            }
+
+            var image = CreateImage(wasValid, columnIndexes, values);
+
+            // writes of a document do not overlap, so newest image and its version are only changed here
+            var images = m_images.GetBlock(docIndex);
+            var imageVersions = m_imageVersions.GetBlock(docIndex);
+            var localIndex = m_images.GetLocalIndex(docIndex);
+            Marshal.WriteInt64(image, VersionOffset, version);
+            Marshal.WriteInt64(image, OlderOffset, Volatile.Read(ref images[localIndex]));
+            Marshal.WriteInt64(image, OlderVersionOffset, Volatile.Read(ref imageVersions[localIndex]));
+            Marshal.WriteInt64(image, RetiredNextOffset, 0);
+
+            // readers check version first, so the image they find is at least as new as the version they checked
+            Volatile.Write(ref images[localIndex], image.ToInt64());
+            Volatile.Write(ref imageVersions[localIndex], version);
+
+            lock (m_retiredLock)
+            {
+                if (m_retiredTail == IntPtr.Zero)
+                {
+                    m_retiredHead = image;
+                }
+                else
+                {
+                    Marshal.WriteInt64(m_retiredTail, RetiredNextOffset, image.ToInt64());
+                }
+
+                m_retiredTail = image;
+                m_imageCount++;
+            }
+
+            PublishRowWrite(docIndex, version);
+        }
+
+        /// <summary>
+        /// Clears write flag of a document and lets next write of the document proceed.
+        /// </summary>
+        public void EndRowWrite(int docIndex, long version)
+        {
+            // column changes are complete before the flag is cleared
+            Volatile.Write(ref m_stamps.GetBlock(docIndex)[m_stamps.GetLocalIndex(docIndex)], version);
+            Reclaim();
+        }
+
+        /// <summary>
+        /// Frees all images and switches to another memory pool.
+        /// Must be called when there are no active snapshots and no writes in progress.
+        /// </summary>
+        public void MigrateRAM(IUnmanagedAllocator newpool)
+        {
+            FreeImages(long.MaxValue);
+            m_allocator = newpool ?? throw new ArgumentNullException("newpool");
+        }
+
+        public void Dispose()
+        {
+            FreeImages(long.MaxValue);
+        }
+
+        /// <summary>
+        /// Returns document's current stamp: version of its last write, possibly with <see cref="WriteInProgress"/> flag.
+        /// </summary>
+        internal long GetStamp(int docIndex)
+        {
+            return docIndex < m_stamps.Capacity
+                       ? Volatile.Read(ref m_stamps.GetBlock(docIndex)[m_stamps.GetLocalIndex(docIndex)])
+                       : 0;
+        }
+
+        /// <summary>
+        /// Returns newest image of a document if it is newer than given snapshot version, otherwise zero.
+        /// Images newer than an active snapshot are not reclaimed, so the one returned stays valid while that snapshot is active.
+        /// </summary>
+        internal IntPtr GetNewestImage(int docIndex, long snapshotVersion)
+        {
+            if (docIndex >= m_imageVersions.Capacity
+                || Volatile.Read(ref m_imageVersions.GetBlock(docIndex)[m_imageVersions.GetLocalIndex(docIndex)]) <= snapshotVersion)
+            {
+                return IntPtr.Zero;
+            }
+
+            return new IntPtr(Volatile.Read(ref m_images.GetBlock(docIndex)[m_images.GetLocalIndex(docIndex)]));
+        }
+
+        /// <summary>
+        /// Returns next older image of a document if it is newer than given snapshot version, otherwise zero.
+        /// Older images are not followed any further, they may already be freed.
+        /// </summary>
+        internal static IntPtr GetOlderImage(IntPtr image, long snapshotVersion)
+        {
+            return Marshal.ReadInt64(image, OlderVersionOffset) > snapshotVersion
+                       ? new IntPtr(Marshal.ReadInt64(image, OlderOffset))
+                       : IntPtr.Zero;
+        }
+
+        internal static bool GetImageWasValid(IntPtr image)
+        {
+            return Marshal.ReadInt32(image, WasValidOffset) != 0;
+        }
+
+        /// <summary>
+        /// Returns ordinal of a column among columns saved in the image, or -1.
+        /// </summary>
+        internal static int FindImageColumn(IntPtr image, int columnIndex)
+        {
+            var count = Marshal.ReadInt32(image, ColumnCountOffset);
+            for (var ordinal = 0; ordinal < count; ordinal++)
+            {
+                if (Marshal.ReadInt32(image, HeaderSize + ordinal * ColumnEntrySize) == columnIndex)
+                {
+                    return ordinal;
+                }
+            }
+
+            return -1;
+        }
+
+        /// <summary>
+        /// Copies value of a saved column from the image into a field of a row.
+        /// </summary>
+        internal static void ReadImageValue(IntPtr image, int imageOrdinal, DriverRowData target, int targetOrdinal)
+        {
+            var offset = Marshal.ReadInt32(image, HeaderSize + imageOrdinal * ColumnEntrySize + sizeof(int));
+
+            // images of deleted documents have no values
+            if (offset == 0)
+            {
+                ClientDriver.Protocol.BitVector.Clear(target.NotNulls, targetOrdinal);
+                return;
+            }
+
+            ClientDriver.Protocol.BitVector.Set(target.NotNulls, targetOrdinal);
+            var targetIndex = target.FieldArrayIndexes[targetOrdinal];
+            switch (target.FieldRepresentationTypes[targetOrdinal])
+            {
+                case DriverRowData.DataTypeRepresentation.Value8Bytes:
+                    target.ValueData8Bytes[targetIndex].AsInt64 = Marshal.ReadInt64(image, offset);
+                    break;
+                case DriverRowData.DataTypeRepresentation.Value16Bytes:
+                    target.ValueData16Bytes[targetIndex].Lo = Marshal.ReadInt64(image, offset);
+                    target.ValueData16Bytes[targetIndex].Hi = Marshal.ReadInt64(image, offset + sizeof(long));
+                    break;
+                case DriverRowData.DataTypeRepresentation.String:
+                    target.StringData[targetIndex] = Marshal.PtrToStringUni(
+                        IntPtr.Add(image, offset + sizeof(int)), Marshal.ReadInt32(image, offset));
+                    break;
+                case DriverRowData.DataTypeRepresentation.ByteArray:
+                    var data = target.BinaryData[targetIndex];
+                    data.SetLength(Marshal.ReadInt32(image, offset));
+                    Marshal.Copy(IntPtr.Add(image, offset + sizeof(int)), data.Data, 0, data.Length);
+                    break;
+                default:
+                    throw new InvalidOperationException("Invalid representation type: " + target.FieldRepresentationTypes[targetOrdinal]);
+            }
+        }
+
+        /// <summary>
+        /// Allocates an image in the memory pool and fills everything except version and links.
+        /// </summary>
+        private IntPtr CreateImage(bool wasValid, int[] columnIndexes, DriverRowData values)
+        {
+            var size = HeaderSize + columnIndexes.Length * ColumnEntrySize;
+            if (values != null)
+            {
+                for (var ordinal = 0; ordinal < columnIndexes.Length; ordinal++)
+                {
+                    if (ClientDriver.Protocol.BitVector.Get(values.NotNulls, ordinal))
+                    {
+                        size += GetValueSize(values, ordinal);
+                    }
+                }
+            }
+
+            var image = m_allocator.AllocIntPtr((ulong)size);
+            Marshal.WriteInt32(image, ColumnCountOffset, columnIndexes.Length);
+            Marshal.WriteInt32(image, WasValidOffset, wasValid ? 1 : 0);
+
+            var offset = HeaderSize + columnIndexes.Length * ColumnEntrySize;
+            for (var ordinal = 0; ordinal < columnIndexes.Length; ordinal++)
+            {
+                var entry = HeaderSize + ordinal * ColumnEntrySize;
+                Marshal.WriteInt32(image, entry, columnIndexes[ordinal]);
+                if (values == null || !ClientDriver.Protocol.BitVector.Get(values.NotNulls, ordinal))
+                {
+                    Marshal.WriteInt32(image, entry + sizeof(int), 0);
+                    continue;
+                }
+
+                Marshal.WriteInt32(image, entry + sizeof(int), offset);
+                WriteValue(image, offset, values, ordinal);
+                offset += GetValueSize(values, ordinal);
+            }
+
+            return image;
+        }
+
+        /// <summary>
+        /// Size of a value in an image, rounded up to keep values aligned.
+        /// </summary>
+        private static int GetValueSize(DriverRowData values, int ordinal)
+        {
+            var index = values.FieldArrayIndexes[ordinal];
+            switch (values.FieldRepresentationTypes[ordinal])
+            {
+                case DriverRowData.DataTypeRepresentation.Value8Bytes:
+                    return 8;
+                case DriverRowData.DataTypeRepresentation.Value16Bytes:
+                    return 16;
+                case DriverRowData.DataTypeRepresentation.String:
+                    return Align(sizeof(int) + sizeof(char) * values.StringData[index].Length);
+                case DriverRowData.DataTypeRepresentation.ByteArray:
+                    return Align(sizeof(int) + values.BinaryData[index].Length);
+                default:
+                    throw new InvalidOperationException("Invalid representation type: " + values.FieldRepresentationTypes[ordinal]);
+            }
+        }
+
+        private static int Align(int size)
+        {
+            return (size + 7) & ~7;
+        }
+
+        private static void WriteValue(IntPtr image, int offset, DriverRowData values, int ordinal)
+        {
+            var index = values.FieldArrayIndexes[ordinal];
+            switch (values.FieldRepresentationTypes[ordinal])
+            {
+                case DriverRowData.DataTypeRepresentation.Value8Bytes:
+                    Marshal.WriteInt64(image, offset, values.ValueData8Bytes[index].AsInt64);
+                    break;
+                case DriverRowData.DataTypeRepresentation.Value16Bytes:
+                    Marshal.WriteInt64(image, offset, values.ValueData16Bytes[index].Lo);
+                    Marshal.WriteInt64(image, offset + sizeof(long), values.ValueData16Bytes[index].Hi);
+                    break;
+                case DriverRowData.DataTypeRepresentation.String:
+                    var str = values.StringData[index];
+                    var chars = t_chars;
+                    if (chars == null || chars.Length < str.Length)
+                    {
+                        t_chars = chars = new char[Math.Max(str.Length, 256)];
+                    }
+
+                    str.CopyTo(0, chars, 0, str.Length);
+                    Marshal.WriteInt32(image, offset, str.Length);
+                    Marshal.Copy(chars, 0, IntPtr.Add(image, offset + sizeof(int)), str.Length);
+                    break;
+                case DriverRowData.DataTypeRepresentation.ByteArray:
+                    var data = values.BinaryData[index];
+                    Marshal.WriteInt32(image, offset, data.Length);
+                    Marshal.Copy(data.Data, 0, IntPtr.Add(image, offset + sizeof(int)), data.Length);
+                    break;
+                default:
+                    throw new InvalidOperationException("Invalid representation type: " + values.FieldRepresentationTypes[ordinal]);
+            }
+        }
+
+        /// <summary>
+        /// Returns a free slot, doubling the slot table when there is none. Must be called under <see cref="m_snapshotLock"/>.
+        /// </summary>
+        private int ClaimSnapshotSlot()
+        {
+            for (var slot = 0; slot < m_snapshots.Length; slot++)
+            {
+                if (m_snapshots[slot] == 0)
+                {
+                    return slot;
+                }
+            }
+
+            // more concurrent readers than slots, existing readers keep their slot numbers
+            var count = m_snapshots.Length;
+            var snapshots = new long[count * 2];
+            Array.Copy(m_snapshots, snapshots, count);
+            m_snapshots = snapshots;
+            return count;
+        }
+
+        /// <summary>
+        /// Oldest version among active snapshots, <see cref="long.MaxValue"/> when there are none.
+        /// Must be called under <see cref="m_snapshotLock"/>; writers read the result cached in <see cref="m_oldestSnapshot"/>.
+        /// </summary>
+        private long GetOldestSnapshot()
+        {
+            var oldest = long.MaxValue;
+            foreach (var version in m_snapshots)
+            {
+                if (version != 0 && version < oldest)
+                {
+                    oldest = version;
+                }
+            }
+
+            return oldest;
+        }
+
+        /// <summary>
+        /// Frees images which no active snapshot needs any more. Skipped while another thread does the same.
+        /// </summary>
+        private void Reclaim()
+        {
+            if (Volatile.Read(ref m_imageCount) == 0 || !Monitor.TryEnter(m_retiredLock))
+            {
+                return;
+            }
+
+            try
+            {
+                // readers which register after this point get versions at least as new as the current one,
+                // so images published meanwhile are not freed before those readers are accounted for
+                var version = Interlocked.Read(ref m_version);
+                FreeRetiredImages(Math.Min(version, Volatile.Read(ref m_oldestSnapshot)));
+            }
+            finally
+            {
+                Monitor.Exit(m_retiredLock);
+            }
+        }
+
+        private void FreeImages(long oldestSnapshot)
+        {
+            lock (m_retiredLock)
+            {
+                FreeRetiredImages(oldestSnapshot);
+            }
+        }
+
+        /// <summary>
+        /// Frees images not newer than given snapshot version, in order of their publication. Must be called under <see cref="m_retiredLock"/>.
+        /// Newest image pointers and older links of later images may still point to freed ones,
+        /// but nobody follows them that far, because all snapshots are at least as new.
+        /// </summary>
+        private void FreeRetiredImages(long oldestSnapshot)
+        {
+            while (m_retiredHead != IntPtr.Zero && Marshal.ReadInt64(m_retiredHead, VersionOffset) <= oldestSnapshot)
+            {
+                var image = m_retiredHead;
+                m_retiredHead = new IntPtr(Marshal.ReadInt64(image, RetiredNextOffset));
+                if (m_retiredHead == IntPtr.Zero)
+                {
+                    m_retiredTail = IntPtr.Zero;
+                }
+
+                m_allocator.Free(image);
+                m_imageCount--;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Reader's view of a <see cref="RowVersionStore"/>. Thread-safe, may be shared by workers of one reader.
+    /// A document is read by taking its stamp with <see cref="BeginRowRead"/>, reading columns,
+    /// replacing values of columns changed after the snapshot with <see cref="ReadColumnImage"/> if <see cref="IsNewer"/>,
+    /// and repeating all of that until <see cref="EndRowRead"/> confirms that the stamp did not change meanwhile.
+    /// </summary>
+    internal sealed class RowVersionSnapshot : IDisposable
+    {
+        private readonly RowVersionStore m_store;
+        private readonly int m_slot;
+        private int m_disposed;
+
+        public readonly long Version;
+
+        public RowVersionSnapshot(RowVersionStore store, int slot, long version)
+        {
+            m_store = store ?? throw new ArgumentNullException("store");
+            m_slot = slot;
+            Version = version;
+        }
+
+        /// <summary>
+        /// Returns stamp of a document, waiting while the document is being written by a write this snapshot has to see,
+        /// or by a write which has not yet taken its version.
+        /// </summary>
+        public long BeginRowRead(int docIndex)
+        {
+            var spinner = new SpinWait();
+            while (true)
+            {
+                var stamp = m_store.GetStamp(docIndex);
+                if ((stamp & RowVersionStore.WriteInProgress) == 0
+                    || ((stamp & ~RowVersionStore.WriteInProgress) != RowVersionStore.UnassignedVersion && IsNewer(stamp)))
+                {
+                    return stamp;
+                }
+
+                spinner.SpinOnce();
+            }
+        }
+
+        /// <summary>
+        /// True when document's stamp is still the one returned by <see cref="BeginRowRead"/>,
+        /// so that values read in between are consistent.
+        /// </summary>
+        public bool EndRowRead(int docIndex, long stamp)
+        {
+            // column reads must complete before the stamp is read again
+            Interlocked.MemoryBarrier();
+            return m_store.GetStamp(docIndex) == stamp;
+        }
+
+        /// <summary>
+        /// True when stamp belongs to a write which happened after this snapshot was taken.
+        /// </summary>
+        public bool IsNewer(long stamp)
+        {
+            return (stamp & ~RowVersionStore.WriteInProgress) > Version;
+        }
+
+        /// <summary>
+        /// Returns validity of a document as of this snapshot, given its current validity and stamp.
+        /// </summary>
+        public bool WasValid(int docIndex, long stamp, bool isValid)
+        {
+            if (!IsNewer(stamp))
+            {
+                return isValid;
+            }
+
+            // the first write after snapshot knows what document was like before it, images are chained from newest to oldest
+            var first = IntPtr.Zero;
+            for (var image = m_store.GetNewestImage(docIndex, Version); image != IntPtr.Zero; image = RowVersionStore.GetOlderImage(image, Version))
+            {
+                first = image;
+            }
+
+            return first != IntPtr.Zero ? RowVersionStore.GetImageWasValid(first) : isValid;
+        }
+
+        /// <summary>
+        /// Replaces value of a field with value of a column as of this snapshot, if the column was changed after the snapshot.
+        /// Returns false when current value is to be used.
+        /// </summary>
+        public bool ReadColumnImage(int docIndex, int columnIndex, DriverRowData target, int targetOrdinal)
+        {
+            var first = IntPtr.Zero;
+            var firstOrdinal = -1;
+            for (var image = m_store.GetNewestImage(docIndex, Version); image != IntPtr.Zero; image = RowVersionStore.GetOlderImage(image, Version))
+            {
+                var ordinal = RowVersionStore.FindImageColumn(image, columnIndex);
+                if (ordinal >= 0)
+                {
+                    first = image;
+                    firstOrdinal = ordinal;
+                }
+            }
+
+            if (first == IntPtr.Zero)
+            {
+                return false;
+            }
+
+            RowVersionStore.ReadImageValue(first, firstOrdinal, target, targetOrdinal);
+            return true;
+        }
+
+        public void Dispose()
+        {
+            if (Interlocked.Exchange(ref m_disposed, 1) == 0)
+            {
+                m_store.EndRead(m_slot);
+            }
+        }
+    }
+}
\ No newline at end of file
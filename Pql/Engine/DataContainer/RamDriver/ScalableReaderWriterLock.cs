@@ -0,0 +1,193 @@
+﻿using System;
+using System.Threading;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Reader-writer lock for structure of a document container, optimized for many short readers and rare writers.
+    /// Readers only touch a counter of their own, so that concurrent point queries on different cores do not contend
+    /// for a single cache line as they would with <see cref="ReaderWriterLockSlim"/>.
+    /// Writers (flush snapshots, RAM migration) announce themselves, wait until all counters drain, and block new readers.
+    /// Both modes are recursive, and a thread which holds write lock may also take read lock.
+    /// Like <see cref="ReaderWriterLockSlim"/>, a lock must be released by the thread which has taken it,
+    /// and must be disposed to release per-thread state of all threads which have ever used it.
+    /// </summary>
+    internal sealed class ScalableReaderWriterLock : IDisposable
+    {
+        /// <summary>
+        /// Number of longs between two reader counters, so that every counter has its own pair of cache lines.
+        /// </summary>
+        private const int CounterStride = 16;
+
+        private readonly long[] m_readerCounters;
+        private readonly int m_counterMask;
+        private readonly ThreadLocal<ReaderState> m_readerState;
+        private int m_nextCounter;
+
+        /// <summary>
+        /// Held by writer for the whole duration of its write lock. New readers queue up on it while writer is active.
+        /// </summary>
+        private readonly object m_writerGate = new object();
+        private volatile bool m_writerActive;
+        private volatile int m_writerThreadId;
+        private int m_writeDepth;
+
+        public ScalableReaderWriterLock()
+        {
+            // twice as many counters as processors, so that threads rarely share one
+            var counterCount = 1;
+            while (counterCount < 2 * Environment.ProcessorCount)
+            {
+                counterCount <<= 1;
+            }
+
+            m_counterMask = counterCount - 1;
+            m_readerCounters = new long[(counterCount + 1) * CounterStride];
+            m_readerState = new ThreadLocal<ReaderState>(() => new ReaderState(Interlocked.Increment(ref m_nextCounter) & m_counterMask));
+        }
+
+        public bool IsReadLockHeld
+        {
+            get { return m_readerState.Value.Depth > 0; }
+        }
+
+        public bool IsWriteLockHeld
+        {
+            get { return m_writerThreadId == Thread.CurrentThread.ManagedThreadId; }
+        }
+
+        public void EnterReadLock()
+        {
+            var state = m_readerState.Value;
+            if (state.Depth > 0 || IsWriteLockHeld)
+            {
+                // recursive readers must not wait for a writer which waits for them
+                state.Depth++;
+                return;
+            }
+
+            // first counter is left unused, so that counters do not share cache lines with array header
+            var index = (state.Counter + 1) * CounterStride;
+            while (true)
+            {
+                Interlocked.Increment(ref m_readerCounters[index]);
+
+                // interlocked increment is a full fence, so either writer sees our counter, or we see its flag
+                if (!m_writerActive)
+                {
+                    break;
+                }
+
+                Interlocked.Decrement(ref m_readerCounters[index]);
+                lock (m_writerGate)
+                {
+                    // waiting for writer to finish
+                }
+            }
+
+            state.Depth = 1;
+        }
+
+        public void ExitReadLock()
+        {
+            var state = m_readerState.Value;
+            if (state.Depth <= 0)
+            {
+                throw new SynchronizationLockException("Read lock is not held by current thread");
+            }
+
+            state.Depth--;
+            if (state.Depth == 0 && !IsWriteLockHeld)
+            {
+                Interlocked.Decrement(ref m_readerCounters[(state.Counter + 1) * CounterStride]);
+            }
+        }
+
+        public void EnterWriteLock()
+        {
+            if (IsWriteLockHeld)
+            {
+                m_writeDepth++;
+                return;
+            }
+
+            if (m_readerState.Value.Depth > 0)
+            {
+                throw new LockRecursionException("Write lock may not be acquired with read lock held");
+            }
+
+            Monitor.Enter(m_writerGate);
+            try
+            {
+                m_writerActive = true;
+                Interlocked.MemoryBarrier();
+
+                var spinner = new SpinWait();
+                while (HasReaders())
+                {
+                    spinner.SpinOnce();
+                }
+            }
+            catch
+            {
+                m_writerActive = false;
+                Monitor.Exit(m_writerGate);
+                throw;
+            }
+
+            m_writerThreadId = Thread.CurrentThread.ManagedThreadId;
+            m_writeDepth = 1;
+        }
+
+        public void ExitWriteLock()
+        {
+            if (!IsWriteLockHeld)
+            {
+                throw new SynchronizationLockException("Write lock is not held by current thread");
+            }
+
+            m_writeDepth--;
+            if (m_writeDepth == 0)
+            {
+                if (m_readerState.Value.Depth > 0)
+                {
+                    // reads nested into write section have not been counted, count them from now on
+                    Interlocked.Increment(ref m_readerCounters[(m_readerState.Value.Counter + 1) * CounterStride]);
+                }
+
+                m_writerThreadId = 0;
+                m_writerActive = false;
+                Monitor.Exit(m_writerGate);
+            }
+        }
+
+        public void Dispose()
+        {
+            m_readerState.Dispose();
+        }
+
+        private bool HasReaders()
+        {
+            for (var index = CounterStride; index < m_readerCounters.Length; index += CounterStride)
+            {
+                if (Interlocked.Read(ref m_readerCounters[index]) != 0)
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        private sealed class ReaderState
+        {
+            public readonly int Counter;
+            public int Depth;
+
+            public ReaderState(int counter)
+            {
+                Counter = counter;
+            }
+        }
+    }
+}
@@ -1,6 +1,7 @@
 ﻿using System;
 using System.Collections.Generic;
-using Pql.Engine.Interfaces.Internal;
+using System.Threading;
+using System.Threading.Tasks;
 using Pql.ExpressionEngine.Interfaces;
 using Pql.UnmanagedLib;
 
@@ -8,26 +9,65 @@ namespace Pql.Engine.DataContainer.RamDriver
 {
     internal class SortIndex
     {
-        private int[] m_orderData;
-        private int m_validDocCount;
+        private volatile Snapshot m_current;
+        private int m_generation;
+        private volatile int m_builtGeneration;
+        private int m_droppedGeneration;
+
+        /// <summary>
+        /// Background rebuild currently in progress, if any. Guarded by lock on this index object.
+        /// </summary>
+        public Task RebuildTask;
 
         public int ValidDocCount
         {
-            get { return m_validDocCount; }
-            private set { m_validDocCount = value; }
+            get { var current = m_current; return current == null ? 0 : current.ValidDocCount; }
         }
 
         public int[] OrderData
         {
-            get { return m_orderData; }
-            private set { m_orderData = value; }
+            get { var current = m_current; return current == null ? new int[0] : current.OrderData; }
+        }
+
+        /// <summary>
+        /// Most recently published version of this index, or null if it was never built.
+        /// Published versions are immutable, so readers may keep using them while a newer one is being built.
+        /// </summary>
+        public Snapshot Current
+        {
+            get { return m_current; }
+        }
+
+        /// <summary>
+        /// Incremented every time underlying data is modified.
+        /// </summary>
+        public int Generation
+        {
+            get { return Volatile.Read(ref m_generation); }
+        }
+
+        /// <summary>
+        /// Value of <see cref="Generation"/> at the moment when data for <see cref="Current"/> was captured.
+        /// </summary>
+        public int BuiltGeneration
+        {
+            get { return m_builtGeneration; }
+        }
+
+        public bool IsValid
+        {
+            get { return m_current != null && m_builtGeneration == Generation; }
         }
 
         public SortIndex()
         {
-            OrderData = new int[0];
+            m_builtGeneration = -1;
         }
 
+        /// <summary>
+        /// Synchronously snapshots column data and rebuilds the index.
+        /// Caller is responsible for making sure that column data does not change while snapshots are taken.
+        /// </summary>
         public void Update<T>(ColumnData<T> columnStore, BitVector validDocumentsBitmap, int count)
         {
             if (columnStore == null)
@@ -35,87 +75,305 @@ namespace Pql.Engine.DataContainer.RamDriver
                 throw new ArgumentNullException("columnStore");
             }
 
-            // construct proper comparer
-            ItemComparer<T> comparer;
-            var type = typeof(T);
-            if (type.IsValueType)
+            if (validDocumentsBitmap == null)
             {
-                comparer = new ItemComparer<T>(columnStore.NotNulls, columnStore.DataArray, Comparer<T>.Default);
+                throw new ArgumentNullException("validDocumentsBitmap");
             }
-            else if (ReferenceEquals(type, typeof(string)))
+
+            var generation = Generation;
+            using (var column = columnStore.Snapshot())
+            using (var validDocuments = validDocumentsBitmap.Snapshot())
             {
-                comparer = new ItemComparer<T>(columnStore.NotNulls, columnStore.DataArray, (IComparer<T>)StringComparer.OrdinalIgnoreCase);
+                Publish(Build<T>(column, validDocuments, count), generation);
             }
-            else if (ReferenceEquals(type, typeof(SizableArrayOfByte)))
+        }
+
+        /// <summary>
+        /// Atomically replaces current version of this index with a newly built one.
+        /// </summary>
+        /// <param name="snapshot">New ordering</param>
+        /// <param name="generation">Value of <see cref="Generation"/> taken before data for the new ordering was captured</param>
+        public void Publish(Snapshot snapshot, int generation)
+        {
+            if (snapshot == null)
             {
-                comparer = new ItemComparer<T>(columnStore.NotNulls, columnStore.DataArray, (IComparer<T>)SizableArrayOfByte.DefaultComparer.Instance);
+                throw new ArgumentNullException("snapshot");
             }
-            else
+
+            lock (this)
+            {
+                // ordering captured before the last drop refers to document indexes that no longer exist
+                if (generation < m_droppedGeneration)
+                {
+                    return;
+                }
+
+                // order matters: readers check generation after they see the new snapshot
+                m_current = snapshot;
+                m_builtGeneration = generation;
+            }
+        }
+
+        public void Invalidate()
+        {
+            Interlocked.Increment(ref m_generation);
+        }
+
+        /// <summary>
+        /// Invalidates the index and forgets its current version, so that it cannot be served even as a stale read.
+        /// Used when document indexes are renumbered or removed, e.g. by trimming of trailing deleted documents.
+        /// Versions captured before this call are discarded when published.
+        /// </summary>
+        public void Drop()
+        {
+            lock (this)
+            {
+                m_droppedGeneration = Interlocked.Increment(ref m_generation);
+                m_builtGeneration = -1;
+                m_current = null;
+            }
+        }
+
+        /// <summary>
+        /// Builds ordering of valid documents from frozen images of column data and valid documents bitmap,
+        /// see <see cref="DocumentDataContainer.ReadFromSnapshots{T}"/>. Images must stay alive until this method returns.
+        /// Strings and binary values are compared right inside the column image, without being copied out of it.
+        /// </summary>
+        public static Snapshot Build<T>(ColumnDataSnapshot column, BitVectorSnapshot validDocuments, int count)
+        {
+            if (column == null)
+            {
+                throw new ArgumentNullException("column");
+            }
+
+            if (validDocuments == null)
             {
-                throw new Exception("Sort indexes are not supported for this type: " + type.FullName);
+                throw new ArgumentNullException("validDocuments");
             }
 
-            // reinitialize index with sequential documentIDs (initial order does not matter)
+            var docs = new int[count];
+            var notNulls = column.NotNulls;
+            var validCount = (int) Math.Min((ulong) count, validDocuments.Capacity);
+            var notNullCount = (int) Math.Min((ulong) count, notNulls.Capacity);
+
             // only use those document indexes that are not marked as deleted
-            ArrayUtils.EnsureCapacity(ref m_orderData, count);
-            m_validDocCount = 0;
-            for (var i = 0; i < m_orderData.Length; i++)
+            // NULL values are collected from the head, non-NULL values from the tail
+            var head = 0;
+            var tail = count;
+            for (var i = 0; i < validCount; i++)
+            {
+                if (!validDocuments.Get(i))
+                {
+                    continue;
+                }
+
+                if (i < notNullCount && notNulls.Get(i))
+                {
+                    tail--;
+                    docs[tail] = i;
+                }
+                else
+                {
+                    docs[head] = i;
+                    head++;
+                }
+            }
+
+            // close the gap left by deleted documents
+            var valueCount = count - tail;
+            if (tail > head)
+            {
+                Array.Copy(docs, tail, docs, head, valueCount);
+                Array.Clear(docs, head + valueCount, count - head - valueCount);
+            }
+
+            // NULLs always go first, their relative order does not matter
+            // now reorder remaining document indexes based on data values they point to
+            var type = typeof(T);
+            var varLength = column as ColumnData<T>.VarLengthDataSnapshot;
+            if (varLength != null)
+            {
+                IComparer<int> comparer;
+                if (ReferenceEquals(type, typeof(string)))
+                {
+                    comparer = new StringValueComparer(varLength.Data);
+                }
+                else if (ReferenceEquals(type, typeof(SizableArrayOfByte)))
+                {
+                    comparer = new BinaryValueComparer(varLength.Data);
+                }
+                else
+                {
+                    throw new Exception("Sort indexes are not supported for this type: " + type.FullName);
+                }
+
+                Array.Sort(docs, head, valueCount, comparer);
+            }
+            else
             {
-                if (validDocumentsBitmap.SafeGet(i))
+                if (!type.IsValueType)
+                {
+                    throw new Exception("Sort indexes are not supported for this type: " + type.FullName);
+                }
+
+                // fixed-size values are cheap to copy, and sorting them as keys is faster than comparing through the image
+                var data = ((ColumnData<T>.FixedSizeDataSnapshot) column).Data;
+                var values = new T[head + valueCount];
+                for (var i = head; i < values.Length; i++)
                 {
-                    OrderData[m_validDocCount] = i;
-                    m_validDocCount++;
+                    values[i] = data[docs[i]];
                 }
+
+                Array.Sort(values, docs, head, valueCount, Comparer<T>.Default);
+            }
+
+            return new Snapshot(docs, head + valueCount);
+        }
+
+        /// <summary>
+        /// Copies normalized composite keys of valid documents out of the column stores, so that sorting can run without holding any locks.
+        /// Caller must hold StructureLock in read mode, to make sure that column stores are not replaced while being copied.
+        /// </summary>
+        public static ColumnSnapshot CaptureCompositeSnapshot(SortKeyFieldWriter[] fieldWriters, BitVector validDocumentsBitmap, int count)
+        {
+            if (fieldWriters == null || fieldWriters.Length == 0)
+            {
+                throw new ArgumentNullException("fieldWriters");
+            }
+
+            if (validDocumentsBitmap == null)
+            {
+                throw new ArgumentNullException("validDocumentsBitmap");
+            }
+
+            return new CompositeColumnSnapshot(fieldWriters, validDocumentsBitmap, count);
+        }
+
+        /// <summary>
+        /// Immutable version of an ordering.
+        /// </summary>
+        public sealed class Snapshot
+        {
+            public readonly int[] OrderData;
+            public readonly int ValidDocCount;
+
+            public Snapshot(int[] orderData, int validDocCount)
+            {
+                if (orderData == null)
+                {
+                    throw new ArgumentNullException("orderData");
+                }
+
+                if (validDocCount < 0 || validDocCount > orderData.Length)
+                {
+                    throw new ArgumentOutOfRangeException("validDocCount", validDocCount, "Valid document count must be within bounds of order data");
+                }
+
+                OrderData = orderData;
+                ValidDocCount = validDocCount;
+            }
+        }
+
+        /// <summary>
+        /// Private copy of composite sort keys, detached from the live column stores.
+        /// </summary>
+        public abstract class ColumnSnapshot
+        {
+            public abstract Snapshot Sort();
+        }
+
+        /// <summary>
+        /// Compares documents by their string values, same as <see cref="StringComparer.OrdinalIgnoreCase"/>.
+        /// </summary>
+        private sealed class StringValueComparer : IComparer<int>
+        {
+            private readonly ExpandableArrayOfValuesSnapshot m_values;
+
+            public StringValueComparer(ExpandableArrayOfValuesSnapshot values)
+            {
+                m_values = values;
             }
-            
-            // now reorder those integers based on data values they point to
-            Array.Sort(OrderData, 0, m_validDocCount, comparer);
 
-            IsValid = true;
+            public int Compare(int x, int y)
+            {
+                return m_values.CompareStringsIgnoreCase(x, y);
+            }
         }
 
-        public class ItemComparer<TUnderlyingValue> : IComparer<int>
+        /// <summary>
+        /// Compares documents by their binary values, same as <see cref="SizableArrayOfByte.DefaultComparer"/>.
+        /// </summary>
+        private sealed class BinaryValueComparer : IComparer<int>
         {
-            private readonly BitVector m_notNulls;
-            private readonly ExpandableArray<TUnderlyingValue> m_data;
-            private readonly IComparer<TUnderlyingValue> m_valueComparer;
+            private readonly ExpandableArrayOfValuesSnapshot m_values;
 
-            public ItemComparer(BitVector notNulls, ExpandableArray<TUnderlyingValue> data, IComparer<TUnderlyingValue> valueComparer)
+            public BinaryValueComparer(ExpandableArrayOfValuesSnapshot values)
             {
-                m_notNulls = notNulls ?? throw new ArgumentNullException("notNulls");
-                m_data = data ?? throw new ArgumentNullException("data");
-                m_valueComparer = valueComparer ?? throw new ArgumentNullException("valueComparer");
+                m_values = values;
             }
 
             public int Compare(int x, int y)
             {
-                var notnullX = m_notNulls.SafeGet(x);
-                var notnullY = m_notNulls.SafeGet(y);
+                return m_values.CompareBytes(x, y);
+            }
+        }
+
+        private sealed class CompositeColumnSnapshot : ColumnSnapshot
+        {
+            private readonly int[] m_docs;
+            private readonly int[] m_keyOffsets;
+            private readonly byte[] m_keys;
+            private readonly int m_validDocCount;
+
+            public CompositeColumnSnapshot(SortKeyFieldWriter[] fieldWriters, BitVector validDocumentsBitmap, int count)
+            {
+                m_docs = new int[count];
+                m_keyOffsets = new int[count + 1];
+                var keys = new SortKeyBuffer((int) Math.Min((long) count * 8 * fieldWriters.Length, 1 << 30));
 
-                if (notnullX)
+                // only use those document indexes that are not marked as deleted
+                var slot = 0;
+                for (var i = 0; i < count; i++)
                 {
-                    if (notnullY)
+                    if (!validDocumentsBitmap.SafeGet(i))
                     {
-                        return m_valueComparer.Compare(m_data[x], m_data[y]);
+                        continue;
                     }
 
-                    return 1;
+                    m_docs[slot] = i;
+                    m_keyOffsets[slot] = keys.Length;
+                    foreach (var writer in fieldWriters)
+                    {
+                        writer.Write(i, keys);
+                    }
+
+                    slot++;
                 }
 
-                if (notnullY)
+                m_keyOffsets[slot] = keys.Length;
+                m_keys = keys.Data;
+                m_validDocCount = slot;
+            }
+
+            public override Snapshot Sort()
+            {
+                // sort key slots, then map them back to document indexes
+                var slots = new int[m_validDocCount];
+                for (var i = 0; i < slots.Length; i++)
                 {
-                    return -1;
+                    slots[i] = i;
                 }
 
-                return 0;
-            }
-        }
+                Array.Sort(slots, new SortKeyBuffer.SegmentComparer(m_keys, m_keyOffsets));
 
-        public void Invalidate()
-        {
-            IsValid = false;
-        }
+                var orderData = new int[m_docs.Length];
+                for (var i = 0; i < slots.Length; i++)
+                {
+                    orderData[i] = m_docs[slots[i]];
+                }
 
-        public bool IsValid { get; private set; }
+                return new Snapshot(orderData, m_validDocCount);
+            }
+        }
     }
-}
\ No newline at end of file
+}
@@ -1,7 +1,11 @@
 ﻿using System;
 using System.Collections.Concurrent;
+using System.Collections.Generic;
 using System.Reflection;
 using System.Runtime.CompilerServices;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Pql.Engine.DataContainer.RamDriver
 {
@@ -10,6 +14,13 @@ namespace Pql.Engine.DataContainer.RamDriver
         private readonly ConcurrentDictionary<int, int> m_fieldIdToIndexHandle;
         private readonly SortIndex[] m_fieldIndexes;
         private readonly DocumentDataContainer m_documentStore;
+        private readonly ConcurrentDictionary<string, CompositeSortIndex> m_compositeIndexes;
+        
+        /// <summary>
+        /// For every field's index handle, holds composite indexes that include this field.
+        /// Elements are replaced as a whole when a new composite index is created.
+        /// </summary>
+        private readonly SortIndex[][] m_dependentCompositeIndexes;
 
         public SortIndexManager(DocumentDataContainer documentStore)
         {
@@ -22,6 +33,8 @@ namespace Pql.Engine.DataContainer.RamDriver
             }
             
             m_fieldIndexes = new SortIndex[m_documentStore.FieldIdToColumnStore.Count];
+            m_dependentCompositeIndexes = new SortIndex[m_fieldIndexes.Length][];
+            m_compositeIndexes = new ConcurrentDictionary<string, CompositeSortIndex>();
             for (var ordinal = 0; ordinal < m_fieldIndexes.Length; ordinal++)
             {
                 m_fieldIndexes[ordinal] = new SortIndex();
@@ -35,6 +48,15 @@ namespace Pql.Engine.DataContainer.RamDriver
             if (m_fieldIdToIndexHandle.TryGetValue(fieldId, out var handle))
             {
                 m_fieldIndexes[handle].Invalidate();
+
+                var dependents = Volatile.Read(ref m_dependentCompositeIndexes[handle]);
+                if (dependents != null)
+                {
+                    foreach (var sortIndex in dependents)
+                    {
+                        sortIndex.Invalidate();
+                    }
+                }
             }
         }
 
@@ -45,44 +67,302 @@ namespace Pql.Engine.DataContainer.RamDriver
             {
                 sortIndex.Invalidate();
             }
+
+            foreach (var composite in m_compositeIndexes.Values)
+            {
+                composite.Index.Invalidate();
+            }
         }
 
-        public SortIndex GetIndex(int fieldId, int count)
+        /// <summary>
+        /// Invalidates all indexes and discards their current versions.
+        /// Must be called under exclusive StructureLock whenever existing document indexes go away.
+        /// </summary>
+        public void DropAllIndexes()
+        {
+            foreach (var sortIndex in m_fieldIndexes)
+            {
+                sortIndex.Drop();
+            }
+
+            foreach (var composite in m_compositeIndexes.Values)
+            {
+                composite.Index.Drop();
+            }
+        }
+
+        /// <summary>
+        /// Returns a version of the sort index on a given field.
+        /// If index is stale, it is rebuilt in background without blocking writers.
+        /// Depending on <see cref="RamDriverSettings.AllowStaleSortIndexReads"/>, caller either gets previous version of the index right away,
+        /// or waits until a version that reflects all modifications made before this call is published.
+        /// </summary>
+        public SortIndex.Snapshot GetIndex(int fieldId)
         {
             var index = m_fieldIndexes[m_fieldIdToIndexHandle[fieldId]];
+            return GetIndexVersion(index, () => UpdateIndex(fieldId, index));
+        }
 
-            if (!index.IsValid)
+        /// <summary>
+        /// Returns a version of the sort index for given ordering, which may include multiple fields.
+        /// Composite indexes are created on first use and are maintained same way as single-field ones.
+        /// </summary>
+        /// <param name="orderFields">Pairs of field ID and descending flag</param>
+        /// <param name="descending">Whether the returned index has to be scanned backwards</param>
+        public SortIndex.Snapshot GetIndex(IReadOnlyList<Tuple<int, bool>> orderFields, out bool descending)
+        {
+            if (orderFields == null || orderFields.Count == 0)
             {
-                lock (index)
-                {
-                    UpdateIndex(fieldId, index, count);
-                }
+                throw new ArgumentNullException("orderFields");
             }
 
-            return index;
+            descending = orderFields[0].Item2;
+            if (orderFields.Count == 1)
+            {
+                return GetIndex(orderFields[0].Item1);
+            }
+
+            // composite index is always built so that its first field is ascending,
+            // this way "a desc, b asc" can be served by scanning "a asc, b desc" backwards
+            var composite = RequireCompositeIndex(orderFields, descending);
+            return GetIndexVersion(composite.Index, () => UpdateCompositeIndex(composite));
         }
 
-        internal void UpdateIndex(int fieldId, SortIndex index, int count)
+        private SortIndex.Snapshot GetIndexVersion(SortIndex index, Action update)
         {
-            if (!index.IsValid)
+            if (index.IsValid)
+            {
+                return index.Current;
+            }
+
+            var requestedGeneration = index.Generation;
+            var rebuild = BeginUpdateIndex(index, update);
+
+            var current = index.Current;
+            if (CanReadStale(current))
+            {
+                return current;
+            }
+
+            // rebuild that was already running when we came in may have captured data before latest modifications
+            while (index.BuiltGeneration < requestedGeneration || index.Current == null)
             {
-                var columnStore = m_documentStore.RequireColumnStore(fieldId);
-                
-                var method = typeof (SortIndex).GetMethod("Update").MakeGenericMethod(columnStore.ElementType);
-                
-                m_documentStore.StructureLock.EnterWriteLock();
                 try
                 {
-                    method.Invoke(index, new object[] { columnStore, m_documentStore.ValidDocumentsBitmap, count });
+                    rebuild.Wait();
                 }
-                catch (TargetInvocationException e)
+                catch (AggregateException e)
                 {
                     throw e.InnerException;
                 }
-                finally
+
+                rebuild = BeginUpdateIndex(index, update);
+            }
+
+            return index.Current;
+        }
+
+        private static Task BeginUpdateIndex(SortIndex index, Action update)
+        {
+            lock (index)
+            {
+                var task = index.RebuildTask;
+                if (task == null || task.IsCompleted)
                 {
-                    m_documentStore.StructureLock.ExitWriteLock();
+                    task = new Task(update, TaskCreationOptions.LongRunning);
+                    index.RebuildTask = task;
+                    task.Start();
                 }
+
+                return task;
+            }
+        }
+
+        /// <summary>
+        /// Returns true if index for given ordering can be used right away, without waiting for it to be built.
+        /// Does not create or rebuild any indexes.
+        /// </summary>
+        public bool IsIndexReady(IReadOnlyList<Tuple<int, bool>> orderFields)
+        {
+            if (orderFields == null || orderFields.Count == 0)
+            {
+                throw new ArgumentNullException("orderFields");
+            }
+
+            SortIndex index;
+            if (orderFields.Count == 1)
+            {
+                index = m_fieldIndexes[m_fieldIdToIndexHandle[orderFields[0].Item1]];
+            }
+            else if (m_compositeIndexes.TryGetValue(GetCompositeIndexName(orderFields, orderFields[0].Item2), out var composite))
+            {
+                index = composite.Index;
+            }
+            else
+            {
+                return false;
+            }
+
+            return index.IsValid || CanReadStale(index.Current);
+        }
+
+        /// <summary>
+        /// Returns true if given version of an index may be served as a stale read.
+        /// Versions that refer to documents beyond current row count are never served, even if trim failed to drop them.
+        /// </summary>
+        private bool CanReadStale(SortIndex.Snapshot current)
+        {
+            return current != null
+                   && m_documentStore.Settings.AllowStaleSortIndexReads
+                   && current.OrderData.Length <= m_documentStore.UntrimmedCount;
+        }
+
+        private static string GetCompositeIndexName(IReadOnlyList<Tuple<int, bool>> orderFields, bool invert)
+        {
+            var name = new StringBuilder();
+            foreach (var field in orderFields)
+            {
+                name.Append(field.Item1).Append(field.Item2 ^ invert ? "-" : "+");
+            }
+
+            return name.ToString();
+        }
+
+        private CompositeSortIndex RequireCompositeIndex(IReadOnlyList<Tuple<int, bool>> orderFields, bool invert)
+        {
+            var fieldIds = new int[orderFields.Count];
+            var descending = new bool[orderFields.Count];
+            for (var i = 0; i < fieldIds.Length; i++)
+            {
+                fieldIds[i] = orderFields[i].Item1;
+                descending[i] = orderFields[i].Item2 ^ invert;
+
+                if (!m_fieldIdToIndexHandle.ContainsKey(fieldIds[i]))
+                {
+                    throw new ArgumentException("Field does not belong to this document type: " + fieldIds[i], "orderFields");
+                }
+            }
+
+            var key = GetCompositeIndexName(orderFields, invert);
+            if (m_compositeIndexes.TryGetValue(key, out var composite))
+            {
+                return composite;
+            }
+
+            lock (m_compositeIndexes)
+            {
+                if (!m_compositeIndexes.TryGetValue(key, out composite))
+                {
+                    composite = new CompositeSortIndex(fieldIds, descending);
+
+                    // register for invalidation before publishing, so that no modification is missed
+                    foreach (var fieldId in fieldIds)
+                    {
+                        var handle = m_fieldIdToIndexHandle[fieldId];
+                        var dependents = m_dependentCompositeIndexes[handle];
+                        var newDependents = new SortIndex[dependents == null ? 1 : dependents.Length + 1];
+                        if (dependents != null)
+                        {
+                            Array.Copy(dependents, newDependents, dependents.Length);
+                        }
+
+                        newDependents[newDependents.Length - 1] = composite.Index;
+                        Volatile.Write(ref m_dependentCompositeIndexes[handle], newDependents);
+                    }
+
+                    m_compositeIndexes[key] = composite;
+                }
+            }
+
+            return composite;
+        }
+
+        internal void UpdateIndex(int fieldId, SortIndex index)
+        {
+            // generation must be taken before data is captured, 
+            // so that modifications made during capture make this version stale
+            var generation = index.Generation;
+            if (index.IsValid)
+            {
+                return;
+            }
+
+            // make sure column is fully loaded before taking any locks
+            m_documentStore.RequireColumnStore(fieldId);
+
+            // element type does not change when column stores get replaced on migration
+            var elementType = m_documentStore.ColumnStores[m_documentStore.FieldIdToColumnStore[fieldId]].ElementType;
+            var method = typeof (SortIndex).GetMethod("Build").MakeGenericMethod(elementType);
+
+            // sort runs over copy-on-write images of the column, so that writers are not blocked by it
+            // and string or binary values are not copied out of the column store
+            var snapshot = m_documentStore.ReadFromSnapshots(
+                new[] {fieldId},
+                (count, validDocuments, columns) =>
+                {
+                    try
+                    {
+                        return (SortIndex.Snapshot) method.Invoke(null, new object[] {columns[0], validDocuments, count});
+                    }
+                    catch (TargetInvocationException e)
+                    {
+                        throw e.InnerException;
+                    }
+                });
+
+            index.Publish(snapshot, generation);
+        }
+
+        private void UpdateCompositeIndex(CompositeSortIndex composite)
+        {
+            var index = composite.Index;
+            var generation = index.Generation;
+            if (index.IsValid)
+            {
+                return;
+            }
+
+            foreach (var fieldId in composite.FieldIds)
+            {
+                m_documentStore.RequireColumnStore(fieldId);
+            }
+
+            SortIndex.ColumnSnapshot snapshot;
+            m_documentStore.StructureLock.EnterReadLock();
+            try
+            {
+                var writers = new SortKeyFieldWriter[composite.FieldIds.Length];
+                for (var i = 0; i < writers.Length; i++)
+                {
+                    var columnStore = m_documentStore.ColumnStores[m_documentStore.FieldIdToColumnStore[composite.FieldIds[i]]];
+                    writers[i] = SortKeyFieldWriter.Create(columnStore, composite.Descending[i]);
+                }
+
+                snapshot = SortIndex.CaptureCompositeSnapshot(writers, m_documentStore.ValidDocumentsBitmap, m_documentStore.UntrimmedCount);
+            }
+            catch (TargetInvocationException e)
+            {
+                throw e.InnerException;
+            }
+            finally
+            {
+                m_documentStore.StructureLock.ExitReadLock();
+            }
+
+            index.Publish(snapshot.Sort(), generation);
+        }
+
+        private sealed class CompositeSortIndex
+        {
+            public readonly int[] FieldIds;
+            public readonly bool[] Descending;
+            public readonly SortIndex Index;
+
+            public CompositeSortIndex(int[] fieldIds, bool[] descending)
+            {
+                FieldIds = fieldIds;
+                Descending = descending;
+                Index = new SortIndex();
             }
         }
     }
@@ -0,0 +1,377 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Runtime.CompilerServices;
+using Pql.ExpressionEngine.Interfaces;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Accumulates normalized sort keys of many documents in a single contiguous buffer.
+    /// Normalized keys are compared as unsigned byte strings, shorter key goes first if it is a prefix of a longer one.
+    /// </summary>
+    internal sealed class SortKeyBuffer
+    {
+        public byte[] Data;
+        public int Length;
+
+        public SortKeyBuffer(int initialCapacity)
+        {
+            Data = new byte[initialCapacity > 16 ? initialCapacity : 16];
+        }
+
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public void Append(byte value)
+        {
+            if (Length == Data.Length)
+            {
+                Grow(1);
+            }
+
+            Data[Length++] = value;
+        }
+
+        /// <summary>
+        /// Appends lowest <paramref name="byteCount"/> bytes of a value, most significant byte first.
+        /// </summary>
+        [MethodImpl(MethodImplOptions.AggressiveInlining)]
+        public void AppendBigEndian(ulong value, int byteCount)
+        {
+            if (Length + byteCount > Data.Length)
+            {
+                Grow(byteCount);
+            }
+
+            for (var shift = (byteCount - 1) * 8; shift >= 0; shift -= 8)
+            {
+                Data[Length++] = (byte) (value >> shift);
+            }
+        }
+
+        /// <summary>
+        /// Appends variable-length byte string in a prefix-free form:
+        /// zero bytes are escaped as 0x00 0xFF, and the string is terminated with 0x00 0x01.
+        /// </summary>
+        public void AppendEscaped(byte[] data, int count)
+        {
+            for (var i = 0; i < count; i++)
+            {
+                var value = data[i];
+                Append(value);
+                if (value == 0)
+                {
+                    Append(0xFF);
+                }
+            }
+
+            Append(0);
+            Append(1);
+        }
+
+        /// <summary>
+        /// Flips all bits of the key tail starting at given position, which reverses its sort order.
+        /// Only valid for prefix-free encodings.
+        /// </summary>
+        public void Invert(int start)
+        {
+            for (var i = start; i < Length; i++)
+            {
+                Data[i] = (byte) ~Data[i];
+            }
+        }
+
+        private void Grow(int minIncrement)
+        {
+            var newCapacity = Math.Max((long) Data.Length * 2, (long) Length + minIncrement);
+            if (newCapacity > 0x7FFFFFC7)
+            {
+                newCapacity = 0x7FFFFFC7;
+                if (newCapacity < (long) Length + minIncrement)
+                {
+                    throw new InsufficientMemoryException("Sort keys are too large to fit into a single buffer");
+                }
+            }
+
+            var newData = new byte[newCapacity];
+            Buffer.BlockCopy(Data, 0, newData, 0, Length);
+            Data = newData;
+        }
+
+        public sealed class SegmentComparer : IComparer<int>
+        {
+            private readonly byte[] m_data;
+            private readonly int[] m_offsets;
+
+            /// <param name="data">Buffer with keys</param>
+            /// <param name="offsets">Start offset of every key, followed by end offset of the last key</param>
+            public SegmentComparer(byte[] data, int[] offsets)
+            {
+                m_data = data ?? throw new ArgumentNullException("data");
+                m_offsets = offsets ?? throw new ArgumentNullException("offsets");
+            }
+
+            public int Compare(int x, int y)
+            {
+                var data = m_data;
+                var posX = m_offsets[x];
+                var endX = m_offsets[x + 1];
+                var posY = m_offsets[y];
+                var endY = m_offsets[y + 1];
+
+                while (posX < endX && posY < endY)
+                {
+                    var diff = data[posX] - data[posY];
+                    if (diff != 0)
+                    {
+                        return diff;
+                    }
+
+                    posX++;
+                    posY++;
+                }
+
+                return (endX - posX) - (endY - posY);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Writes normalized sort key segment for one column of a composite sort index.
+    /// Every segment starts with a NULL marker, so that NULLs go first in ascending order, same as in single-column indexes.
+    /// </summary>
+    internal abstract class SortKeyFieldWriter
+    {
+        public abstract void Write(int docIndex, SortKeyBuffer buffer);
+
+        public static SortKeyFieldWriter Create(ColumnDataBase columnStore, bool descending)
+        {
+            if (columnStore == null)
+            {
+                throw new ArgumentNullException("columnStore");
+            }
+
+            var writerType = typeof (SortKeyFieldWriter<>).MakeGenericType(columnStore.ElementType);
+            return (SortKeyFieldWriter) Activator.CreateInstance(writerType, columnStore, descending);
+        }
+    }
+
+    internal sealed class SortKeyFieldWriter<T> : SortKeyFieldWriter
+    {
+        private readonly ColumnData<T> m_column;
+        private readonly BitVector m_notNulls;
+        private readonly bool m_descending;
+        private readonly Action<T, SortKeyBuffer> m_encoder;
+
+        public SortKeyFieldWriter(ColumnDataBase columnStore, bool descending)
+        {
+            var typed = (ColumnData<T>) columnStore;
+            m_column = typed;
+            m_notNulls = typed.NotNulls;
+            m_descending = descending;
+            m_encoder = SortKeyEncoder<T>.Encode;
+        }
+
+        public override void Write(int docIndex, SortKeyBuffer buffer)
+        {
+            var start = buffer.Length;
+            if (m_notNulls.SafeGet(docIndex))
+            {
+                buffer.Append(1);
+                m_encoder(m_column.GetValue(docIndex), buffer);
+            }
+            else
+            {
+                buffer.Append(0);
+            }
+
+            if (m_descending)
+            {
+                buffer.Invert(start);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Order-preserving binary encodings of supported column types.
+    /// Resulting order must match comparers used by single-column <see cref="SortIndex"/>.
+    /// </summary>
+    internal static class SortKeyEncoder<T>
+    {
+        public static readonly Action<T, SortKeyBuffer> Encode;
+
+        static SortKeyEncoder()
+        {
+            Encode = (Action<T, SortKeyBuffer>) CreateEncoder(typeof (T));
+        }
+
+        private static Delegate CreateEncoder(Type type)
+        {
+            if (type == typeof (bool))
+            {
+                return new Action<bool, SortKeyBuffer>((v, b) => b.Append(v ? (byte) 1 : (byte) 0));
+            }
+            if (type == typeof (byte))
+            {
+                return new Action<byte, SortKeyBuffer>((v, b) => b.Append(v));
+            }
+            if (type == typeof (sbyte))
+            {
+                return new Action<sbyte, SortKeyBuffer>((v, b) => b.Append((byte) (v ^ sbyte.MinValue)));
+            }
+            if (type == typeof (short))
+            {
+                return new Action<short, SortKeyBuffer>((v, b) => b.AppendBigEndian((ushort) (v ^ short.MinValue), 2));
+            }
+            if (type == typeof (ushort))
+            {
+                return new Action<ushort, SortKeyBuffer>((v, b) => b.AppendBigEndian(v, 2));
+            }
+            if (type == typeof (int))
+            {
+                return new Action<int, SortKeyBuffer>((v, b) => b.AppendBigEndian((uint) (v ^ int.MinValue), 4));
+            }
+            if (type == typeof (uint))
+            {
+                return new Action<uint, SortKeyBuffer>((v, b) => b.AppendBigEndian(v, 4));
+            }
+            if (type == typeof (long))
+            {
+                return new Action<long, SortKeyBuffer>((v, b) => b.AppendBigEndian((ulong) (v ^ long.MinValue), 8));
+            }
+            if (type == typeof (ulong))
+            {
+                return new Action<ulong, SortKeyBuffer>((v, b) => b.AppendBigEndian(v, 8));
+            }
+            if (type == typeof (float))
+            {
+                return new Action<float, SortKeyBuffer>((v, b) => b.AppendBigEndian(NormalizeDouble(v), 8));
+            }
+            if (type == typeof (double))
+            {
+                return new Action<double, SortKeyBuffer>((v, b) => b.AppendBigEndian(NormalizeDouble(v), 8));
+            }
+            if (type == typeof (decimal))
+            {
+                return new Action<decimal, SortKeyBuffer>(EncodeDecimal);
+            }
+            if (type == typeof (DateTime))
+            {
+                // default comparer ignores DateTimeKind
+                return new Action<DateTime, SortKeyBuffer>((v, b) => b.AppendBigEndian((ulong) (v.Ticks ^ long.MinValue), 8));
+            }
+            if (type == typeof (DateTimeOffset))
+            {
+                return new Action<DateTimeOffset, SortKeyBuffer>((v, b) => b.AppendBigEndian((ulong) (v.UtcTicks ^ long.MinValue), 8));
+            }
+            if (type == typeof (TimeSpan))
+            {
+                return new Action<TimeSpan, SortKeyBuffer>((v, b) => b.AppendBigEndian((ulong) (v.Ticks ^ long.MinValue), 8));
+            }
+            if (type == typeof (Guid))
+            {
+                return new Action<Guid, SortKeyBuffer>(EncodeGuid);
+            }
+            if (type == typeof (string))
+            {
+                return new Action<string, SortKeyBuffer>(EncodeString);
+            }
+            if (type == typeof (SizableArrayOfByte))
+            {
+                return new Action<SizableArrayOfByte, SortKeyBuffer>((v, b) => b.AppendEscaped(v.Data, v.Length));
+            }
+
+            throw new Exception("Sort indexes are not supported for this type: " + type.FullName);
+        }
+
+        private static ulong NormalizeDouble(double value)
+        {
+            // default comparer puts NaN below everything else and treats negative zero as zero
+            if (double.IsNaN(value))
+            {
+                return 0;
+            }
+
+            if (value == 0)
+            {
+                value = 0;
+            }
+
+            var bits = (ulong) BitConverter.DoubleToInt64Bits(value);
+            return (bits & 0x8000000000000000UL) != 0 ? ~bits : bits | 0x8000000000000000UL;
+        }
+
+        private static void EncodeDecimal(decimal value, SortKeyBuffer buffer)
+        {
+            // integral part is at most 96 bits, fractional part scaled by 10^28 is an integer below 10^28,
+            // so both fit into decimal's mantissa without rounding
+            var negative = value < 0;
+            var magnitude = negative ? -value : value;
+            var integral = decimal.Truncate(magnitude);
+            var fraction = (magnitude - integral) * 10000000000000000000000000000m;
+
+            var start = buffer.Length;
+            buffer.Append(negative ? (byte) 0 : (byte) 1);
+
+            var magnitudeStart = buffer.Length;
+            AppendMantissa(integral, buffer);
+            AppendMantissa(decimal.Truncate(fraction), buffer);
+
+            if (negative)
+            {
+                buffer.Invert(magnitudeStart);
+            }
+        }
+
+        private static void AppendMantissa(decimal value, SortKeyBuffer buffer)
+        {
+            var bits = decimal.GetBits(value);
+            buffer.AppendBigEndian((uint) bits[2], 4);
+            buffer.AppendBigEndian((uint) bits[1], 4);
+            buffer.AppendBigEndian((uint) bits[0], 4);
+        }
+
+        private static void EncodeGuid(Guid value, SortKeyBuffer buffer)
+        {
+            // Guid.CompareTo compares first three components as unsigned integers, then remaining bytes in order;
+            // ToByteArray returns first three components in little-endian
+            var bytes = value.ToByteArray();
+            buffer.Append(bytes[3]);
+            buffer.Append(bytes[2]);
+            buffer.Append(bytes[1]);
+            buffer.Append(bytes[0]);
+            buffer.Append(bytes[5]);
+            buffer.Append(bytes[4]);
+            buffer.Append(bytes[7]);
+            buffer.Append(bytes[6]);
+            for (var i = 8; i < 16; i++)
+            {
+                buffer.Append(bytes[i]);
+            }
+        }
+
+        private static void EncodeString(string value, SortKeyBuffer buffer)
+        {
+            // single-column indexes use case-insensitive ordinal comparison,
+            // which is equivalent to ordinal comparison of upper-cased strings
+            var upper = value.ToUpperInvariant();
+            for (var i = 0; i < upper.Length; i++)
+            {
+                var c = upper[i];
+                buffer.Append((byte) (c >> 8));
+                if ((c >> 8) == 0)
+                {
+                    buffer.Append(0xFF);
+                }
+
+                buffer.Append((byte) c);
+                if ((c & 0xFF) == 0)
+                {
+                    buffer.Append(0xFF);
+                }
+            }
+
+            buffer.Append(0);
+            buffer.Append(1);
+        }
+    }
+}
@@ -0,0 +1,182 @@
+﻿using System;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Bounded max-heap that retains documents with K smallest normalized sort keys.
+    /// Ties on keys are broken by document index, so that results do not depend on scan order.
+    /// Not thread-safe: parallel scans fill one heap per worker and merge them afterwards.
+    /// </summary>
+    internal sealed class TopKHeap
+    {
+        private readonly int m_capacity;
+        private readonly byte[][] m_keys;
+        private readonly int[] m_docs;
+        private int m_count;
+
+        public TopKHeap(int capacity)
+        {
+            if (capacity <= 0)
+            {
+                throw new ArgumentOutOfRangeException("capacity", capacity, "Capacity must be positive");
+            }
+
+            m_capacity = capacity;
+            m_keys = new byte[capacity][];
+            m_docs = new int[capacity];
+        }
+
+        public int Count
+        {
+            get { return m_count; }
+        }
+
+        /// <summary>
+        /// Attempts to put a document into the heap. Key data is copied if document is admitted.
+        /// </summary>
+        /// <returns>False if heap is full and all retained documents go before this one</returns>
+        public bool Offer(byte[] keyData, int keyLength, int doc)
+        {
+            if (m_count < m_capacity)
+            {
+                var pos = m_count++;
+                m_keys[pos] = CopyKey(keyData, keyLength, null);
+                m_docs[pos] = doc;
+                SiftUp(pos);
+                return true;
+            }
+
+            if (Compare(keyData, keyLength, doc, m_keys[0], m_keys[0].Length, m_docs[0]) >= 0)
+            {
+                return false;
+            }
+
+            m_keys[0] = CopyKey(keyData, keyLength, m_keys[0]);
+            m_docs[0] = doc;
+            SiftDown(0);
+            return true;
+        }
+
+        /// <summary>
+        /// Offers all documents retained by another heap.
+        /// </summary>
+        public void MergeFrom(TopKHeap other)
+        {
+            if (other == null)
+            {
+                throw new ArgumentNullException("other");
+            }
+
+            for (var i = 0; i < other.m_count; i++)
+            {
+                Offer(other.m_keys[i], other.m_keys[i].Length, other.m_docs[i]);
+            }
+        }
+
+        /// <summary>
+        /// Empties the heap and returns retained documents in ascending order of their keys.
+        /// </summary>
+        public int[] DrainSorted()
+        {
+            var result = new int[m_count];
+            while (m_count > 0)
+            {
+                result[m_count - 1] = m_docs[0];
+
+                m_count--;
+                m_keys[0] = m_keys[m_count];
+                m_docs[0] = m_docs[m_count];
+                m_keys[m_count] = null;
+                SiftDown(0);
+            }
+
+            return result;
+        }
+
+        private void SiftUp(int pos)
+        {
+            while (pos > 0)
+            {
+                var parent = (pos - 1) >> 1;
+                if (CompareAt(pos, parent) <= 0)
+                {
+                    break;
+                }
+
+                Swap(pos, parent);
+                pos = parent;
+            }
+        }
+
+        private void SiftDown(int pos)
+        {
+            while (true)
+            {
+                var largest = pos;
+                var left = (pos << 1) + 1;
+                var right = left + 1;
+
+                if (left < m_count && CompareAt(left, largest) > 0)
+                {
+                    largest = left;
+                }
+
+                if (right < m_count && CompareAt(right, largest) > 0)
+                {
+                    largest = right;
+                }
+
+                if (largest == pos)
+                {
+                    break;
+                }
+
+                Swap(pos, largest);
+                pos = largest;
+            }
+        }
+
+        private int CompareAt(int x, int y)
+        {
+            return Compare(m_keys[x], m_keys[x].Length, m_docs[x], m_keys[y], m_keys[y].Length, m_docs[y]);
+        }
+
+        private void Swap(int x, int y)
+        {
+            var key = m_keys[x];
+            m_keys[x] = m_keys[y];
+            m_keys[y] = key;
+
+            var doc = m_docs[x];
+            m_docs[x] = m_docs[y];
+            m_docs[y] = doc;
+        }
+
+        private static byte[] CopyKey(byte[] keyData, int keyLength, byte[] reuse)
+        {
+            var result = reuse != null && reuse.Length == keyLength ? reuse : new byte[keyLength];
+            Buffer.BlockCopy(keyData, 0, result, 0, keyLength);
+            return result;
+        }
+
+        private static int Compare(byte[] x, int lengthX, int docX, byte[] y, int lengthY, int docY)
+        {
+            var len = Math.Min(lengthX, lengthY);
+            for (var i = 0; i < len; i++)
+            {
+                var diff = x[i] - y[i];
+                if (diff != 0)
+                {
+                    return diff;
+                }
+            }
+
+            if (lengthX != lengthY)
+            {
+                return lengthX - lengthY;
+            }
+
+            return docX.CompareTo(docY);
+        }
+    }
+}
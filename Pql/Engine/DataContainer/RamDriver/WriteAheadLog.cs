@@ -0,0 +1,483 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using Pql.Engine.Interfaces;
+using Pql.Engine.Interfaces.Internal;
+using Pql.Engine.Interfaces.Services;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.DataContainer.RamDriver
+{
+    /// <summary>
+    /// Log of changesets applied since data was last flushed to store, which makes them durable without a full flush.
+    /// <code>
+    /// file:    magic, format version, records
+    /// record:  payload length, CRC-32C of payload, payload
+    /// payload: document type, field count, field ids, changes
+    /// change:  change type, document key, not-null flags and values of fields (except for deletes)
+    /// </code>
+    /// Driver logs every change as a record of its own, right after the change is made in memory,
+    /// so that changes of a document are replayed in the same order as they were made.
+    /// Every flush to store starts a new file, and files which precede it are deleted once flush succeeds.
+    /// A record which was torn by a crash ends its file, and is ignored on replay.
+    /// <para>
+    /// Commits are batched: the first committing thread writes records of all threads appended so far
+    /// with a single write and a single flush to disk, while other threads wait for it.
+    /// Commit latency is thus bounded by about two flushes to disk, and number of flushes does not grow with concurrency.
+    /// </para>
+    /// </summary>
+    internal sealed class WriteAheadLog : IDisposable
+    {
+        /// <summary>
+        /// "PQLW" in little-endian order.
+        /// </summary>
+        public const int Magic = 0x574C5150;
+        public const int FormatVersion = 1;
+
+        private const string FileNamePrefix = "changes-";
+        private const string FileNameExtension = ".wal";
+        private const int FileHeaderSize = 8;
+        private const int RecordHeaderSize = 8;
+
+        private readonly string m_storageRoot;
+        private readonly object m_sync = new object();
+        private FileStream m_file;
+        private long m_fileNumber;
+        private MemoryStream m_pending = new MemoryStream();
+        private MemoryStream m_spare = new MemoryStream();
+        private long m_appended;
+        private long m_durable;
+        private bool m_committing;
+        private Exception m_failure;
+        private bool m_disposed;
+
+        /// <summary>
+        /// Starts a new log file, numbered after all existing log files in storage root.
+        /// </summary>
+        public WriteAheadLog(string storageRoot)
+        {
+            m_storageRoot = storageRoot ?? throw new ArgumentNullException("storageRoot");
+
+            var existing = GetFileNumbers(storageRoot);
+            m_fileNumber = existing.Count > 0 ? existing[existing.Count - 1] + 1 : 1;
+            m_file = CreateFile(m_fileNumber);
+        }
+
+        /// <summary>
+        /// Appends a record to the log. Record becomes durable once <see cref="WaitDurable"/> returns for returned sequence number.
+        /// </summary>
+        public long Append(MemoryStream payload)
+        {
+            var length = (int)payload.Length;
+            var crc = Crc32C.Compute(0, payload.GetBuffer(), 0, length);
+
+            lock (m_sync)
+            {
+                CheckState();
+
+                using (var writer = new BinaryWriter(m_pending, Encoding.UTF8, true))
+                {
+                    writer.Write(length);
+                    writer.Write(crc);
+                    writer.Write(payload.GetBuffer(), 0, length);
+                }
+
+                return ++m_appended;
+            }
+        }
+
+        /// <summary>
+        /// Waits until record with given sequence number, and all records appended before it, are flushed to disk.
+        /// </summary>
+        /// <exception cref="IOException">Log could not be written, no more records will be accepted</exception>
+        public void WaitDurable(long sequence)
+        {
+            Monitor.Enter(m_sync);
+            try
+            {
+                while (m_durable < sequence)
+                {
+                    CheckState();
+
+                    if (m_committing)
+                    {
+                        Monitor.Wait(m_sync);
+                        continue;
+                    }
+
+                    // this thread commits records of all threads which were appended so far
+                    m_committing = true;
+                    var batch = m_pending;
+                    var batchEnd = m_appended;
+                    m_pending = m_spare;
+
+                    Exception failure = null;
+                    Monitor.Exit(m_sync);
+                    try
+                    {
+                        WriteBatch(batch);
+                    }
+                    catch (Exception e)
+                    {
+                        failure = e;
+                    }
+                    finally
+                    {
+                        Monitor.Enter(m_sync);
+                    }
+
+                    batch.SetLength(0);
+                    m_spare = batch;
+                    m_committing = false;
+
+                    if (failure == null)
+                    {
+                        m_durable = batchEnd;
+                    }
+                    else
+                    {
+                        m_failure = failure;
+                    }
+
+                    Monitor.PulseAll(m_sync);
+                }
+            }
+            finally
+            {
+                Monitor.Exit(m_sync);
+            }
+        }
+
+        /// <summary>
+        /// Makes all appended records durable and starts a new log file.
+        /// Returns number of the file which was closed, to be passed into <see cref="DeleteFiles"/>
+        /// once all changes made before the call are flushed to store.
+        /// </summary>
+        public long Rotate()
+        {
+            lock (m_sync)
+            {
+                while (m_committing)
+                {
+                    Monitor.Wait(m_sync);
+                }
+
+                CheckState();
+
+                try
+                {
+                    WriteBatch(m_pending);
+                    m_pending.SetLength(0);
+                    m_durable = m_appended;
+
+                    m_file.Dispose();
+                    m_file = CreateFile(m_fileNumber + 1);
+                    m_fileNumber++;
+                }
+                catch (Exception e)
+                {
+                    m_failure = e;
+                    throw;
+                }
+                finally
+                {
+                    Monitor.PulseAll(m_sync);
+                }
+
+                return m_fileNumber - 1;
+            }
+        }
+
+        private void WriteBatch(MemoryStream batch)
+        {
+            if (batch.Length > 0)
+            {
+                m_file.Write(batch.GetBuffer(), 0, (int)batch.Length);
+                m_file.Flush(true);
+            }
+        }
+
+        private void CheckState()
+        {
+            if (m_disposed)
+            {
+                throw new ObjectDisposedException("WriteAheadLog");
+            }
+
+            if (m_failure != null)
+            {
+                throw new IOException("Write-ahead log in " + m_storageRoot + " failed, changes are no longer logged", m_failure);
+            }
+        }
+
+        private FileStream CreateFile(long number)
+        {
+            var file = new FileStream(GetFilePath(m_storageRoot, number), FileMode.CreateNew, FileAccess.Write, FileShare.Read, 1 << 16, FileOptions.None);
+            try
+            {
+                using (var writer = new BinaryWriter(file, Encoding.UTF8, true))
+                {
+                    writer.Write(Magic);
+                    writer.Write(FormatVersion);
+                }
+
+                file.Flush(true);
+                return file;
+            }
+            catch
+            {
+                file.Dispose();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Deletes log files up to and including given number.
+        /// </summary>
+        public static void DeleteFiles(string storageRoot, long lastNumber)
+        {
+            foreach (var number in GetFileNumbers(storageRoot).Where(x => x <= lastNumber))
+            {
+                File.Delete(GetFilePath(storageRoot, number));
+            }
+        }
+
+        /// <summary>
+        /// Returns numbers of log files in storage root, in ascending order.
+        /// </summary>
+        public static List<long> GetFileNumbers(string storageRoot)
+        {
+            var result = new List<long>();
+            foreach (var path in Directory.GetFiles(storageRoot, FileNamePrefix + "*" + FileNameExtension))
+            {
+                var name = Path.GetFileNameWithoutExtension(path);
+                if (long.TryParse(name.Substring(FileNamePrefix.Length), out var number) && number > 0)
+                {
+                    result.Add(number);
+                }
+            }
+
+            result.Sort();
+            return result;
+        }
+
+        private static string GetFilePath(string storageRoot, long number)
+        {
+            return Path.Combine(storageRoot, string.Format("{0}{1:D10}{2}", FileNamePrefix, number, FileNameExtension));
+        }
+
+        /// <summary>
+        /// Enumerates payloads of intact records of a log file, stops at the first torn or damaged record.
+        /// </summary>
+        /// <exception cref="InvalidDataException">File is not a log file</exception>
+        public static IEnumerable<byte[]> ReadRecords(string storageRoot, long number, ITracer tracer)
+        {
+            var path = GetFilePath(storageRoot, number);
+            using (var reader = new BinaryReader(new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.Read, 1 << 20, FileOptions.SequentialScan)))
+            {
+                var length = reader.BaseStream.Length;
+                if (length < FileHeaderSize || reader.ReadInt32() != Magic)
+                {
+                    // file may have been created right before a crash
+                    if (length < FileHeaderSize)
+                    {
+                        yield break;
+                    }
+
+                    throw new InvalidDataException("Write-ahead log file " + path + " is damaged or invalid: header magic not found");
+                }
+
+                var version = reader.ReadInt32();
+                if (version > FormatVersion)
+                {
+                    throw new InvalidDataException("Write-ahead log file " + path + " is damaged or invalid: format version " + version + " is not supported");
+                }
+
+                while (reader.BaseStream.Position < length)
+                {
+                    var position = reader.BaseStream.Position;
+                    byte[] payload = null;
+                    if (length - position >= RecordHeaderSize)
+                    {
+                        var payloadLength = reader.ReadInt32();
+                        var crc = reader.ReadUInt32();
+                        if (payloadLength >= 0 && payloadLength <= length - position - RecordHeaderSize)
+                        {
+                            payload = reader.ReadBytes(payloadLength);
+                            if (crc != Crc32C.Compute(0, payload, 0, payload.Length))
+                            {
+                                payload = null;
+                            }
+                        }
+                    }
+
+                    if (payload == null)
+                    {
+                        if (tracer.IsInfoEnabled)
+                        {
+                            tracer.InfoFormat("Ignoring torn record at offset {0} of write-ahead log file {1}, {2} bytes", position, path, length - position);
+                        }
+
+                        yield break;
+                    }
+
+                    yield return payload;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Writes header of a changeset record.
+        /// </summary>
+        public static void WriteChangesetHeader(BinaryWriter writer, int documentType, FieldMetadata[] fields)
+        {
+            writer.Write(documentType);
+            writer.Write(fields == null ? 0 : fields.Length);
+            if (fields != null)
+            {
+                foreach (var field in fields)
+                {
+                    writer.Write(field.FieldId);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Appends current contents of change buffer to a changeset record.
+        /// </summary>
+        public static void WriteChange(BinaryWriter writer, DriverChangeBuffer change)
+        {
+            writer.Write((byte)change.ChangeType);
+
+            var key = change.InternalEntityId;
+            writer.Write(key, 0, key[0] + 1);
+
+            if (change.ChangeType == DriverChangeType.Delete || change.Fields == null)
+            {
+                return;
+            }
+
+            var data = change.Data;
+            ClientDriver.Protocol.BitVector.Write(data.NotNulls, change.Fields.Length, writer);
+
+            for (var ordinal = 0; ordinal < change.Fields.Length; ordinal++)
+            {
+                if (!ClientDriver.Protocol.BitVector.Get(data.NotNulls, ordinal))
+                {
+                    continue;
+                }
+
+                var indexInArray = data.GetIndexInArray(ordinal);
+                switch (data.FieldRepresentationTypes[ordinal])
+                {
+                    case DriverRowData.DataTypeRepresentation.Value8Bytes:
+                        writer.Write(data.ValueData8Bytes[indexInArray].AsInt64);
+                        break;
+                    case DriverRowData.DataTypeRepresentation.Value16Bytes:
+                        writer.Write(data.ValueData16Bytes[indexInArray].Lo);
+                        writer.Write(data.ValueData16Bytes[indexInArray].Hi);
+                        break;
+                    case DriverRowData.DataTypeRepresentation.String:
+                        writer.Write(data.StringData[indexInArray] ?? string.Empty);
+                        break;
+                    case DriverRowData.DataTypeRepresentation.ByteArray:
+                        var value = data.BinaryData[indexInArray];
+                        writer.Write(value.Length);
+                        writer.Write(value.Data ?? new byte[0], 0, value.Length);
+                        break;
+                    default:
+                        throw new InvalidOperationException("Invalid representation type: " + data.FieldRepresentationTypes[ordinal]);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Reads next change of a changeset record into change buffer, which must be created for fields listed in record header.
+        /// </summary>
+        public static void ReadChange(BinaryReader reader, DriverChangeBuffer change)
+        {
+            change.ChangeType = (DriverChangeType)reader.ReadByte();
+
+            var key = change.InternalEntityId;
+            key[0] = reader.ReadByte();
+            if (reader.Read(key, 1, key[0]) != key[0])
+            {
+                throw new EndOfStreamException();
+            }
+
+            if (change.ChangeType == DriverChangeType.Delete || change.Fields == null)
+            {
+                return;
+            }
+
+            var data = change.Data;
+            ClientDriver.Protocol.BitVector.Read(data.NotNulls, change.Fields.Length, reader);
+
+            for (var ordinal = 0; ordinal < change.Fields.Length; ordinal++)
+            {
+                if (!ClientDriver.Protocol.BitVector.Get(data.NotNulls, ordinal))
+                {
+                    continue;
+                }
+
+                var indexInArray = data.GetIndexInArray(ordinal);
+                switch (data.FieldRepresentationTypes[ordinal])
+                {
+                    case DriverRowData.DataTypeRepresentation.Value8Bytes:
+                        data.ValueData8Bytes[indexInArray].AsInt64 = reader.ReadInt64();
+                        break;
+                    case DriverRowData.DataTypeRepresentation.Value16Bytes:
+                        data.ValueData16Bytes[indexInArray].Lo = reader.ReadInt64();
+                        data.ValueData16Bytes[indexInArray].Hi = reader.ReadInt64();
+                        break;
+                    case DriverRowData.DataTypeRepresentation.String:
+                        data.StringData[indexInArray] = reader.ReadString();
+                        break;
+                    case DriverRowData.DataTypeRepresentation.ByteArray:
+                        var value = data.BinaryData[indexInArray];
+                        value.SetLength(reader.ReadInt32());
+                        if (value.Length > 0 && reader.Read(value.Data, 0, value.Length) != value.Length)
+                        {
+                            throw new EndOfStreamException();
+                        }
+                        break;
+                    default:
+                        throw new InvalidOperationException("Invalid representation type: " + data.FieldRepresentationTypes[ordinal]);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Makes all appended records durable and closes the log.
+        /// </summary>
+        public void Dispose()
+        {
+            lock (m_sync)
+            {
+                if (m_disposed)
+                {
+                    return;
+                }
+            }
+
+            try
+            {
+                if (m_failure == null)
+                {
+                    WaitDurable(Interlocked.Read(ref m_appended));
+                }
+            }
+            finally
+            {
+                lock (m_sync)
+                {
+                    m_disposed = true;
+                    m_file.Dispose();
+                }
+            }
+        }
+    }
+}
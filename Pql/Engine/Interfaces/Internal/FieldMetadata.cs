@@ -53,6 +53,13 @@ namespace Pql.Engine.Interfaces.Internal
         [IgnoreDataMember]
         public Type SerializationType;
 
+        /// <summary>
+        /// Storage hint for cold columns: keep values in a memory-mapped scratch file instead of RAM,
+        /// so that they are paged in on demand. RAM driver honors it for string and binary fields.
+        /// </summary>
+        [DataMember]
+        public bool MemoryMapped;
+
         private FieldMetadata()
         {
         }
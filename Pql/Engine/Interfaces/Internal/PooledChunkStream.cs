@@ -0,0 +1,335 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+
+namespace Pql.Engine.Interfaces.Internal
+{
+    /// <summary>
+    /// A growable stream over a list of fixed-size chunks, which are taken from a process-wide pool.
+    /// Chunks are small enough to stay off the large object heap, and go back to the pool when stream is truncated or disposed,
+    /// so that output buffers of consecutive requests keep reusing the same memory.
+    /// </summary>
+    public sealed class PooledChunkStream : Stream
+    {
+        /// <summary>
+        /// Size of every chunk, below the large object heap threshold.
+        /// </summary>
+        public const int ChunkSize = 64 * 1024;
+
+        /// <summary>
+        /// Upper limit on number of idle chunks kept in the pool, excess chunks are left to garbage collector.
+        /// </summary>
+        private const int MaxPooledChunks = 2048;
+
+        private static readonly ConcurrentQueue<byte[]> Pool = new ConcurrentQueue<byte[]>();
+        private static int PoolSize;
+
+        private readonly List<byte[]> m_chunks;
+        private long m_length;
+        private long m_position;
+        private bool m_disposed;
+
+        /// <summary>
+        /// Ctr.
+        /// </summary>
+        public PooledChunkStream()
+        {
+            m_chunks = new List<byte[]>();
+        }
+
+        /// <summary>
+        /// Number of idle chunks currently held by the process-wide pool.
+        /// </summary>
+        public static int PooledChunkCount
+        {
+            get { return PoolSize; }
+        }
+
+        /// <summary>
+        /// Number of bytes currently reserved by this stream.
+        /// </summary>
+        public long Capacity
+        {
+            get { return (long)m_chunks.Count * ChunkSize; }
+        }
+
+        public override bool CanRead
+        {
+            get { return !m_disposed; }
+        }
+
+        public override bool CanSeek
+        {
+            get { return !m_disposed; }
+        }
+
+        public override bool CanWrite
+        {
+            get { return !m_disposed; }
+        }
+
+        public override long Length
+        {
+            get
+            {
+                CheckDisposed();
+                return m_length;
+            }
+        }
+
+        public override long Position
+        {
+            get
+            {
+                CheckDisposed();
+                return m_position;
+            }
+            set
+            {
+                CheckDisposed();
+                if (value < 0 || value > m_length)
+                {
+                    throw new ArgumentOutOfRangeException("value", value, "Position must be within stream length");
+                }
+
+                m_position = value;
+            }
+        }
+
+        public override void Flush()
+        {
+            CheckDisposed();
+        }
+
+        public override long Seek(long offset, SeekOrigin origin)
+        {
+            switch (origin)
+            {
+                case SeekOrigin.Begin:
+                    Position = offset;
+                    break;
+                case SeekOrigin.Current:
+                    Position = m_position + offset;
+                    break;
+                case SeekOrigin.End:
+                    Position = m_length + offset;
+                    break;
+                default:
+                    throw new ArgumentOutOfRangeException("origin", origin, "Invalid value");
+            }
+
+            return m_position;
+        }
+
+        /// <summary>
+        /// Truncates the stream. Chunks which are no longer needed are returned to the pool.
+        /// </summary>
+        /// <exception cref="NotSupportedException">Attempt to extend the stream</exception>
+        public override void SetLength(long value)
+        {
+            CheckDisposed();
+
+            if (value < 0)
+            {
+                throw new ArgumentOutOfRangeException("value", value, "Length cannot be negative");
+            }
+
+            if (value > m_length)
+            {
+                throw new NotSupportedException("Stream can only be extended by writing");
+            }
+
+            var chunksToKeep = (int)((value + ChunkSize - 1) / ChunkSize);
+            for (var i = chunksToKeep; i < m_chunks.Count; i++)
+            {
+                ReturnChunk(m_chunks[i]);
+            }
+
+            m_chunks.RemoveRange(chunksToKeep, m_chunks.Count - chunksToKeep);
+
+            m_length = value;
+            if (m_position > value)
+            {
+                m_position = value;
+            }
+        }
+
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            CheckDisposed();
+            CheckArguments(buffer, offset, count);
+
+            var total = (int)Math.Min(count, m_length - m_position);
+            var remaining = total;
+            while (remaining > 0)
+            {
+                var chunk = m_chunks[(int)(m_position / ChunkSize)];
+                var offsetInChunk = (int)(m_position % ChunkSize);
+                var len = Math.Min(remaining, ChunkSize - offsetInChunk);
+
+                Buffer.BlockCopy(chunk, offsetInChunk, buffer, offset, len);
+
+                offset += len;
+                remaining -= len;
+                m_position += len;
+            }
+
+            return total;
+        }
+
+        public override void Write(byte[] buffer, int offset, int count)
+        {
+            CheckDisposed();
+            CheckArguments(buffer, offset, count);
+
+            EnsureCapacity(m_position + count);
+
+            while (count > 0)
+            {
+                var chunk = m_chunks[(int)(m_position / ChunkSize)];
+                var offsetInChunk = (int)(m_position % ChunkSize);
+                var len = Math.Min(count, ChunkSize - offsetInChunk);
+
+                Buffer.BlockCopy(buffer, offset, chunk, offsetInChunk, len);
+
+                offset += len;
+                count -= len;
+                m_position += len;
+            }
+
+            if (m_position > m_length)
+            {
+                m_length = m_position;
+            }
+        }
+
+        /// <summary>
+        /// Overridden because base implementation allocates a temporary array for every byte,
+        /// and <see cref="BinaryWriter"/> writes single bytes a lot.
+        /// </summary>
+        public override void WriteByte(byte value)
+        {
+            CheckDisposed();
+            EnsureCapacity(m_position + 1);
+
+            m_chunks[(int)(m_position / ChunkSize)][m_position % ChunkSize] = value;
+
+            m_position++;
+            if (m_position > m_length)
+            {
+                m_length = m_position;
+            }
+        }
+
+        /// <summary>
+        /// Writes entire content of this stream to another stream, chunk by chunk. Does not change position.
+        /// </summary>
+        public void WriteTo(Stream destination)
+        {
+            CheckDisposed();
+
+            if (destination == null)
+            {
+                throw new ArgumentNullException("destination");
+            }
+
+            var remaining = m_length;
+            foreach (var chunk in m_chunks)
+            {
+                if (remaining <= 0)
+                {
+                    break;
+                }
+
+                var len = (int)Math.Min(remaining, ChunkSize);
+                destination.Write(chunk, 0, len);
+                remaining -= len;
+            }
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (!m_disposed)
+            {
+                m_disposed = true;
+
+                if (disposing)
+                {
+                    foreach (var chunk in m_chunks)
+                    {
+                        ReturnChunk(chunk);
+                    }
+                }
+
+                m_chunks.Clear();
+                m_length = 0;
+                m_position = 0;
+            }
+
+            base.Dispose(disposing);
+        }
+
+        private void EnsureCapacity(long capacity)
+        {
+            while (Capacity < capacity)
+            {
+                m_chunks.Add(RentChunk());
+            }
+        }
+
+        private void CheckDisposed()
+        {
+            if (m_disposed)
+            {
+                throw new ObjectDisposedException("PooledChunkStream");
+            }
+        }
+
+        private static void CheckArguments(byte[] buffer, int offset, int count)
+        {
+            if (buffer == null)
+            {
+                throw new ArgumentNullException("buffer");
+            }
+
+            if (offset < 0)
+            {
+                throw new ArgumentOutOfRangeException("offset", offset, "Offset is negative");
+            }
+
+            if (count < 0)
+            {
+                throw new ArgumentOutOfRangeException("count", count, "Count is negative");
+            }
+
+            if (offset + count > buffer.Length)
+            {
+                throw new ArgumentException("The sum of offset and count is larger than the buffer length");
+            }
+        }
+
+        private static byte[] RentChunk()
+        {
+            byte[] chunk;
+            if (Pool.TryDequeue(out chunk))
+            {
+                Interlocked.Decrement(ref PoolSize);
+                return chunk;
+            }
+
+            return new byte[ChunkSize];
+        }
+
+        private static void ReturnChunk(byte[] chunk)
+        {
+            // pool limit is approximate under concurrency, which is fine
+            if (PoolSize < MaxPooledChunks)
+            {
+                Interlocked.Increment(ref PoolSize);
+                Pool.Enqueue(chunk);
+            }
+        }
+    }
+}
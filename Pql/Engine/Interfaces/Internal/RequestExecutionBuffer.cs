@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Diagnostics;
 using System.IO;
 using System.Text;
 using System.Threading;
@@ -6,21 +7,43 @@ using System.Threading;
 namespace Pql.Engine.Interfaces.Internal
 {
     /// <summary>
-    /// A reusable pair of <see cref="MemoryStream"/> and <see cref="BinaryWriter"/>.
-    /// MemoryStream is of fixed maximum capacity, based on a pre-allocated array (see <see cref="MaxBytesPerBuffer"/>).
+    /// A reusable pair of <see cref="PooledChunkStream"/> and <see cref="BinaryWriter"/>.
+    /// Stream memory comes in chunks from a process-wide pool, so buffers do not allocate large arrays per request.
+    /// Number of bytes producer puts into this buffer before handing it over (see <see cref="Capacity"/>)
+    /// adapts to row width and to how fast the data link to PQL client is.
     /// </summary>
     public sealed class RequestExecutionBuffer : IDisposable
     {
-        private MemoryStream m_stream;
+        private PooledChunkStream m_stream;
         private BinaryWriter m_writer;
+        private int m_capacity;
 
         /// <summary>
-        /// Maximum number of bytes that can be held in this buffer.
+        /// Upper bound for <see cref="Capacity"/>.
         /// Small value, because for now single process will serve multiple workspaces.
-        /// Optimal value varies between 5Mb and 100Mb depending on how fast the data link to PQL client is.
         /// </summary>
-        public const int MaxBytesPerBuffer = 5*1000*1000; 
-        
+        public const int MaxBytesPerBuffer = 5*1000*1000;
+
+        /// <summary>
+        /// Lower bound for <see cref="Capacity"/>.
+        /// </summary>
+        public const int MinBytesPerBuffer = 256*1024;
+
+        /// <summary>
+        /// Initial value for <see cref="Capacity"/>, before anything is known about the data link.
+        /// </summary>
+        public const int InitialBytesPerBuffer = 1024*1024;
+
+        /// <summary>
+        /// Capacity is never reduced below this number of average rows.
+        /// </summary>
+        private const int MinRowsPerBuffer = 64;
+
+        /// <summary>
+        /// Capacity is adjusted so that sending one buffer to client takes about this long.
+        /// </summary>
+        private const int TargetSendMilliseconds = 250;
+
         /// <summary>
         /// Number of rows (not bytes) written into this buffer.
         /// </summary>
@@ -32,10 +55,16 @@ namespace Pql.Engine.Interfaces.Internal
         public Exception Error;
 
         /// <summary>
-        /// Pre-allocated stream to hold data.
-        /// This stream is of fixed maximum capacity, based on a pre-allocated array (see <see cref="MaxBytesPerBuffer"/>).
+        /// Stream to hold data.
+        /// It can grow beyond <see cref="Capacity"/>, so that a single row wider than capacity still fits.
+        /// </summary>
+        public PooledChunkStream Stream { get { CheckInitialized(); return m_stream; } }
+
+        /// <summary>
+        /// Number of bytes producer should put into this buffer before handing it over to consumer.
+        /// Between <see cref="MinBytesPerBuffer"/> and <see cref="MaxBytesPerBuffer"/>, see <see cref="AdaptCapacity"/>.
         /// </summary>
-        public MemoryStream Stream { get { CheckInitialized(); return m_stream; } }
+        public int Capacity { get { return m_capacity; } }
         
         /// <summary>
         /// Pre-allocated writer, pointed to <see cref="Stream"/>.
@@ -55,15 +84,45 @@ namespace Pql.Engine.Interfaces.Internal
         /// <summary>
         /// Ctr.
         /// </summary>
+        public RequestExecutionBuffer()
+        {
+            m_capacity = InitialBytesPerBuffer;
+        }
+
+        /// <summary>
+        /// Adjusts <see cref="Capacity"/> after content of this buffer has been sent to client.
+        /// Fast links get larger buffers to reduce per-block overhead, slow links get smaller ones to hold less memory,
+        /// but every buffer still fits a reasonable number of rows.
+        /// </summary>
+        /// <param name="bytesSent">Number of bytes sent</param>
+        /// <param name="rowsSent">Number of rows in sent data</param>
+        /// <param name="elapsedTicks">Time it took to send, in <see cref="Stopwatch"/> ticks</param>
+        public void AdaptCapacity(long bytesSent, long rowsSent, long elapsedTicks)
+        {
+            if (bytesSent <= 0)
+            {
+                return;
+            }
+
+            var bytesPerSecond = bytesSent * (double)Stopwatch.Frequency / Math.Max(1, elapsedTicks);
+            var target = bytesPerSecond * TargetSendMilliseconds / 1000;
+
+            if (rowsSent > 0)
+            {
+                target = Math.Max(target, (double)bytesSent / rowsSent * MinRowsPerBuffer);
+            }
+
+            // smooth out the jitter of individual measurements
+            target = (m_capacity + target) / 2;
+
+            m_capacity = (int)Math.Max(MinBytesPerBuffer, Math.Min(MaxBytesPerBuffer, target));
+        }
+
         private void CheckInitialized()
         {
             if (m_stream == null)
             {
-                m_stream = new MemoryStream(new byte[MaxBytesPerBuffer], 0, MaxBytesPerBuffer, true, true);
-                
-                // make sure length is zero, by default it will be set to length of underlying data buffer
-                m_stream.SetLength(0);
-
+                m_stream = new PooledChunkStream();
                 m_writer = new BinaryWriter(m_stream, Encoding.UTF8, true);
             }
         }
@@ -90,7 +149,8 @@ namespace Pql.Engine.Interfaces.Internal
         }
 
         /// <summary>
-        /// Resets content of this buffer.
+        /// Resets content of this buffer, its memory goes back to the pool.
+        /// Keeps <see cref="Capacity"/>, it describes the data link of the request rather than content.
         /// </summary>
         public void Cleanup()
         {
@@ -0,0 +1,381 @@
+﻿using System;
+using System.Data;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class ColumnFileTest
+    {
+        static readonly IUnmanagedAllocator Pool = new DynamicMemoryPool();
+
+        private const int Count = 2 * ColumnFile.RowsPerBlock + 1000;
+
+        [TestMethod]
+        public void TestRoundTrip()
+        {
+            var notNullsPath = Path.GetTempFileName();
+            var dataPath = Path.GetTempFileName();
+            try
+            {
+                using (var source = CreateColumn())
+                {
+                    ColumnFile.Write(notNullsPath, ColumnFileKind.Bitmap, (int) DbType.Int32, Count, 0,
+                        (writer, first, n) => source.NotNulls.Write(writer, (ulong) first, (ulong) n), null);
+                    ColumnFile.Write(dataPath, ColumnFileKind.Values, (int) DbType.Int32, Count, 0, source.WriteData, source.ComputeZoneMap);
+
+                    // mapped files go through bulk copies, others through per-value reads
+                    foreach (var mapped in new[] {true, false})
+                    {
+                        using (var target = new ColumnData<int>(DbType.Int32, Pool))
+                        {
+                            target.EnsureCapacity(Count);
+
+                            using (var file = Open(notNullsPath, mapped, ColumnFileKind.Bitmap))
+                            {
+                                Assert.AreEqual(mapped, file.IsMapped);
+                                Assert.AreEqual(3, file.Blocks.Length);
+                                for (var i = 0; i < file.Blocks.Length; i++)
+                                {
+                                    using (var reader = file.OpenBlock(i))
+                                    {
+                                        target.NotNulls.Read(reader, (ulong) file.Blocks[i].FirstRow, (ulong) file.Blocks[i].RowCount);
+                                    }
+                                }
+                            }
+
+                            using (var file = Open(dataPath, mapped, ColumnFileKind.Values))
+                            {
+                                for (var i = file.Blocks.Length - 1; i >= 0; i--)
+                                {
+                                    using (var reader = file.OpenBlock(i))
+                                    {
+                                        target.ReadData(reader, file.Blocks[i].FirstRow, file.Blocks[i].RowCount);
+                                        Assert.AreEqual(reader.BaseStream.Length, reader.BaseStream.Position);
+                                    }
+                                }
+                            }
+
+                            for (var i = 0; i < Count; i++)
+                            {
+                                Assert.AreEqual(source.NotNulls.Get(i), target.NotNulls.Get(i));
+                                if (source.NotNulls.Get(i))
+                                {
+                                    Assert.AreEqual(source.GetValue(i), target.GetValue(i));
+                                }
+                            }
+                        }
+                    }
+                }
+
+                using (var file = Open(dataPath, true, ColumnFileKind.Values))
+                {
+                    var zoneMap = file.Blocks[0].ZoneMap;
+                    Assert.AreEqual(ColumnZoneMapKind.Int64, zoneMap.Kind);
+                    Assert.AreEqual(ColumnFile.RowsPerBlock - ColumnFile.RowsPerBlock / 3 - 1, zoneMap.NonNullCount);
+                    Assert.AreEqual(1L - 1000, zoneMap.Min);
+                    Assert.AreEqual(ColumnFile.RowsPerBlock - 2L - 1000, zoneMap.Max);
+
+                    zoneMap = file.Blocks[2].ZoneMap;
+                    Assert.AreEqual(2 * ColumnFile.RowsPerBlock, file.Blocks[2].FirstRow);
+                    Assert.AreEqual(1000, file.Blocks[2].RowCount);
+                    Assert.AreEqual(Count - 1L - 1000, zoneMap.Max);
+                }
+            }
+            finally
+            {
+                File.Delete(notNullsPath);
+                File.Delete(dataPath);
+            }
+        }
+
+        [TestMethod]
+        public void TestDamageDetection()
+        {
+            var path = Path.GetTempFileName();
+            try
+            {
+                using (var source = CreateColumn())
+                {
+                    ColumnFile.Write(path, ColumnFileKind.Values, (int) DbType.Int32, Count, 0, source.WriteData, source.ComputeZoneMap);
+                }
+
+                // kind, type and row count are verified when file is opened
+                ExceptionAssert(() => Open(path, true, ColumnFileKind.Bitmap).Dispose());
+                ExceptionAssert(() => new ColumnFileReader(path, File.OpenRead(path), ColumnFileKind.Values, (int) DbType.Int64, Count).Dispose());
+                ExceptionAssert(() => new ColumnFileReader(path, File.OpenRead(path), ColumnFileKind.Values, (int) DbType.Int32, Count + 1).Dispose());
+
+                long offset;
+                using (var file = Open(path, false, ColumnFileKind.Values))
+                {
+                    offset = file.Blocks[1].Offset + 100;
+                }
+
+                using (var stream = new FileStream(path, FileMode.Open, FileAccess.ReadWrite))
+                {
+                    stream.Position = offset;
+                    var value = stream.ReadByte();
+                    stream.Position = offset;
+                    stream.WriteByte((byte) (value ^ 1));
+                }
+
+                // damage in one block does not prevent reading the others
+                foreach (var mapped in new[] {true, false})
+                {
+                    using (var file = Open(path, mapped, ColumnFileKind.Values))
+                    {
+                        file.OpenBlock(0).Dispose();
+                        file.OpenBlock(2).Dispose();
+                        ExceptionAssert(() => file.OpenBlock(1));
+                    }
+                }
+
+                // truncated file
+                using (var stream = new FileStream(path, FileMode.Open, FileAccess.ReadWrite))
+                {
+                    stream.SetLength(stream.Length - 1);
+                }
+
+                ExceptionAssert(() => Open(path, false, ColumnFileKind.Values).Dispose());
+            }
+            finally
+            {
+                File.Delete(path);
+            }
+        }
+
+        [TestMethod]
+        public void TestDeltaSegments()
+        {
+            const int grownCount = Count + ColumnFile.RowsPerBlock;
+
+            var path = Path.GetTempFileName();
+            var deltaPath = path + ColumnFile.DeltaSuffix;
+            try
+            {
+                using (var source = CreateColumn())
+                {
+                    var state = new CheckpointState();
+                    Assert.IsTrue(state.RequiresRewrite(Count));
+
+                    ColumnFile.Write(path, ColumnFileKind.Values, (int) DbType.Int32, Count, 1, source.WriteData, source.ComputeZoneMap);
+                    state.OnPersisted(Count, 1);
+                    Assert.IsFalse(state.RequiresRewrite(Count));
+                    Assert.AreEqual(0, state.GetDirtyBlocks(Count).Count);
+
+                    // one value changed in the middle, and rows appended to partial last block and beyond it
+                    source.EnsureCapacity(grownCount);
+                    source.DataArray[ColumnFile.RowsPerBlock + 4] = -1;
+                    state.MarkDirty(ColumnFile.RowsPerBlock + 4);
+                    for (var i = Count; i < grownCount; i++)
+                    {
+                        source.NotNulls.Set(i);
+                        source.DataArray[i] = i;
+                    }
+
+                    var blocks = state.GetDirtyBlocks(grownCount);
+                    CollectionAssert.AreEqual(new[] {1, 2, 3}, blocks);
+                    Assert.IsTrue(state.RequiresRewrite(Count - 1));
+
+                    ColumnFile.AppendDelta(deltaPath, ColumnFileKind.Values, (int) DbType.Int32, grownCount, 2, blocks, source.WriteData, source.ComputeZoneMap);
+                    state.OnPersisted(grownCount, 2);
+                    Assert.AreEqual(0, state.GetDirtyBlocks(grownCount).Count);
+
+                    // base file alone is still valid, and does not have appended rows
+                    ExceptionAssert(() => new ColumnFileReader(path, File.OpenRead(path), ColumnFileKind.Values, (int) DbType.Int32, grownCount).Dispose());
+
+                    using (var file = new ColumnFileReader(path, File.OpenRead(path), File.OpenRead(deltaPath), ColumnFileKind.Values, (int) DbType.Int32, grownCount))
+                    {
+                        Assert.AreEqual(2, file.Generation);
+                        Assert.AreEqual(4, file.Blocks.Length);
+                        Assert.AreEqual(ColumnFile.RowsPerBlock, file.Blocks[2].RowCount);
+                        Assert.AreEqual(-1L, file.Blocks[1].ZoneMap.Min);
+                        AssertSameValues(source, file, grownCount);
+                    }
+
+                    // segments older than rewritten base file are ignored
+                    source.DataArray[5] = -2;
+                    ColumnFile.Write(path, ColumnFileKind.Values, (int) DbType.Int32, grownCount, 3, source.WriteData, source.ComputeZoneMap);
+
+                    using (var file = new ColumnFileReader(path, File.OpenRead(path), File.OpenRead(deltaPath), ColumnFileKind.Values, (int) DbType.Int32, grownCount))
+                    {
+                        Assert.AreEqual(3, file.Generation);
+                        AssertSameValues(source, file, grownCount);
+                    }
+                }
+
+                // torn segment at the end of delta file is detected
+                using (var stream = new FileStream(deltaPath, FileMode.Open, FileAccess.ReadWrite))
+                {
+                    stream.SetLength(stream.Length - 1);
+                }
+
+                ExceptionAssert(() => new ColumnFileReader(path, File.OpenRead(path), File.OpenRead(deltaPath), ColumnFileKind.Values, (int) DbType.Int32, grownCount).Dispose());
+            }
+            finally
+            {
+                File.Delete(path);
+                File.Delete(deltaPath);
+            }
+        }
+
+        [TestMethod]
+        public void TestRangePublication()
+        {
+            using (var column = new ColumnData<int>(DbType.Int32, Pool))
+            {
+                Assert.AreEqual(int.MaxValue, column.LoadedPrefix);
+
+                column.BeginRangeTracking(Count, null);
+                Assert.AreEqual(0, column.LoadedPrefix);
+
+                // blocks loaded out of order only become visible when all preceding blocks are loaded
+                column.PublishLoadedRange(ColumnFile.RowsPerBlock, ColumnFile.RowsPerBlock);
+                Assert.AreEqual(0, column.LoadedPrefix);
+
+                var waiter = Task.Run(() => column.WaitRangeLoaded(Count));
+                Assert.IsFalse(waiter.Wait(100));
+
+                column.PublishLoadedRange(0, ColumnFile.RowsPerBlock);
+                Assert.AreEqual(2 * ColumnFile.RowsPerBlock, column.LoadedPrefix);
+                column.WaitRangeLoaded(2 * ColumnFile.RowsPerBlock);
+                Assert.IsFalse(waiter.Wait(100));
+
+                column.PublishLoadedRange(2 * ColumnFile.RowsPerBlock, Count - 2 * ColumnFile.RowsPerBlock);
+                Assert.AreEqual(Count, column.LoadedPrefix);
+                Assert.IsTrue(waiter.Wait(1000));
+
+                column.EndRangeTracking(true);
+                Assert.AreEqual(int.MaxValue, column.LoadedPrefix);
+            }
+        }
+
+        [TestMethod]
+        public void TestBlockLoadOnDemand()
+        {
+            using (var column = new ColumnData<int>(DbType.Int32, Pool))
+            {
+                var loads = new int[3];
+                var failing = true;
+
+                column.BeginRangeTracking(
+                    Count,
+                    i =>
+                        {
+                            Interlocked.Increment(ref loads[i]);
+                            if (i == 1 && failing)
+                            {
+                                throw new InvalidDataException("test");
+                            }
+
+                            column.PublishLoadedRange(i * ColumnFile.RowsPerBlock, Math.Min(ColumnFile.RowsPerBlock, Count - i * ColumnFile.RowsPerBlock));
+                        });
+
+                // reader loads the block it needs, other blocks stay pending
+                column.WaitRowLoaded(2 * ColumnFile.RowsPerBlock + 1);
+                CollectionAssert.AreEqual(new[] {0, 0, 1}, loads);
+                Assert.AreEqual(0, column.LoadedPrefix);
+
+                // failed block can be retried
+                ExceptionAssert(() => column.WaitRowLoaded(ColumnFile.RowsPerBlock));
+                failing = false;
+
+                // prefix scan loads what is missing, loader skips blocks which are already loaded
+                column.WaitRangeLoaded(Count);
+                for (var i = 0; i < loads.Length; i++)
+                {
+                    column.EnsureBlockLoaded(i);
+                }
+
+                CollectionAssert.AreEqual(new[] {1, 2, 1}, loads);
+                Assert.AreEqual(Count, column.LoadedPrefix);
+
+                column.EndRangeTracking(true);
+                Assert.AreEqual(int.MaxValue, column.LoadedPrefix);
+            }
+        }
+
+        [TestMethod]
+        public void TestCrc32C()
+        {
+            // standard check value of CRC-32C
+            var data = System.Text.Encoding.ASCII.GetBytes("123456789");
+            Assert.AreEqual(0xE3069283, Crc32C.Compute(0, data, 0, data.Length));
+            Assert.AreEqual(0xE3069283, Crc32C.Compute(Crc32C.Compute(0, data, 0, 4), data, 4, 5));
+        }
+
+        private static ColumnData<int> CreateColumn()
+        {
+            var column = new ColumnData<int>(DbType.Int32, Pool);
+            column.EnsureCapacity(Count);
+            for (var i = 0; i < Count; i++)
+            {
+                if (i % 3 != 0)
+                {
+                    column.NotNulls.Set(i);
+                    column.DataArray[i] = i - 1000;
+                }
+            }
+
+            return column;
+        }
+
+        private static void AssertSameValues(ColumnData<int> source, ColumnFileReader file, int count)
+        {
+            using (var target = new ColumnData<int>(DbType.Int32, Pool))
+            {
+                target.EnsureCapacity(count);
+
+                // values are encoded for non-null rows only
+                for (var i = 0; i < count; i++)
+                {
+                    if (source.NotNulls.Get(i))
+                    {
+                        target.NotNulls.Set(i);
+                    }
+                }
+
+                for (var i = 0; i < file.Blocks.Length; i++)
+                {
+                    using (var reader = file.OpenBlock(i))
+                    {
+                        target.ReadData(reader, file.Blocks[i].FirstRow, file.Blocks[i].RowCount);
+                    }
+                }
+
+                for (var i = 0; i < count; i++)
+                {
+                    if (source.NotNulls.Get(i))
+                    {
+                        Assert.AreEqual(source.GetValue(i), target.GetValue(i));
+                    }
+                }
+            }
+        }
+
+        private static ColumnFileReader Open(string path, bool mapped, ColumnFileKind kind)
+        {
+            var stream = mapped ? (Stream) MemoryViewStream.OpenMappedFile(path) : File.OpenRead(path);
+            return new ColumnFileReader(path, stream, kind, (int) DbType.Int32, Count);
+        }
+
+        private static void ExceptionAssert(Action action)
+        {
+            try
+            {
+                action();
+            }
+            catch (InvalidDataException)
+            {
+                return;
+            }
+
+            Assert.Fail("Expected exception was not thrown");
+        }
+    }
+}
@@ -0,0 +1,187 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Data;
+using System.Linq;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.Engine.Interfaces.Internal;
+using Pql.IntegrationStubs;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class DocumentDataContainerTest
+    {
+        [TestMethod]
+        public void TestConcurrentPartitionedInserts()
+        {
+            var descriptor = new DataContainerDescriptor();
+            descriptor.AddDocumentTypeName("doc");
+            var docType = descriptor.RequireDocumentTypeName("doc");
+            descriptor.AddField(new FieldMetadata(1, "id", "id", DbType.Int64, docType));
+            var docDesc = new DocumentTypeDescriptor("doc", "doc", docType, "id", new[] {1});
+            descriptor.AddDocumentTypeDescriptor(docDesc);
+
+            const int partitionCount = 8;
+            const int threadCount = 4;
+            const int insertsPerThread = 20000;
+            var settings = new RamDriverSettings {InsertPartitionCount = partitionCount};
+
+            using (var pool = new DynamicMemoryPool())
+            using (var container = new DocumentDataContainer(descriptor, docDesc, pool, settings, new DummyTracer()))
+            {
+                // threads insert interleaved keys, so that partitions are refilled concurrently
+                var indexes = new int[threadCount * insertsPerThread];
+                var threads = Enumerable.Range(0, threadCount).Select(t => Task.Factory.StartNew(() =>
+                    {
+                        for (var i = 0; i < insertsPerThread; i++)
+                        {
+                            var id = i * threadCount + t;
+                            container.TryAddDocument(CreateKey(id), out indexes[id]);
+                        }
+                    }, TaskCreationOptions.LongRunning)).ToArray();
+
+                Task.WaitAll(threads);
+
+                Assert.AreEqual(indexes.Length, indexes.Distinct().Count());
+
+                for (var id = 0; id < indexes.Length; id++)
+                {
+                    var index = -1;
+                    Assert.IsTrue(container.DocumentIdToIndex.TryGetValueInt32(CreateKey(id), ref index));
+                    Assert.AreEqual(indexes[id], index);
+                    Assert.IsTrue(container.ValidDocumentsBitmap.SafeGet(index));
+                }
+
+                // no reserved range is lost, every partition holds at most one partially used range
+                Assert.IsTrue(container.UntrimmedCount <= indexes.Length + partitionCount * 64, "Untrimmed count: " + container.UntrimmedCount);
+            }
+        }
+
+        [TestMethod]
+        public void TestReadDuringInserts()
+        {
+            var descriptor = new DataContainerDescriptor();
+            descriptor.AddDocumentTypeName("doc");
+            var docType = descriptor.RequireDocumentTypeName("doc");
+            descriptor.AddField(new FieldMetadata(1, "value", "value", DbType.Int64, docType));
+            var docDesc = new DocumentTypeDescriptor("doc", "doc", docType, "value", new[] {1});
+            descriptor.AddDocumentTypeDescriptor(docDesc);
+            var fields = new[] {descriptor.RequireField(1)};
+            var columnIndexes = new[] {0};
+            var columnTypes = new[] {DbType.Int64};
+
+            using (var pool = new DynamicMemoryPool())
+            using (var container = new DocumentDataContainer(descriptor, docDesc, pool, new RamDriverSettings(), new DummyTracer()))
+            {
+                const int count = 20000;
+                var inserts = Task.Factory.StartNew(() =>
+                    {
+                        var values = new DriverRowData(columnTypes);
+                        for (var i = 0; i < count; i++)
+                        {
+                            // same sequence as an insert made by the driver
+                            var version = container.BeginAddDocument(CreateKey(i), columnIndexes, columnTypes, out var index);
+                            try
+                            {
+                                values.ValueData8Bytes[values.FieldArrayIndexes[0]].AsInt64 = i + 1;
+                                container.ColumnStores[0].NotNulls.SafeSet(index);
+                                container.ColumnStores[0].AssignFromDriverRow(index, values, values.FieldArrayIndexes[0]);
+                            }
+                            finally
+                            {
+                                container.Versions.EndRowWrite(index, version);
+                            }
+                        }
+                    }, TaskCreationOptions.LongRunning);
+
+                // every document a reader sees must already have its value
+                var row = new DriverRowData(columnTypes);
+                var scanCount = 0;
+                while (!inserts.IsCompleted || scanCount == 0)
+                {
+                    using (var scan = container.GetUnorderedEnumerator(fields, 1, row))
+                    {
+                        while (scan != null && scan.MoveNext())
+                        {
+                            Assert.IsTrue(Pql.ClientDriver.Protocol.BitVector.Get(row.NotNulls, 0));
+                            Assert.IsTrue(row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt64 > 0);
+                        }
+                    }
+
+                    scanCount++;
+                }
+
+                inserts.Wait();
+            }
+        }
+
+        [TestMethod]
+        public void TestOrderedReadAfterTrim()
+        {
+            var descriptor = new DataContainerDescriptor();
+            descriptor.AddDocumentTypeName("doc");
+            var docType = descriptor.RequireDocumentTypeName("doc");
+            descriptor.AddField(new FieldMetadata(1, "value", "value", DbType.Int64, docType));
+            var docDesc = new DocumentTypeDescriptor("doc", "doc", docType, "value", new[] {1});
+            descriptor.AddDocumentTypeDescriptor(docDesc);
+            var fields = new[] {descriptor.RequireField(1)};
+            var orderFields = new[] {Tuple.Create(1, false)};
+
+            // stale reads must not be served from an index that was built before the trim
+            var settings = new RamDriverSettings {AllowStaleSortIndexReads = true};
+
+            using (var pool = new DynamicMemoryPool())
+            using (var newPool = new DynamicMemoryPool())
+            using (var container = new DocumentDataContainer(descriptor, docDesc, pool, settings, new DummyTracer()))
+            {
+                const int count = 10;
+                const int deleteCount = 3;
+                var values = new DriverRowData(new[] {DbType.Int64});
+                for (var i = 0; i < count; i++)
+                {
+                    container.TryAddDocument(CreateKey(i), out var index);
+                    values.ValueData8Bytes[values.FieldArrayIndexes[0]].AsInt64 = count - index;
+                    container.ColumnStores[0].NotNulls.SafeSet(index);
+                    container.ColumnStores[0].AssignFromDriverRow(index, values, values.FieldArrayIndexes[0]);
+                }
+
+                container.SortIndexManager.GetIndex(1);
+
+                // trailing documents go away, but the index still covers them
+                for (var i = count - deleteCount; i < count; i++)
+                {
+                    Assert.IsTrue(container.TryDeleteDocument(CreateKey(i)));
+                }
+
+                container.SortIndexManager.InvalidateAllIndexes();
+                Assert.AreEqual(count, container.SortIndexManager.GetIndex(1).OrderData.Length);
+
+                container.MigrateRAM(newPool);
+                Assert.AreEqual(count - deleteCount, container.UntrimmedCount);
+
+                var row = new DriverRowData(new[] {DbType.Int64});
+                var ordered = new List<long>();
+                using (var scan = container.GetOrderedEnumerator(fields, 1, row, orderFields))
+                {
+                    while (scan.MoveNext())
+                    {
+                        ordered.Add(row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt64);
+                    }
+                }
+
+                CollectionAssert.AreEqual(Enumerable.Range(deleteCount + 1, count - deleteCount).Select(x => (long) x).ToList(), ordered);
+            }
+        }
+
+        internal static byte[] CreateKey(long id)
+        {
+            var key = new byte[byte.MaxValue + 1];
+            key[0] = sizeof(long);
+            BitConverter.GetBytes(id).CopyTo(key, 1);
+            return key;
+        }
+    }
+}
@@ -0,0 +1,180 @@
+﻿using System;
+using System.IO;
+using System.Linq;
+using System.Text;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class ExpandableArrayOfValuesTest
+    {
+        static readonly IUnmanagedAllocator Pool = new DynamicMemoryPool();
+
+        [TestMethod]
+        public void TestStrings()
+        {
+            using (var values = new ExpandableArrayOfValues(Pool))
+            {
+                values.EnsureCapacity(70000);
+
+                values.SetString(0, "abc");
+                values.SetString(1, string.Empty);
+                values.SetString(2, "абв 中文 😀");
+                values.SetString(69999, "last");
+
+                Assert.AreEqual("abc", values.GetString(0));
+                Assert.AreEqual(string.Empty, values.GetString(1));
+                Assert.AreEqual("абв 中文 😀", values.GetString(2));
+                Assert.AreEqual("last", values.GetString(69999));
+                Assert.IsNull(values.GetString(3));
+                Assert.IsFalse(values.HasValue(3));
+
+                Assert.AreEqual(3, values.GetLength(0));
+                Assert.AreEqual(Encoding.UTF8.GetByteCount(values.GetString(2)), values.GetLength(2));
+
+                values.SetString(0, "replaced");
+                values.Clear(69999);
+
+                Assert.AreEqual("replaced", values.GetString(0));
+                Assert.IsFalse(values.HasValue(69999));
+            }
+        }
+
+        [TestMethod]
+        public void TestBinary()
+        {
+            var small = new byte[] {0, 1, 2, 255};
+            var large = Enumerable.Range(0, 1024 * 1024).Select(x => (byte) x).ToArray();
+
+            using (var values = new ExpandableArrayOfValues(Pool))
+            {
+                values.EnsureCapacity(3);
+
+                values.SetAt(0, small, 3);
+                values.SetAt(1, large, large.Length);
+                values.SetAt(2, null, 0);
+
+                var buffer = new byte[large.Length];
+                Assert.AreEqual(3, values.CopyTo(0, buffer, 0));
+                CollectionAssert.AreEqual(small.Take(3).ToArray(), buffer.Take(3).ToArray());
+
+                Assert.AreEqual(large.Length, values.CopyTo(1, buffer, 0));
+                CollectionAssert.AreEqual(large, buffer);
+
+                Assert.IsTrue(values.HasValue(2));
+                Assert.AreEqual(0, values.CopyTo(2, null, 0));
+            }
+        }
+
+        [TestMethod]
+        public void TestReadWriteAndCompaction()
+        {
+            const int count = 1000;
+
+            using (var validEntries = new BitVector(Pool))
+            using (var values = new ExpandableArrayOfValues(Pool))
+            {
+                validEntries.EnsureCapacity(count);
+                values.EnsureCapacity(count);
+
+                for (var i = 0; i < count; i++)
+                {
+                    if (i % 3 != 0)
+                    {
+                        validEntries.Set(i);
+                        values.SetString(i, "garbage");
+                        values.SetString(i, "value " + i);
+                    }
+                }
+
+                using (var stream = new MemoryStream())
+                {
+                    using (var writer = new BinaryWriter(stream, Encoding.UTF8, true))
+                    {
+                        values.Write(writer, count, validEntries);
+                    }
+
+                    // format must be compatible with strings written by BinaryWriter
+                    stream.Seek(0, SeekOrigin.Begin);
+                    using (var reader = new BinaryReader(stream, Encoding.UTF8, true))
+                    {
+                        for (var i = 0; i < count; i++)
+                        {
+                            if (i % 3 != 0)
+                            {
+                                Assert.AreEqual("value " + i, reader.ReadString());
+                            }
+                        }
+                    }
+
+                    Assert.AreEqual(stream.Length, stream.Position);
+
+                    stream.Seek(0, SeekOrigin.Begin);
+                    using (var reader = new BinaryReader(stream, Encoding.UTF8, true))
+                    using (var loaded = new ExpandableArrayOfValues(Pool))
+                    {
+                        loaded.Read(reader, count, validEntries);
+
+                        for (var i = 0; i < count; i++)
+                        {
+                            Assert.AreEqual(i % 3 != 0 ? "value " + i : null, loaded.GetString(i));
+                        }
+                    }
+                }
+
+                using (var newPool = new DynamicMemoryPool())
+                using (var copy = new ExpandableArrayOfValues(values, newPool))
+                {
+                    for (var i = 0; i < count; i++)
+                    {
+                        Assert.AreEqual(values.GetString(i), copy.GetString(i));
+                    }
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestMappedFile()
+        {
+            var path = Path.Combine(Path.GetTempPath(), Guid.NewGuid().ToString("N") + ".col");
+            var large = Enumerable.Range(0, 200000).Select(x => (byte) x).ToArray();
+            const int count = 100000;
+
+            using (var values = new ExpandableArrayOfValues(Pool, path))
+            {
+                Assert.IsTrue(values.IsMapped);
+                Assert.IsTrue(File.Exists(path));
+
+                values.EnsureCapacity(count);
+                for (var i = 0; i < count; i++)
+                {
+                    values.SetString(i, "value " + i);
+                }
+
+                values.SetAt(1, large, large.Length);
+                values.Prefetch(0, count);
+
+                var buffer = new byte[large.Length];
+                Assert.AreEqual(large.Length, values.CopyTo(1, buffer, 0));
+                CollectionAssert.AreEqual(large, buffer);
+
+                for (var i = 2; i < count; i++)
+                {
+                    Assert.AreEqual("value " + i, values.GetString(i));
+                }
+
+                using (var newPool = new DynamicMemoryPool())
+                using (var copy = new ExpandableArrayOfValues(values, newPool))
+                {
+                    Assert.IsFalse(copy.IsMapped);
+                    Assert.AreEqual(values.GetString(count - 1), copy.GetString(count - 1));
+                }
+            }
+
+            // scratch file is deleted when its last view is unmapped
+            Assert.IsFalse(File.Exists(path));
+        }
+    }
+}
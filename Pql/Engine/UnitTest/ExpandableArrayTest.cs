@@ -1,4 +1,5 @@
-﻿using System.Collections.Generic;
+﻿using System;
+using System.Collections.Generic;
 using System.Linq;
 using Microsoft.VisualStudio.TestTools.UnitTesting;
 using Pql.Engine.DataContainer.RamDriver;
@@ -13,11 +14,13 @@ namespace Pql.Engine.UnitTest
         public void Test()
         {
             const int blockCount = 10;
-            const int elemPerItem = 5;
+            const int elemPerItem = 4;
             var itemsPerBlock = ExpandableArray<int>.ComputeItemsPerBlock(sizeof(int));
 
             var x = new ExpandableArray<int>(elemPerItem, sizeof(int));
             Assert.AreEqual(itemsPerBlock, x.ElementsPerBlock / elemPerItem);
+            Assert.AreEqual(0, x.ElementsPerBlock & (x.ElementsPerBlock - 1));
+            Assert.AreEqual(x.ElementsPerBlock, 1 << x.BlockShift);
             Assert.AreEqual(0, x.GetLocalIndex(0));
             Assert.AreEqual(1, x.GetLocalIndex(1));
             Assert.AreEqual(x.ElementsPerBlock-1, x.GetLocalIndex(x.ElementsPerBlock-1));
@@ -33,6 +36,135 @@ namespace Pql.Engine.UnitTest
             Assert.IsTrue(realBlockCount == 1 + blockCount + x.BlockCountIncrement);
         }
 
+        [TestMethod]
+        public void TestBlockGeometry()
+        {
+            foreach (var itemSize in new[] {1, 2, 3, 4, 8, 12, 16, 24, 1000, 100000})
+            {
+                var itemsPerBlock = ExpandableArray<byte>.ComputeItemsPerBlock(itemSize);
+                Assert.AreEqual(0, itemsPerBlock & (itemsPerBlock - 1));
+                Assert.IsTrue(itemsPerBlock >= 32);
+                Assert.IsTrue(itemsPerBlock == 32 || itemsPerBlock * itemSize <= ExpandableArray<byte>.LargestObjectSizeOnNormalHeap);
+            }
+
+            try
+            {
+                new ExpandableArray<int>(3, sizeof(int));
+                Assert.Fail("Elements per item must be a power of two");
+            }
+            catch (ArgumentOutOfRangeException)
+            {
+            }
+        }
+
+        [TestMethod]
+        public void TestBlockSpan()
+        {
+            var x = new ExpandableArray<int>(1, sizeof(int));
+            var count = 3 * x.ElementsPerBlock + 5;
+            x.EnsureCapacity(count);
+
+            for (var i = 0; i < count; i++)
+            {
+                x[i] = i;
+            }
+
+            var span = x.GetBlockSpan(x.ElementsPerBlock - 2, 10);
+            Assert.AreEqual(x.ElementsPerBlock - 2, span.Offset);
+            Assert.AreEqual(2, span.Count);
+
+            span = x.GetBlockSpan(x.ElementsPerBlock + 1, 10);
+            Assert.AreEqual(1, span.Offset);
+            Assert.AreEqual(10, span.Count);
+
+            var seen = 0;
+            for (var start = 7; start < count;)
+            {
+                span = x.GetBlockSpan(start, count - start);
+                for (var i = 0; i < span.Count; i++)
+                {
+                    Assert.AreEqual(start + i, span.Array[span.Offset + i]);
+                }
+
+                start += span.Count;
+                seen += span.Count;
+            }
+
+            Assert.AreEqual(count - 7, seen);
+        }
+
+        [TestMethod]
+        public void TestTrim()
+        {
+            var x = new ExpandableArray<int>(1, sizeof(int));
+            x.EnsureCapacity(10 * x.ElementsPerBlock);
+            for (var i = 0; i < x.Capacity; i++)
+            {
+                x[i] = i;
+            }
+
+            x.TrimTo(2 * x.ElementsPerBlock + 1);
+            Assert.AreEqual(3 * x.ElementsPerBlock, x.Capacity);
+            Assert.AreEqual(3 + x.BlockCountIncrement, x.EnumerateBlocks().Count());
+            for (var i = 0; i < x.Capacity; i++)
+            {
+                Assert.AreEqual(i, x[i]);
+            }
+
+            x.EnsureCapacity(5 * x.ElementsPerBlock);
+            Assert.AreEqual(0, x[5 * x.ElementsPerBlock - 1]);
+
+            x.TrimTo(0);
+            Assert.AreEqual(0, x.Capacity);
+        }
+
+        [TestMethod]
+        public void TestSnapshot()
+        {
+            var x = new ExpandableArray<int>(1, sizeof(int));
+            x.EnsureCapacity(2 * x.ElementsPerBlock);
+            for (var i = 0; i < x.Capacity; i++)
+            {
+                x[i] = i;
+            }
+
+            using (var snapshot = x.Snapshot())
+            {
+                Assert.AreEqual(x.Capacity, snapshot.Capacity);
+
+                // written block is copied, untouched block stays shared, expansion is not visible in snapshot
+                x[1] = -1;
+                x.GetWritableBlock(2)[2] = -2;
+                x.EnsureCapacity(4 * x.ElementsPerBlock);
+                x[3 * x.ElementsPerBlock] = -3;
+
+                Assert.AreEqual(-1, x[1]);
+                Assert.AreEqual(-2, x[2]);
+                Assert.AreEqual(1, snapshot[1]);
+                Assert.AreEqual(2, snapshot[2]);
+                Assert.AreSame(x.GetBlock(x.ElementsPerBlock), snapshot.GetBlock(x.ElementsPerBlock));
+                Assert.AreNotSame(x.GetBlock(0), snapshot.GetBlock(0));
+                Assert.AreEqual(2 * x.ElementsPerBlock, snapshot.Capacity);
+
+                try
+                {
+                    x.Snapshot();
+                    Assert.Fail("Only one snapshot can be alive");
+                }
+                catch (InvalidOperationException)
+                {
+                }
+            }
+
+            // without a snapshot, blocks are written in place
+            var block = x.GetBlock(0);
+            x[3] = -4;
+            Assert.AreSame(block, x.GetBlock(0));
+            Assert.AreEqual(-4, block[3]);
+
+            x.Snapshot().Dispose();
+        }
+
         [TestMethod]
         public void DebugUtil()
         {
@@ -0,0 +1,120 @@
+﻿using System;
+using System.IO;
+using System.Linq;
+using System.Text;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.Engine.Interfaces.Internal;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class PooledChunkStreamTest
+    {
+        [TestMethod]
+        public void TestWriteAcrossChunks()
+        {
+            var data = Enumerable.Range(0, 3 * PooledChunkStream.ChunkSize + 17).Select(x => (byte) (x * 7)).ToArray();
+
+            using (var stream = new PooledChunkStream())
+            {
+                stream.Write(data, 0, 100);
+                stream.WriteByte(data[100]);
+                stream.Write(data, 101, data.Length - 101);
+
+                Assert.AreEqual(data.Length, stream.Length);
+                Assert.AreEqual(4 * PooledChunkStream.ChunkSize, stream.Capacity);
+
+                using (var copy = new MemoryStream())
+                {
+                    stream.WriteTo(copy);
+                    CollectionAssert.AreEqual(data, copy.ToArray());
+                }
+
+                stream.Seek(0, SeekOrigin.Begin);
+                var read = new byte[data.Length + 10];
+                Assert.AreEqual(data.Length, stream.Read(read, 0, read.Length));
+                CollectionAssert.AreEqual(data, read.Take(data.Length).ToArray());
+            }
+        }
+
+        [TestMethod]
+        public void TestTruncateReturnsChunksToPool()
+        {
+            using (var stream = new PooledChunkStream())
+            using (var writer = new BinaryWriter(stream, Encoding.UTF8, true))
+            {
+                for (var i = 0; i < 100000; i++)
+                {
+                    writer.Write(i);
+                }
+
+                var pooledBefore = PooledChunkStream.PooledChunkCount;
+                var chunks = (int) (stream.Capacity / PooledChunkStream.ChunkSize);
+
+                stream.SetLength(10);
+                Assert.AreEqual(10, stream.Length);
+                Assert.AreEqual(10, stream.Position);
+                Assert.AreEqual(PooledChunkStream.ChunkSize, stream.Capacity);
+                Assert.AreEqual(pooledBefore + chunks - 1, PooledChunkStream.PooledChunkCount);
+
+                // truncated stream can be appended to again
+                writer.Write(-1);
+                stream.Position = 8;
+                using (var reader = new BinaryReader(stream, Encoding.UTF8, true))
+                {
+                    Assert.AreEqual(2, reader.ReadInt16());
+                    Assert.AreEqual(-1, reader.ReadInt32());
+                }
+
+                ExceptionAssert(() => stream.SetLength(stream.Length + 1));
+            }
+        }
+
+        [TestMethod]
+        public void TestAdaptCapacity()
+        {
+            using (var buffer = new RequestExecutionBuffer())
+            {
+                Assert.AreEqual(RequestExecutionBuffer.InitialBytesPerBuffer, buffer.Capacity);
+
+                // very fast link: capacity grows up to the limit
+                for (var i = 0; i < 20; i++)
+                {
+                    buffer.AdaptCapacity(buffer.Capacity, 1000, 1);
+                }
+
+                Assert.AreEqual(RequestExecutionBuffer.MaxBytesPerBuffer, buffer.Capacity);
+
+                // very slow link: capacity goes down to the limit
+                for (var i = 0; i < 20; i++)
+                {
+                    buffer.AdaptCapacity(buffer.Capacity, 1000, System.Diagnostics.Stopwatch.Frequency * 100);
+                }
+
+                Assert.AreEqual(RequestExecutionBuffer.MinBytesPerBuffer, buffer.Capacity);
+
+                // very slow link but wide rows: buffer still fits a number of rows
+                for (var i = 0; i < 20; i++)
+                {
+                    buffer.AdaptCapacity(100000, 1, System.Diagnostics.Stopwatch.Frequency * 100);
+                }
+
+                Assert.IsTrue(buffer.Capacity > 10 * 100000);
+            }
+        }
+
+        private static void ExceptionAssert(Action action)
+        {
+            try
+            {
+                action();
+            }
+            catch (NotSupportedException)
+            {
+                return;
+            }
+
+            Assert.Fail("Expected exception was not thrown");
+        }
+    }
+}
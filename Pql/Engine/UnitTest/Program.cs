@@ -1,7 +1,13 @@
 ﻿using System;
+using System.Data;
 using System.Diagnostics;
+using System.Linq;
 using System.Threading;
 using System.Threading.Tasks;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.Engine.Interfaces.Internal;
+using Pql.IntegrationStubs;
+using Pql.UnmanagedLib;
 
 namespace Pql.Engine.UnitTest
 {
@@ -26,6 +32,7 @@ namespace Pql.Engine.UnitTest
             //GenerateDemoData();
             ReadDemoData();
             //PerformanceTest();
+            //InsertPartitionTest();
         }
 
         private static void ReadDemoData()
@@ -103,6 +110,52 @@ namespace Pql.Engine.UnitTest
             Console.ReadLine();
         }
 
+        /// <summary>
+        /// Compares throughput of concurrent inserts into a single document container with and without insert partitions.
+        /// Partitions only remove contention on document count and valid documents bitmap,
+        /// keys and structure lock are still shared, see <see cref="RamDriverSettings.InsertPartitionCount"/>.
+        /// </summary>
+        private static void InsertPartitionTest()
+        {
+            var descriptor = new DataContainerDescriptor();
+            descriptor.AddDocumentTypeName("doc");
+            var docType = descriptor.RequireDocumentTypeName("doc");
+            descriptor.AddField(new FieldMetadata(1, "id", "id", DbType.Int64, docType));
+            var docDesc = new DocumentTypeDescriptor("doc", "doc", docType, "id", new[] {1});
+            descriptor.AddDocumentTypeDescriptor(docDesc);
+
+            const int countPerThread = 500000;
+            var numThreads = Environment.ProcessorCount;
+
+            foreach (var partitionCount in new[] {0, numThreads, numThreads * 4})
+            {
+                // first round is a warm-up
+                for (var round = 0; round < 3; round++)
+                {
+                    var settings = new RamDriverSettings {InsertPartitionCount = partitionCount};
+                    using (var pool = new DynamicMemoryPool())
+                    using (var container = new DocumentDataContainer(descriptor, docDesc, pool, settings, new DummyTracer()))
+                    {
+                        var timer = Stopwatch.StartNew();
+                        var threads = Enumerable.Range(0, numThreads).Select(t => Task.Factory.StartNew(() =>
+                            {
+                                for (var i = 0; i < countPerThread; i++)
+                                {
+                                    int index;
+                                    container.TryAddDocument(DocumentDataContainerTest.CreateKey((long) i * numThreads + t), out index);
+                                }
+                            }, TaskCreationOptions.LongRunning)).ToArray();
+
+                        Task.WaitAll(threads);
+                        timer.Stop();
+
+                        Console.WriteLine("Partitions: {0,3}, threads: {1,3}, elapsed ms: {2,5}, rps: {3,10:F0}",
+                            partitionCount, numThreads, timer.ElapsedMilliseconds, countPerThread * numThreads * 1000.0 / timer.ElapsedMilliseconds);
+                    }
+                }
+            }
+        }
+
         private static void RunMultithreaded(
             RamDriverTest test, int numThreads, int firstId, int countPerInterval,
             Action<RamDriverTest, int, object> threadAction)
@@ -0,0 +1,174 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Data;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.Engine.DataContainer.Engine;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.Engine.Interfaces.Internal;
+using Pql.IntegrationStubs;
+using Pql.UnmanagedLib;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class QuerySchedulerTest
+    {
+        [TestMethod]
+        public void TestGrantOrder()
+        {
+            var x = new QueryScheduler(1);
+            var granted = new List<string>();
+            var waiters = new List<Task>();
+
+            x.Enter("a", QueryLane.Batch, CancellationToken.None);
+            Assert.AreEqual(1, x.RunningCount);
+
+            waiters.Add(StartWaiter(x, granted, "b", QueryLane.Batch, "b1"));
+            waiters.Add(StartWaiter(x, granted, "a", QueryLane.Interactive, "a1"));
+            waiters.Add(StartWaiter(x, granted, "a", QueryLane.Interactive, "a2"));
+            waiters.Add(StartWaiter(x, granted, "a", QueryLane.Interactive, "a3"));
+            waiters.Add(StartWaiter(x, granted, "c", QueryLane.Interactive, "c1"));
+
+            // interactive lane goes first with tenants taking turns, batch lane is let in after a few interactive grants
+            x.Exit();
+            Assert.IsTrue(Task.WaitAll(waiters.ToArray(), 1000));
+            Assert.AreEqual("a1,c1,a2,b1,a3", string.Join(",", granted));
+            Assert.AreEqual(0, x.RunningCount);
+            Assert.AreEqual(0, x.WaitingCount);
+        }
+
+        [TestMethod]
+        public void TestCancellation()
+        {
+            var x = new QueryScheduler(1);
+            var granted = new List<string>();
+            var cts = new CancellationTokenSource();
+
+            x.Enter("a", QueryLane.Interactive, CancellationToken.None);
+
+            var cancelled = Task.Run(() => x.Enter("a", QueryLane.Interactive, cts.Token));
+            WaitForWaiters(x, 1);
+            var waiter = StartWaiter(x, granted, "b", QueryLane.Batch, "b1");
+
+            cts.Cancel();
+            try
+            {
+                cancelled.Wait(1000);
+                Assert.Fail("Cancelled wait must throw");
+            }
+            catch (AggregateException e)
+            {
+                Assert.IsInstanceOfType(e.InnerException, typeof(OperationCanceledException));
+            }
+
+            // cancelled waiter is skipped
+            x.Exit();
+            Assert.IsTrue(waiter.Wait(1000));
+            Assert.AreEqual("b1", string.Join(",", granted));
+            Assert.AreEqual(0, x.RunningCount);
+
+            try
+            {
+                x.Exit();
+                Assert.Fail("Slot is not taken");
+            }
+            catch (SynchronizationLockException)
+            {
+            }
+        }
+
+        [TestMethod]
+        public void TestScansWithoutFreeSlots()
+        {
+            var descriptor = new DataContainerDescriptor();
+            descriptor.AddDocumentTypeName("doc");
+            var docType = descriptor.RequireDocumentTypeName("doc");
+            descriptor.AddField(new FieldMetadata(1, "value", "value", DbType.Int64, docType));
+            var docDesc = new DocumentTypeDescriptor("doc", "doc", docType, "value", new[] {1});
+            descriptor.AddDocumentTypeDescriptor(docDesc);
+            var fields = new[] {descriptor.RequireField(1)};
+
+            using (var pool = new DynamicMemoryPool())
+            using (var container = new DocumentDataContainer(descriptor, docDesc, pool, new RamDriverSettings(), new DummyTracer()))
+            {
+                // several morsels and partitions, values go down as document indexes go up
+                var count = 3 * DocumentDataContainerEnumerator_ParallelScan.MorselSize + 5;
+                var values = new DriverRowData(new[] {DbType.Int64});
+                var key = new byte[byte.MaxValue + 1];
+                key[0] = sizeof(long);
+                for (var i = 0; i < count; i++)
+                {
+                    BitConverter.GetBytes((long) i).CopyTo(key, 1);
+                    container.TryAddDocument(key, out var index);
+                    values.ValueData8Bytes[values.FieldArrayIndexes[0]].AsInt64 = count - index;
+                    container.ColumnStores[0].NotNulls.SafeSet(index);
+                    container.ColumnStores[0].AssignFromDriverRow(index, values, values.FieldArrayIndexes[0]);
+                }
+
+                // this thread plays a producer which holds the only slot, so scan workers never get one
+                var x = new QueryScheduler(1);
+                x.Enter("a", QueryLane.Batch, CancellationToken.None);
+
+                var row = new DriverRowData(new[] {DbType.Int64});
+                var seen = new HashSet<long>();
+                using (var scan = container.GetParallelScanEnumerator(
+                    fields, 1, row, context => true, new ClauseEvaluationContext(), true, x, "a", CancellationToken.None))
+                {
+                    while (scan.MoveNext())
+                    {
+                        Assert.IsTrue(seen.Add(row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt64));
+                    }
+                }
+
+                Assert.AreEqual(count, seen.Count);
+
+                var top = new List<long>();
+                using (var topK = container.GetTopKEnumerator(
+                    fields, 1, row, new[] {Tuple.Create(1, false)}, 3, null, new ClauseEvaluationContext(), x, "a", CancellationToken.None))
+                {
+                    while (topK.MoveNext())
+                    {
+                        top.Add(row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt64);
+                    }
+                }
+
+                CollectionAssert.AreEqual(new[] {1L, 2L, 3L}, top);
+
+                x.Exit();
+                Assert.AreEqual(0, x.RunningCount);
+            }
+        }
+
+        private static Task StartWaiter(QueryScheduler x, List<string> granted, string tenantId, QueryLane lane, string name)
+        {
+            var expected = x.WaitingCount + 1;
+            var task = Task.Run(() =>
+                {
+                    x.Enter(tenantId, lane, CancellationToken.None);
+                    try
+                    {
+                        granted.Add(name);
+                    }
+                    finally
+                    {
+                        x.Exit();
+                    }
+                });
+
+            // waiters must be queued in order of this test
+            WaitForWaiters(x, expected);
+            return task;
+        }
+
+        private static void WaitForWaiters(QueryScheduler x, int count)
+        {
+            var spinner = new SpinWait();
+            while (x.WaitingCount < count)
+            {
+                spinner.SpinOnce();
+            }
+        }
+    }
+}
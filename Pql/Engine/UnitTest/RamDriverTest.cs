@@ -3,9 +3,12 @@ using System.Collections.Generic;
 using System.Configuration;
 using System.Data;
 using System.Diagnostics;
+using System.IO;
 using System.Linq;
+using System.Text;
 using System.Threading;
 using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Newtonsoft.Json.Linq;
 using Pql.ClientDriver;
 using Pql.Engine.DataContainer;
 
@@ -444,6 +447,72 @@ namespace Pql.Engine.UnitTest
             }
         }
 
+        [TestMethod]
+        public void TestSelectOrderWithSmallPage()
+        {
+            using (var conn = GetTestConnection())
+            {
+                using (var command = conn.CreateCommand())
+                {
+                    var all = GetEnumerable<long>(command, "select id from testdoc order by id desc").ToList();
+                    Assert.AreNotEqual(0, all.Count);
+
+                    var page = GetEnumerable<long>(command, "select id from testdoc order by id desc limit 10 offset 3").ToList();
+                    Assert.IsTrue(all.Skip(3).Take(10).SequenceEqual(page));
+
+                    var filtered = GetEnumerable<long>(command, "select id from testdoc where id > 5 order by id limit 5").ToList();
+                    Assert.IsTrue(all.Where(x => x > 5).OrderBy(x => x).Take(5).SequenceEqual(filtered));
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestExportColumns()
+        {
+            var driver = TestServiceContainer.StorageDriver;
+            var docDesc = driver.GetDescriptor().RequireDocumentType("testdoc");
+            var path = Path.GetTempFileName();
+
+            try
+            {
+                driver.ExportColumnsToFile(docDesc.DocumentType, null, path);
+
+                var bytes = File.ReadAllBytes(path);
+                Assert.AreEqual("PQLARROW", Encoding.ASCII.GetString(bytes, 0, 8));
+                Assert.AreEqual(1, BitConverter.ToInt32(bytes, 8));
+
+                var manifestLength = BitConverter.ToInt32(bytes, 12);
+                var manifest = JObject.Parse(Encoding.UTF8.GetString(bytes, 16, manifestLength));
+                var dataStart = (16 + manifestLength + 63) / 64 * 64;
+
+                var fields = (JArray) manifest["fields"];
+                Assert.AreEqual(docDesc.Fields.Length + 1, fields.Count);
+                Assert.AreEqual("$valid", (string) fields[0]["name"]);
+
+                var rowCount = (int) manifest["rowCount"];
+                long end = 0;
+                foreach (var field in fields)
+                {
+                    foreach (var buffer in (JArray) field["buffers"])
+                    {
+                        var offset = (long) buffer["offset"];
+                        Assert.AreEqual(0, offset % 64);
+                        Assert.IsTrue(offset >= end);
+                        end = offset + (long) buffer["length"];
+                    }
+
+                    // every field starts with a bitmap
+                    Assert.AreEqual((rowCount + 7) / 8, (long) field["buffers"][0]["length"]);
+                }
+
+                Assert.IsTrue(dataStart + end <= bytes.Length);
+            }
+            finally
+            {
+                File.Delete(path);
+            }
+        }
+
         [TestMethod]
         public void TestBasicSelect()
         {
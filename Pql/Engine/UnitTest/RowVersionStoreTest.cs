@@ -0,0 +1,210 @@
+﻿using System;
+using System.Data;
+using System.Linq;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.ClientDriver.Protocol;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.Engine.Interfaces.Internal;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class RowVersionStoreTest
+    {
+        static readonly Pql.UnmanagedLib.IUnmanagedAllocator Pool = new Pql.UnmanagedLib.DynamicMemoryPool();
+
+        [TestMethod]
+        public void TestSnapshotReads()
+        {
+            using (var x = new RowVersionStore(Pool))
+            {
+                // nobody reads, no images are kept
+                var version = x.BeginRowWrite(5, out var keepImage);
+                Assert.IsFalse(keepImage);
+                x.PublishRowWrite(5, version);
+                x.EndRowWrite(5, version);
+
+                var before = x.BeginRead();
+                var stamp = before.BeginRowRead(5);
+                Assert.IsFalse(before.IsNewer(stamp));
+
+                // document 5 changes column 2 from 1 to something else, and then gets deleted
+                version = x.BeginRowWrite(5, out keepImage);
+                Assert.IsTrue(keepImage);
+
+                // overlapping write is detected, and a write newer than snapshot is not waited for once its image is published
+                Assert.IsFalse(before.EndRowRead(5, stamp));
+                x.PublishRowWrite(5, version, true, new[] {2}, CreateValues(1));
+                stamp = before.BeginRowRead(5);
+                Assert.IsTrue(before.IsNewer(stamp));
+
+                x.EndRowWrite(5, version);
+                Assert.IsFalse(before.EndRowRead(5, stamp));
+
+                version = x.BeginRowWrite(5, out keepImage);
+                x.PublishRowWrite(5, version, true, new[] {1, 2}, CreateValues(2, 3));
+                x.EndRowWrite(5, version);
+                Assert.AreEqual(2, x.ImageCount);
+
+                var after = x.BeginRead();
+
+                // old snapshot sees valid document with original value, taken from the first image
+                stamp = before.BeginRowRead(5);
+                Assert.IsTrue(before.EndRowRead(5, stamp));
+                Assert.IsTrue(before.WasValid(5, stamp, false));
+
+                var row = CreateValues(0);
+                Assert.IsTrue(before.ReadColumnImage(5, 2, row, 0));
+                Assert.AreEqual(1, row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt32);
+
+                Assert.IsTrue(before.ReadColumnImage(5, 1, row, 0));
+                Assert.AreEqual(2, row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt32);
+
+                Assert.IsFalse(before.ReadColumnImage(5, 0, row, 0));
+                Assert.IsFalse(before.ReadColumnImage(4, 2, row, 0));
+
+                // new snapshot sees current state
+                stamp = after.BeginRowRead(5);
+                Assert.IsFalse(after.IsNewer(stamp));
+                Assert.IsFalse(after.WasValid(5, stamp, false));
+
+                // images are freed when the last snapshot that needs them completes
+                after.Dispose();
+                Assert.AreEqual(2, x.ImageCount);
+                before.Dispose();
+                Assert.AreEqual(0, x.ImageCount);
+                Assert.IsFalse(after.ReadColumnImage(5, 2, row, 0));
+            }
+        }
+
+        [TestMethod]
+        public void TestImageValues()
+        {
+            using (var x = new RowVersionStore(Pool))
+            {
+                var types = new[] {DbType.Int64, DbType.Guid, DbType.String, DbType.Binary, DbType.String, DbType.Int32};
+                var values = new DriverRowData(types);
+                var guid = Guid.NewGuid();
+                for (var i = 0; i < 5; i++)
+                {
+                    BitVector.Set(values.NotNulls, i);
+                }
+
+                values.ValueData8Bytes[values.FieldArrayIndexes[0]].AsInt64 = -5;
+                values.ValueData16Bytes[values.FieldArrayIndexes[1]].AsGuid = guid;
+                values.StringData[values.FieldArrayIndexes[2]] = "abc";
+                values.BinaryData[values.FieldArrayIndexes[3]].CopyFrom(new byte[] {1, 2, 3, 4, 5});
+                values.StringData[values.FieldArrayIndexes[4]] = string.Empty;
+
+                var snapshot = x.BeginRead();
+                var version = x.BeginRowWrite(0, out var keepImage);
+                Assert.IsTrue(keepImage);
+                x.PublishRowWrite(0, version, true, new[] {0, 1, 2, 3, 4, 5}, values);
+                x.EndRowWrite(0, version);
+
+                // values are copied into the pool, the row buffer can be reused
+                values.StringData[values.FieldArrayIndexes[2]] = "xyz";
+                values.BinaryData[values.FieldArrayIndexes[3]].SetLength(0);
+
+                var row = new DriverRowData(types);
+                for (var i = 0; i < types.Length; i++)
+                {
+                    BitVector.Set(row.NotNulls, i);
+                    Assert.IsTrue(snapshot.ReadColumnImage(0, i, row, i));
+                }
+
+                Assert.AreEqual(-5, row.ValueData8Bytes[row.FieldArrayIndexes[0]].AsInt64);
+                Assert.AreEqual(guid, row.ValueData16Bytes[row.FieldArrayIndexes[1]].AsGuid);
+                Assert.AreEqual("abc", row.StringData[row.FieldArrayIndexes[2]]);
+                var binary = row.BinaryData[row.FieldArrayIndexes[3]];
+                CollectionAssert.AreEqual(new byte[] {1, 2, 3, 4, 5}, binary.Data.Take(binary.Length).ToArray());
+                Assert.AreEqual(string.Empty, row.StringData[row.FieldArrayIndexes[4]]);
+                Assert.IsFalse(BitVector.Get(row.NotNulls, 5));
+
+                snapshot.Dispose();
+                Assert.AreEqual(0, x.ImageCount);
+            }
+        }
+
+        [TestMethod]
+        public void TestReadDuringWriteOfSnapshotVersion()
+        {
+            var x = new RowVersionStore(Pool);
+
+            // snapshot is taken after the write has taken its version, so it has to see the write
+            var version = x.BeginRowWrite(5, out var keepImage);
+            Assert.IsFalse(keepImage);
+            var snapshot = x.BeginRead();
+
+            var read = Task.Run(() => snapshot.BeginRowRead(5));
+            Assert.IsFalse(read.Wait(100));
+
+            // next write of the same document waits for this one too
+            var nextWrite = Task.Run(() => x.BeginRowWrite(5, out var ignored));
+            Assert.IsFalse(nextWrite.Wait(100));
+
+            x.PublishRowWrite(5, version);
+            Assert.IsFalse(read.Wait(100));
+
+            x.EndRowWrite(5, version);
+            Assert.IsTrue(read.Wait(1000));
+            Assert.IsFalse(snapshot.IsNewer(read.Result));
+            Assert.IsTrue(snapshot.EndRowRead(5, read.Result));
+
+            Assert.IsTrue(nextWrite.Wait(1000));
+            Assert.IsTrue(nextWrite.Result > version);
+            x.PublishRowWrite(5, nextWrite.Result);
+            x.EndRowWrite(5, nextWrite.Result);
+            snapshot.Dispose();
+        }
+
+        [TestMethod]
+        public void TestManySnapshots()
+        {
+            using (var x = new RowVersionStore(Pool))
+            {
+                // far more readers than initial slots, none of them waits for a free one
+                var snapshots = Enumerable.Range(0, 64 * Environment.ProcessorCount + 100).Select(i => x.BeginRead()).ToArray();
+
+                var version = x.BeginRowWrite(3, out var keepImage);
+                Assert.IsTrue(keepImage);
+                x.PublishRowWrite(3, version, true, new[] {0}, CreateValues(7));
+                x.EndRowWrite(3, version);
+
+                // image stays until the oldest snapshot completes, which is the last one here
+                for (var i = snapshots.Length - 1; i >= 0; i--)
+                {
+                    Assert.AreEqual(1, x.ImageCount);
+                    snapshots[i].Dispose();
+                }
+
+                Assert.AreEqual(0, x.ImageCount);
+
+                // without readers, writes keep no images
+                version = x.BeginRowWrite(3, out keepImage);
+                Assert.IsFalse(keepImage);
+                x.PublishRowWrite(3, version);
+                x.EndRowWrite(3, version);
+            }
+        }
+
+        private static DriverRowData CreateValues(params int[] values)
+        {
+            var types = new DbType[values.Length];
+            for (var i = 0; i < types.Length; i++)
+            {
+                types[i] = DbType.Int32;
+            }
+
+            var result = new DriverRowData(types);
+            for (var i = 0; i < values.Length; i++)
+            {
+                BitVector.Set(result.NotNulls, i);
+                result.ValueData8Bytes[result.FieldArrayIndexes[i]].AsInt32 = values[i];
+            }
+
+            return result;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+﻿using System;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.Engine.DataContainer.RamDriver;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class ScalableReaderWriterLockTest
+    {
+        [TestMethod]
+        public void TestRecursion()
+        {
+            var x = new ScalableReaderWriterLock();
+
+            x.EnterReadLock();
+            x.EnterReadLock();
+            Assert.IsTrue(x.IsReadLockHeld);
+
+            try
+            {
+                x.EnterWriteLock();
+                Assert.Fail("Read lock cannot be upgraded");
+            }
+            catch (LockRecursionException)
+            {
+            }
+
+            x.ExitReadLock();
+            x.ExitReadLock();
+            Assert.IsFalse(x.IsReadLockHeld);
+
+            try
+            {
+                x.ExitReadLock();
+                Assert.Fail("Read lock is not held");
+            }
+            catch (SynchronizationLockException)
+            {
+            }
+
+            // reads nested into a write section stay held after it ends, and block other writers
+            x.EnterWriteLock();
+            x.EnterWriteLock();
+            x.EnterReadLock();
+            Assert.IsTrue(x.IsWriteLockHeld);
+            x.ExitWriteLock();
+            x.ExitWriteLock();
+            Assert.IsFalse(x.IsWriteLockHeld);
+            Assert.IsTrue(x.IsReadLockHeld);
+
+            var writer = Task.Run(() =>
+                {
+                    x.EnterWriteLock();
+                    x.ExitWriteLock();
+                });
+            Assert.IsFalse(writer.Wait(100));
+
+            x.ExitReadLock();
+            Assert.IsTrue(writer.Wait(1000));
+        }
+
+        [TestMethod]
+        public void TestExclusion()
+        {
+            var x = new ScalableReaderWriterLock();
+            var value = 0;
+            var torn = 0;
+
+            // writers keep value even outside of write sections, readers must never see it odd
+            Parallel.For(0, 10000, i =>
+                {
+                    if (i % 100 == 0)
+                    {
+                        x.EnterWriteLock();
+                        try
+                        {
+                            value++;
+                            Thread.SpinWait(100);
+                            value++;
+                        }
+                        finally
+                        {
+                            x.ExitWriteLock();
+                        }
+                    }
+                    else
+                    {
+                        x.EnterReadLock();
+                        try
+                        {
+                            if (Volatile.Read(ref value) % 2 != 0)
+                            {
+                                Interlocked.Increment(ref torn);
+                            }
+                        }
+                        finally
+                        {
+                            x.ExitReadLock();
+                        }
+                    }
+                });
+
+            Assert.AreEqual(0, torn);
+            Assert.AreEqual(200, value);
+        }
+
+        [TestMethod]
+        public void TestDispose()
+        {
+            var x = new ScalableReaderWriterLock();
+            Task.Run(() =>
+                {
+                    x.EnterReadLock();
+                    x.ExitReadLock();
+                }).Wait();
+
+            x.Dispose();
+
+            try
+            {
+                x.EnterReadLock();
+                Assert.Fail("Disposed lock cannot be used");
+            }
+            catch (ObjectDisposedException)
+            {
+            }
+        }
+    }
+}
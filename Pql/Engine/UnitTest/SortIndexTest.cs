@@ -1,6 +1,9 @@
-﻿using System.Data;
+﻿using System;
+using System.Data;
+using System.Linq;
 using Microsoft.VisualStudio.TestTools.UnitTesting;
 using Pql.Engine.DataContainer.RamDriver;
+using Pql.ExpressionEngine.Interfaces;
 using Pql.UnmanagedLib;
 
 namespace Pql.Engine.UnitTest
@@ -84,5 +87,218 @@ namespace Pql.Engine.UnitTest
                 }
             }
         }
+
+        [TestMethod]
+        public void TestIndexSnapshotIsolation()
+        {
+            using (var validDocsBitmap = new BitVector(Pool))
+            {
+                validDocsBitmap.EnsureCapacity(4);
+                validDocsBitmap.ChangeAll(true);
+                validDocsBitmap.Clear(1);
+
+                using (var data = new ColumnData<int>(DbType.Int32, Pool))
+                {
+                    data.EnsureCapacity(4);
+
+                    data.DataArray.GetBlock(0)[0] = 10;
+                    data.DataArray.GetBlock(0)[1] = 5;
+                    data.DataArray.GetBlock(0)[2] = 7;
+                    data.DataArray.GetBlock(0)[3] = 1;
+
+                    data.NotNulls.Set(0);
+                    data.NotNulls.Set(1);
+                    data.NotNulls.Set(2);
+                    data.NotNulls.Set(3);
+
+                    var index = new SortIndex();
+                    Assert.IsFalse(index.IsValid);
+
+                    var generation = index.Generation;
+                    using (var column = data.Snapshot())
+                    using (var validDocuments = validDocsBitmap.Snapshot())
+                    {
+                        // modifications made after snapshots are taken must not affect ordering being built
+                        data.DataArray[3] = 100;
+                        index.Invalidate();
+
+                        index.Publish(SortIndex.Build<int>(column, validDocuments, 4), generation);
+                    }
+
+                    Assert.IsFalse(index.IsValid);
+
+                    // deleted document 1 is excluded, expected order: 3, 2, 0
+                    var previous = index.Current;
+                    Assert.AreEqual(3, previous.ValidDocCount);
+                    Assert.AreEqual(3, previous.OrderData[0]);
+                    Assert.AreEqual(2, previous.OrderData[1]);
+                    Assert.AreEqual(0, previous.OrderData[2]);
+
+                    index.Update(data, validDocsBitmap, 4);
+                    Assert.IsTrue(index.IsValid);
+                    Assert.AreEqual(2, index.OrderData[0]);
+                    Assert.AreEqual(0, index.OrderData[1]);
+                    Assert.AreEqual(3, index.OrderData[2]);
+
+                    // previously published version stays intact
+                    Assert.AreEqual(3, previous.OrderData[0]);
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestIndexString()
+        {
+            var values = new[] { "abc", "x", "ABD", null, "ab", "\u00C9a", "\u00E9", "\U0001F600", "\uFF21" };
+            using (var validDocsBitmap = new BitVector(Pool))
+            {
+                validDocsBitmap.EnsureCapacity(values.Length);
+                validDocsBitmap.ChangeAll(true);
+
+                using (var data = new ColumnData<string>(DbType.String, Pool))
+                {
+                    data.EnsureCapacity(values.Length);
+                    for (var i = 0; i < values.Length; i++)
+                    {
+                        if (values[i] != null)
+                        {
+                            data.VarLengthData.SetString(i, values[i]);
+                            data.NotNulls.Set(i);
+                        }
+                    }
+
+                    var index = new SortIndex();
+                    using (var column = data.Snapshot())
+                    using (var validDocuments = validDocsBitmap.Snapshot())
+                    {
+                        // value written after snapshot is taken must not affect ordering being built
+                        data.VarLengthData.SetString(8, "a");
+
+                        index.Publish(SortIndex.Build<string>(column, validDocuments, values.Length), index.Generation);
+                    }
+
+                    // same order as StringComparer.OrdinalIgnoreCase gives for decoded strings, NULL goes first,
+                    // characters above the basic plane go by their UTF-16 surrogates, before U+FF21
+                    var expected = new[] { 3, 4, 0, 2, 1, 6, 5, 7, 8 };
+                    CollectionAssert.AreEqual(expected, index.OrderData);
+                    CollectionAssert.AreEqual(
+                        expected.Skip(1).ToArray(),
+                        expected.Skip(1).OrderBy(i => values[i], StringComparer.OrdinalIgnoreCase).ToArray());
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestIndexBinary()
+        {
+            var values = new[] { new byte[] { 1, 2 }, new byte[] { 1 }, new byte[] { 0, 255 }, new byte[] { 1, 2, 0 }, null };
+            using (var validDocsBitmap = new BitVector(Pool))
+            {
+                validDocsBitmap.EnsureCapacity(values.Length);
+                validDocsBitmap.ChangeAll(true);
+
+                using (var data = new ColumnData<SizableArrayOfByte>(DbType.Binary, Pool))
+                {
+                    data.EnsureCapacity(values.Length);
+                    for (var i = 0; i < values.Length; i++)
+                    {
+                        if (values[i] != null)
+                        {
+                            data.VarLengthData.SetAt(i, values[i], values[i].Length);
+                            data.NotNulls.Set(i);
+                        }
+                    }
+
+                    var index = new SortIndex();
+                    index.Update(data, validDocsBitmap, values.Length);
+
+                    // bytes are compared one by one, then shorter value goes first
+                    CollectionAssert.AreEqual(new[] { 4, 2, 1, 0, 3 }, index.OrderData);
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestCompositeIndex()
+        {
+            using (var validDocsBitmap = new BitVector(Pool))
+            {
+                validDocsBitmap.EnsureCapacity(5);
+                validDocsBitmap.ChangeAll(true);
+
+                using (var status = new ColumnData<int>(DbType.Int32, Pool))
+                using (var name = new ColumnData<string>(DbType.String, Pool))
+                {
+                    status.EnsureCapacity(5);
+                    name.EnsureCapacity(5);
+
+                    status.DataArray.GetBlock(0)[0] = 2;
+                    status.DataArray.GetBlock(0)[1] = -1;
+                    status.DataArray.GetBlock(0)[2] = 2;
+                    status.DataArray.GetBlock(0)[3] = -1;
+                    status.DataArray.GetBlock(0)[4] = 2;
+
+                    name.VarLengthData.SetString(0, "abc");
+                    name.VarLengthData.SetString(1, "x");
+                    name.VarLengthData.SetString(2, "ABD");
+                    name.VarLengthData.SetString(3, "y");
+                    name.VarLengthData.SetString(4, "ab");
+
+                    for (var i = 0; i < 5; i++)
+                    {
+                        status.NotNulls.Set(i);
+                        name.NotNulls.Set(i);
+                    }
+
+                    name.NotNulls.Clear(3);
+
+                    var writers = new[]
+                        {
+                            SortKeyFieldWriter.Create(status, false),
+                            SortKeyFieldWriter.Create(name, true)
+                        };
+
+                    var index = new SortIndex();
+                    index.Publish(SortIndex.CaptureCompositeSnapshot(writers, validDocsBitmap, 5).Sort(), index.Generation);
+
+                    // expected order by (status asc, name desc): 1, 3, 2, 0, 4
+                    // item 3 goes after item 1 because NULLs go last in descending order
+                    Assert.AreEqual(5, index.ValidDocCount);
+                    Assert.AreEqual(1, index.OrderData[0]);
+                    Assert.AreEqual(3, index.OrderData[1]);
+                    Assert.AreEqual(2, index.OrderData[2]);
+                    Assert.AreEqual(0, index.OrderData[3]);
+                    Assert.AreEqual(4, index.OrderData[4]);
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestTopKHeap()
+        {
+            var rand = new Random(42);
+            var values = new int[1000];
+            for (var i = 0; i < values.Length; i++)
+            {
+                values[i] = rand.Next(100);
+            }
+
+            var buffer = new SortKeyBuffer(16);
+            var heaps = new[] { new TopKHeap(10), new TopKHeap(10) };
+            for (var i = 0; i < values.Length; i++)
+            {
+                buffer.Length = 0;
+                SortKeyEncoder<int>.Encode(values[i], buffer);
+                heaps[i % 2].Offer(buffer.Data, buffer.Length, i);
+            }
+
+            heaps[0].MergeFrom(heaps[1]);
+            Assert.AreEqual(10, heaps[0].Count);
+
+            // ties are broken by document index
+            var expected = Enumerable.Range(0, values.Length).OrderBy(x => values[x]).ThenBy(x => x).Take(10).ToArray();
+            Assert.IsTrue(expected.SequenceEqual(heaps[0].DrainSorted()));
+            Assert.AreEqual(0, heaps[0].Count);
+        }
     }
 }
@@ -0,0 +1,206 @@
+﻿using System;
+using System.Data;
+using System.IO;
+using System.Linq;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using Pql.ClientDriver.Protocol;
+using Pql.Engine.DataContainer.RamDriver;
+using Pql.Engine.Interfaces.Internal;
+using Pql.Engine.Interfaces.Services;
+using Pql.IntegrationStubs;
+
+namespace Pql.Engine.UnitTest
+{
+    [TestClass]
+    public class WriteAheadLogTest
+    {
+        [TestMethod]
+        public void TestGroupCommitAndRotation()
+        {
+            var root = Path.Combine(Path.GetTempPath(), Guid.NewGuid().ToString("N"));
+            Directory.CreateDirectory(root);
+            try
+            {
+                long firstFile;
+                using (var log = new WriteAheadLog(root))
+                {
+                    // concurrent commits share flushes, but every record becomes durable
+                    Parallel.For(0, 100, i => log.WaitDurable(log.Append(CreatePayload(i))));
+
+                    firstFile = log.Rotate();
+                    log.Append(CreatePayload(100));
+                }
+
+                var files = WriteAheadLog.GetFileNumbers(root);
+                CollectionAssert.AreEqual(new[] {firstFile, firstFile + 1}, files);
+
+                var values = WriteAheadLog.ReadRecords(root, firstFile, new DummyTracer()).Select(x => BitConverter.ToInt32(x, 0)).ToList();
+                CollectionAssert.AreEquivalent(Enumerable.Range(0, 100).ToList(), values);
+
+                // torn record at the end of file is ignored
+                var lastPath = Directory.GetFiles(root).OrderBy(x => x).Last();
+                using (var stream = new FileStream(lastPath, FileMode.Append))
+                {
+                    stream.Write(new byte[] {100, 0, 0, 0, 1, 2, 3}, 0, 7);
+                }
+
+                values = WriteAheadLog.ReadRecords(root, firstFile + 1, new DummyTracer()).Select(x => BitConverter.ToInt32(x, 0)).ToList();
+                CollectionAssert.AreEqual(new[] {100}, values);
+
+                // new log continues after existing files
+                using (var log = new WriteAheadLog(root))
+                {
+                    Assert.AreEqual(firstFile + 2, log.Rotate());
+                }
+
+                WriteAheadLog.DeleteFiles(root, firstFile + 2);
+                CollectionAssert.AreEqual(new[] {firstFile + 3}, WriteAheadLog.GetFileNumbers(root));
+            }
+            finally
+            {
+                Directory.Delete(root, true);
+            }
+        }
+
+        [TestMethod]
+        public void TestChangeRoundTrip()
+        {
+            var fields = new[]
+                {
+                    new FieldMetadata(1, "id", "id", DbType.Int64, 1),
+                    new FieldMetadata(2, "name", "name", DbType.String, 1),
+                    new FieldMetadata(3, "blob", "blob", DbType.Binary, 1),
+                    new FieldMetadata(4, "amount", "amount", DbType.Decimal, 1),
+                    new FieldMetadata(5, "missing", "missing", DbType.Int32, 1)
+                };
+
+            var source = new DriverChangeBuffer(1, 0, fields) {ChangeType = DriverChangeType.Insert, InternalEntityId = new byte[256]};
+            source.InternalEntityId[0] = 3;
+            source.InternalEntityId[1] = 7;
+            source.InternalEntityId[3] = 9;
+
+            BitVector.Set(source.Data.NotNulls, 0);
+            BitVector.Set(source.Data.NotNulls, 1);
+            BitVector.Set(source.Data.NotNulls, 2);
+            BitVector.Set(source.Data.NotNulls, 3);
+            source.Data.ValueData8Bytes[source.Data.GetIndexInArray(0)].AsInt64 = -42;
+            source.Data.StringData[source.Data.GetIndexInArray(1)] = "abc";
+            source.Data.BinaryData[source.Data.GetIndexInArray(2)].CopyFrom(new byte[] {1, 2, 3, 4});
+            source.Data.ValueData16Bytes[source.Data.GetIndexInArray(3)].AsDecimal = 12.5m;
+
+            using (var stream = new MemoryStream())
+            {
+                using (var writer = new BinaryWriter(stream, System.Text.Encoding.UTF8, true))
+                {
+                    WriteAheadLog.WriteChange(writer, source);
+                    source.ChangeType = DriverChangeType.Delete;
+                    WriteAheadLog.WriteChange(writer, source);
+                }
+
+                stream.Position = 0;
+                var target = new DriverChangeBuffer(1, 0, fields) {InternalEntityId = new byte[256]};
+                using (var reader = new BinaryReader(stream))
+                {
+                    WriteAheadLog.ReadChange(reader, target);
+
+                    Assert.AreEqual(DriverChangeType.Insert, target.ChangeType);
+                    CollectionAssert.AreEqual(source.InternalEntityId.Take(4).ToArray(), target.InternalEntityId.Take(4).ToArray());
+                    Assert.AreEqual(-42L, target.Data.GetInt64(0));
+                    Assert.AreEqual("abc", target.Data.GetString(1));
+                    CollectionAssert.AreEqual(new byte[] {1, 2, 3, 4}, target.Data.GetBinary(2).Data.Take(target.Data.GetBinary(2).Length).ToArray());
+                    Assert.AreEqual(12.5m, target.Data.GetCurrency(3));
+                    Assert.IsFalse(BitVector.Get(target.Data.NotNulls, 4));
+
+                    WriteAheadLog.ReadChange(reader, target);
+                    Assert.AreEqual(DriverChangeType.Delete, target.ChangeType);
+                    Assert.AreEqual(stream.Length, stream.Position);
+                }
+            }
+        }
+
+        [TestMethod]
+        public void TestReplayOverlappingUpdates()
+        {
+            var root = Path.Combine(Path.GetTempPath(), Guid.NewGuid().ToString("N"));
+            Directory.CreateDirectory(root);
+            try
+            {
+                var descriptor = new DataContainerDescriptor();
+                descriptor.AddDocumentTypeName("doc");
+                var docType = descriptor.RequireDocumentTypeName("doc");
+                descriptor.AddField(new FieldMetadata(1, "id", "id", DbType.Int64, docType));
+                descriptor.AddField(new FieldMetadata(2, "value", "value", DbType.Int64, docType));
+                descriptor.AddDocumentTypeDescriptor(new DocumentTypeDescriptor("doc", "doc", docType, "id", new[] {1, 2}));
+                var fields = new[] {descriptor.RequireField(1), descriptor.RequireField(2)};
+
+                var settings = new RamDriverSettings {Descriptor = descriptor, StorageRoot = root, UseWriteAheadLog = true};
+                using (var driver = new RamDriver())
+                {
+                    driver.Initialize(new DummyTracer(), settings);
+
+                    var insert = driver.CreateChangeset(CreateChange(docType, fields, DriverChangeType.Insert, 0), false);
+                    driver.AddChange(insert);
+                    driver.Apply(insert);
+
+                    // first changeset changes the document first, but commits last
+                    var first = CreateChange(docType, fields, DriverChangeType.Update, 1);
+                    var second = CreateChange(docType, fields, DriverChangeType.Update, 2);
+                    var firstChangeset = driver.CreateChangeset(first, false);
+                    var secondChangeset = driver.CreateChangeset(second, false);
+                    driver.AddChange(firstChangeset);
+                    driver.AddChange(secondChangeset);
+                    Assert.AreEqual(1, driver.Apply(secondChangeset));
+                    Assert.AreEqual(1, driver.Apply(firstChangeset));
+
+                    Assert.AreEqual(2L, GetValue(driver, docType));
+                }
+
+                // driver is disposed without flush, as if it crashed
+                using (var driver = new RamDriver())
+                {
+                    driver.Initialize(new DummyTracer(), new RamDriverSettings(settings) {UseWriteAheadLog = false});
+                    driver.PrepareAllColumnsAndWait(docType);
+                    Assert.AreEqual(2L, GetValue(driver, docType));
+                }
+            }
+            finally
+            {
+                Directory.Delete(root, true);
+            }
+        }
+
+        private static DriverChangeBuffer CreateChange(int docType, FieldMetadata[] fields, DriverChangeType changeType, long value)
+        {
+            var result = new DriverChangeBuffer(docType, 0, fields) {ChangeType = changeType, InternalEntityId = CreateKey()};
+            BitVector.Set(result.Data.NotNulls, 0);
+            BitVector.Set(result.Data.NotNulls, 1);
+            result.Data.ValueData8Bytes[result.Data.GetIndexInArray(0)].AsInt64 = 7;
+            result.Data.ValueData8Bytes[result.Data.GetIndexInArray(1)].AsInt64 = value;
+            return result;
+        }
+
+        private static long GetValue(RamDriver driver, int docType)
+        {
+            var container = driver.RequireDocumentContainer(docType);
+            var docIndex = -1;
+            Assert.IsTrue(container.DocumentIdToIndex.TryGetValueInt32(CreateKey(), ref docIndex));
+            return ((ColumnData<long>) container.RequireColumnStore(2)).GetValue(docIndex);
+        }
+
+        private static byte[] CreateKey()
+        {
+            var key = new byte[byte.MaxValue + 1];
+            key[0] = sizeof(long);
+            BitConverter.GetBytes(7L).CopyTo(key, 1);
+            return key;
+        }
+
+        private static MemoryStream CreatePayload(int value)
+        {
+            var result = new MemoryStream();
+            result.Write(BitConverter.GetBytes(value), 0, sizeof(int));
+            return result;
+        }
+    }
+}
@@ -9,6 +9,11 @@ namespace Pql.UnitTestProject
         {
             //new TestBitVector().TestRandomValuesSetter();
             new TestMemoryViewStream().Test();
+            new TestMemoryViewStream().TestTypedReaders();
+            new TestMemoryViewStream().TestMappedFile();
+            new TestMemoryViewStream().Benchmark();
+            new TestAsyncFileWriter().Test();
+            new TestBitVector().TestConcurrentGrowth();
             //new TestConcurrentHashmapOfKeys().Test();
             //new TestConcurrentDictOfKeys().Test();
         }
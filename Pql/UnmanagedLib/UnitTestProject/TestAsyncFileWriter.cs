@@ -0,0 +1,72 @@
+﻿using System;
+using System.IO;
+using Pql.UnmanagedLib;
+
+namespace Pql.UnitTestProject
+{
+    public class TestAsyncFileWriter
+    {
+        public void Test()
+        {
+            var path = Path.GetTempFileName();
+            try
+            {
+                // odd sizes, so that writes straddle buffers and more buffers are submitted than queue depth allows
+                var data = new byte[100003];
+                new Random(5).NextBytes(data);
+
+                using (var writer = new AsyncFileWriter(path, false, 2, 4096))
+                {
+                    for (var offset = 0; offset < data.Length; offset += 777)
+                    {
+                        writer.Write(data, offset, Math.Min(777, data.Length - offset));
+                    }
+
+                    AreEqual((long)data.Length, writer.Position);
+                    writer.Flush(true);
+                }
+
+                AreEqual(Convert.ToBase64String(data), Convert.ToBase64String(File.ReadAllBytes(path)));
+
+                // appended data starts at end of existing file, rolled back data is cut away
+                using (var writer = new AsyncFileWriter(path, true, 3, 1))
+                {
+                    AreEqual((long)data.Length, writer.Position);
+                    writer.Write(data, 0, 10);
+                    writer.Flush();
+
+                    var start = writer.Position;
+                    writer.Write(data, 0, 50000);
+                    writer.Truncate(start);
+                    AreEqual(start, writer.Position);
+                }
+
+                var expected = new byte[data.Length + 10];
+                Buffer.BlockCopy(data, 0, expected, 0, data.Length);
+                Buffer.BlockCopy(data, 0, expected, data.Length, 10);
+                AreEqual(Convert.ToBase64String(expected), Convert.ToBase64String(File.ReadAllBytes(path)));
+
+                // not appending truncates
+                using (var writer = new AsyncFileWriter(path, false, 1, 65536))
+                {
+                    AreEqual(0L, writer.Position);
+                    writer.Write(data, 3, 5);
+                }
+
+                AreEqual(5L, new FileInfo(path).Length);
+            }
+            finally
+            {
+                File.Delete(path);
+            }
+        }
+
+        private static void AreEqual<T>(T expected, T actual)
+        {
+            if (!Equals(expected, actual))
+            {
+                throw new Exception(string.Format("{0} != {1}", expected, actual));
+            }
+        }
+    }
+}
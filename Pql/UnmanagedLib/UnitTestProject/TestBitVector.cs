@@ -1,5 +1,6 @@
 ﻿using System;
 using System.Diagnostics;
+using System.Threading;
 using System.Threading.Tasks;
 using Pql.UnmanagedLib;
 
@@ -25,6 +26,164 @@ namespace Pql.UnitTestProject
             TestRandomValuesSetter(33);
             TestRandomValuesSetter(45310000);
             TestSetAll();
+            TestTrimTo();
+            TestSnapshot();
+        }
+
+        /// <summary>
+        /// Several threads grow the same vector at once, each setting the last bit of every capacity it has ensured.
+        /// A block which got reallocated or replaced after publication would lose bits set in it,
+        /// so reader checks that bits of completed steps stay set, and that capacity never goes down.
+        /// </summary>
+        public void TestConcurrentGrowth()
+        {
+            const int growers = 4;
+            const int steps = 200;
+            const int stepSize = 100003;
+
+            using (var vector = new BitVector(Pool))
+            {
+                var completedSteps = new int[growers];
+                var tasks = new Task[growers];
+                for (var t = 0; t < growers; t++)
+                {
+                    var grower = t;
+                    tasks[t] = Task.Factory.StartNew(() =>
+                    {
+                        for (var step = 0; step < steps; step++)
+                        {
+                            var capacity = (ulong)((step * growers + grower + 1) * stepSize);
+                            vector.EnsureCapacity(capacity);
+                            IsFalse(vector.Capacity < capacity);
+                            vector.SafeSet(capacity - 1);
+                            Volatile.Write(ref completedSteps[grower], step + 1);
+                        }
+                    }, TaskCreationOptions.LongRunning);
+                }
+
+                var reader = Task.Factory.StartNew(() =>
+                {
+                    var rand = new Random(5);
+                    var lastCapacity = 0UL;
+                    while (!Task.WaitAll(tasks, 0))
+                    {
+                        var capacity = vector.Capacity;
+                        IsFalse(capacity < lastCapacity);
+                        lastCapacity = capacity;
+
+                        var grower = rand.Next(growers);
+                        var completed = Volatile.Read(ref completedSteps[grower]);
+                        if (completed > 0)
+                        {
+                            var step = rand.Next(completed);
+                            IsFalse(!vector.Get((ulong)((step * growers + grower + 1) * stepSize) - 1));
+                        }
+                    }
+                }, TaskCreationOptions.LongRunning);
+
+                Task.WaitAll(tasks);
+                reader.Wait();
+
+                IsFalse(vector.Capacity < (ulong)(steps * growers * stepSize));
+                for (var i = 1; i <= steps * growers; i++)
+                {
+                    var index = (ulong)(i * stepSize);
+                    IsFalse(!vector.Get(index - 1));
+                    IsFalse(vector.Get(index - 2));
+                }
+            }
+        }
+
+        private void TestSnapshot()
+        {
+            const int count = 3000000;
+
+            using (var vector = new BitVector(Pool))
+            {
+                vector.EnsureCapacity(count);
+                for (var i = 0; i < count; i += 3)
+                {
+                    vector.Set(i);
+                }
+
+                using (var snapshot = vector.Snapshot())
+                {
+                    // writers proceed concurrently with snapshot reader, and grow the vector past snapshot capacity
+                    var writer = Task.Factory.StartNew(() =>
+                    {
+                        vector.EnsureCapacity(2 * count);
+                        for (var i = 0; i < 2 * count; i++)
+                        {
+                            if (i % 3 == 0)
+                            {
+                                vector.SafeClear(i);
+                            }
+                            else
+                            {
+                                vector.SafeSet(i);
+                            }
+                        }
+                    });
+
+                    for (var i = 0; i < count; i++)
+                    {
+                        AreEqual(i % 3 == 0, snapshot.Get(i));
+                    }
+
+                    writer.Wait();
+
+                    IsFalse(snapshot.Capacity < count);
+                    IsFalse(snapshot.Capacity >= 2 * count);
+                    for (var i = 0; i < count; i++)
+                    {
+                        AreEqual(i % 3 == 0, snapshot.Get(i));
+                        AreEqual(i % 3 != 0, vector.Get(i));
+                    }
+
+                    // nested snapshot sees copies made for the outer one
+                    using (var nested = vector.Snapshot())
+                    {
+                        vector.ChangeAll(false);
+                        for (var i = 0; i < count; i++)
+                        {
+                            AreEqual(i % 3 != 0, nested.Get(i));
+                            AreEqual(i % 3 == 0, snapshot.Get(i));
+                            IsFalse(vector.Get(i));
+                        }
+                    }
+                }
+
+                // without snapshots, writes go in place again
+                vector.Set(0);
+                IsFalse(!vector.Get(0));
+            }
+        }
+
+        private void TestTrimTo()
+        {
+            using (var vector = new BitVector(Pool))
+            {
+                vector.EnsureCapacity(10000000);
+                vector.ChangeAll(true);
+
+                vector.TrimTo(1000003);
+                IsFalse(vector.Capacity < 1000003);
+                IsFalse(vector.Capacity >= 10000000);
+
+                for (ulong i = 0; i < vector.Capacity; i++)
+                {
+                    AreEqual(i < 1000003, vector.Get(i));
+                }
+
+                // trimmed storage must be usable again after expansion
+                vector.EnsureCapacity(10000000);
+                vector.Set(9999999);
+                IsFalse(!vector.Get(9999999));
+                IsFalse(vector.Get(9999998));
+
+                vector.TrimTo(0);
+                AreEqual(true, vector.Capacity == 0);
+            }
         }
 
         private void TestSetAll()
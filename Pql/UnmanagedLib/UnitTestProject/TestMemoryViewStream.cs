@@ -1,4 +1,5 @@
 ﻿using System;
+using System.Diagnostics;
 using System.IO;
 using System.Text;
 using Pql.UnmanagedLib;
@@ -61,5 +62,199 @@ namespace Pql.UnitTestProject
 
             stream.Position = 0;
         }
+
+        public unsafe void TestTypedReaders()
+        {
+            var pool = new DynamicMemoryPool();
+
+            uint blocksize = 4096;
+            var pblock = (byte*)pool.Alloc(blocksize);
+            var stream = new MemoryViewStream();
+            stream.Attach(pblock, blocksize);
+
+            using (var writer = new BinaryWriter(stream, Encoding.UTF8, true))
+            {
+                writer.Write(-12345);
+                writer.Write(long.MinValue + 7);
+                writer.Write("абв 中文 😀");
+                writer.Write(new string('x', 300));
+                writer.Write(string.Empty);
+            }
+
+            stream.Write7BitEncodedInt(int.MaxValue);
+            stream.WriteInt64(42);
+            var end = stream.Position;
+
+            stream.Position = 0;
+            AreEqual(-12345, stream.ReadInt32());
+            AreEqual(long.MinValue + 7, stream.ReadInt64());
+            AreEqual("абв 中文 😀", stream.ReadString());
+            AreEqual(new string('x', 300), stream.ReadString());
+            AreEqual(string.Empty, stream.ReadString());
+            AreEqual(int.MaxValue, stream.Read7BitEncodedInt());
+            AreEqual(42L, stream.ReadInt64());
+            AreEqual(end, stream.Position);
+
+            stream.Position = 0;
+            var raw = stream.ReadRaw(4);
+            AreEqual(-12345, *(int*)raw);
+            AreEqual(4L, stream.Position);
+
+            var copy = new byte[8];
+            fixed (byte* pcopy = copy)
+            {
+                AreEqual(8, stream.Read(pcopy, 8));
+            }
+            AreEqual(long.MinValue + 7, BitConverter.ToInt64(copy, 0));
+
+            stream.Position = blocksize - 2;
+            try
+            {
+                stream.ReadInt32();
+                throw new Exception("Expected EndOfStreamException");
+            }
+            catch (EndOfStreamException)
+            {
+            }
+        }
+
+        public void TestMappedFile()
+        {
+            var path = Path.GetTempFileName();
+            try
+            {
+                var values = new double[100000];
+                for (var i = 0; i < values.Length; i++)
+                {
+                    values[i] = i * 0.5;
+                }
+
+                using (var writer = new BinaryWriter(File.Create(path)))
+                {
+                    writer.Write("header");
+                    foreach (var value in values)
+                    {
+                        writer.Write(value);
+                    }
+                }
+
+                using (var stream = MemoryViewStream.OpenMappedFile(path))
+                {
+                    IsFalse(stream.CanWrite);
+                    AreEqual(new FileInfo(path).Length, stream.Length);
+                    AreEqual("header", stream.ReadString());
+
+                    var loaded = new double[values.Length + 10];
+                    stream.ReadArray(loaded, 10, values.Length);
+                    for (var i = 0; i < values.Length; i++)
+                    {
+                        AreEqual(values[i], loaded[i + 10]);
+                    }
+
+                    AreEqual(stream.Length, stream.Position);
+
+                    try
+                    {
+                        stream.Position = 0;
+                        stream.WriteInt32(1);
+                        throw new Exception("Expected NotSupportedException");
+                    }
+                    catch (NotSupportedException)
+                    {
+                    }
+                }
+
+                // empty files cannot be mapped, but still open as empty streams
+                File.WriteAllBytes(path, new byte[0]);
+                using (var stream = MemoryViewStream.OpenMappedFile(path))
+                {
+                    AreEqual(0L, stream.Length);
+                    AreEqual(-1, stream.ReadByte());
+                }
+            }
+            finally
+            {
+                File.Delete(path);
+            }
+        }
+
+        private static void IsFalse(bool x)
+        {
+            if (x)
+            {
+                throw new Exception("Is true");
+            }
+        }
+
+        /// <summary>
+        /// Measures bulk copy throughput against the per-byte path that BinaryReader used to go through.
+        /// </summary>
+        public unsafe void Benchmark()
+        {
+            var pool = new DynamicMemoryPool();
+
+            const int blocksize = 64 * 1024 * 1024;
+            const int passes = 20;
+            var pblock = (byte*)pool.Alloc(blocksize);
+            var stream = new MemoryViewStream();
+            stream.Attach(pblock, blocksize);
+
+            var data = new byte[1024 * 1024];
+            new Random(1).NextBytes(data);
+
+            var watch = Stopwatch.StartNew();
+            for (var pass = 0; pass < passes; pass++)
+            {
+                stream.Position = 0;
+                for (var i = 0; i < blocksize / data.Length; i++)
+                {
+                    stream.Write(data, 0, data.Length);
+                }
+            }
+            Report("Write(byte[])", (long)blocksize * passes, watch.Elapsed);
+
+            watch.Restart();
+            for (var pass = 0; pass < passes; pass++)
+            {
+                stream.Position = 0;
+                for (var i = 0; i < blocksize / data.Length; i++)
+                {
+                    stream.Read(data, 0, data.Length);
+                }
+            }
+            Report("Read(byte[])", (long)blocksize * passes, watch.Elapsed);
+
+            watch.Restart();
+            stream.Position = 0;
+            long sum = 0;
+            for (var i = 0; i < blocksize / sizeof(long); i++)
+            {
+                sum += stream.ReadInt64();
+            }
+            Report("ReadInt64", blocksize, watch.Elapsed);
+
+            watch.Restart();
+            stream.Position = 0;
+            for (var i = 0; i < blocksize; i++)
+            {
+                sum += stream.ReadByte();
+            }
+            Report("ReadByte", blocksize, watch.Elapsed);
+
+            Console.WriteLine("Checksum: {0}", sum);
+        }
+
+        private static void Report(string what, long bytes, TimeSpan elapsed)
+        {
+            Console.WriteLine("{0}: {1:F2} GB/s", what, bytes / elapsed.TotalSeconds / (1024.0 * 1024 * 1024));
+        }
+
+        private static void AreEqual<T>(T expected, T actual)
+        {
+            if (!Equals(expected, actual))
+            {
+                throw new Exception(string.Format("{0} != {1}", expected, actual));
+            }
+        }
     }
 }
\ No newline at end of file
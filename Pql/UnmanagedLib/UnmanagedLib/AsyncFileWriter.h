@@ -0,0 +1,432 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vcclr.h>
+#include "Win32Imports.h"
+
+namespace Pql {
+	namespace UnmanagedLib {
+
+		struct AsyncWriteRequest
+		{
+			Win32Overlapped Overlapped;
+			uint32_t Length;
+			bool InFlight;
+		};
+
+		/// <summary>
+		/// Write-only stream over a file opened for overlapped I/O.
+		/// Data is collected in a ring of page-aligned native buffers, every full buffer is submitted to the OS
+		/// as an asynchronous write at its file offset, and the caller only blocks when all buffers are in flight.
+		/// Thus producing data and writing it overlap, and the number of outstanding writes per file is bounded by queue depth,
+		/// without any threads besides the caller.
+		/// Not thread-safe. Written data is only guaranteed to be on disk after Flush(true).
+		/// </summary>
+		public ref class AsyncFileWriter : System::IO::Stream
+		{
+			System::String^ m_path;
+			void* m_hFile;
+			AsyncWriteRequest* m_requests;
+			byte* m_buffers;
+			int32_t m_queueDepth;
+			int32_t m_bufferSize;
+			int32_t m_current;
+			int32_t m_bytesInCurrent;
+			int64_t m_submittedPosition;
+			bool m_failed;
+
+			!AsyncFileWriter()
+			{
+				// kernel may still be reading from buffers, they can only be released when all writes complete
+				WaitAll(false);
+				Cleanup();
+			}
+
+			void Cleanup()
+			{
+				if (m_requests)
+				{
+					for (auto i = 0; i < m_queueDepth; i++)
+					{
+						if (m_requests[i].Overlapped.hEvent)
+						{
+							CloseHandle(m_requests[i].Overlapped.hEvent);
+						}
+					}
+
+					delete[] m_requests;
+					m_requests = nullptr;
+				}
+
+				if (m_buffers)
+				{
+					VirtualFree(m_buffers, 0, 0x8000 /* MEM_RELEASE */);
+					m_buffers = nullptr;
+				}
+
+				if (m_hFile)
+				{
+					CloseHandle(m_hFile);
+					m_hFile = nullptr;
+				}
+			}
+
+			inline void CheckDisposed()
+			{
+				if (!m_hFile)
+				{
+					throw gcnew System::ObjectDisposedException("AsyncFileWriter");
+				}
+			}
+
+			inline void CheckFailed()
+			{
+				if (m_failed)
+				{
+					throw gcnew System::IO::IOException("A previous write to file " + m_path + " failed");
+				}
+			}
+
+			System::IO::IOException^ Failure(System::String^ what, int error)
+			{
+				m_failed = true;
+				return gcnew System::IO::IOException("Failed to " + what + " file " + m_path + ", error " + error);
+			}
+
+			/// <summary>
+			/// Submits current buffer and waits until the next one in the ring can be reused.
+			/// </summary>
+			void Submit()
+			{
+				if (m_bytesInCurrent == 0)
+				{
+					return;
+				}
+
+				auto& request = m_requests[m_current];
+				request.Overlapped.Internal = 0;
+				request.Overlapped.InternalHigh = 0;
+				request.Overlapped.Offset = (uint32_t)m_submittedPosition;
+				request.Overlapped.OffsetHigh = (uint32_t)(m_submittedPosition >> 32);
+				request.Length = (uint32_t)m_bytesInCurrent;
+
+				if (!WriteFile(m_hFile, m_buffers + (int64_t)m_current * m_bufferSize, request.Length, nullptr, &request.Overlapped))
+				{
+					auto error = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+					if (error != 997 /* ERROR_IO_PENDING */)
+					{
+						throw Failure("write to", error);
+					}
+				}
+
+				request.InFlight = true;
+				m_submittedPosition += m_bytesInCurrent;
+				m_bytesInCurrent = 0;
+				m_current = (m_current + 1) % m_queueDepth;
+
+				Complete(m_current);
+			}
+
+			void Complete(int32_t index)
+			{
+				auto& request = m_requests[index];
+				if (!request.InFlight)
+				{
+					return;
+				}
+
+				uint32_t written = 0;
+				auto succeeded = GetOverlappedResult(m_hFile, &request.Overlapped, &written, 1);
+				auto error = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+				request.InFlight = false;
+
+				if (!succeeded)
+				{
+					throw Failure("write to", error);
+				}
+
+				if (written != request.Length)
+				{
+					throw Failure("write all bytes to", 0);
+				}
+			}
+
+			/// <summary>
+			/// Waits for all outstanding writes. Reports the first failure after all of them complete, if throwOnFailure is set.
+			/// </summary>
+			void WaitAll(bool throwOnFailure)
+			{
+				if (!m_requests)
+				{
+					return;
+				}
+
+				System::Exception^ failure = nullptr;
+				for (auto i = 0; i < m_queueDepth; i++)
+				{
+					try
+					{
+						Complete(i);
+					}
+					catch (System::Exception^ e)
+					{
+						if (!failure)
+						{
+							failure = e;
+						}
+					}
+				}
+
+				if (failure && throwOnFailure)
+				{
+					throw failure;
+				}
+			}
+
+		public:
+
+			/// <summary>
+			/// Opens file for writing with at most queueDepth outstanding writes of bufferSize bytes each.
+			/// Existing file is either truncated, or kept and appended to.
+			/// Throws IOException when file cannot be opened.
+			/// </summary>
+			AsyncFileWriter(System::String^ path, bool append, int32_t queueDepth, int32_t bufferSize)
+			{
+				if (System::String::IsNullOrEmpty(path))
+				{
+					throw gcnew System::ArgumentNullException("path");
+				}
+
+				if (queueDepth < 1)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("queueDepth", queueDepth, "Queue depth must be positive");
+				}
+
+				if (bufferSize < 1 || bufferSize > (1 << 30))
+				{
+					throw gcnew System::ArgumentOutOfRangeException("bufferSize", bufferSize, "Buffer size must be positive and not exceed 1 GB");
+				}
+
+				m_path = path;
+				m_queueDepth = queueDepth;
+				// full buffers are written at page multiples
+				m_bufferSize = (bufferSize + 4095) & ~4095;
+
+				pin_ptr<const wchar_t> ppath = PtrToStringChars(path);
+
+				// GENERIC_WRITE, no sharing, OPEN_ALWAYS or CREATE_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN
+				auto hFile = CreateFileW(ppath, 0x40000000, 0, nullptr, append ? 4 : 2, 0x40000000 | 0x08000000, nullptr);
+				if (hFile == (void*)-1)
+				{
+					throw gcnew System::IO::IOException(
+						"Failed to open file " + path + ", error " + System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+				}
+
+				m_hFile = hFile;
+
+				try
+				{
+					if (append)
+					{
+						int64_t size = 0;
+						if (!GetFileSizeEx(m_hFile, &size))
+						{
+							throw Failure("get size of", System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+						}
+
+						m_submittedPosition = size;
+					}
+
+					m_requests = new AsyncWriteRequest[m_queueDepth];
+					memset(m_requests, 0, sizeof(AsyncWriteRequest) * m_queueDepth);
+
+					for (auto i = 0; i < m_queueDepth; i++)
+					{
+						// manual-reset events, as required for overlapped I/O
+						m_requests[i].Overlapped.hEvent = CreateEventW(nullptr, 1, 0, nullptr);
+						if (!m_requests[i].Overlapped.hEvent)
+						{
+							throw Failure("create events for", System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+						}
+					}
+
+					// MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE
+					m_buffers = (byte*)VirtualAlloc(nullptr, (size_t)m_queueDepth * m_bufferSize, 0x1000 | 0x2000, 0x04);
+					if (!m_buffers)
+					{
+						throw Failure("allocate buffers for", System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+					}
+				}
+				catch (...)
+				{
+					Cleanup();
+					throw;
+				}
+			}
+
+			~AsyncFileWriter()
+			{
+				try
+				{
+					if (m_hFile && !m_failed)
+					{
+						Submit();
+						WaitAll(true);
+					}
+				}
+				finally
+				{
+					this->!AsyncFileWriter();
+					System::GC::SuppressFinalize(this);
+				}
+			}
+
+			/// <summary>
+			/// Submits buffered data and waits until all writes complete.
+			/// </summary>
+			virtual void Flush() override
+			{
+				CheckDisposed();
+				CheckFailed();
+
+				Submit();
+				WaitAll(true);
+			}
+
+			/// <summary>
+			/// Submits buffered data, waits until all writes complete, and optionally flushes OS buffers to disk.
+			/// </summary>
+			void Flush(bool flushToDisk)
+			{
+				Flush();
+
+				if (flushToDisk && !FlushFileBuffers(m_hFile))
+				{
+					throw Failure("flush", System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+				}
+			}
+
+			/// <summary>
+			/// Discards buffered data, waits for outstanding writes regardless of their outcome, and cuts the file at given length.
+			/// Position moves to the new end of file, and a previous write failure is forgotten.
+			/// Used to roll back a partially written append.
+			/// </summary>
+			void Truncate(int64_t length)
+			{
+				CheckDisposed();
+
+				if (length < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("length", "length is negative");
+				}
+
+				m_bytesInCurrent = 0;
+				WaitAll(false);
+
+				if (!SetFilePointerEx(m_hFile, length, nullptr, 0 /* FILE_BEGIN */) || !SetEndOfFile(m_hFile))
+				{
+					throw Failure("truncate", System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+				}
+
+				m_submittedPosition = length;
+				m_failed = false;
+			}
+
+			virtual void Write(array<byte>^ buffer, int32_t offset, int32_t count) override
+			{
+				CheckDisposed();
+				CheckFailed();
+
+				if (buffer == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("buffer");
+				}
+
+				if (count < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
+				}
+
+				if (offset < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("offset", "offset is negative");
+				}
+
+				if (offset + count > buffer->Length)
+				{
+					throw gcnew System::ArgumentException("The sum of offset and count is larger than the buffer length.");
+				}
+
+				if (count == 0)
+				{
+					return;
+				}
+
+				pin_ptr<byte> pbuffer = &buffer[0];
+				auto p = pbuffer + offset;
+
+				while (count > 0)
+				{
+					auto chunk = min(count, m_bufferSize - m_bytesInCurrent);
+					memcpy(m_buffers + (int64_t)m_current * m_bufferSize + m_bytesInCurrent, p, chunk);
+					m_bytesInCurrent += chunk;
+					p += chunk;
+					count -= chunk;
+
+					if (m_bytesInCurrent == m_bufferSize)
+					{
+						Submit();
+					}
+				}
+			}
+
+			virtual int32_t Read(array<byte>^ buffer, int32_t offset, int32_t count) override
+			{
+				throw gcnew System::NotSupportedException();
+			}
+
+			virtual int64_t Seek(int64_t offset, System::IO::SeekOrigin origin) override
+			{
+				throw gcnew System::NotSupportedException();
+			}
+
+			virtual void SetLength(int64_t value) override
+			{
+				throw gcnew System::NotSupportedException("Use Truncate");
+			}
+
+			property virtual bool CanRead
+			{
+				bool get() override { return false; }
+			}
+
+			property virtual bool CanSeek
+			{
+				bool get() override { return false; }
+			}
+
+			property virtual bool CanWrite
+			{
+				bool get() override { return m_hFile != nullptr; }
+			}
+
+			/// <summary>
+			/// Length of file including buffered data.
+			/// </summary>
+			property virtual int64_t Length
+			{
+				int64_t get() override { return Position; }
+			}
+
+			/// <summary>
+			/// Offset at which next written byte will land. Cannot be set.
+			/// </summary>
+			property virtual int64_t Position
+			{
+				int64_t get() override { return m_submittedPosition + m_bytesInCurrent; }
+				void set(int64_t pos) override { throw gcnew System::NotSupportedException(); }
+			}
+		};
+	}
+}
@@ -3,25 +3,27 @@
 #include <memory>
 #include "IUnmanagedAllocator.h"
 #include "ExpandableArrayImpl.h"
+#include "MemoryViewStream.h"
 
 namespace Pql {
 	namespace UnmanagedLib {
 
 		using namespace System::Runtime::CompilerServices;
 
+		ref class BitVectorSnapshot;
+
 		public ref class BitVector
 		{
-			typedef ExpandableArrayImpl<uint8_t> dataarray_t;
-
 #define ITEMS_PER_BLOCK 65536
 #define BITS_PER_ITEM 8
 #define BITS_PER_BLOCK (ITEMS_PER_BLOCK * BITS_PER_ITEM)
 #define BLOCKS_GROWTH 64
 #define CAS UnmanagedLib_InterlockedCompareExchange8
 
+			typedef ExpandableArrayImpl<uint8_t, ITEMS_PER_BLOCK> dataarray_t;
+
 			IUnmanagedAllocator^ m_allocator;
 			dataarray_t* m_pArray;
-			dataarray_t::containerref_t volatile m_pData;
 			size_t volatile m_itemCapacity;
 
 			void Cleanup(bool disposing)
@@ -34,7 +36,6 @@ namespace Pql {
 				// simply discard the reference
 				// rely upon pool management to clean up the garbage
 				m_pArray = nullptr;
-				m_pData = nullptr;
 				m_itemCapacity = 0;
 			}
 
@@ -54,7 +55,7 @@ namespace Pql {
 
 				auto pobj = (dataarray_t*)m_allocator->Alloc(sizeof(dataarray_t));
 
-				m_pArray = new (pobj)dataarray_t(m_allocator->GetAllocator(), ITEMS_PER_BLOCK, BLOCKS_GROWTH);
+				m_pArray = new (pobj)dataarray_t(m_allocator->GetAllocator(), BLOCKS_GROWTH);
 
 				if (src)
 				{
@@ -68,6 +69,19 @@ namespace Pql {
 				}
 			}
 
+			void CheckRange(size_t first, size_t count)
+			{
+				if (first % BITS_PER_ITEM)
+				{
+					throw gcnew System::ArgumentException("First bit of range must be a multiple of " + BITS_PER_ITEM + ": " + first);
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Range end is beyond capacity: " + (first + count));
+				}
+			}
+
 		public:
 
 			BitVector(IUnmanagedAllocator^ allocator)
@@ -93,8 +107,34 @@ namespace Pql {
 				}
 
 				EnsureCapacity(count);
+				Read(reader, 0, count);
+			}
 
-				for (auto ix = 0; ix < count; ix += BITS_PER_ITEM)
+			/// <summary>
+			/// Reads count bits starting at bit first, which must be a multiple of 8.
+			/// Capacity must already cover the range. Ranges which do not share bytes can be read concurrently.
+			/// </summary>
+			void Read(System::IO::BinaryReader^ reader, size_t first, size_t count)
+			{
+				CheckRange(first, count);
+
+				// bits of native memory are copied block by block
+				auto view = dynamic_cast<MemoryViewStream^>(reader->BaseStream);
+				if (view)
+				{
+					size_t end = (first + count + BITS_PER_ITEM - 1) / BITS_PER_ITEM;
+					for (size_t offset = first / BITS_PER_ITEM; offset < end;)
+					{
+						size_t length;
+						auto pspan = m_pArray->writable_span(offset, end - offset, length);
+						memcpy((void*)pspan, view->ReadRaw(length), length);
+						offset += length;
+					}
+
+					return;
+				}
+
+				for (auto ix = first; ix < first + count; ix += BITS_PER_ITEM)
 				{
 					SetGroup(ix, reader->ReadByte());
 				}
@@ -102,34 +142,100 @@ namespace Pql {
 
 			void Write(System::IO::BinaryWriter^ writer, size_t count)
 			{
-				if (count > Capacity)
+				Write(writer, 0, count);
+			}
+
+			/// <summary>
+			/// Writes count bits starting at bit first, which must be a multiple of 8.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count)
+			{
+				CheckRange(first, count);
+
+				auto view = dynamic_cast<MemoryViewStream^>(writer->BaseStream);
+				if (view)
 				{
-					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + count);
+					writer->Flush();
+
+					size_t end = (first + count + BITS_PER_ITEM - 1) / BITS_PER_ITEM;
+					for (size_t offset = first / BITS_PER_ITEM; offset < end;)
+					{
+						size_t length;
+						auto pspan = m_pArray->span(offset, end - offset, length);
+						view->Write((const byte*)pspan, (int32_t)length);
+						offset += length;
+					}
+
+					return;
 				}
 
-				for (auto ix = 0; ix < count; ix += BITS_PER_ITEM)
+				for (auto ix = first; ix < first + count; ix += BITS_PER_ITEM)
 				{
 					byte group = GetGroup(ix);
 					writer->Write(group);
 				}
 			}
 
+			/// <summary>
+			/// Copies first count bits into a contiguous buffer, least significant bit of every byte first.
+			/// This is the layout of Arrow validity bitmaps. Bits beyond capacity are copied as zeros.
+			/// </summary>
+			void CopyTo(System::IntPtr dest, size_t count)
+			{
+				if (dest == System::IntPtr::Zero)
+				{
+					throw gcnew System::ArgumentNullException("dest");
+				}
+
+				auto pdest = (uint8_t*)dest.ToPointer();
+				size_t nbytes = (count + BITS_PER_ITEM - 1) / BITS_PER_ITEM;
+				size_t available = nbytes < m_itemCapacity ? nbytes : m_itemCapacity;
+
+				for (size_t offset = 0; offset < available;)
+				{
+					size_t chunk;
+					auto pspan = m_pArray->span(offset, available - offset, chunk);
+					memcpy(pdest + offset, (const void*)pspan, chunk);
+					offset += chunk;
+				}
+
+				if (nbytes > available)
+				{
+					memset(pdest + available, 0, nbytes - available);
+				}
+				else if (count % BITS_PER_ITEM)
+				{
+					pdest[nbytes - 1] &= (uint8_t)((1 << (count % BITS_PER_ITEM)) - 1);
+				}
+			}
+
 			property size_t Capacity {
 				[MethodImpl(MethodImplOptions::AggressiveInlining)]
 				inline size_t get() { return m_itemCapacity * BITS_PER_ITEM; }
 			}
 
+			/// <summary>
+			/// Takes a frozen image of this vector, which is not affected by subsequent writes.
+			/// Caller must make sure there are no concurrent writers while snapshot is taken, and must dispose it when done.
+			/// Until then, first write into every pinned block makes a copy of that block.
+			/// </summary>
+			BitVectorSnapshot^ Snapshot();
+
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline void ChangeAll(bool value)
 			{
-				auto nBlocks = m_pArray->capacity() / ITEMS_PER_BLOCK;
+				auto cap = m_pArray->capacity();
 				dataarray_t::value_type newvalue = value ? ~0 : 0;
-				for (auto p = m_pData; p != m_pData + nBlocks; p++)
+				for (size_t offset = 0; offset < cap;)
 				{
-					for (auto v = *p; v != *p + ITEMS_PER_BLOCK; v++)
+					size_t length;
+					auto p = m_pArray->writable_span(offset, cap - offset, length);
+					for (auto v = p; v != p + length; v++)
 					{
 						*v = newvalue;
 					}
+
+					offset += length;
 				}
 			}
 
@@ -159,39 +265,64 @@ namespace Pql {
 			{
 				if (capacity > 0)
 				{
-					auto pdata = interior_ptr<dataarray_t::containerref_t>(&m_pData);
 					auto pcapacity = interior_ptr<size_t>(&m_itemCapacity);
-					return m_pArray->try_ensure_capacity(1 + capacity / BITS_PER_ITEM, timeout, pdata, pcapacity);
+					return m_pArray->try_ensure_capacity(1 + capacity / BITS_PER_ITEM, pcapacity);
 				}
 
 				return true;
 			}
 
+			/// <summary>
+			/// Releases storage which is not needed to hold first capacity bits, and clears retained bits at and above capacity.
+			/// Caller must have exclusive access to this vector.
+			/// Released blocks are scheduled for collection and only get deallocated with the rest of pool garbage.
+			/// </summary>
+			inline void TrimTo(size_t capacity)
+			{
+				auto pcapacity = interior_ptr<size_t>(&m_itemCapacity);
+				m_pArray->trim_to(capacity > 0 ? 1 + capacity / BITS_PER_ITEM : 0, pcapacity);
+
+				auto cap = Capacity;
+				auto index = capacity;
+				for (; index < cap && (index % BITS_PER_ITEM) != 0; index++)
+				{
+					Clear(index);
+				}
+
+				for (auto offset = index / BITS_PER_ITEM; offset < m_itemCapacity;)
+				{
+					size_t length;
+					auto pspan = m_pArray->writable_span(offset, m_itemCapacity - offset, length);
+					memset((void*)pspan, 0, length);
+					offset += length;
+				}
+			}
+
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline bool Get(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->reference(index / BITS_PER_ITEM);
 				return 0 != (*pValue & (dataarray_t::value_type(1) << (index % BITS_PER_ITEM)));
 			}
 
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline dataarray_t::value_type GetGroup(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->reference(index / BITS_PER_ITEM);
 				return *pValue;
 			}
 
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline void Set(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				*pValue |= (dataarray_t::value_type(1) << (index % BITS_PER_ITEM));
 			}
 
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline void SetGroup(size_t index, dataarray_t::value_type group)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				*pValue = group;
 			}
 
@@ -199,14 +330,14 @@ namespace Pql {
 			[System::Security::SuppressUnmanagedCodeSecurityAttribute]
 			inline void Clear(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				*pValue &= ~(dataarray_t::value_type(1) << (index % BITS_PER_ITEM));
 			}
 
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline void SafeSet(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				dataarray_t::value_type oldValue;
 				dataarray_t::value_type value;
 				do
@@ -221,7 +352,7 @@ namespace Pql {
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline bool SafeGetAndSet(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				dataarray_t::value_type oldValue;
 				dataarray_t::value_type value;
 				dataarray_t::value_type mask = dataarray_t::value_type(1) << (index % BITS_PER_ITEM);
@@ -239,7 +370,7 @@ namespace Pql {
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline void SafeClear(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				dataarray_t::value_type oldValue;
 				dataarray_t::value_type value;
 				do
@@ -254,7 +385,7 @@ namespace Pql {
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline bool SafeGetAndClear(size_t index)
 			{
-				auto pValue = m_pData[index / BITS_PER_BLOCK] + ((index / BITS_PER_ITEM) % ITEMS_PER_BLOCK);
+				auto pValue = m_pArray->writable_reference(index / BITS_PER_ITEM);
 				dataarray_t::value_type oldValue;
 				dataarray_t::value_type value;
 				dataarray_t::value_type mask = (dataarray_t::value_type(1) << (index % BITS_PER_ITEM));
@@ -323,5 +454,155 @@ namespace Pql {
 				return SafeGetAndSet((size_t)index);
 			}
 		};
+
+		/// <summary>
+		/// Read-only frozen image of a BitVector, see BitVector::Snapshot.
+		/// </summary>
+		public ref class BitVectorSnapshot
+		{
+			typedef ExpandableArrayImpl<uint8_t, ITEMS_PER_BLOCK> dataarray_t;
+
+			dataarray_t::snapshot_t* m_pSnapshot;
+			size_t m_itemCapacity;
+
+			void Cleanup(bool disposing)
+			{
+				if (disposing)
+				{
+					System::GC::SuppressFinalize(this);
+
+					// owner and its pool must still be alive, so only release on explicit dispose
+					auto pSnapshot = m_pSnapshot;
+					m_pSnapshot = nullptr;
+					m_itemCapacity = 0;
+
+					if (pSnapshot)
+					{
+						pSnapshot->owner()->release_snapshot(pSnapshot);
+					}
+				}
+				else
+				{
+					// simply discard the reference
+					m_pSnapshot = nullptr;
+					m_itemCapacity = 0;
+				}
+			}
+
+			!BitVectorSnapshot()
+			{
+				Cleanup(false);
+			}
+
+		internal:
+			BitVectorSnapshot(dataarray_t::snapshot_t* pSnapshot, size_t itemCapacity)
+				: m_pSnapshot(pSnapshot), m_itemCapacity(itemCapacity)
+			{
+			}
+
+		public:
+			~BitVectorSnapshot()
+			{
+				Cleanup(true);
+			}
+
+			property size_t Capacity {
+				[MethodImpl(MethodImplOptions::AggressiveInlining)]
+				inline size_t get() { return m_itemCapacity * BITS_PER_ITEM; }
+			}
+
+			void Write(System::IO::BinaryWriter^ writer, size_t count)
+			{
+				if (count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + count);
+				}
+
+				for (auto ix = 0; ix < count; ix += BITS_PER_ITEM)
+				{
+					byte group = GetGroup(ix);
+					writer->Write(group);
+				}
+			}
+
+			/// <summary>
+			/// Writes count bits starting at bit first, which must be a multiple of 8, same as BitVector::Write.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count)
+			{
+				if (first % BITS_PER_ITEM)
+				{
+					throw gcnew System::ArgumentException("First bit of range must be a multiple of " + BITS_PER_ITEM + ": " + first);
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Range end is beyond capacity: " + (first + count));
+				}
+
+				for (auto ix = first; ix < first + count; ix += BITS_PER_ITEM)
+				{
+					writer->Write(byte(GetGroup(ix)));
+				}
+			}
+
+			/// <summary>
+			/// Copies first count bits into a contiguous buffer, same as BitVector::CopyTo.
+			/// </summary>
+			void CopyTo(System::IntPtr dest, size_t count)
+			{
+				if (dest == System::IntPtr::Zero)
+				{
+					throw gcnew System::ArgumentNullException("dest");
+				}
+
+				auto pdest = (uint8_t*)dest.ToPointer();
+				size_t nbytes = (count + BITS_PER_ITEM - 1) / BITS_PER_ITEM;
+				size_t available = nbytes < m_itemCapacity ? nbytes : m_itemCapacity;
+
+				for (size_t offset = 0; offset < available;)
+				{
+					size_t chunk;
+					auto pspan = m_pSnapshot->span(offset, available - offset, chunk);
+					memcpy(pdest + offset, (const void*)pspan, chunk);
+					offset += chunk;
+				}
+
+				if (nbytes > available)
+				{
+					memset(pdest + available, 0, nbytes - available);
+				}
+				else if (count % BITS_PER_ITEM)
+				{
+					pdest[nbytes - 1] &= (uint8_t)((1 << (count % BITS_PER_ITEM)) - 1);
+				}
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline bool Get(size_t index)
+			{
+				auto pValue = m_pSnapshot->reference(index / BITS_PER_ITEM);
+				return 0 != (*pValue & (dataarray_t::value_type(1) << (index % BITS_PER_ITEM)));
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline bool Get(int32_t index)
+			{
+				return Get((size_t)index);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline dataarray_t::value_type GetGroup(size_t index)
+			{
+				return *m_pSnapshot->reference(index / BITS_PER_ITEM);
+			}
+		};
+
+		inline BitVectorSnapshot^ BitVector::Snapshot()
+		{
+			// capacity is only published after blocks are allocated, so it never exceeds snapshot capacity
+			auto itemCapacity = m_itemCapacity;
+			return gcnew BitVectorSnapshot(m_pArray->take_snapshot(), itemCapacity);
+		}
 	}
 }
\ No newline at end of file
@@ -103,11 +103,16 @@ namespace Pql {
 				m_pMap = new (pobj)hashmap_t(*m_allocator->GetAllocator());
 				if (src != nullptr)
 				{
+					auto cap = srcValues->Capacity;
 					for (auto it = src->m_pMap->cbegin(), end = src->m_pMap->cend(); it != end; it++)
 					{
+						// keys array may have been trimmed after source map was populated
 						auto value = it->second;
-						auto key = srcValues->GetAt(value);
-						m_pMap->insert(hashmap_t::value_type(key, value));
+						auto key = value < cap ? srcValues->GetAt(value) : nullptr;
+						if (key)
+						{
+							m_pMap->insert(hashmap_t::value_type(key, value));
+						}
 					}
 				}
 			}
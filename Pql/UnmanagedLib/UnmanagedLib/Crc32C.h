@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include "Win32Imports.h"
+
+namespace Pql {
+	namespace UnmanagedLib {
+
+		/// <summary>
+		/// CRC-32C (Castagnoli) checksums, as used by iSCSI, ext4 and others.
+		/// Computed with SSE 4.2 crc32 instruction when CPU supports it, and with a lookup table otherwise.
+		/// Checksums can be extended: Compute(Compute(0, a), b) equals checksum of a followed by b.
+		/// </summary>
+		public ref class Crc32C abstract sealed
+		{
+		public:
+			static uint32_t Compute(uint32_t crc, const byte* p, size_t count)
+			{
+				if (count > 0 && p == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("p");
+				}
+
+				return UnmanagedLib_Crc32C(crc, p, count);
+			}
+
+			static uint32_t Compute(uint32_t crc, System::IntPtr p, int64_t count)
+			{
+				if (count < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
+				}
+
+				return Compute(crc, (const byte*)p.ToPointer(), (size_t)count);
+			}
+
+			static uint32_t Compute(uint32_t crc, array<byte>^ data, int32_t offset, int32_t count)
+			{
+				if (data == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("data");
+				}
+
+				if (offset < 0 || count < 0 || offset + count > data->Length)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "offset and count must denote a range within the array");
+				}
+
+				if (count == 0)
+				{
+					return crc;
+				}
+
+				pin_ptr<byte> pdata = &data[offset];
+				return UnmanagedLib_Crc32C(crc, pdata, count);
+			}
+		};
+	}
+}
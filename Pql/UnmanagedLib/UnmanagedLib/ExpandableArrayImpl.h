@@ -1,133 +1,562 @@
 #pragma once
 
-#include "tbb/critical_section.h"
 #include "MemoryPoolTypes.h"
+#include "Win32Imports.h"
+#include "MappedFileSpace.h"
 
 namespace Pql {
 	namespace UnmanagedLib {
 
-		template <typename T> class ExpandableArrayImpl
+		/// <summary>
+		/// Computes base-2 logarithm of a power of two at compile time.
+		/// </summary>
+		template <size_t N> struct BlockShiftOf
+		{
+			static_assert(N > 1 && (N & (N - 1)) == 0, "Block size must be a power of two");
+			static const size_t value = 1 + BlockShiftOf<N / 2>::value;
+		};
+
+		template <> struct BlockShiftOf<1>
+		{
+			static const size_t value = 0;
+		};
+
+		/// <summary>
+		/// Grow-only array of fixed-size blocks.
+		/// Number of elements per block is a power of two known at compile time, so element lookup is a shift and a mask.
+		/// Block pointers live in a two-level directory: fixed top level is embedded into this object,
+		/// and leaves of blocksPerLeaf pointers are allocated on demand. Directory is never copied or moved,
+		/// so growth does not need any locks: leaves and blocks are published with CAS,
+		/// and concurrent growers simply skip slots which were already filled by others.
+		/// Blocks are either allocated from memory pool, or mapped from a scratch file for columns which should not take RAM.
+		/// Long-running readers can take a snapshot, which pins current set of blocks. While any snapshot is alive,
+		/// first write into a pinned block through writable_reference copies it, so snapshot keeps seeing a frozen image.
+		/// Every directory leaf keeps generation stamps of its blocks next to block pointers: a block is pinned
+		/// when its stamp is older than generation of the latest snapshot.
+		/// </summary>
+		template <typename T, size_t ElementsPerBlock> class ExpandableArrayImpl
 		{
 		public:
 			typedef T value_type;
-			typedef value_type volatile* volatile* containerref_t;
+			typedef value_type volatile* block_t;
+			typedef block_t volatile* leaf_t;
+
+			static const size_t elements_per_block = ElementsPerBlock;
+			static const size_t block_shift = BlockShiftOf<ElementsPerBlock>::value;
+			static const size_t block_mask = ElementsPerBlock - 1;
+			static const size_t directory_leaf_count = 512;
+
+			/// <summary>
+			/// Frozen image of the array. Blocks it refers to are never modified or released while it is alive.
+			/// Obtained from take_snapshot and must be returned with release_snapshot.
+			/// </summary>
+			class snapshot_t
+			{
+				ExpandableArrayImpl* m_pOwner;
+				size_t m_blockCount;
+				block_t* m_pBlocks;
+
+			public:
+				snapshot_t(ExpandableArrayImpl* pOwner, size_t blockCount, block_t* pBlocks)
+					: m_pOwner(pOwner), m_blockCount(blockCount), m_pBlocks(pBlocks)
+				{}
+
+				inline ExpandableArrayImpl* owner() const { return m_pOwner; }
+
+				inline size_t capacity() const { return m_blockCount << block_shift; }
+
+				inline block_t block(size_t blockIndex) const { return m_pBlocks[blockIndex]; }
+
+				inline value_type get(size_t index) const
+				{
+					return *reference(index);
+				}
+
+				/// <summary>
+				/// Returns pointer to element, which must be below snapshot capacity. Must not be written to.
+				/// </summary>
+				inline value_type volatile* reference(size_t index) const
+				{
+					return m_pBlocks[index >> block_shift] + (index & block_mask);
+				}
+
+				inline value_type volatile* span(size_t index, size_t maxCount, size_t& length) const
+				{
+					auto available = ElementsPerBlock - (index & block_mask);
+					length = maxCount < available ? maxCount : available;
+					return reference(index);
+				}
+			};
 
 		private:
-			memorypoolallocator_t* m_pAllocator;
-			size_t m_elementsPerBlock;
-			size_t m_blocksGrowth;
-			tbb::critical_section m_thisLock;
+			/// <summary>
+			/// Block which was replaced by a copy, but may still be referenced by live snapshots.
+			/// </summary>
+			struct retired_t
+			{
+				block_t pBlock;
+				retired_t* pNext;
+			};
 
-			containerref_t volatile m_blockList;
-			size_t volatile m_blockCapacity;
+			memorypoolallocator_t* m_pAllocator;
+			MappedFileSpace* m_pMappedSpace;
+			size_t m_blocksPerLeaf;
+			size_t m_leafShift;
 			size_t volatile m_blockCount;
+			size_t volatile m_generation;
+			uint32_t volatile m_liveSnapshots;
+			uint32_t volatile m_cowLock;
+			retired_t* m_pRetired;
+			leaf_t volatile m_directory[directory_leaf_count];
+
+			/// <summary>
+			/// Generation stamps of blocks are stored in every leaf right after block pointers.
+			/// </summary>
+			inline size_t volatile* stamps(leaf_t leaf) const
+			{
+				return (size_t volatile*)(leaf + m_blocksPerLeaf);
+			}
+
+			inline void lock_cow()
+			{
+				while (0 != UnmanagedLib_InterlockedCompareExchange32(&m_cowLock, 1, 0))
+				{
+					System::Threading::Thread::Yield();
+				}
+			}
+
+			inline void unlock_cow()
+			{
+				UnmanagedLib_InterlockedCompareExchange32(&m_cowLock, 0, 1);
+			}
+
+			inline leaf_t try_ensure_leaf(size_t leafIndex)
+			{
+				auto leaf = m_directory[leafIndex];
+				if (leaf)
+				{
+					return leaf;
+				}
+
+				leaf_t pNewLeaf;
+				try
+				{
+					pNewLeaf = (leaf_t)m_pAllocator->allocate(m_blocksPerLeaf * (sizeof(block_t) + sizeof(size_t)));
+				}
+				catch (System::InsufficientMemoryException^)
+				{
+					return nullptr;
+				}
+
+				leaf = (leaf_t)UnmanagedLib_InterlockedCompareExchangePointer((void* volatile*)&m_directory[leafIndex], (void*)pNewLeaf, nullptr);
+				if (leaf)
+				{
+					// somebody else has published this leaf first
+					m_pAllocator->deallocate((void*)pNewLeaf);
+					return leaf;
+				}
+
+				return pNewLeaf;
+			}
+
+			inline bool try_ensure_block(size_t blockIndex)
+			{
+				auto leaf = try_ensure_leaf(blockIndex >> m_leafShift);
+				if (!leaf)
+				{
+					return false;
+				}
+
+				auto slotIndex = blockIndex & (m_blocksPerLeaf - 1);
+				auto slot = &leaf[slotIndex];
+				if (*slot)
+				{
+					return true;
+				}
+
+				auto pNewBlock = try_allocate_block();
+				if (!pNewBlock)
+				{
+					return false;
+				}
+
+				// fresh block is not pinned by any existing snapshot; concurrent growers write the same stamp
+				stamps(leaf)[slotIndex] = m_generation;
+
+				if (UnmanagedLib_InterlockedCompareExchangePointer((void* volatile*)slot, (void*)pNewBlock, nullptr))
+				{
+					// somebody else has published this block first
+					release_block(pNewBlock);
+				}
+
+				return true;
+			}
+
+			inline block_t try_allocate_block()
+			{
+				if (m_pMappedSpace)
+				{
+					return (block_t)m_pMappedSpace->map(ElementsPerBlock * sizeof(value_type));
+				}
+
+				try
+				{
+					return (block_t)m_pAllocator->allocate(ElementsPerBlock * sizeof(value_type));
+				}
+				catch (System::InsufficientMemoryException^)
+				{
+					return nullptr;
+				}
+			}
+
+			inline void release_block(block_t pBlock)
+			{
+				if (m_pMappedSpace)
+				{
+					m_pMappedSpace->unmap((void*)pBlock);
+				}
+				else
+				{
+					m_pAllocator->deallocate((void*)pBlock);
+				}
+			}
+
+			/// <summary>
+			/// Releases a block which stale readers may still be looking at.
+			/// Mapped blocks cannot be put into pool garbage, they are unmapped right away.
+			/// </summary>
+			inline void collect_block(block_t pBlock)
+			{
+				if (m_pMappedSpace)
+				{
+					m_pMappedSpace->unmap((void*)pBlock);
+				}
+				else
+				{
+					m_pAllocator->schedule_for_collection((void*)pBlock);
+				}
+			}
+
+			/// <summary>
+			/// Keeps a block for snapshots until all of them are released. Must be called under COW lock.
+			/// </summary>
+			inline void retire_block(block_t pBlock)
+			{
+				auto pRetired = (retired_t*)m_pAllocator->allocate(sizeof(retired_t));
+				pRetired->pBlock = pBlock;
+				pRetired->pNext = m_pRetired;
+				m_pRetired = pRetired;
+			}
+
+			inline void collect_retired(retired_t* pRetired)
+			{
+				while (pRetired)
+				{
+					auto pNext = pRetired->pNext;
+					collect_block(pRetired->pBlock);
+					m_pAllocator->deallocate(pRetired);
+					pRetired = pNext;
+				}
+			}
+
+			/// <summary>
+			/// Replaces a block pinned by snapshots with its private copy.
+			/// Writers which find a stale stamp serialize here, so nobody writes into a block while it is being copied.
+			/// </summary>
+			void copy_pinned_block(leaf_t leaf, size_t slotIndex)
+			{
+				lock_cow();
+				try
+				{
+					if (m_liveSnapshots != 0 && stamps(leaf)[slotIndex] != m_generation)
+					{
+						auto pOld = leaf[slotIndex];
+						auto pNew = try_allocate_block();
+						if (!pNew)
+						{
+							throw gcnew System::InsufficientMemoryException("Failed to allocate copy of a block pinned by snapshot");
+						}
+
+						memcpy((void*)pNew, (const void*)pOld, ElementsPerBlock * sizeof(value_type));
+
+						try
+						{
+							retire_block(pOld);
+						}
+						catch (System::InsufficientMemoryException^)
+						{
+							release_block(pNew);
+							throw;
+						}
+
+						// pointer must be published before the stamp, lock-free writers read them in reverse order
+						leaf[slotIndex] = pNew;
+						stamps(leaf)[slotIndex] = m_generation;
+					}
+				}
+				finally
+				{
+					unlock_cow();
+				}
+			}
 
 		public:
-			ExpandableArrayImpl(memorypoolallocator_t* pAllocator, size_t elementsPerBlock, size_t blocksGrowth)
-				: m_pAllocator(pAllocator), m_elementsPerBlock(elementsPerBlock), m_blocksGrowth(blocksGrowth)
+			/// <param name="blocksPerLeaf">Number of block pointers in every directory leaf, must be a power of two.
+			/// Largest number of blocks is directory_leaf_count times this value.</param>
+			/// <param name="pMappedSpace">Optional scratch file to map blocks from, owned by the caller and must outlive this array.
+			/// Directory leaves are always allocated from the pool.</param>
+			ExpandableArrayImpl(memorypoolallocator_t* pAllocator, size_t blocksPerLeaf, MappedFileSpace* pMappedSpace = nullptr)
+				: m_pAllocator(pAllocator), m_pMappedSpace(pMappedSpace), m_blocksPerLeaf(blocksPerLeaf), m_leafShift(0), m_blockCount(0),
+				m_generation(0), m_liveSnapshots(0), m_cowLock(0), m_pRetired(nullptr)
 			{
+				if (blocksPerLeaf == 0 || (blocksPerLeaf & (blocksPerLeaf - 1)) != 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("blocksPerLeaf", blocksPerLeaf, "Number of blocks per directory leaf must be a power of two");
+				}
+
+				while (((size_t)1 << m_leafShift) < blocksPerLeaf)
+				{
+					m_leafShift++;
+				}
+
+				for (size_t i = 0; i < directory_leaf_count; i++)
+				{
+					m_directory[i] = nullptr;
+				}
 			}
 
+			/// <summary>
+			/// All snapshots must be released before array is destroyed.
+			/// </summary>
 			~ExpandableArrayImpl(void)
 			{
 				if (m_pAllocator)
 				{
-					if (m_blockList)
+					collect_retired(m_pRetired);
+					m_pRetired = nullptr;
+
+					for (size_t i = 0; i < directory_leaf_count; i++)
 					{
-						for (auto i = 0; i < m_blockCapacity; i++)
+						auto leaf = m_directory[i];
+						if (leaf)
 						{
-							if (m_blockList[i])
+							for (size_t j = 0; j < m_blocksPerLeaf; j++)
 							{
-								m_pAllocator->deallocate((void*)m_blockList[i]);
+								if (leaf[j])
+								{
+									release_block(leaf[j]);
+								}
 							}
-						}
 
-						m_pAllocator->deallocate((void*)m_blockList);
-						m_blockCapacity = 0;
-						m_blockList = nullptr;
+							m_pAllocator->deallocate((void*)leaf);
+							m_directory[i] = nullptr;
+						}
 					}
 
+					m_blockCount = 0;
 					m_pAllocator = nullptr;
 				}
 			}
 
-			inline bool try_ensure_capacity(size_t newCapacity, size_t timeout, interior_ptr<containerref_t> ref, interior_ptr<size_t> cap)
+			/// <summary>
+			/// Makes sure that first newCapacity elements are backed by allocated blocks.
+			/// Never blocks, only returns false when memory cannot be allocated or directory is full.
+			/// </summary>
+			/// <param name="cap">Cached capacity value owned by the caller, is only ever increased</param>
+			inline bool try_ensure_capacity(size_t newCapacity, interior_ptr<size_t> cap)
 			{
-				if (capacity() >= newCapacity)
+				auto blockCount = m_blockCount;
+				if ((blockCount << block_shift) >= newCapacity)
 				{
 					return true;
 				}
 
-				tbb::critical_section::scoped_lock lock(m_thisLock);
-
-				if (capacity() >= newCapacity)
+				auto requiredBlockCount = (newCapacity + block_mask) >> block_shift;
+				if (requiredBlockCount > directory_leaf_count * m_blocksPerLeaf)
 				{
-					return true;
+					return false;
 				}
 
-				// adjust new capacity value to desired granularity - may be larger than what's needed for this request
-				auto requestedListCapacity = 1 + newCapacity / m_elementsPerBlock;
-				auto newListCapacity = (1 + newCapacity / (m_elementsPerBlock*m_blocksGrowth)) * m_blocksGrowth;
-
-				// make sure top-level list has enough capacity, with respect to our granularity setting
-				if (m_blockCapacity < newListCapacity)
+				// blocks below published count are known to exist, fill in everything above it
+				for (auto ix = blockCount; ix < requiredBlockCount; ix++)
 				{
-					value_type** pNewList;
-					try
-					{
-						pNewList = (value_type**)m_pAllocator->allocate(newListCapacity * sizeof(value_type*));
-					}
-					catch (System::InsufficientMemoryException^)
+					if (!try_ensure_block(ix))
 					{
 						return false;
 					}
+				}
 
-					size_t ix;
-					for (ix = 0; ix < m_blockCapacity; ix++)
+				// all blocks up to required count now exist, so published count may be advanced up to it
+				while (blockCount < requiredBlockCount)
+				{
+					auto prev = (size_t)UnmanagedLib_InterlockedCompareExchange64((volatile uint64_t*)&m_blockCount, requiredBlockCount, blockCount);
+					if (prev == blockCount)
 					{
-						pNewList[ix] = const_cast<value_type*>(m_blockList[ix]);
+						break;
 					}
 
-					// do not deallocate current list immediately, some threads might be accessing it right now
-					auto prevList = m_blockList;
-
-					m_blockList = const_cast<containerref_t>(pNewList);
+					blockCount = prev;
+				}
 
-					if (prevList)
+				// concurrent growers may publish their cached values in any order, never let it go down
+				auto newCap = capacity();
+				pin_ptr<size_t> pcap = cap;
+				while (true)
+				{
+					auto prevCap = *pcap;
+					if (prevCap >= newCap || prevCap == (size_t)UnmanagedLib_InterlockedCompareExchange64((volatile uint64_t*)(size_t*)pcap, newCap, prevCap))
 					{
-						m_pAllocator->schedule_for_collection((void*)prevList);
+						break;
 					}
-
-					tbb::full_fence;
-
-					*ref = m_blockList;
-					m_blockCapacity = newListCapacity;
 				}
 
-				// now allocate missing blocks up to requested number
-				for (auto ix = m_blockCount; ix < requestedListCapacity; ix++)
+				return true;
+			}
+
+			/// <summary>
+			/// Releases blocks which are not needed to hold first newCapacity elements, and directory leaves which became empty.
+			/// Contents of the last retained block are not touched.
+			/// Caller must have exclusive access to this array. Released memory is only scheduled for collection,
+			/// so that stale readers which still hold block pointers do not touch deallocated memory until pool garbage is collected.
+			/// Mapped blocks cannot be put into pool garbage, they are unmapped right away.
+			/// Blocks which may be pinned by live snapshots are retired instead, and released with the last snapshot.
+			/// </summary>
+			/// <param name="cap">Cached capacity value owned by the caller, is set to the new capacity</param>
+			inline void trim_to(size_t newCapacity, interior_ptr<size_t> cap)
+			{
+				auto blockCount = m_blockCount;
+				auto requiredBlockCount = (newCapacity + block_mask) >> block_shift;
+				if (requiredBlockCount < blockCount)
 				{
+					// make sure no new lookups go beyond new capacity before releasing anything
+					m_blockCount = requiredBlockCount;
+					*cap = capacity();
+
+					lock_cow();
 					try
 					{
-						(const_cast<value_type**>(m_blockList))[ix] = (value_type*)m_pAllocator->allocate(m_elementsPerBlock * sizeof(value_type));
+						for (auto ix = requiredBlockCount; ix < blockCount; ix++)
+						{
+							auto slot = &m_directory[ix >> m_leafShift][ix & (m_blocksPerLeaf - 1)];
+							if (*slot)
+							{
+								if (m_liveSnapshots != 0)
+								{
+									retire_block(*slot);
+								}
+								else
+								{
+									collect_block(*slot);
+								}
+
+								*slot = nullptr;
+							}
+						}
+					}
+					finally
+					{
+						unlock_cow();
 					}
-					catch (System::InsufficientMemoryException^)
+
+					// leaves below this one still hold retained blocks
+					auto firstEmptyLeaf = (requiredBlockCount + m_blocksPerLeaf - 1) >> m_leafShift;
+					for (auto i = firstEmptyLeaf; i < directory_leaf_count; i++)
 					{
-						m_blockCount = ix;
-						*cap = capacity();
-						return false;
+						auto leaf = m_directory[i];
+						if (leaf)
+						{
+							m_pAllocator->schedule_for_collection((void*)leaf);
+							m_directory[i] = nullptr;
+						}
 					}
 				}
+			}
 
-				tbb::full_fence;
+			inline size_t capacity() const { return m_blockCount << block_shift; }
 
-				m_blockCount = requestedListCapacity;
-				*cap = capacity();
+			inline bool is_mapped() const { return m_pMappedSpace != nullptr; }
 
-				return true;
+			/// <summary>
+			/// Pins current blocks into a new snapshot, which must later be returned with release_snapshot.
+			/// Takes time proportional to number of blocks, not elements.
+			/// Caller must make sure there are no concurrent writers or growers while snapshot is taken,
+			/// after that writers may proceed concurrently with snapshot readers.
+			/// </summary>
+			snapshot_t* take_snapshot()
+			{
+				auto blockCount = m_blockCount;
+				auto p = (snapshot_t*)m_pAllocator->allocate(sizeof(snapshot_t) + blockCount * sizeof(block_t));
+				auto pBlocks = (block_t*)(p + 1);
+				for (size_t ix = 0; ix < blockCount; ix++)
+				{
+					pBlocks[ix] = block(ix);
+				}
+
+				lock_cow();
+				m_generation++;
+				m_liveSnapshots++;
+				unlock_cow();
+
+				return new (p)snapshot_t(this, blockCount, pBlocks);
 			}
 
-			inline size_t capacity() const { return m_blockCount * m_elementsPerBlock; }
+			/// <summary>
+			/// Releases a snapshot. Blocks replaced while snapshots were alive are released together with the last one.
+			/// </summary>
+			void release_snapshot(snapshot_t* pSnapshot)
+			{
+				retired_t* pRetired = nullptr;
+
+				lock_cow();
+				if (0 == --m_liveSnapshots)
+				{
+					pRetired = m_pRetired;
+					m_pRetired = nullptr;
+				}
+				unlock_cow();
+
+				collect_retired(pRetired);
+				m_pAllocator->deallocate(pSnapshot);
+			}
+
+			/// <summary>
+			/// For mapped blocks, hints the OS to read ahead pages of given range of elements, which must be below current capacity.
+			/// </summary>
+			inline void advise_will_need(size_t index, size_t count) const
+			{
+				if (!m_pMappedSpace)
+				{
+					return;
+				}
+
+				Win32MemoryRangeEntry entries[16];
+				size_t nEntries = 0;
+				for (auto end = index + count; index < end;)
+				{
+					size_t length;
+					auto p = span(index, end - index, length);
+					entries[nEntries].VirtualAddress = (void*)p;
+					entries[nEntries].NumberOfBytes = length * sizeof(value_type);
+					nEntries++;
+					index += length;
+
+					if (nEntries == 16)
+					{
+						MappedFileSpace::advise_will_need(entries, nEntries);
+						nEntries = 0;
+					}
+				}
+
+				MappedFileSpace::advise_will_need(entries, nEntries);
+			}
+
+			/// <summary>
+			/// Returns pointer to block, which must be below current capacity.
+			/// </summary>
+			inline block_t block(size_t blockIndex) const
+			{
+				return m_directory[blockIndex >> m_leafShift][blockIndex & (m_blocksPerLeaf - 1)];
+			}
 
 			inline value_type get(size_t index) const
 			{
@@ -136,18 +565,56 @@ namespace Pql {
 
 			inline void set(size_t index, value_type newValue)
 			{
-				m_blockList[index / m_elementsPerBlock][index % m_elementsPerBlock] = newValue;
+				*reference(index) = newValue;
+			}
+
+			inline value_type volatile* reference(size_t index) const
+			{
+				return block(index >> block_shift) + (index & block_mask);
+			}
+
+			/// <summary>
+			/// Returns pointer to element for writing, which must be below current capacity.
+			/// When block is pinned by a live snapshot, it is copied first.
+			/// Without live snapshots, costs one extra read compared to reference.
+			/// </summary>
+			inline value_type volatile* writable_reference(size_t index)
+			{
+				if (m_liveSnapshots != 0)
+				{
+					auto blockIndex = index >> block_shift;
+					auto leaf = m_directory[blockIndex >> m_leafShift];
+					auto slotIndex = blockIndex & (m_blocksPerLeaf - 1);
+					if (stamps(leaf)[slotIndex] != m_generation)
+					{
+						copy_pinned_block(leaf, slotIndex);
+					}
+				}
+
+				return reference(index);
 			}
 
-			inline value_type volatile* volatile reference(size_t index) const
+			/// <summary>
+			/// Returns pointer to element at index and number of contiguous elements available from it,
+			/// which is bounded by maxCount and by the end of containing block.
+			/// Lets scans iterate whole blocks instead of looking up every element.
+			/// </summary>
+			inline value_type volatile* span(size_t index, size_t maxCount, size_t& length) const
 			{
-				return &m_blockList[index / m_elementsPerBlock][index % m_elementsPerBlock];
+				auto available = ElementsPerBlock - (index & block_mask);
+				length = maxCount < available ? maxCount : available;
+				return reference(index);
 			}
 
-			inline containerref_t head() const
+			/// <summary>
+			/// Same as span, for writing into returned elements.
+			/// </summary>
+			inline value_type volatile* writable_span(size_t index, size_t maxCount, size_t& length)
 			{
-				return m_blockList;
+				auto available = ElementsPerBlock - (index & block_mask);
+				length = maxCount < available ? maxCount : available;
+				return writable_reference(index);
 			}
 		};
 	}
-}
\ No newline at end of file
+}
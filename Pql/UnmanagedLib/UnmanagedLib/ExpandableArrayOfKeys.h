@@ -13,14 +13,13 @@ namespace Pql {
 
 		public ref class ExpandableArrayOfKeys
 		{
-			typedef ExpandableArrayImpl<uint8_t*> dataarray_t;
-
 #define ITEMS_PER_BLOCK 65536
 #define BLOCKS_GROWTH 64
 
+			typedef ExpandableArrayImpl<uint8_t*, ITEMS_PER_BLOCK> dataarray_t;
+
 			dataarray_t* m_pArray;
 			IUnmanagedAllocator^ m_allocator;
-			dataarray_t::containerref_t volatile m_pData;
 			size_t volatile m_capacity;
 
 			void Cleanup(bool disposing)
@@ -30,18 +29,24 @@ namespace Pql {
 					System::GC::SuppressFinalize(this);
 				}
 
-				m_pData = nullptr;
 				m_capacity = 0;
 
 				if (m_pArray)
 				{
-					for (auto x = 0; x < m_pArray->capacity(); x++)
+					auto cap = m_pArray->capacity();
+					for (size_t x = 0; x < cap;)
 					{
-						auto ptr = m_pArray->get(x);
-						if (ptr)
+						size_t length;
+						auto pspan = m_pArray->span(x, cap - x, length);
+						for (size_t i = 0; i < length; i++)
 						{
-							m_allocator->Free(ptr);
+							if (pspan[i])
+							{
+								m_allocator->Free(pspan[i]);
+							}
 						}
+
+						x += length;
 					}
 
 					m_pArray->~dataarray_t();
@@ -66,7 +71,23 @@ namespace Pql {
 
 				auto pobj = (dataarray_t*)m_allocator->Alloc(sizeof(dataarray_t));
 
-				m_pArray = new (pobj)dataarray_t(m_allocator->GetAllocator(), ITEMS_PER_BLOCK, BLOCKS_GROWTH);
+				m_pArray = new (pobj)dataarray_t(m_allocator->GetAllocator(), BLOCKS_GROWTH);
+			}
+
+			static void WriteKey(System::IO::BinaryWriter^ writer, const uint8_t* value)
+			{
+				if (value)
+				{
+					writer->Write(byte(value[0]));
+					for (auto c = 1; c <= value[0]; c++)
+					{
+						writer->Write(byte(value[c]));
+					}
+				}
+				else
+				{
+					writer->Write(byte(0));
+				}
 			}
 
 		public:
@@ -118,10 +139,32 @@ namespace Pql {
 				}
 
 				EnsureCapacity(count);
+				Read(reader, 0, count, validEntries);
+			}
 
-				byte buff[255];
+			/// <summary>
+			/// Reads keys of count entries starting at first. Capacity must already cover the range.
+			/// </summary>
+			void Read(System::IO::BinaryReader^ reader, size_t first, size_t count, BitVector^ validEntries)
+			{
+				if (validEntries == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("validEntries");
+				}
+
+				if (reader == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("reader");
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Range end is beyond capacity: " + (first + count));
+				}
 
-				for (size_t ix = 0; ix < count; ix++)
+				byte buff[256];
+
+				for (size_t ix = first; ix < first + count; ix++)
 				{
 					if (!validEntries->Get(ix))
 					{
@@ -153,6 +196,14 @@ namespace Pql {
 			}
 
 			void Write(System::IO::BinaryWriter^ writer, size_t count, BitVector^ validEntries)
+			{
+				Write(writer, 0, count, validEntries);
+			}
+
+			/// <summary>
+			/// Writes keys of count entries starting at first, in the same format as the other overload.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count, BitVector^ validEntries)
 			{
 				if (writer == nullptr)
 				{
@@ -164,30 +215,47 @@ namespace Pql {
 					throw gcnew System::ArgumentNullException("validEntries");
 				}
 
-				if (count > Capacity)
+				if (first + count > Capacity)
 				{
-					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + count);
+					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + (first + count));
 				}
 
-				for (size_t ix = 0; ix < count; ix++)
+				for (size_t ix = first; ix < first + count; ix++)
 				{
-					if (!validEntries->Get(ix))
+					if (validEntries->Get(ix))
 					{
-						continue;
+						WriteKey(writer, GetAt(ix));
 					}
+				}
+			}
 
-					auto value = GetAt(ix);
-					if (value)
-					{
-						writer->Write(byte(value[0]));
-						for (auto c = 1; c <= value[0]; c++)
-						{
-							writer->Write(byte(value[c]));
-						}
-					}
-					else
+			/// <summary>
+			/// Writes keys of count entries starting at first, filtered by a frozen image of valid entries.
+			/// Keys are only assigned to new entries, so keys below count of a snapshot taken together with
+			/// validEntries do not change while it is alive, unless this array is trimmed.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count, BitVectorSnapshot^ validEntries)
+			{
+				if (writer == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("writer");
+				}
+
+				if (validEntries == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("validEntries");
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + (first + count));
+				}
+
+				for (size_t ix = first; ix < first + count; ix++)
+				{
+					if (validEntries->Get(ix))
 					{
-						writer->Write(byte(0));
+						WriteKey(writer, GetAt(ix));
 					}
 				}
 			}
@@ -223,14 +291,41 @@ namespace Pql {
 			{
 				if (capacity > 0)
 				{
-					auto pdata = interior_ptr<dataarray_t::containerref_t>(&m_pData);
 					auto pcapacity = interior_ptr<size_t>(&m_capacity);
-					auto result = m_pArray->try_ensure_capacity(capacity, timeout, pdata, pcapacity);
+					return m_pArray->try_ensure_capacity(capacity, pcapacity);
 				}
 
 				return true;
 			}
 
+			/// <summary>
+			/// Releases keys at and above capacity, and storage which is not needed to hold first capacity keys.
+			/// Caller must have exclusive access to this array, and must not keep any references to released keys,
+			/// which are scheduled for collection and only get deallocated with the rest of pool garbage.
+			/// </summary>
+			inline void TrimTo(size_t capacity)
+			{
+				auto cap = m_pArray->capacity();
+				for (auto x = capacity; x < cap;)
+				{
+					size_t length;
+					auto pspan = m_pArray->span(x, cap - x, length);
+					for (size_t i = 0; i < length; i++)
+					{
+						if (pspan[i])
+						{
+							m_allocator->ScheduleForCollection(pspan[i]);
+							pspan[i] = nullptr;
+						}
+					}
+
+					x += length;
+				}
+
+				auto pcapacity = interior_ptr<size_t>(&m_capacity);
+				m_pArray->trim_to(capacity, pcapacity);
+			}
+
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
 			inline bool TrySetAt(int32_t index, array<byte>^ data)
 			{
@@ -284,7 +379,7 @@ namespace Pql {
 
 				void* prev;
 
-				auto targetref = m_pData[index / ITEMS_PER_BLOCK] + (index % ITEMS_PER_BLOCK);
+				auto targetref = m_pArray->reference(index);
 				prev = *targetref;
 				if (prev != UnmanagedLib_InterlockedCompareExchangePointer((void* volatile*)targetref, (void*)pnew, prev))
 				{
@@ -312,7 +407,7 @@ namespace Pql {
 					throw gcnew System::ArgumentOutOfRangeException("index", index, "Index must be less than allocated capacity");
 				}
 
-				return *(m_pData[index / ITEMS_PER_BLOCK] + (index % ITEMS_PER_BLOCK));
+				return *(m_pArray->reference(index));
 			}
 
 			[MethodImpl(MethodImplOptions::AggressiveInlining)]
@@ -344,7 +439,7 @@ namespace Pql {
 					throw gcnew System::ArgumentOutOfRangeException("index", index, "Index must be less than allocated capacity");
 				}
 
-				return System::IntPtr(*(m_pData[index / ITEMS_PER_BLOCK] + (index % ITEMS_PER_BLOCK)));
+				return System::IntPtr(*(m_pArray->reference(index)));
 			}
 		};
 	}
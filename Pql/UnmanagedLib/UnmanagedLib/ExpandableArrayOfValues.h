@@ -0,0 +1,1034 @@
+#pragma once
+
+#include <xstddef>
+#include <vcclr.h>
+#include "MemoryPoolTypes.h"
+#include "IUnmanagedAllocator.h"
+#include "ExpandableArrayImpl.h"
+#include "BitVector.h"
+#include "MappedFileSpace.h"
+#include "MemoryViewStream.h"
+#include "Win32Imports.h"
+
+namespace Pql {
+	namespace UnmanagedLib {
+
+		using namespace System::Runtime::CompilerServices;
+
+		/// <summary>
+		/// Page of the append-only value heap. Value bytes follow the header.
+		/// </summary>
+		struct ValueHeapPage
+		{
+			ValueHeapPage* next;
+			uint64_t volatile used;
+			uint64_t size;
+
+			inline uint8_t* data() { return (uint8_t*)(this + 1); }
+		};
+
+		struct ValueHeapState
+		{
+			ValueHeapPage* volatile current;
+			ValueHeapPage* volatile oversized;
+		};
+
+		ref class ExpandableArrayOfValuesSnapshot;
+
+		/// <summary>
+		/// Column store for variable-length values, such as UTF-8 strings and binary blobs.
+		/// Every entry points to a length-prefixed value in an append-only heap of large pages.
+		/// Values are never updated in place: new version is appended and entry pointer is swapped,
+		/// so that readers never see torn values. Space taken by replaced values is only reclaimed
+		/// when the store is copied into a new pool, which only copies live values.
+		/// Optionally, entry blocks and heap pages are mapped from a scratch file instead of the pool,
+		/// so that rarely used columns may be paged out and only cost I/O when queried.
+		/// </summary>
+		public ref class ExpandableArrayOfValues
+		{
+#define ITEMS_PER_BLOCK 65536
+#define BLOCKS_GROWTH 64
+#define VALUE_PAGE_BYTES 1048576
+#define VALUE_PREFIX_BYTES sizeof(uint32_t)
+
+			typedef ExpandableArrayImpl<uint8_t*, ITEMS_PER_BLOCK> dataarray_t;
+
+			dataarray_t* m_pArray;
+			ValueHeapState* m_pHeap;
+			MappedFileSpace* m_pMapped;
+			IUnmanagedAllocator^ m_allocator;
+			size_t volatile m_capacity;
+			array<byte>^ m_ioBuffer;
+
+			void ReleasePage(ValueHeapPage* page)
+			{
+				if (m_pMapped)
+				{
+					m_pMapped->unmap(page);
+				}
+				else
+				{
+					m_allocator->Free(page);
+				}
+			}
+
+			void FreePages(ValueHeapPage* page)
+			{
+				while (page)
+				{
+					auto next = page->next;
+					ReleasePage(page);
+					page = next;
+				}
+			}
+
+			void Cleanup(bool disposing)
+			{
+				if (disposing)
+				{
+					System::GC::SuppressFinalize(this);
+				}
+
+				m_capacity = 0;
+
+				if (m_pArray)
+				{
+					// entries point into heap pages, they are not freed individually
+					m_pArray->~dataarray_t();
+					m_allocator->Free(m_pArray);
+					m_pArray = nullptr;
+				}
+
+				if (m_pHeap)
+				{
+					FreePages(m_pHeap->current);
+					FreePages(m_pHeap->oversized);
+					m_allocator->Free(m_pHeap);
+					m_pHeap = nullptr;
+				}
+
+				if (m_pMapped)
+				{
+					m_pMapped->~MappedFileSpace();
+					m_allocator->Free(m_pMapped);
+					m_pMapped = nullptr;
+				}
+			}
+
+			!ExpandableArrayOfValues()
+			{
+				Cleanup(false);
+			}
+
+			void Initialize(ExpandableArrayOfValues^ src, IUnmanagedAllocator^ allocator, System::String^ mappedFilePath)
+			{
+				if (!allocator)
+				{
+					throw gcnew System::ArgumentNullException("allocator");
+				}
+
+				m_allocator = allocator;
+
+				if (mappedFilePath != nullptr)
+				{
+					auto pmapped = (MappedFileSpace*)m_allocator->Alloc(sizeof(MappedFileSpace));
+					try
+					{
+						m_pMapped = new (pmapped)MappedFileSpace(mappedFilePath);
+					}
+					catch (System::Exception^)
+					{
+						m_allocator->Free(pmapped);
+						throw;
+					}
+				}
+
+				auto pobj = (dataarray_t*)m_allocator->Alloc(sizeof(dataarray_t));
+				m_pArray = new (pobj)dataarray_t(m_allocator->GetAllocator(), BLOCKS_GROWTH, m_pMapped);
+
+				// allocator returns zeroed memory, so heap starts with no pages
+				m_pHeap = (ValueHeapState*)m_allocator->Alloc(sizeof(ValueHeapState));
+
+				if (src)
+				{
+					auto cap = src->Capacity;
+					EnsureCapacity(cap);
+
+					for (size_t ix = 0; ix < cap; ix++)
+					{
+						auto pvalue = src->GetAt(ix);
+						if (pvalue)
+						{
+							SetAt(ix, pvalue + VALUE_PREFIX_BYTES, *(uint32_t*)pvalue);
+						}
+					}
+				}
+			}
+
+			ValueHeapPage* AllocatePage(size_t nBytes)
+			{
+				ValueHeapPage* page;
+				if (m_pMapped)
+				{
+					// regions are rounded up, let the page use all of it
+					auto regionBytes = MappedFileSpace::region_size(sizeof(ValueHeapPage) + nBytes);
+					page = (ValueHeapPage*)m_pMapped->map(regionBytes);
+					if (!page)
+					{
+						throw gcnew System::InsufficientMemoryException("Failed to map " + regionBytes + " bytes of column file");
+					}
+
+					nBytes = regionBytes - sizeof(ValueHeapPage);
+				}
+				else
+				{
+					page = (ValueHeapPage*)m_allocator->Alloc(sizeof(ValueHeapPage) + nBytes);
+				}
+
+				page->next = nullptr;
+				page->used = 0;
+				page->size = nBytes;
+				return page;
+			}
+
+			/// <summary>
+			/// Reserves space for a value of given size in the heap, without taking any locks.
+			/// </summary>
+			uint8_t* Reserve(size_t nBytes)
+			{
+				// keep length prefixes aligned
+				auto need = (nBytes + 7) & ~size_t(7);
+
+				if (need > VALUE_PAGE_BYTES / 4)
+				{
+					// large values get dedicated pages, to avoid wasting tails of regular ones
+					auto page = AllocatePage(need);
+					page->used = need;
+
+					ValueHeapPage* head;
+					do
+					{
+						head = m_pHeap->oversized;
+						page->next = head;
+					} while (head != UnmanagedLib_InterlockedCompareExchangePointer((void* volatile*)&m_pHeap->oversized, page, head));
+
+					return page->data();
+				}
+
+				while (true)
+				{
+					auto page = m_pHeap->current;
+					if (page)
+					{
+						auto used = page->used;
+						if (used + need <= page->size)
+						{
+							if (used == UnmanagedLib_InterlockedCompareExchange64(&page->used, used + need, used))
+							{
+								return page->data() + used;
+							}
+
+							continue;
+						}
+					}
+
+					auto newpage = AllocatePage(VALUE_PAGE_BYTES);
+					newpage->next = page;
+					if (page != UnmanagedLib_InterlockedCompareExchangePointer((void* volatile*)&m_pHeap->current, newpage, page))
+					{
+						// somebody else has just started a new page, use that one
+						ReleasePage(newpage);
+					}
+				}
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void Publish(size_t index, uint8_t* pvalue)
+			{
+				if (index >= Capacity)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("index", index, "Index must be less than allocated capacity");
+				}
+
+				// last writer wins, previous value becomes garbage in the heap, so snapshots can still refer to it
+				auto targetref = (void* volatile*)(m_pArray->writable_reference(index));
+				void* prev;
+				do
+				{
+					prev = *targetref;
+				} while (prev != UnmanagedLib_InterlockedCompareExchangePointer(targetref, pvalue, prev));
+			}
+
+			static array<byte>^ RequireIoBuffer(array<byte>^% ioBuffer, int32_t length)
+			{
+				if (ioBuffer == nullptr || ioBuffer->Length < length)
+				{
+					ioBuffer = gcnew array<byte>(length > 65536 ? length : 65536);
+				}
+
+				return ioBuffer;
+			}
+
+		internal:
+			/// <summary>
+			/// Writes a length-prefixed value, or an empty value for null pointer, see Write.
+			/// </summary>
+			static void WriteValue(System::IO::BinaryWriter^ writer, MemoryViewStream^ view, const uint8_t* pvalue, array<byte>^% ioBuffer)
+			{
+				uint32_t length = pvalue ? *(uint32_t*)pvalue : 0;
+
+				if (view)
+				{
+					view->Write7BitEncodedInt((int32_t)length);
+					if (length > 0)
+					{
+						view->Write(pvalue + VALUE_PREFIX_BYTES, (int32_t)length);
+					}
+
+					return;
+				}
+
+				auto num = length;
+				while (num >= 0x80)
+				{
+					writer->Write(byte(num | 0x80));
+					num >>= 7;
+				}
+				writer->Write(byte(num));
+
+				if (length > 0)
+				{
+					auto buffer = RequireIoBuffer(ioBuffer, length);
+					pin_ptr<byte> pbuffer = &buffer[0];
+					memcpy(pbuffer, pvalue + VALUE_PREFIX_BYTES, length);
+					writer->Write(buffer, 0, length);
+				}
+			}
+
+		public:
+
+			ExpandableArrayOfValues(IUnmanagedAllocator^ allocator)
+			{
+				Initialize(nullptr, allocator, nullptr);
+			}
+
+			/// <param name="mappedFilePath">Path of a scratch file to keep entries and values in, or null to keep them in the pool.
+			/// File is overwritten, and deleted when this store is disposed.</param>
+			ExpandableArrayOfValues(IUnmanagedAllocator^ allocator, System::String^ mappedFilePath)
+			{
+				Initialize(nullptr, allocator, mappedFilePath);
+			}
+
+			/// <summary>
+			/// Copies live values into a new pool. Space taken by replaced values is not copied.
+			/// </summary>
+			ExpandableArrayOfValues(ExpandableArrayOfValues^ src, IUnmanagedAllocator^ allocator)
+			{
+				Initialize(src, allocator, nullptr);
+			}
+
+			/// <summary>
+			/// Copies live values into a new pool or a new scratch file. Space taken by replaced values is not copied.
+			/// </summary>
+			ExpandableArrayOfValues(ExpandableArrayOfValues^ src, IUnmanagedAllocator^ allocator, System::String^ mappedFilePath)
+			{
+				Initialize(src, allocator, mappedFilePath);
+			}
+
+			~ExpandableArrayOfValues()
+			{
+				Cleanup(true);
+			}
+
+			/// <summary>
+			/// Reads values in the same format as written by BinaryWriter for strings:
+			/// 7-bit encoded byte count, followed by bytes.
+			/// When reader is attached to a MemoryViewStream, values are copied straight from its memory.
+			/// </summary>
+			void Read(System::IO::BinaryReader^ reader, size_t count, BitVector^ validEntries)
+			{
+				EnsureCapacity(count);
+				Read(reader, 0, count, validEntries);
+			}
+
+			/// <summary>
+			/// Reads values of count entries starting at first. Capacity must already cover the range.
+			/// Different ranges can be read concurrently from readers attached to MemoryViewStream,
+			/// other readers share an intermediate buffer and must not be used concurrently.
+			/// </summary>
+			void Read(System::IO::BinaryReader^ reader, size_t first, size_t count, BitVector^ validEntries)
+			{
+				if (reader == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("reader");
+				}
+
+				if (validEntries == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("validEntries");
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Range end is beyond capacity: " + (first + count));
+				}
+
+				auto view = dynamic_cast<MemoryViewStream^>(reader->BaseStream);
+
+				for (size_t ix = first; ix < first + count; ix++)
+				{
+					if (!validEntries->Get(ix))
+					{
+						continue;
+					}
+
+					int32_t length = 0;
+					if (view)
+					{
+						length = view->Read7BitEncodedInt();
+					}
+					else
+					{
+						int32_t shift = 0;
+						uint8_t b;
+						do
+						{
+							if (shift == 35)
+							{
+								throw gcnew System::FormatException("Bad 7-bit encoded length of value at " + ix);
+							}
+
+							b = reader->ReadByte();
+							length |= (b & 0x7F) << shift;
+							shift += 7;
+						} while (b & 0x80);
+					}
+
+					if (length < 0)
+					{
+						throw gcnew System::FormatException("Negative length of value at " + ix);
+					}
+
+					auto pnew = Reserve(VALUE_PREFIX_BYTES + length);
+					*(uint32_t*)pnew = length;
+
+					if (length > 0 && view)
+					{
+						memcpy(pnew + VALUE_PREFIX_BYTES, view->ReadRaw(length), length);
+					}
+					else if (length > 0)
+					{
+						auto buffer = RequireIoBuffer(m_ioBuffer, length);
+						auto read = 0;
+						while (read < length)
+						{
+							auto chunk = reader->Read(buffer, read, length - read);
+							if (chunk <= 0)
+							{
+								throw gcnew System::IO::EndOfStreamException("Unexpected end of stream while reading value at " + ix);
+							}
+
+							read += chunk;
+						}
+
+						pin_ptr<byte> pbuffer = &buffer[0];
+						memcpy(pnew + VALUE_PREFIX_BYTES, pbuffer, length);
+					}
+
+					Publish(ix, pnew);
+				}
+			}
+
+			/// <summary>
+			/// Writes values in the same format as written by BinaryWriter for strings.
+			/// Entries without a value are written as empty values.
+			/// When writer is attached to a MemoryViewStream, values are copied straight into its memory.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t count, BitVector^ validEntries)
+			{
+				Write(writer, 0, count, validEntries);
+			}
+
+			/// <summary>
+			/// Writes values of count entries starting at first, in the same format as the other overload.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count, BitVector^ validEntries)
+			{
+				if (writer == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("writer");
+				}
+
+				if (validEntries == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("validEntries");
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + (first + count));
+				}
+
+				auto view = dynamic_cast<MemoryViewStream^>(writer->BaseStream);
+				if (view)
+				{
+					writer->Flush();
+				}
+
+				for (size_t ix = first; ix < first + count; ix++)
+				{
+					if (!validEntries->Get(ix))
+					{
+						continue;
+					}
+
+					WriteValue(writer, view, GetAt(ix), m_ioBuffer);
+				}
+			}
+
+			/// <summary>
+			/// Takes a frozen image of entries, which is not affected by subsequent writes.
+			/// Values themselves are never modified in place, and heap pages are only released with this store,
+			/// so pinning entry blocks is enough. Same rules as for BitVector::Snapshot apply.
+			/// </summary>
+			ExpandableArrayOfValuesSnapshot^ Snapshot();
+
+			property size_t Capacity {
+				[MethodImpl(MethodImplOptions::AggressiveInlining)]
+				inline size_t get() { return m_capacity; }
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void EnsureCapacity(int32_t capacity)
+			{
+				EnsureCapacity((size_t)capacity);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void EnsureCapacity(size_t capacity)
+			{
+				if (!TryEnsureCapacity(capacity, System::Threading::Timeout::Infinite))
+				{
+					throw gcnew System::InsufficientMemoryException("Failed to ensure capacity for " + capacity);
+				}
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline bool TryEnsureCapacity(size_t capacity)
+			{
+				return TryEnsureCapacity(capacity, 0);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline bool TryEnsureCapacity(size_t capacity, System::Int32 timeout)
+			{
+				if (capacity > 0)
+				{
+					auto pcapacity = interior_ptr<size_t>(&m_capacity);
+					return m_pArray->try_ensure_capacity(capacity, pcapacity);
+				}
+
+				return true;
+			}
+
+			/// <summary>
+			/// Clears entries at and above capacity, and releases storage which is not needed to hold first capacity entries.
+			/// Caller must have exclusive access to this array. Bytes of cleared values stay in the heap as garbage
+			/// until this array is copied, same as with replaced values.
+			/// </summary>
+			inline void TrimTo(size_t capacity)
+			{
+				auto cap = m_pArray->capacity();
+				for (auto x = capacity; x < cap;)
+				{
+					size_t length;
+					auto pspan = m_pArray->writable_span(x, cap - x, length);
+					for (size_t i = 0; i < length; i++)
+					{
+						pspan[i] = nullptr;
+					}
+
+					x += length;
+				}
+
+				auto pcapacity = interior_ptr<size_t>(&m_capacity);
+				m_pArray->trim_to(capacity, pcapacity);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void SetAt(size_t index, const uint8_t* pdata, uint32_t length)
+			{
+				if (length > 0 && pdata == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("pdata");
+				}
+
+				auto pnew = Reserve(VALUE_PREFIX_BYTES + length);
+				*(uint32_t*)pnew = length;
+				if (length > 0)
+				{
+					memcpy(pnew + VALUE_PREFIX_BYTES, pdata, length);
+				}
+
+				Publish(index, pnew);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void SetAt(int32_t index, array<byte>^ data, int32_t length)
+			{
+				if (data == nullptr)
+				{
+					if (length != 0)
+					{
+						throw gcnew System::ArgumentNullException("data");
+					}
+
+					SetAt((size_t)index, (const uint8_t*)nullptr, 0);
+					return;
+				}
+
+				if (length < 0 || length > data->Length)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("length", length, "Length must be within bounds of the data array");
+				}
+
+				if (length == 0)
+				{
+					SetAt((size_t)index, (const uint8_t*)nullptr, 0);
+					return;
+				}
+
+				pin_ptr<byte> pdata = &data[0];
+				SetAt((size_t)index, pdata, (uint32_t)length);
+			}
+
+			/// <summary>
+			/// Encodes a string into UTF-8 directly in the heap.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void SetString(int32_t index, System::String^ value)
+			{
+				if (value == nullptr)
+				{
+					Clear(index);
+					return;
+				}
+
+				auto charcount = value->Length;
+				if (charcount == 0)
+				{
+					SetAt((size_t)index, (const uint8_t*)nullptr, 0);
+					return;
+				}
+
+				auto encoding = System::Text::Encoding::UTF8;
+				pin_ptr<const wchar_t> pchars = PtrToStringChars(value);
+				auto bytecount = encoding->GetByteCount((wchar_t*)pchars, charcount);
+
+				auto pnew = Reserve(VALUE_PREFIX_BYTES + bytecount);
+				*(uint32_t*)pnew = bytecount;
+				encoding->GetBytes((wchar_t*)pchars, charcount, pnew + VALUE_PREFIX_BYTES, bytecount);
+
+				Publish((size_t)index, pnew);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void Clear(int32_t index)
+			{
+				Publish((size_t)index, nullptr);
+			}
+
+			/// <summary>
+			/// Returns pointer to length-prefixed value, or null if there is no value at this index.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline dataarray_t::value_type GetAt(size_t index)
+			{
+				if (index >= Capacity)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("index", index, "Index must be less than allocated capacity");
+				}
+
+				return *(m_pArray->reference(index));
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline bool HasValue(int32_t index)
+			{
+				return GetAt((size_t)index) != nullptr;
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t GetLength(int32_t index)
+			{
+				auto pvalue = GetAt((size_t)index);
+				return pvalue ? *(int32_t*)pvalue : 0;
+			}
+
+			/// <summary>
+			/// Decodes UTF-8 value into a new string, or returns null if there is no value at this index.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline System::String^ GetString(int32_t index)
+			{
+				auto pvalue = GetAt((size_t)index);
+				if (!pvalue)
+				{
+					return nullptr;
+				}
+
+				auto length = *(int32_t*)pvalue;
+				return length == 0
+					? System::String::Empty
+					: System::Text::Encoding::UTF8->GetString(pvalue + VALUE_PREFIX_BYTES, length);
+			}
+
+			/// <summary>
+			/// Copies value bytes into a buffer.
+			/// </summary>
+			/// <returns>Length of the value</returns>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t CopyTo(int32_t index, array<byte>^ data, int32_t offset)
+			{
+				auto pvalue = GetAt((size_t)index);
+				auto length = pvalue ? *(int32_t*)pvalue : 0;
+				if (length == 0)
+				{
+					return 0;
+				}
+
+				if (data == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("data");
+				}
+
+				if (offset < 0 || length > data->Length - offset)
+				{
+					throw gcnew System::ArgumentException("Buffer is too small, must have: " + length, "data");
+				}
+
+				pin_ptr<byte> pdata = &data[offset];
+				memcpy(pdata, pvalue + VALUE_PREFIX_BYTES, length);
+				return length;
+			}
+
+			/// <summary>
+			/// Copies value bytes into unmanaged memory.
+			/// </summary>
+			/// <returns>Length of the value, or -1 if it is longer than maxLength and nothing was copied</returns>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t CopyTo(int32_t index, System::IntPtr dest, int32_t maxLength)
+			{
+				auto pvalue = GetAt((size_t)index);
+				auto length = pvalue ? *(int32_t*)pvalue : 0;
+				if (length > maxLength)
+				{
+					return -1;
+				}
+
+				if (length > 0)
+				{
+					memcpy(dest.ToPointer(), pvalue + VALUE_PREFIX_BYTES, length);
+				}
+
+				return length;
+			}
+
+			/// <summary>
+			/// Returns pointer to value bytes, or zero if there is no value at this index.
+			/// Pointer stays valid for the lifetime of this store.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline System::IntPtr GetIntPtrAt(int32_t index)
+			{
+				auto pvalue = GetAt((size_t)index);
+				return pvalue ? System::IntPtr(pvalue + VALUE_PREFIX_BYTES) : System::IntPtr::Zero;
+			}
+
+			property bool IsMapped {
+				[MethodImpl(MethodImplOptions::AggressiveInlining)]
+				inline bool get() { return m_pMapped != nullptr; }
+			}
+
+			/// <summary>
+			/// For file-backed stores, hints the OS to read ahead pages holding entries and beginnings of values in given range.
+			/// Sequential scans call this ahead of their position, so that page faults are replaced with larger read-ahead requests.
+			/// </summary>
+			void Prefetch(int32_t first, int32_t count)
+			{
+				if (!m_pMapped || first < 0 || count <= 0 || (size_t)first >= Capacity)
+				{
+					return;
+				}
+
+				size_t begin = first;
+				size_t end = begin + count < Capacity ? begin + count : Capacity;
+				m_pArray->advise_will_need(begin, end - begin);
+
+				// only pages holding value starts are known without touching values, longer values fault as usual
+				Win32MemoryRangeEntry entries[16];
+				size_t nEntries = 0;
+				uint8_t* lastPage = nullptr;
+				for (auto ix = begin; ix < end; ix++)
+				{
+					auto pvalue = GetAt(ix);
+					auto page = (uint8_t*)((size_t)pvalue & ~size_t(4095));
+					if (!pvalue || page == lastPage)
+					{
+						continue;
+					}
+
+					entries[nEntries].VirtualAddress = page;
+					entries[nEntries].NumberOfBytes = 4096;
+					nEntries++;
+					lastPage = page;
+
+					if (nEntries == 16)
+					{
+						MappedFileSpace::advise_will_need(entries, nEntries);
+						nEntries = 0;
+					}
+				}
+
+				MappedFileSpace::advise_will_need(entries, nEntries);
+			}
+		};
+
+		/// <summary>
+		/// Read-only frozen image of entries of an ExpandableArrayOfValues, see ExpandableArrayOfValues::Snapshot.
+		/// </summary>
+		public ref class ExpandableArrayOfValuesSnapshot
+		{
+			typedef ExpandableArrayImpl<uint8_t*, ITEMS_PER_BLOCK> dataarray_t;
+
+			dataarray_t::snapshot_t* m_pSnapshot;
+			size_t m_capacity;
+			array<byte>^ m_ioBuffer;
+
+			/// <summary>
+			/// Decodes next UTF-16 code unit of a UTF-8 value, the same way as Encoding.UTF8 does for well-formed input.
+			/// Code points above the basic plane produce a surrogate pair, low surrogate is kept in pending for the next call.
+			/// Malformed sequences decode as replacement characters.
+			/// </summary>
+			static wchar_t NextUtf16(const uint8_t*& p, const uint8_t* pend, wchar_t& pending)
+			{
+				if (pending)
+				{
+					auto result = pending;
+					pending = 0;
+					return result;
+				}
+
+				uint32_t lead = *p++;
+				if (lead < 0x80)
+				{
+					return (wchar_t)lead;
+				}
+
+				int extra;
+				uint32_t codePoint;
+				if ((lead & 0xE0) == 0xC0)
+				{
+					extra = 1;
+					codePoint = lead & 0x1F;
+				}
+				else if ((lead & 0xF0) == 0xE0)
+				{
+					extra = 2;
+					codePoint = lead & 0x0F;
+				}
+				else if ((lead & 0xF8) == 0xF0)
+				{
+					extra = 3;
+					codePoint = lead & 0x07;
+				}
+				else
+				{
+					return 0xFFFD;
+				}
+
+				for (; extra > 0; extra--)
+				{
+					if (p == pend || (*p & 0xC0) != 0x80)
+					{
+						return 0xFFFD;
+					}
+
+					codePoint = (codePoint << 6) | (*p++ & 0x3F);
+				}
+
+				if (codePoint >= 0x10000)
+				{
+					codePoint -= 0x10000;
+					pending = (wchar_t)(0xDC00 | (codePoint & 0x3FF));
+					return (wchar_t)(0xD800 | (codePoint >> 10));
+				}
+
+				return (wchar_t)codePoint;
+			}
+
+			!ExpandableArrayOfValuesSnapshot()
+			{
+				// owner and its pool must still be alive, so only release on explicit dispose
+				m_pSnapshot = nullptr;
+				m_capacity = 0;
+			}
+
+		internal:
+			ExpandableArrayOfValuesSnapshot(dataarray_t::snapshot_t* pSnapshot, size_t capacity)
+				: m_pSnapshot(pSnapshot), m_capacity(capacity)
+			{
+			}
+
+		public:
+			~ExpandableArrayOfValuesSnapshot()
+			{
+				System::GC::SuppressFinalize(this);
+
+				auto pSnapshot = m_pSnapshot;
+				m_pSnapshot = nullptr;
+				m_capacity = 0;
+
+				if (pSnapshot)
+				{
+					pSnapshot->owner()->release_snapshot(pSnapshot);
+				}
+			}
+
+			property size_t Capacity {
+				[MethodImpl(MethodImplOptions::AggressiveInlining)]
+				inline size_t get() { return m_capacity; }
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t GetLength(int32_t index)
+			{
+				auto pvalue = m_pSnapshot->get((size_t)index);
+				return pvalue ? *(int32_t*)pvalue : 0;
+			}
+
+			/// <summary>
+			/// Copies value bytes into unmanaged memory, same as ExpandableArrayOfValues::CopyTo.
+			/// </summary>
+			/// <returns>Length of the value, or -1 if it is longer than maxLength and nothing was copied</returns>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t CopyTo(int32_t index, System::IntPtr dest, int32_t maxLength)
+			{
+				auto pvalue = m_pSnapshot->get((size_t)index);
+				auto length = pvalue ? *(int32_t*)pvalue : 0;
+				if (length > maxLength)
+				{
+					return -1;
+				}
+
+				if (length > 0)
+				{
+					memcpy(dest.ToPointer(), pvalue + VALUE_PREFIX_BYTES, length);
+				}
+
+				return length;
+			}
+
+			/// <summary>
+			/// Compares values of two entries as byte strings, same as SizableArrayOfByte.DefaultComparer.
+			/// Entries without values compare as empty ones.
+			/// </summary>
+			int32_t CompareBytes(int32_t x, int32_t y)
+			{
+				auto px = m_pSnapshot->get((size_t)x);
+				auto py = m_pSnapshot->get((size_t)y);
+				auto xlength = px ? *(uint32_t*)px : 0;
+				auto ylength = py ? *(uint32_t*)py : 0;
+
+				auto common = xlength < ylength ? xlength : ylength;
+				auto result = common == 0 ? 0 : memcmp(px + VALUE_PREFIX_BYTES, py + VALUE_PREFIX_BYTES, common);
+				if (result != 0)
+				{
+					return result < 0 ? -1 : 1;
+				}
+
+				return xlength < ylength ? -1 : (xlength > ylength ? 1 : 0);
+			}
+
+			/// <summary>
+			/// Compares values of two entries as UTF-8 strings, same as StringComparer.OrdinalIgnoreCase compares decoded strings:
+			/// UTF-16 code units are compared after upper-casing each of them with invariant culture, then lengths are compared.
+			/// Entries without values compare as empty ones.
+			/// </summary>
+			int32_t CompareStringsIgnoreCase(int32_t x, int32_t y)
+			{
+				auto px = m_pSnapshot->get((size_t)x);
+				auto py = m_pSnapshot->get((size_t)y);
+				const uint8_t* pxend = px ? px + VALUE_PREFIX_BYTES + *(uint32_t*)px : nullptr;
+				const uint8_t* pyend = py ? py + VALUE_PREFIX_BYTES + *(uint32_t*)py : nullptr;
+				const uint8_t* pxnext = px ? px + VALUE_PREFIX_BYTES : nullptr;
+				const uint8_t* pynext = py ? py + VALUE_PREFIX_BYTES : nullptr;
+				wchar_t xpending = 0;
+				wchar_t ypending = 0;
+
+				while ((xpending || pxnext < pxend) && (ypending || pynext < pyend))
+				{
+					auto cx = NextUtf16(pxnext, pxend, xpending);
+					auto cy = NextUtf16(pynext, pyend, ypending);
+					if (cx != cy)
+					{
+						cx = System::Char::ToUpperInvariant(cx);
+						cy = System::Char::ToUpperInvariant(cy);
+						if (cx != cy)
+						{
+							return cx < cy ? -1 : 1;
+						}
+					}
+				}
+
+				auto xrest = xpending || pxnext < pxend;
+				auto yrest = ypending || pynext < pyend;
+				return xrest == yrest ? 0 : (xrest ? 1 : -1);
+			}
+
+			/// <summary>
+			/// Writes values of count entries starting at first, in the same format as ExpandableArrayOfValues::Write.
+			/// </summary>
+			void Write(System::IO::BinaryWriter^ writer, size_t first, size_t count, BitVectorSnapshot^ validEntries)
+			{
+				if (writer == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("writer");
+				}
+
+				if (validEntries == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("validEntries");
+				}
+
+				if (first + count > Capacity)
+				{
+					throw gcnew System::InvalidOperationException("Count to write is larger than capacity: " + (first + count));
+				}
+
+				auto view = dynamic_cast<MemoryViewStream^>(writer->BaseStream);
+				if (view)
+				{
+					writer->Flush();
+				}
+
+				for (size_t ix = first; ix < first + count; ix++)
+				{
+					if (!validEntries->Get(ix))
+					{
+						continue;
+					}
+
+					ExpandableArrayOfValues::WriteValue(writer, view, m_pSnapshot->get(ix), m_ioBuffer);
+				}
+			}
+		};
+
+		inline ExpandableArrayOfValuesSnapshot^ ExpandableArrayOfValues::Snapshot()
+		{
+			// capacity is only published after blocks are allocated, so it never exceeds snapshot capacity
+			auto capacity = m_capacity;
+			return gcnew ExpandableArrayOfValuesSnapshot(m_pArray->take_snapshot(), capacity);
+		}
+	}
+}
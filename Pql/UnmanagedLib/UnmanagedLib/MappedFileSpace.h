@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <vcclr.h>
+#include "Win32Imports.h"
+
+namespace Pql {
+	namespace UnmanagedLib {
+
+#define MAPPED_REGION_GRANULARITY 65536
+
+		/// <summary>
+		/// Hands out zero-filled memory regions backed by a scratch file instead of RAM.
+		/// Every region is a separate view appended at the end of the file, so that the OS can write cold pages
+		/// back to the file and fault them in again on demand, without involving the page file.
+		/// Space of released regions is not reused, file is deleted when this object is destroyed.
+		/// </summary>
+		class MappedFileSpace
+		{
+			void* m_hFile;
+			uint64_t volatile m_fileSize;
+
+			static inline bool volatile& prefetch_unavailable()
+			{
+				static bool volatile value = false;
+				return value;
+			}
+
+		public:
+			MappedFileSpace(System::String^ path)
+				: m_hFile(nullptr), m_fileSize(0)
+			{
+				if (System::String::IsNullOrEmpty(path))
+				{
+					throw gcnew System::ArgumentNullException("path");
+				}
+
+				pin_ptr<const wchar_t> ppath = PtrToStringChars(path);
+
+				// GENERIC_READ | GENERIC_WRITE, no sharing, CREATE_ALWAYS
+				// FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED
+				auto hFile = CreateFileW(ppath, 0x80000000 | 0x40000000, 0, nullptr, 2, 0x04000000 | 0x08000000 | 0x00002000, nullptr);
+				if (hFile == (void*)-1)
+				{
+					throw gcnew System::IO::IOException(
+						"Failed to create mapped column file " + path + ", error " + System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+				}
+
+				m_hFile = hFile;
+			}
+
+			~MappedFileSpace()
+			{
+				if (m_hFile)
+				{
+					// views which are still mapped keep the file alive until they are unmapped
+					CloseHandle(m_hFile);
+					m_hFile = nullptr;
+				}
+			}
+
+			/// <summary>
+			/// Size of a region that will be mapped for a request of given size.
+			/// </summary>
+			static inline size_t region_size(size_t nBytes)
+			{
+				return (nBytes + MAPPED_REGION_GRANULARITY - 1) & ~size_t(MAPPED_REGION_GRANULARITY - 1);
+			}
+
+			/// <summary>
+			/// Maps a new zero-filled region of at least nBytes at the end of the file.
+			/// Returns null if file cannot be extended or mapped.
+			/// </summary>
+			inline void* map(size_t nBytes)
+			{
+				auto size = region_size(nBytes);
+
+				uint64_t offset;
+				do
+				{
+					offset = m_fileSize;
+				} while (offset != UnmanagedLib_InterlockedCompareExchange64(&m_fileSize, offset + size, offset));
+
+				// mapping object larger than the file extends it with zeros
+				auto end = offset + size;
+				auto hMapping = CreateFileMappingW(m_hFile, nullptr, 0x04 /* PAGE_READWRITE */, (uint32_t)(end >> 32), (uint32_t)end, nullptr);
+				if (!hMapping)
+				{
+					return nullptr;
+				}
+
+				// view keeps mapping object alive after its handle is closed
+				auto p = MapViewOfFile(hMapping, 0x0002 /* FILE_MAP_WRITE */, (uint32_t)(offset >> 32), (uint32_t)offset, size);
+				CloseHandle(hMapping);
+				return p;
+			}
+
+			inline void unmap(void* p)
+			{
+				UnmapViewOfFile(p);
+			}
+
+			/// <summary>
+			/// Hints the OS that given ranges are about to be read, so that their pages are read ahead
+			/// in large sequential requests instead of one fault at a time.
+			/// Does nothing on systems without PrefetchVirtualMemory.
+			/// </summary>
+			static void advise_will_need(Win32MemoryRangeEntry* pEntries, size_t nEntries)
+			{
+				if (nEntries == 0 || prefetch_unavailable())
+				{
+					return;
+				}
+
+				try
+				{
+					PrefetchVirtualMemory(GetCurrentProcess(), nEntries, pEntries, 0);
+				}
+				catch (System::EntryPointNotFoundException^)
+				{
+					prefetch_unavailable() = true;
+				}
+			}
+		};
+	}
+}
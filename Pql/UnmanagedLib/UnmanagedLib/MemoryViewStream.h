@@ -1,17 +1,56 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <xstddef>
+#include <vcclr.h>
+#include "Win32Imports.h"
+#include "MappedFileSpace.h"
+#include "Crc32C.h"
 
 namespace Pql {
 	namespace UnmanagedLib {
 
+		using namespace System::Runtime::CompilerServices;
+
+		/// <summary>
+		/// Stream over a block of native memory. Copies are done with memcpy, and typed readers and writers
+		/// work straight on the attached memory, so callers which know they deal with this stream
+		/// can skip intermediate managed buffers and BinaryReader/BinaryWriter overhead.
+		/// Can also own a read-only view of a memory-mapped file, see OpenMappedFile.
+		/// </summary>
 		public ref class MemoryViewStream : System::IO::Stream
 		{
 			bool m_disposed;
+			bool m_readOnly;
 			int64_t m_bytesInBuffer;
 			int64_t m_positionInBuffer;
 			byte* m_buffer;
+			void* m_pMappedView;
+
+			void ReleaseMappedView()
+			{
+				auto pView = m_pMappedView;
+				m_pMappedView = nullptr;
+				if (pView)
+				{
+					UnmapViewOfFile(pView);
+				}
+			}
+
+			void Cleanup()
+			{
+				m_disposed = true;
+				m_buffer = nullptr;
+				m_positionInBuffer = 0;
+				m_bytesInBuffer = 0;
+				ReleaseMappedView();
+			}
+
+			!MemoryViewStream()
+			{
+				Cleanup();
+			}
 
 			inline void CheckDisposed()
 			{
@@ -21,6 +60,52 @@ namespace Pql {
 				}
 			}
 
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void CheckAvailable(int64_t count)
+			{
+				if (count > m_bytesInBuffer - m_positionInBuffer)
+				{
+					throw gcnew System::IO::EndOfStreamException("Unable to read beyond the end of the stream");
+				}
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void CheckSpace(int64_t count)
+			{
+				if (m_readOnly)
+				{
+					throw gcnew System::NotSupportedException("Stream is read-only");
+				}
+
+				if (count > m_bytesInBuffer - m_positionInBuffer)
+				{
+					throw gcnew System::IO::IOException("Insufficient space to write this number of bytes: " + count);
+				}
+			}
+
+			static void CheckArguments(array<byte>^ buffer, int32_t offset, int32_t count)
+			{
+				if (buffer == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("buffer");
+				}
+
+				if (count < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
+				}
+
+				if (offset < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("offset", "offset is negative");
+				}
+
+				if (offset + count > buffer->Length)
+				{
+					throw gcnew System::ArgumentException("The sum of offset and count is larger than the buffer length.");
+				}
+			}
+
 		public:
 
 			MemoryViewStream(void)
@@ -34,17 +119,105 @@ namespace Pql {
 					throw gcnew System::ArgumentNullException("p");
 				}
 
+				ReleaseMappedView();
+
 				m_buffer = p;
 				m_bytesInBuffer = len;
 				m_positionInBuffer = 0;
+				m_readOnly = false;
+			}
+
+			void Attach(System::IntPtr p, int64_t len)
+			{
+				if (len < 0)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("len", "len is negative");
+				}
+
+				Attach((byte*)p.ToPointer(), (size_t)len);
+			}
+
+			/// <summary>
+			/// Maps entire file into memory for reading and returns a read-only stream over it, which owns the view.
+			/// Pages are read ahead sequentially and faulted in by the OS on access, no data goes through managed buffers.
+			/// Throws IOException when file cannot be opened or mapped, e.g. when address space is insufficient.
+			/// </summary>
+			static MemoryViewStream^ OpenMappedFile(System::String^ path)
+			{
+				if (System::String::IsNullOrEmpty(path))
+				{
+					throw gcnew System::ArgumentNullException("path");
+				}
+
+				pin_ptr<const wchar_t> ppath = PtrToStringChars(path);
+
+				// GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN
+				auto hFile = CreateFileW(ppath, 0x80000000, 0x00000001, nullptr, 3, 0x08000000, nullptr);
+				if (hFile == (void*)-1)
+				{
+					throw gcnew System::IO::IOException(
+						"Failed to open file " + path + ", error " + System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+				}
+
+				auto result = gcnew MemoryViewStream();
+				result->m_readOnly = true;
+
+				try
+				{
+					int64_t size = 0;
+					if (!GetFileSizeEx(hFile, &size))
+					{
+						throw gcnew System::IO::IOException(
+							"Failed to get size of file " + path + ", error " + System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+					}
+
+					if ((uint64_t)size > (uint64_t)SIZE_MAX)
+					{
+						throw gcnew System::IO::IOException("File " + path + " is too large to be mapped into address space");
+					}
+
+					// empty files cannot be mapped
+					if (size > 0)
+					{
+						auto hMapping = CreateFileMappingW(hFile, nullptr, 0x02 /* PAGE_READONLY */, 0, 0, nullptr);
+						if (!hMapping)
+						{
+							throw gcnew System::IO::IOException(
+								"Failed to map file " + path + ", error " + System::Runtime::InteropServices::Marshal::GetLastWin32Error());
+						}
+
+						// view keeps mapping object alive after its handle is closed
+						auto pView = MapViewOfFile(hMapping, 0x0004 /* FILE_MAP_READ */, 0, 0, 0);
+						auto error = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+						CloseHandle(hMapping);
+
+						if (!pView)
+						{
+							throw gcnew System::IO::IOException("Failed to map view of file " + path + ", error " + error);
+						}
+
+						result->m_pMappedView = pView;
+						result->m_buffer = (byte*)pView;
+						result->m_bytesInBuffer = size;
+
+						Win32MemoryRangeEntry entry;
+						entry.VirtualAddress = pView;
+						entry.NumberOfBytes = (size_t)size;
+						MappedFileSpace::advise_will_need(&entry, 1);
+					}
+				}
+				finally
+				{
+					CloseHandle(hFile);
+				}
+
+				return result;
 			}
 
 			~MemoryViewStream() override
 			{
-				m_disposed = true;
-				m_buffer = nullptr;
-				m_positionInBuffer = 0;
-				m_bytesInBuffer = 0;
+				this->!MemoryViewStream();
+				System::GC::SuppressFinalize(this);
 			}
 
 			virtual void Flush() override
@@ -95,77 +268,329 @@ namespace Pql {
 			virtual int32_t Read(array<byte>^ buffer, int32_t offset, int32_t count) override
 			{
 				CheckDisposed();
+				CheckArguments(buffer, offset, count);
 
-				if (buffer == nullptr)
-				{
-					throw gcnew System::ArgumentNullException("buffer");
-				}
+				int32_t bytesRead = (int32_t)(min(count, m_bytesInBuffer - m_positionInBuffer));
 
-				if (count < 0)
+				if (bytesRead > 0)
 				{
-					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
+					pin_ptr<byte> pbuffer = &buffer[offset];
+					memcpy(pbuffer, m_buffer + m_positionInBuffer, bytesRead);
+					m_positionInBuffer += bytesRead;
 				}
 
-				if (offset < 0)
-				{
-					throw gcnew System::ArgumentOutOfRangeException("offset", "offset is negative");
-				}
+				return bytesRead;
+			}
 
-				if (offset + count > buffer->Length)
+			/// <summary>
+			/// Copies up to count bytes into native memory. Returns number of bytes copied.
+			/// </summary>
+			int32_t Read(byte* dest, int32_t count)
+			{
+				CheckDisposed();
+
+				if (count < 0)
 				{
-					throw gcnew System::ArgumentException("The sum of offset and count is larger than the buffer length.");
+					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
 				}
 
 				int32_t bytesRead = (int32_t)(min(count, m_bytesInBuffer - m_positionInBuffer));
 
 				if (bytesRead > 0)
 				{
-					for (auto head = m_buffer + m_positionInBuffer; head != (m_buffer + m_positionInBuffer + bytesRead); head++, offset++)
+					if (dest == nullptr)
 					{
-						buffer[offset] = *head;
+						throw gcnew System::ArgumentNullException("dest");
 					}
 
+					memcpy(dest, m_buffer + m_positionInBuffer, bytesRead);
 					m_positionInBuffer += bytesRead;
 				}
 
 				return bytesRead;
 			}
 
+			int32_t Read(System::IntPtr dest, int32_t count)
+			{
+				return Read((byte*)dest.ToPointer(), count);
+			}
+
 			virtual void Write(array<byte>^ buffer, int32_t offset, int32_t count) override
 			{
 				CheckDisposed();
+				CheckArguments(buffer, offset, count);
+				CheckSpace(count);
 
-				if (buffer == nullptr)
+				if (count > 0)
 				{
-					throw gcnew System::ArgumentNullException("buffer");
+					pin_ptr<byte> pbuffer = &buffer[offset];
+					memcpy(m_buffer + m_positionInBuffer, pbuffer, count);
+					m_positionInBuffer += count;
 				}
+			}
+
+			/// <summary>
+			/// Copies count bytes from native memory.
+			/// </summary>
+			void Write(const byte* src, int32_t count)
+			{
+				CheckDisposed();
 
 				if (count < 0)
 				{
 					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
 				}
 
-				if (offset < 0)
+				CheckSpace(count);
+
+				if (count > 0)
 				{
-					throw gcnew System::ArgumentOutOfRangeException("offset", "offset is negative");
+					if (src == nullptr)
+					{
+						throw gcnew System::ArgumentNullException("src");
+					}
+
+					memcpy(m_buffer + m_positionInBuffer, src, count);
+					m_positionInBuffer += count;
 				}
+			}
 
-				if (offset + count > buffer->Length)
+			void Write(System::IntPtr src, int32_t count)
+			{
+				Write((const byte*)src.ToPointer(), count);
+			}
+
+			/// <summary>
+			/// Overridden because base implementation allocates a temporary array for every byte.
+			/// </summary>
+			virtual int32_t ReadByte() override
+			{
+				CheckDisposed();
+
+				if (m_positionInBuffer >= m_bytesInBuffer)
 				{
-					throw gcnew System::ArgumentException("The sum of offset and count is larger than the buffer length.");
+					return -1;
 				}
 
-				if (count > m_bytesInBuffer - m_positionInBuffer)
+				return m_buffer[m_positionInBuffer++];
+			}
+
+			virtual void WriteByte(byte value) override
+			{
+				CheckDisposed();
+				CheckSpace(1);
+
+				m_buffer[m_positionInBuffer++] = value;
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t ReadInt32()
+			{
+				CheckDisposed();
+				CheckAvailable(sizeof(int32_t));
+
+				int32_t value;
+				memcpy(&value, m_buffer + m_positionInBuffer, sizeof(int32_t));
+				m_positionInBuffer += sizeof(int32_t);
+				return value;
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int64_t ReadInt64()
+			{
+				CheckDisposed();
+				CheckAvailable(sizeof(int64_t));
+
+				int64_t value;
+				memcpy(&value, m_buffer + m_positionInBuffer, sizeof(int64_t));
+				m_positionInBuffer += sizeof(int64_t);
+				return value;
+			}
+
+			/// <summary>
+			/// Reads an integer in the format written by BinaryWriter for string lengths.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline int32_t Read7BitEncodedInt()
+			{
+				CheckDisposed();
+
+				int32_t value = 0;
+				int32_t shift = 0;
+				byte b;
+				do
 				{
-					throw gcnew System::IO::IOException("Insufficient space to write this number of bytes: " + count);
+					if (shift == 35)
+					{
+						throw gcnew System::FormatException("Bad 7-bit encoded integer");
+					}
+
+					CheckAvailable(1);
+					b = m_buffer[m_positionInBuffer++];
+					value |= (b & 0x7F) << shift;
+					shift += 7;
+				} while (b & 0x80);
+
+				return value;
+			}
+
+			/// <summary>
+			/// Reads a string in the format written by BinaryWriter, decoding UTF-8 straight from attached memory.
+			/// </summary>
+			System::String^ ReadString()
+			{
+				auto length = Read7BitEncodedInt();
+				if (length < 0)
+				{
+					throw gcnew System::FormatException("Negative string length");
+				}
+
+				if (length == 0)
+				{
+					return System::String::Empty;
+				}
+
+				auto p = ReadRaw(length);
+				return gcnew System::String((signed char*)p, 0, length, System::Text::Encoding::UTF8);
+			}
+
+			/// <summary>
+			/// Copies count elements into an array of a primitive type, starting at given element index.
+			/// Elements are taken in their in-memory representation, which for primitive numeric types
+			/// is the same as written by BinaryWriter. Throws EndOfStreamException if not enough data.
+			/// </summary>
+			void ReadArray(System::Array^ dest, int32_t index, int32_t count)
+			{
+				CheckDisposed();
+
+				if (dest == nullptr)
+				{
+					throw gcnew System::ArgumentNullException("dest");
+				}
+
+				if (index < 0 || count < 0 || index + count > dest->Length)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "index and count must denote a range within the array");
+				}
+
+				if (count == 0)
+				{
+					return;
+				}
+
+				// throws for arrays of non-primitive types
+				auto elementSize = System::Buffer::ByteLength(dest) / dest->Length;
+				auto nbytes = (int64_t)elementSize * count;
+				CheckAvailable(nbytes);
+
+				auto handle = System::Runtime::InteropServices::GCHandle::Alloc(dest, System::Runtime::InteropServices::GCHandleType::Pinned);
+				try
+				{
+					auto pdest = (byte*)handle.AddrOfPinnedObject().ToPointer() + (int64_t)elementSize * index;
+					memcpy(pdest, m_buffer + m_positionInBuffer, (size_t)nbytes);
+					m_positionInBuffer += nbytes;
+				}
+				finally
+				{
+					handle.Free();
 				}
+			}
+
+			/// <summary>
+			/// Returns pointer to next count bytes of attached memory and advances position past them, without copying.
+			/// Pointer stays valid as long as attached memory does.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline byte* ReadRaw(int64_t count)
+			{
+				CheckDisposed();
 
-				for (auto p = m_buffer + m_positionInBuffer; p < m_buffer + m_positionInBuffer + count; p++, offset++)
+				if (count < 0)
 				{
-					*p = buffer[offset];
+					throw gcnew System::ArgumentOutOfRangeException("count", "count is negative");
 				}
 
+				CheckAvailable(count);
+
+				auto p = m_buffer + m_positionInBuffer;
 				m_positionInBuffer += count;
+				return p;
+			}
+
+			/// <summary>
+			/// Returns a read-only stream over a range of attached memory, without copying.
+			/// New stream does not own the memory, so this stream (or whoever owns attached memory) must outlive it.
+			/// Slices of one stream can be read concurrently, since every slice has its own position.
+			/// </summary>
+			MemoryViewStream^ Slice(int64_t offset, int64_t count)
+			{
+				CheckDisposed();
+
+				if (offset < 0 || count < 0 || offset > m_bytesInBuffer || count > m_bytesInBuffer - offset)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "offset and count must denote a range within the stream");
+				}
+
+				auto result = gcnew MemoryViewStream();
+				result->m_buffer = m_buffer + offset;
+				result->m_bytesInBuffer = count;
+				result->m_readOnly = true;
+				return result;
+			}
+
+			/// <summary>
+			/// Computes CRC-32C of a range of attached memory. Does not change position.
+			/// </summary>
+			uint32_t ComputeCrc32C(int64_t offset, int64_t count)
+			{
+				CheckDisposed();
+
+				if (offset < 0 || count < 0 || offset > m_bytesInBuffer || count > m_bytesInBuffer - offset)
+				{
+					throw gcnew System::ArgumentOutOfRangeException("count", "offset and count must denote a range within the stream");
+				}
+
+				return Crc32C::Compute(0, m_buffer + offset, (size_t)count);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void WriteInt32(int32_t value)
+			{
+				CheckDisposed();
+				CheckSpace(sizeof(int32_t));
+
+				memcpy(m_buffer + m_positionInBuffer, &value, sizeof(int32_t));
+				m_positionInBuffer += sizeof(int32_t);
+			}
+
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void WriteInt64(int64_t value)
+			{
+				CheckDisposed();
+				CheckSpace(sizeof(int64_t));
+
+				memcpy(m_buffer + m_positionInBuffer, &value, sizeof(int64_t));
+				m_positionInBuffer += sizeof(int64_t);
+			}
+
+			/// <summary>
+			/// Writes an integer in the format used by BinaryWriter for string lengths.
+			/// </summary>
+			[MethodImpl(MethodImplOptions::AggressiveInlining)]
+			inline void Write7BitEncodedInt(int32_t value)
+			{
+				CheckDisposed();
+
+				auto num = (uint32_t)value;
+				while (num >= 0x80)
+				{
+					CheckSpace(1);
+					m_buffer[m_positionInBuffer++] = (byte)(num | 0x80);
+					num >>= 7;
+				}
+
+				CheckSpace(1);
+				m_buffer[m_positionInBuffer++] = (byte)num;
 			}
 
 			/// <summary>
@@ -201,7 +626,7 @@ namespace Pql {
 			/// <filterpriority>1</filterpriority>
 			property virtual bool CanWrite
 			{
-				bool get() override { return true; }
+				bool get() override { return !m_readOnly; }
 			}
 
 			/// <summary>
@@ -12,9 +12,15 @@
 #include "BitVector.h"
 #include "MemoryViewStream.h"
 #include "ConcurrentHashmapOfKeys.h"
-//#include "ExpandableArrayOfValues.h"
+#include "ExpandableArrayOfValues.h"
+#include "MappedFileSpace.h"
+#include "Crc32C.h"
+#include "AsyncFileWriter.h"
 #include "Win32imports.h"
 
+#include <intrin.h>
+#include <nmmintrin.h>
+
 #pragma unmanaged
 
 namespace Pql {
@@ -40,5 +46,82 @@ namespace Pql {
 		{
 			return _InterlockedCompareExchangePointer(pTarget, value, comparand);
 		}
+
+		static uint32_t Crc32CTable[256];
+		static volatile int32_t Crc32CMode = 0; // 0 - not initialized, 1 - SSE 4.2, 2 - lookup table
+
+		static void Crc32CInitialize()
+		{
+			int32_t cpuInfo[4];
+			__cpuid(cpuInfo, 1);
+
+			// ECX bit 20 is SSE 4.2
+			if (cpuInfo[2] & (1 << 20))
+			{
+				Crc32CMode = 1;
+				return;
+			}
+
+			// reflected Castagnoli polynomial
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				auto crc = i;
+				for (auto bit = 0; bit < 8; bit++)
+				{
+					crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+				}
+
+				Crc32CTable[i] = crc;
+			}
+
+			// concurrent initializers produce the same table
+			Crc32CMode = 2;
+		}
+
+		extern "C" uint32_t __fastcall UnmanagedLib_Crc32C(uint32_t crc, const uint8_t* p, size_t count)
+		{
+			if (!Crc32CMode)
+			{
+				Crc32CInitialize();
+			}
+
+			crc = ~crc;
+
+			if (Crc32CMode == 1)
+			{
+				for (; count > 0 && ((size_t)p & 7); count--)
+				{
+					crc = _mm_crc32_u8(crc, *p++);
+				}
+
+#ifdef _M_X64
+				uint64_t crc64 = crc;
+				for (; count >= 8; count -= 8, p += 8)
+				{
+					crc64 = _mm_crc32_u64(crc64, *(const uint64_t*)p);
+				}
+
+				crc = (uint32_t)crc64;
+#endif
+				for (; count >= 4; count -= 4, p += 4)
+				{
+					crc = _mm_crc32_u32(crc, *(const uint32_t*)p);
+				}
+
+				for (; count > 0; count--)
+				{
+					crc = _mm_crc32_u8(crc, *p++);
+				}
+			}
+			else
+			{
+				for (; count > 0; count--)
+				{
+					crc = Crc32CTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+				}
+			}
+
+			return ~crc;
+		}
 	}
 }
\ No newline at end of file
@@ -9,6 +9,7 @@ namespace Pql {
 		extern "C" uint32_t __fastcall UnmanagedLib_InterlockedCompareExchange32(volatile uint32_t*, uint32_t, uint32_t);
 		extern "C" uint64_t __fastcall UnmanagedLib_InterlockedCompareExchange64(volatile uint64_t*, uint64_t, uint64_t);
 		extern "C" void* __fastcall UnmanagedLib_InterlockedCompareExchangePointer(void*volatile*, void*, void*);
+		extern "C" uint32_t __fastcall UnmanagedLib_Crc32C(uint32_t crc, const uint8_t* p, size_t count);
 
 		[System::Runtime::InteropServices::DllImport("kernel32")]
 		extern "C" uint32_t __stdcall HeapFree(void* hHeap, uint32_t flags, void* pMem);
@@ -18,5 +19,56 @@ namespace Pql {
 		extern "C" void* __stdcall HeapCreate(uint32_t flags, uint64_t initialBytes, uint64_t maxBytes);
 		[System::Runtime::InteropServices::DllImport("kernel32")]
 		extern "C" uint32_t  __stdcall HeapDestroy(void* hHeap);
+
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true, CharSet = System::Runtime::InteropServices::CharSet::Unicode)]
+		extern "C" void* __stdcall CreateFileW(const wchar_t* path, uint32_t access, uint32_t shareMode, void* security, uint32_t disposition, uint32_t flags, void* hTemplate);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall GetFileSizeEx(void* hFile, int64_t* pSize);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true, CharSet = System::Runtime::InteropServices::CharSet::Unicode)]
+		extern "C" void* __stdcall CreateFileMappingW(void* hFile, void* security, uint32_t protect, uint32_t maxSizeHigh, uint32_t maxSizeLow, const wchar_t* name);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" void* __stdcall MapViewOfFile(void* hMapping, uint32_t access, uint32_t offsetHigh, uint32_t offsetLow, size_t nBytes);
+		[System::Runtime::InteropServices::DllImport("kernel32")]
+		extern "C" uint32_t __stdcall UnmapViewOfFile(const void* p);
+		[System::Runtime::InteropServices::DllImport("kernel32")]
+		extern "C" uint32_t __stdcall CloseHandle(void* h);
+		[System::Runtime::InteropServices::DllImport("kernel32")]
+		extern "C" void* __stdcall GetCurrentProcess();
+
+		struct Win32MemoryRangeEntry
+		{
+			void* VirtualAddress;
+			size_t NumberOfBytes;
+		};
+
+		// only available starting with Windows 8 / Server 2012
+		[System::Runtime::InteropServices::DllImport("kernel32")]
+		extern "C" uint32_t __stdcall PrefetchVirtualMemory(void* hProcess, size_t nEntries, Win32MemoryRangeEntry* pEntries, uint32_t flags);
+
+		struct Win32Overlapped
+		{
+			uintptr_t Internal;
+			uintptr_t InternalHigh;
+			uint32_t Offset;
+			uint32_t OffsetHigh;
+			void* hEvent;
+		};
+
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall WriteFile(void* hFile, const void* pBuffer, uint32_t nBytes, uint32_t* pWritten, Win32Overlapped* pOverlapped);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall GetOverlappedResult(void* hFile, Win32Overlapped* pOverlapped, uint32_t* pTransferred, uint32_t wait);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" void* __stdcall CreateEventW(void* security, uint32_t manualReset, uint32_t initialState, const wchar_t* name);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall FlushFileBuffers(void* hFile);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall SetFilePointerEx(void* hFile, int64_t distance, int64_t* pNewPosition, uint32_t method);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" uint32_t __stdcall SetEndOfFile(void* hFile);
+		[System::Runtime::InteropServices::DllImport("kernel32", SetLastError = true)]
+		extern "C" void* __stdcall VirtualAlloc(void* p, size_t nBytes, uint32_t allocationType, uint32_t protect);
+		[System::Runtime::InteropServices::DllImport("kernel32")]
+		extern "C" uint32_t __stdcall VirtualFree(void* p, size_t nBytes, uint32_t freeType);
 	}
 }
\ No newline at end of file